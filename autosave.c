@@ -0,0 +1,465 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "autosave.h"
+
+/*
+ * A journal starts with its base: the path, size and modification time of the
+ * document's file, or the whole text if no file holds it byte for byte (an
+ * untitled document, or a file in another encoding than UTF-8). Every
+ * autosave then appends one record replacing a range of the previous text,
+ * found by comparing the snapshot last written with the current one from both
+ * ends. Pieces the two snapshots share are skipped by pointer without reading
+ * their bytes, so only the edited region is compared and written. The compare
+ * and the write run on a worker thread; the UI thread only takes a snapshot.
+ * Records are written whole and synced, so a crash can at most cut off the
+ * last one, which recovery then ignores.
+ */
+
+#define JOURNAL_MAGIC "EDJOURN1"
+#define JOURNAL_MAGIC_LENGTH 8
+#define JOURNAL_SUFFIX ".journal"
+#define RECORD_HEADER 13  // Kind byte and three 32-bit fields
+#define COMPARE_BLOCK 4096
+#define FORMAT_LINE_ENDING_SHIFT 16  // The base record's third field holds the encoding, then the line-ending style
+
+#define JOURNAL_NAME_ATTEMPTS 16  // Fresh names tried when a journal file by the chosen name exists
+
+static char *recovery_dir(void) {
+    return g_build_filename(g_get_user_cache_dir(), "text-editor", "recovery", NULL);
+}
+
+/*
+ * A new journal's path. The time and a random part keep an editor that reuses
+ * an earlier run's process id from picking the name of a journal kept from it;
+ * the file is still created exclusively, in case the name is taken anyway.
+ */
+static char *new_journal_path(void) {
+    char *dir = recovery_dir();
+    char *name = g_strdup_printf("%d-%" G_GINT64_FORMAT "-%08x" JOURNAL_SUFFIX, (int)getpid(), g_get_real_time(),
+                                 g_random_int());
+    char *path = g_build_filename(dir, name, NULL);
+    g_free(name);
+    g_free(dir);
+    return path;
+}
+
+// Locks the journal open on fd for this editor; fails if another editor holds it
+static int lock_journal(int fd) {
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) return 0;
+    if (errno == EWOULDBLOCK) errno = EBUSY;
+    return -1;
+}
+
+static void put_header(char *out, char kind, gint32 a, gint32 b, gint32 c) {
+    out[0] = kind;
+    memcpy(out + 1, &a, 4);
+    memcpy(out + 5, &b, 4);
+    memcpy(out + 9, &c, 4);
+}
+
+static void get_header(const char *in, char *kind, gint32 *a, gint32 *b, gint32 *c) {
+    *kind = in[0];
+    memcpy(a, in + 1, 4);
+    memcpy(b, in + 5, 4);
+    memcpy(c, in + 9, 4);
+}
+
+static int write_all(int fd, const char *text, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, text, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        text += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// --- Comparing snapshots ---
+
+// Returns how many of the first n bytes of a and b are equal
+static int matching_bytes(const char *a, const char *b, int n) {
+    int same = 0;
+    while (same + COMPARE_BLOCK <= n && memcmp(a + same, b + same, COMPARE_BLOCK) == 0) same += COMPARE_BLOCK;
+    while (same < n && a[same] == b[same]) same++;
+    return same;
+}
+
+// Returns how many of the n bytes before a_end and b_end are equal, counting back
+static int matching_bytes_back(const char *a_end, const char *b_end, int n) {
+    int same = 0;
+    while (same + COMPARE_BLOCK <= n &&
+           memcmp(a_end - same - COMPARE_BLOCK, b_end - same - COMPARE_BLOCK, COMPARE_BLOCK) == 0)
+        same += COMPARE_BLOCK;
+    while (same < n && a_end[-same - 1] == b_end[-same - 1]) same++;
+    return same;
+}
+
+static int common_prefix(PiecetableSnapshot a, PiecetableSnapshot b) {
+    int i = 0, j = 0, in_a = 0, in_b = 0, same = 0;
+    while (i < a->count && j < b->count) {
+        const char *pa = piecetable_snapshot_piece_text(a, i) + in_a;
+        const char *pb = piecetable_snapshot_piece_text(b, j) + in_b;
+        int n = MIN(a->pieces[i].length - in_a, b->pieces[j].length - in_b);
+        int equal = pa == pb ? n : matching_bytes(pa, pb, n);
+        same += equal;
+        if (equal < n) break;
+        in_a += n;
+        in_b += n;
+        if (in_a == a->pieces[i].length) i++, in_a = 0;
+        if (in_b == b->pieces[j].length) j++, in_b = 0;
+    }
+    return same;
+}
+
+// Like common_prefix from the other end, stopping after limit bytes
+static int common_suffix(PiecetableSnapshot a, PiecetableSnapshot b, int limit) {
+    int i = a->count - 1, j = b->count - 1, in_a = 0, in_b = 0, same = 0;
+    while (i >= 0 && j >= 0 && same < limit) {
+        int rest_a = a->pieces[i].length - in_a, rest_b = b->pieces[j].length - in_b;
+        const char *pa = piecetable_snapshot_piece_text(a, i) + rest_a;
+        const char *pb = piecetable_snapshot_piece_text(b, j) + rest_b;
+        int n = MIN(MIN(rest_a, rest_b), limit - same);
+        int equal = pa == pb ? n : matching_bytes_back(pa, pb, n);
+        same += equal;
+        if (equal < n) break;
+        in_a += n;
+        in_b += n;
+        if (in_a == a->pieces[i].length) i--, in_a = 0;
+        if (in_b == b->pieces[j].length) j--, in_b = 0;
+    }
+    return same;
+}
+
+static void copy_range(PiecetableSnapshot snapshot, int from, int to, char *out) {
+    int offset = 0;
+    for (int i = 0; i < snapshot->count && offset < to; i++) {
+        int length = snapshot->pieces[i].length;
+        int start = MAX(from, offset), end = MIN(to, offset + length);
+        if (start < end) {
+            memcpy(out, piecetable_snapshot_piece_text(snapshot, i) + (start - offset), end - start);
+            out += end - start;
+        }
+        offset += length;
+    }
+}
+
+// --- Writing ---
+
+// Creates and locks a new journal file and writes its base record
+static int open_journal(Autosave journal) {
+    char *dir = recovery_dir();
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    for (int attempt = 0;; attempt++) {
+        journal->fd = open(journal->path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+        if (journal->fd >= 0 && lock_journal(journal->fd) == 0) break;
+        if (journal->fd >= 0) {
+            // Another editor looking for journals to recover has the new file locked; leave it that one
+            close(journal->fd);
+            journal->fd = -1;
+            g_unlink(journal->path);
+            errno = EBUSY;
+        } else if (errno != EEXIST) {
+            return -1;
+        }
+        if (attempt == JOURNAL_NAME_ATTEMPTS) return -1;
+        g_free(journal->path);
+        journal->path = new_journal_path();
+    }
+
+    GString *record = g_string_new(NULL);
+    char header[RECORD_HEADER];
+    g_string_append_len(record, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH);
+    PiecetableSnapshot base = journal->written;
+    gint32 format = journal->encoding | journal->line_ending << FORMAT_LINE_ENDING_SHIFT;
+    struct stat st;
+    if (journal->filename && journal->encoding == ENCODING_UTF8 && stat(journal->filename, &st) == 0 &&
+        st.st_size == base->length) {
+        gint64 size = st.st_size, mtime = st.st_mtime;
+        put_header(header, 'F', strlen(journal->filename), 0, format);
+        g_string_append_len(record, header, RECORD_HEADER);
+        g_string_append(record, journal->filename);
+        g_string_append_len(record, (const char *)&size, 8);
+        g_string_append_len(record, (const char *)&mtime, 8);
+    } else {
+        // No file holds the base text, so the journal does, followed by the file's name if there is one
+        int name_length = journal->filename ? strlen(journal->filename) : 0;
+        put_header(header, 'T', base->length, name_length, format);
+        g_string_append_len(record, header, RECORD_HEADER);
+        gsize at = record->len;
+        g_string_set_size(record, at + base->length);
+        copy_range(base, 0, base->length, record->str + at);
+        if (journal->filename) g_string_append(record, journal->filename);
+    }
+    int result = write_all(journal->fd, record->str, record->len);
+    g_string_free(record, TRUE);
+    return result;
+}
+
+static gboolean journal_written(gpointer data) {
+    Autosave journal = data;
+    g_thread_join(journal->worker);
+    journal->worker = NULL;
+    if (journal->error) {
+        journal->broken = 1;
+        piecetable_snapshot_unref(journal->writing);
+    } else {
+        piecetable_snapshot_unref(journal->written);
+        journal->written = journal->writing;
+    }
+    journal->writing = NULL;
+    journal->done(journal, journal->error, journal->data);
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer journal_thread(gpointer data) {
+    Autosave journal = data;
+    PiecetableSnapshot old = journal->written, new = journal->writing;
+    if (journal->fd < 0 && open_journal(journal) < 0) {
+        journal->error = g_strdup_printf("%s: %s", journal->path, g_strerror(errno));
+    } else {
+        int prefix = common_prefix(old, new);
+        int suffix = common_suffix(old, new, MIN(old->length, new->length) - prefix);
+        int removed = old->length - prefix - suffix, inserted = new->length - prefix - suffix;
+        if (removed > 0 || inserted > 0) {
+            char *record = g_malloc(RECORD_HEADER + inserted);
+            put_header(record, 'R', prefix, removed, inserted);
+            copy_range(new, prefix, prefix + inserted, record + RECORD_HEADER);
+            if (write_all(journal->fd, record, RECORD_HEADER + inserted) < 0)
+                journal->error = g_strdup_printf("%s: %s", journal->path, g_strerror(errno));
+            g_free(record);
+        }
+        if (!journal->error && fdatasync(journal->fd) < 0)
+            journal->error = g_strdup_printf("%s: %s", journal->path, g_strerror(errno));
+    }
+    journal->idle = g_idle_add(journal_written, journal);
+    return NULL;
+}
+
+/**
+ * Start the journal of a document whose file (NULL if untitled), read in
+ * encoding and line_ending, holds base; nothing is written until the first
+ * autosave
+ */
+Autosave autosave_create(const char *filename, Encoding encoding, LineEnding line_ending, PiecetableSnapshot base) {
+    Autosave journal = g_new0(struct autosave, 1);
+    journal->path = new_journal_path();
+    journal->filename = g_strdup(filename);
+    journal->encoding = encoding;
+    journal->line_ending = line_ending;
+    journal->fd = -1;
+    journal->written = piecetable_snapshot_ref(base);
+    return journal;
+}
+
+/**
+ * Append the change from the last write to current on a worker thread; done
+ * runs on the main loop afterwards. Returns 0 if a write is still running or
+ * the journal failed before.
+ */
+int autosave_write(Autosave journal, PiecetableSnapshot current, AutosaveDone done, gpointer data) {
+    if (journal->worker || journal->broken) return 0;
+    journal->writing = piecetable_snapshot_ref(current);
+    journal->done = done;
+    journal->data = data;
+    g_free(journal->error);
+    journal->error = NULL;
+    journal->worker = g_thread_new("autosave", journal_thread, journal);
+    return 1;
+}
+
+int autosave_busy(Autosave journal) {
+    return journal->worker != NULL;
+}
+
+// Frees the journal, waiting for a write still running; remove deletes its file
+void autosave_free(Autosave journal, gboolean remove) {
+    if (journal->worker) {
+        g_thread_join(journal->worker);
+        g_source_remove(journal->idle);
+        if (journal->writing) piecetable_snapshot_unref(journal->writing);
+    }
+    if (journal->fd >= 0) {
+        if (remove) g_unlink(journal->path);
+        close(journal->fd);
+    }
+    piecetable_snapshot_unref(journal->written);
+    g_free(journal->error);
+    g_free(journal->filename);
+    g_free(journal->path);
+    g_free(journal);
+}
+
+// --- Recovery ---
+
+/**
+ * Return the paths of journals no running editor holds
+ */
+GPtrArray *autosave_find_recoverable(void) {
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    char *dir_path = recovery_dir();
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    const char *name;
+    while (dir && (name = g_dir_read_name(dir))) {
+        if (!g_str_has_suffix(name, JOURNAL_SUFFIX)) continue;
+        char *path = g_build_filename(dir_path, name, NULL);
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0) g_ptr_array_add(paths, path);
+        else g_free(path);
+        if (fd >= 0) close(fd);
+    }
+    if (dir) g_dir_close(dir);
+    g_free(dir_path);
+    return paths;
+}
+
+// Rebuilds the text of a journal this editor has locked, as autosave_recover describes
+static Piecetable read_journal(const char *path, char **filename, Encoding *encoding, LineEnding *line_ending,
+                               GMappedFile **mapping, GError **error) {
+    gchar *data;
+    gsize size;
+    *filename = NULL;
+    *encoding = ENCODING_UTF8;
+    *line_ending = LINE_ENDING_LF;
+    *mapping = NULL;
+    if (!g_file_get_contents(path, &data, &size, error)) return NULL;
+
+    Piecetable pt = NULL;
+    gsize pos = JOURNAL_MAGIC_LENGTH;
+    char kind;
+    gint32 a, b, c;
+    if (size < JOURNAL_MAGIC_LENGTH + RECORD_HEADER || memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) != 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s is not a recovery journal", path);
+        g_free(data);
+        return NULL;
+    }
+    get_header(data + pos, &kind, &a, &b, &c);
+    pos += RECORD_HEADER;
+    Encoding format_encoding = c & ((1 << FORMAT_LINE_ENDING_SHIFT) - 1);
+    LineEnding format_line_ending = c >> FORMAT_LINE_ENDING_SHIFT;
+
+    if (kind == 'F' && a >= 0 && pos + a + 16 <= size) {
+        char *file = g_strndup(data + pos, a);
+        gint64 base_size, base_mtime;
+        memcpy(&base_size, data + pos + a, 8);
+        memcpy(&base_mtime, data + pos + a + 8, 8);
+        pos += a + 16;
+        struct stat st;
+        if (stat(file, &st) != 0 || st.st_size != base_size || st.st_mtime != base_mtime) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s has changed since its changes were saved",
+                        file);
+            g_free(file);
+            g_free(data);
+            return NULL;
+        }
+        if (base_size > 0) {
+            *mapping = g_mapped_file_new(file, FALSE, error);
+            if (!*mapping) {
+                g_free(file);
+                g_free(data);
+                return NULL;
+            }
+            pt = piecetable_create_view(g_mapped_file_get_contents(*mapping), base_size);
+        } else {
+            pt = piecetable_create("");
+        }
+        *filename = file;
+        *encoding = format_encoding;
+        *line_ending = format_line_ending;
+    } else if (kind == 'T' && a >= 0 && b >= 0 && pos + a + b <= size) {
+        char *text = g_strndup(data + pos, a);
+        pt = piecetable_create(text);
+        g_free(text);
+        if (b > 0) *filename = g_strndup(data + pos + a, b);
+        *encoding = format_encoding;
+        *line_ending = format_line_ending;
+        pos += a + b;
+    } else {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s has no readable start", path);
+        g_free(data);
+        return NULL;
+    }
+
+    while (pos + RECORD_HEADER <= size) {
+        get_header(data + pos, &kind, &a, &b, &c);
+        if (kind != 'R' || a < 0 || b < 0 || c < 0 || a + b > pt->length || pos + RECORD_HEADER + c > size) break;
+        piecetable_delete(pt, a, b);
+        piecetable_insert_text(pt, data + pos + RECORD_HEADER, c, a);
+        pos += RECORD_HEADER + c;
+    }
+    // Autosaves resumed from here append to the journal, where a cut-off record left in place would hide them
+    if (pos < size && truncate(path, pos) < 0) {
+        int saved_errno = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno), "%s: %s", path,
+                    g_strerror(saved_errno));
+        piecetable_free(pt);
+        if (*mapping) g_mapped_file_unref(*mapping);
+        *mapping = NULL;
+        g_free(*filename);
+        *filename = NULL;
+        g_free(data);
+        return NULL;
+    }
+    g_free(data);
+    return pt;
+}
+
+/**
+ * Rebuild the text a journal holds. filename is set to the document's file, or
+ * NULL if it had none, encoding and line_ending to the file's, and mapping to
+ * the mapped file the returned piece table reads, which must outlive it. A
+ * record cut off by a crash is dropped from the journal; if that fails the
+ * journal is left as it is and nothing is recovered. Nothing is recovered
+ * either from a journal another editor holds.
+ */
+Piecetable autosave_recover(const char *path, char **filename, Encoding *encoding, LineEnding *line_ending,
+                            GMappedFile **mapping, GError **error) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || lock_journal(fd) < 0) {
+        int saved_errno = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno), "%s: %s", path,
+                    saved_errno == EBUSY ? "In use by another editor" : g_strerror(saved_errno));
+        if (fd >= 0) close(fd);
+        *filename = NULL;
+        *mapping = NULL;
+        return NULL;
+    }
+    Piecetable pt = read_journal(path, filename, encoding, line_ending, mapping, error);
+    close(fd);
+    return pt;
+}
+
+/**
+ * Go on with a recovered journal for the document rebuilt from it, whose text
+ * is recovered
+ */
+Autosave autosave_resume(const char *path, const char *filename, PiecetableSnapshot recovered) {
+    Autosave journal = g_new0(struct autosave, 1);
+    journal->path = g_strdup(path);
+    journal->filename = g_strdup(filename);
+    journal->fd = open(path, O_WRONLY | O_APPEND);
+    if (journal->fd >= 0 && lock_journal(journal->fd) < 0) {
+        // Another editor took the journal over meanwhile; its changes are no longer appended to it
+        close(journal->fd);
+        journal->fd = -1;
+    }
+    if (journal->fd < 0) journal->broken = 1;
+    journal->written = piecetable_snapshot_ref(recovered);
+    return journal;
+}
+
+// Deletes a journal, unless another editor holds it
+void autosave_discard(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    if (lock_journal(fd) == 0) g_unlink(path);
+    close(fd);
+}
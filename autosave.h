@@ -0,0 +1,49 @@
+#ifndef AUTOSAVE_H
+#define AUTOSAVE_H
+
+#include <glib.h>
+#include "encoding.h"
+#include "piecetable.h"
+
+#define AUTOSAVE_EDITS 200     // Edits after which the document is autosaved
+#define AUTOSAVE_INTERVAL 30   // Seconds after an edit by which it is autosaved at the latest
+
+typedef struct autosave *Autosave;
+
+// Called on the main loop once a journal write has finished; error is NULL on success
+typedef void (*AutosaveDone)(Autosave journal, const char *error, gpointer data);
+
+/*
+ * The recovery journal of one document: its file on disk, or its text if no
+ * file holds it as is, followed by the changes made since, each stored as one
+ * replaced range. A running editor holds a lock on its journals, so journals
+ * found unlocked were left behind by an editor that did not exit cleanly.
+ */
+struct autosave {
+    char *path;                   // The journal file, created by the first write
+    char *filename;               // The document's file, NULL if untitled
+    Encoding encoding;            // Encoding of that file
+    LineEnding line_ending;       // Its line-ending style
+    int fd;
+    PiecetableSnapshot written;   // The text the journal holds
+    PiecetableSnapshot writing;   // The text being written, while the worker runs
+    GThread *worker;
+    guint idle;                   // Hands a finished write back to the main loop
+    int broken;                   // Set after a failed write; the journal is no longer used
+    char *error;
+    AutosaveDone done;
+    gpointer data;
+};
+
+Autosave autosave_create(const char *filename, Encoding encoding, LineEnding line_ending, PiecetableSnapshot base);
+int autosave_write(Autosave journal, PiecetableSnapshot current, AutosaveDone done, gpointer data);
+int autosave_busy(Autosave journal);
+void autosave_free(Autosave journal, gboolean remove);
+
+GPtrArray *autosave_find_recoverable(void);
+Piecetable autosave_recover(const char *path, char **filename, Encoding *encoding, LineEnding *line_ending,
+                            GMappedFile **mapping, GError **error);
+Autosave autosave_resume(const char *path, const char *filename, PiecetableSnapshot recovered);
+void autosave_discard(const char *path);
+
+#endif // AUTOSAVE_H
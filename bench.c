@@ -0,0 +1,422 @@
+/*
+ * Benchmarks for the editor's search, replace and formatting paths
+ * Each benchmark builds a large synthetic document, times one hot path on it and checks the result, printing
+ * one line per measurement. Run all of them with ./bench, or name the ones to run: ./bench regex kmp
+ * A failed check prints FAILED and makes the exit status non-zero.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include "piecetable.h"
+#include "search.h"
+#include "regex_engine.h"
+#include "search_index.h"
+#include "replace.h"
+#include "text_color.h"
+#include "autosave.h"
+
+#define BENCH_DOCUMENT_SIZE (32 * 1024 * 1024) // Bytes of synthetic text the benchmarks search
+
+static int failures = 0;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(int ok, const char *what) {
+    if (ok) return;
+    printf("  FAILED: %s\n", what);
+    failures++;
+}
+
+// Lines of words from a small vocabulary, with `needle` and a number dropped in every 97th line
+static char *make_document(int size) {
+    static const char *words[] = {"alpha", "beta", "gamma", "delta", "search", "replace", "buffer", "window",
+                                  "cursor", "Needle", "piece", "table", "regex", "match", "line", "Ärger"};
+    char *text = malloc(size + 1);
+    unsigned int seed = 12345;
+    int length = 0, line = 0;
+    while (length < size - 64) {
+        if (++line % 97 == 0)
+            length += sprintf(text + length, "needle%d ", line);
+        int count = 4 + line % 8;
+        for (int i = 0; i < count; i++) {
+            seed = seed * 1103515245 + 12345;
+            length += sprintf(text + length, "%s ", words[(seed >> 16) % 16]);
+        }
+        text[length - 1] = '\n';
+    }
+    text[length] = '\0';
+    return text;
+}
+
+// --- regex: the regex engine against a plain KMP scan ---
+
+static int bench_regex_pattern(Piecetable pt, const char *pattern, int flags) {
+    char error[256];
+    Regex rx = regex_compile(pattern, flags, error, sizeof(error));
+    if (!rx) {
+        printf("  %-24s error: %s\n", pattern, error);
+        failures++;
+        return -1;
+    }
+    double start = now_seconds();
+    SearchResults results = regex_search(rx, pt, SEARCH_NO_LIMIT);
+    double elapsed = now_seconds() - start;
+    printf("  regex %-20s %s %8d matches %8.1f ms %8.0f MB/s  %4d DFA states  prefix \"%s\"\n", pattern,
+           flags & SEARCH_CASE_INSENSITIVE ? "/i" : "  ", results.total, elapsed * 1000, pt->length / elapsed / 1e6,
+           regex_dfa_states(rx), regex_literal_prefix(rx));
+    int total = results.total;
+    search_results_free(&results);
+    regex_free(rx);
+    return total;
+}
+
+static void bench_regex(Piecetable pt) {
+    double start = now_seconds();
+    SearchResults literal = kmp_search("needle", 0, pt, SEARCH_NO_LIMIT);
+    double elapsed = now_seconds() - start;
+    printf("  kmp   %-23s %8d matches %8.1f ms %8.0f MB/s\n", "needle", literal.total, elapsed * 1000,
+           pt->length / elapsed / 1e6);
+
+    check(bench_regex_pattern(pt, "needle", 0) == literal.total, "regex and KMP disagree on a literal");
+    check(bench_regex_pattern(pt, "needle[0-9]+", 0) == literal.total, "prefixed regex missed matches");
+    bench_regex_pattern(pt, "needle", SEARCH_CASE_INSENSITIVE);
+    bench_regex_pattern(pt, "(alpha|beta) gamma", 0);
+    bench_regex_pattern(pt, "[a-z]+ta\\b", 0);
+    search_results_free(&literal);
+
+    char error[256];
+    Regex rx = regex_compile("needle[0-9]+", 0, error, sizeof(error));
+    check(rx && strcmp(regex_literal_prefix(rx), "needle") == 0, "literal prefix of needle[0-9]+");
+    regex_free(rx);
+}
+
+// --- kmp: literal search, exact and case-folded ---
+
+static int bench_kmp_pattern(Piecetable pt, const char *pattern, int flags, const char *path) {
+    double start = now_seconds();
+    SearchResults results = kmp_search(pattern, flags, pt, SEARCH_NO_LIMIT);
+    double elapsed = now_seconds() - start;
+    printf("  %-12s %s %-14s %8d matches %8.1f ms %8.0f MB/s\n", pattern,
+           flags & SEARCH_CASE_INSENSITIVE ? "/i" : "  ", path, results.total, elapsed * 1000,
+           pt->length / elapsed / 1e6);
+    int total = results.total;
+    search_results_free(&results);
+    return total;
+}
+
+// Counts matches with the regex engine, as an independent check on the KMP counts
+static int regex_count(Piecetable pt, const char *pattern, int flags) {
+    char error[256];
+    Regex rx = regex_compile(pattern, flags, error, sizeof(error));
+    if (!rx) return -1;
+    SearchResults results = regex_search(rx, pt, SEARCH_NO_LIMIT);
+    int total = results.total;
+    search_results_free(&results);
+    regex_free(rx);
+    return total;
+}
+
+static void bench_kmp(Piecetable pt) {
+    int exact = bench_kmp_pattern(pt, "needle", 0, "bytes");
+    int folded = bench_kmp_pattern(pt, "needle", SEARCH_CASE_INSENSITIVE, "folded bytes");
+    check(folded > exact, "case folding found no extra matches");
+    check(folded == regex_count(pt, "needle", SEARCH_CASE_INSENSITIVE), "folded needle count");
+
+    // 's' and 'k' have non-ASCII case variants, so these fold by code point
+    check(bench_kmp_pattern(pt, "SEARCH", SEARCH_CASE_INSENSITIVE, "code points") ==
+          regex_count(pt, "search", SEARCH_CASE_INSENSITIVE), "folded search count");
+    int umlaut = bench_kmp_pattern(pt, "ärger", SEARCH_CASE_INSENSITIVE, "code points");
+    check(umlaut > 0 && umlaut == bench_kmp_pattern(pt, "Ärger", 0, "bytes"), "folded ärger count");
+    bench_kmp_pattern(pt, "table", SEARCH_WHOLE_WORD, "whole word");
+
+    // Find next, one match at a time, as the search bar steps through a document
+    Kmp kmp = kmp_create("needle", 6, 0);
+    PiecetableCursor cursor;
+    piecetable_cursor_init(pt, &cursor);
+    int steps = 0;
+    double start = now_seconds();
+    for (int at = kmp_find(kmp, pt, &cursor, 0, pt->length); at >= 0;
+         at = kmp_find(kmp, pt, &cursor, at + 1, pt->length))
+        steps++;
+    double elapsed = now_seconds() - start;
+    printf("  needle          find next      %8d matches %8.1f ms %8.0f MB/s\n", steps, elapsed * 1000,
+           pt->length / elapsed / 1e6);
+    check(steps == exact, "find next and scan disagree");
+    kmp_free(kmp);
+}
+
+// --- index: building the trigram block index and querying through it ---
+
+#define BENCH_INDEX_SLICE 64 // Blocks built per step, as the editor's idle callback does
+
+static void bench_index_query(SearchIndex index, Piecetable pt, const char *pattern) {
+    double start = now_seconds();
+    SearchResults indexed = search_index_find(index, pattern, 0, pt, SEARCH_NO_LIMIT);
+    double indexed_time = now_seconds() - start;
+    start = now_seconds();
+    SearchResults scanned = kmp_search(pattern, 0, pt, SEARCH_NO_LIMIT);
+    double scan_time = now_seconds() - start;
+    printf("  %-12s %8d matches %8.1f ms indexed (%5.1f%% of the document read) %8.1f ms scanned\n", pattern,
+           indexed.total, indexed_time * 1000, 100.0 * index->last_scanned / pt->length, scan_time * 1000);
+    check(indexed.total == scanned.total, "indexed and scanned counts differ");
+    search_results_free(&indexed);
+    search_results_free(&scanned);
+}
+
+static void bench_index(Piecetable pt) {
+    SearchIndex index = search_index_create(pt->length);
+    int steps = 0;
+    double slowest = 0, start = now_seconds();
+    for (int more = 1; more; steps++) {
+        double step_start = now_seconds();
+        more = search_index_build_step(index, pt, BENCH_INDEX_SLICE);
+        double step_time = now_seconds() - step_start;
+        if (step_time > slowest) slowest = step_time;
+    }
+    double elapsed = now_seconds() - start;
+    long memory = search_index_memory(index);
+    printf("  built %d blocks in %.1f ms over %d steps (slowest %.2f ms), %.2f MB (%.1f%% of the document)\n",
+           index->count, elapsed * 1000, steps, slowest * 1000, memory / (1024.0 * 1024.0),
+           100.0 * memory / pt->length);
+    check(index->stale == 0, "index left stale blocks");
+
+    bench_index_query(index, pt, "needle4850");
+    bench_index_query(index, pt, "zebra");
+    bench_index_query(index, pt, "needle");
+    search_index_free(index);
+}
+
+// --- replace: replace all over the whole document, literal and regex ---
+
+static void bench_replace(Piecetable pt) {
+    char *text = piecetable_value(pt);
+    int length = pt->length;
+
+    Piecetable copy = piecetable_create_view(text, length);
+    double start = now_seconds();
+    SearchResults matches = kmp_search("needle", 0, copy, SEARCH_NO_LIMIT);
+    int replaced = replace_all(copy, &matches, "pin");
+    double elapsed = now_seconds() - start;
+    printf("  literal %8d replacements %8.1f ms (search included)\n", replaced, elapsed * 1000);
+    check(replaced == matches.total && copy->length == length - 3 * replaced, "literal replace length");
+    search_results_free(&matches);
+    matches = kmp_search("needle", 0, copy, SEARCH_NO_LIMIT);
+    check(matches.total == 0, "literal replace left matches behind");
+    search_results_free(&matches);
+    piecetable_free(copy);
+
+    copy = piecetable_create_view(text, length);
+    char error[256];
+    Regex rx = regex_compile("needle([0-9]+)", 0, error, sizeof(error));
+    start = now_seconds();
+    replaced = replace_regex(copy, rx, "pin-\\1", error, sizeof(error));
+    elapsed = now_seconds() - start;
+    printf("  regex   %8d replacements %8.1f ms (search included)\n", replaced, elapsed * 1000);
+    check(replaced > 0 && copy->length == length - 2 * replaced, "regex replace length");
+    matches = kmp_search("pin-97 ", 0, copy, SEARCH_NO_LIMIT);
+    check(matches.total == 1, "regex replace lost a group");
+    search_results_free(&matches);
+    regex_free(rx);
+    piecetable_free(copy);
+    free(text);
+}
+
+// --- style_tags: formatting reuses interned tags instead of growing the tag table ---
+
+#define BENCH_STYLE_ROUNDS 100000 // Times a color or size is applied
+
+static void bench_style_tags(Piecetable pt) {
+    // Each row spells one color several ways; all of them must share a tag
+    static const char *colors[][3] = {
+        {"red", "#ff0000", "rgb(255,0,0)"}, {"blue", "#0000ff", "rgb(0,0,255)"}, {"white", "#fff", "#ffffff"},
+    };
+    static const int sizes[] = {8, 10, 12, 14, 18, 24, 36};
+    int ncolors = sizeof(colors) / sizeof(colors[0]), nsizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    GtkTextBuffer *buffer = gtk_text_buffer_new(NULL);
+    GtkTextTag *first[sizeof(colors) / sizeof(colors[0])] = {NULL};
+    int created_before, reused_before;
+    text_style_tag_counts(&created_before, &reused_before);
+
+    double start = now_seconds();
+    int shared = 1;
+    for (int i = 0; i < BENCH_STYLE_ROUNDS; i++) {
+        int c = i % ncolors;
+        GtkTextTag *tag = text_style_tag(buffer, "foreground", colors[c][i / ncolors % 3]);
+        if (!first[c]) first[c] = tag;
+        if (tag != first[c]) shared = 0;
+        text_style_tag_int(buffer, "size", sizes[i % nsizes] * PANGO_SCALE);
+    }
+    double elapsed = now_seconds() - start;
+
+    int created, reused;
+    text_style_tag_counts(&created, &reused);
+    created -= created_before;
+    reused -= reused_before;
+    printf("  %d formats in %.1f ms (%.2f us each): %d tags created, %d reused, %d in the tag table\n",
+           2 * BENCH_STYLE_ROUNDS, elapsed * 1000, elapsed * 1e6 / (2 * BENCH_STYLE_ROUNDS), created, reused,
+           gtk_text_tag_table_get_size(gtk_text_buffer_get_tag_table(buffer)));
+    check(shared, "spellings of one color got different tags");
+    check(created == ncolors + nsizes, "formatting created more tags than distinct styles");
+    check(reused == 2 * BENCH_STYLE_ROUNDS - created, "formatting did not reuse its tags");
+    g_object_unref(buffer);
+}
+
+// --- autosave: journal writes stay off the keystroke path ---
+
+#define BENCH_KEYSTROKES 20000 // Characters typed at random places, with and without autosaving
+
+static void on_journal_written(Autosave journal, const char *error, gpointer data) {
+    check(error == NULL, error ? error : "");
+}
+
+typedef struct {
+    double mean;          // Per keystroke, in seconds
+    double slowest;
+    int writes;           // autosave_write calls, which the keystroke times include
+    double write_mean;
+    double write_slowest;
+} KeystrokeTimes;
+
+/*
+ * Types BENCH_KEYSTROKES characters into pt, handing the text to journal every
+ * AUTOSAVE_EDITS of them as the editor does, if journal is set
+ */
+static KeystrokeTimes type_keystrokes(Piecetable pt, Autosave journal) {
+    KeystrokeTimes times = {0};
+    unsigned int seed = 777;
+    double total = 0, write_total = 0;
+    for (int i = 0; i < BENCH_KEYSTROKES; i++) {
+        seed = seed * 1103515245 + 12345;
+        int at = (seed >> 8) % (pt->length + 1);
+        double start = now_seconds();
+        piecetable_insert_text(pt, "x", 1, at);
+        if (journal && (i + 1) % AUTOSAVE_EDITS == 0 && !autosave_busy(journal)) {
+            double write_start = now_seconds();
+            PiecetableSnapshot current = piecetable_snapshot(pt);
+            autosave_write(journal, current, on_journal_written, NULL);
+            piecetable_snapshot_unref(current);
+            double write_time = now_seconds() - write_start;
+            times.writes++;
+            write_total += write_time;
+            if (write_time > times.write_slowest) times.write_slowest = write_time;
+        }
+        double elapsed = now_seconds() - start;
+        total += elapsed;
+        if (elapsed > times.slowest) times.slowest = elapsed;
+        // Finished writes report back through the main loop, between keystrokes as in the editor
+        while (g_main_context_iteration(NULL, FALSE)) continue;
+    }
+    times.mean = total / BENCH_KEYSTROKES;
+    if (times.writes) times.write_mean = write_total / times.writes;
+    return times;
+}
+
+static void bench_autosave(Piecetable pt) {
+    // Journals go to a scratch cache directory, so none is left for the editor to offer recovering
+    char *cache = g_dir_make_tmp("bench-autosave-XXXXXX", NULL);
+    g_setenv("XDG_CACHE_HOME", cache, TRUE);
+    char *text = piecetable_value(pt);
+
+    Piecetable plain = piecetable_create_view(text, pt->length);
+    KeystrokeTimes times = type_keystrokes(plain, NULL);
+    printf("  without autosave: %6.2f us per keystroke, slowest %8.2f us\n", times.mean * 1e6, times.slowest * 1e6);
+
+    // The journal's worker compares and writes on another thread; with a single core it competes for that one
+    Piecetable journaled = piecetable_create_view(text, pt->length);
+    PiecetableSnapshot base = piecetable_snapshot(journaled);
+    Autosave journal = autosave_create(NULL, ENCODING_UTF8, LINE_ENDING_LF, base);
+    piecetable_snapshot_unref(base);
+    times = type_keystrokes(journaled, journal);
+    printf("  with autosave:    %6.2f us per keystroke, slowest %8.2f us (%d cores)\n", times.mean * 1e6,
+           times.slowest * 1e6, g_get_num_processors());
+    printf("  autosave_write on the UI thread: %d calls, %.2f us each, slowest %.2f us\n", times.writes,
+           times.write_mean * 1e6, times.write_slowest * 1e6);
+
+    // The last changes are written too, then the journal must rebuild the typed text
+    while (autosave_busy(journal)) g_main_context_iteration(NULL, TRUE);
+    PiecetableSnapshot current = piecetable_snapshot(journaled);
+    autosave_write(journal, current, on_journal_written, NULL);
+    piecetable_snapshot_unref(current);
+    while (autosave_busy(journal)) g_main_context_iteration(NULL, TRUE);
+    char *path = g_strdup(journal->path);
+    autosave_free(journal, FALSE);
+
+    char *filename;
+    Encoding encoding;
+    LineEnding line_ending;
+    GMappedFile *mapping;
+    GError *error = NULL;
+    Piecetable recovered = autosave_recover(path, &filename, &encoding, &line_ending, &mapping, &error);
+    check(recovered != NULL, error ? error->message : "");
+    if (recovered) {
+        char *expected = piecetable_value(journaled), *actual = piecetable_value(recovered);
+        check(strcmp(expected, actual) == 0, "the journal does not rebuild the typed text");
+        free(expected);
+        free(actual);
+        piecetable_free(recovered);
+        if (mapping) g_mapped_file_unref(mapping);
+        g_free(filename);
+    }
+    g_clear_error(&error);
+    autosave_discard(path);
+
+    char *dir = g_build_filename(cache, "text-editor", "recovery", NULL);
+    g_rmdir(dir);
+    g_free(dir);
+    dir = g_build_filename(cache, "text-editor", NULL);
+    g_rmdir(dir);
+    g_free(dir);
+    g_rmdir(cache);
+    g_free(cache);
+    g_free(path);
+    piecetable_free(plain);
+    piecetable_free(journaled);
+    free(text);
+}
+
+// --- Driver ---
+
+typedef struct {
+    const char *name;
+    void (*run)(Piecetable pt);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    {"regex", bench_regex},
+    {"kmp", bench_kmp},
+    {"index", bench_index},
+    {"replace", bench_replace},
+    {"style_tags", bench_style_tags},
+    {"autosave", bench_autosave},
+};
+
+static int selected(const char *name, int argc, char **argv) {
+    if (argc < 2) return 1;
+    for (int i = 1; i < argc; i++)
+        if (strcmp(argv[i], name) == 0) return 1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    char *text = make_document(BENCH_DOCUMENT_SIZE);
+    Piecetable pt = piecetable_create_owned(text, strlen(text));
+    printf("Document: %.1f MB\n", pt->length / 1e6);
+
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (!selected(benchmarks[i].name, argc, argv)) continue;
+        printf("%s:\n", benchmarks[i].name);
+        benchmarks[i].run(pt);
+    }
+
+    piecetable_free(pt);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,266 @@
+#include <limits.h>
+#include <stdlib.h>
+#include "bracket_index.h"
+
+/*
+ * Brackets are nodes of a treap ordered by character offset. Edits split the
+ * treap at the edit position and shift everything after it with a lazy tag,
+ * so an insertion or deletion costs O(log n) plus the brackets it adds or
+ * removes. Each node aggregates, per bracket type, the sum of +1/-1 signs of
+ * its subtree and the extreme prefix and suffix sums; the partner of a bracket
+ * is the first later bracket where the running sum drops below zero (or the
+ * last earlier one where it rises above), found by one descent. Which
+ * characters are brackets rather than string or comment text is the lexer's
+ * call; the index stores the positions it is given.
+ */
+
+static const char bracket_chars[] = "([{<)]}>";
+
+// Returns the type of a bracket character, or -1
+int bracket_type(char c) {
+    for (int t = 0; t < 2 * BRACKET_TYPES; t++) {
+        if (bracket_chars[t] == c) return t % BRACKET_TYPES;
+    }
+    return -1;
+}
+
+static unsigned next_priority(BracketIndex index) {
+    index->seed = index->seed * 1103515245u + 12345u;
+    return index->seed;
+}
+
+static void push(BracketNode node) {
+    if (node->shift == 0) return;
+    node->position += node->shift;
+    if (node->left) node->left->shift += node->shift;
+    if (node->right) node->right->shift += node->shift;
+    node->shift = 0;
+}
+
+static void update(BracketNode node) {
+    BracketNode l = node->left, r = node->right;
+    for (int t = 0; t < BRACKET_TYPES; t++) {
+        int self = node->type == t ? node->sign : 0;
+        int lsum = l ? l->sum[t] : 0, rsum = r ? r->sum[t] : 0;
+
+        int min_prefix = lsum + self;
+        if (l && l->min_prefix[t] < min_prefix) min_prefix = l->min_prefix[t];
+        if (r && lsum + self + r->min_prefix[t] < min_prefix) min_prefix = lsum + self + r->min_prefix[t];
+
+        int max_suffix = self + rsum;
+        if (r && r->max_suffix[t] > max_suffix) max_suffix = r->max_suffix[t];
+        if (l && l->max_suffix[t] + self + rsum > max_suffix) max_suffix = l->max_suffix[t] + self + rsum;
+
+        node->sum[t] = lsum + self + rsum;
+        node->min_prefix[t] = min_prefix;
+        node->max_suffix[t] = max_suffix;
+    }
+}
+
+// Splits into brackets before position and brackets at or after it
+static void split(BracketNode node, int position, BracketNode *before, BracketNode *after) {
+    if (!node) {
+        *before = *after = NULL;
+        return;
+    }
+    push(node);
+    if (node->position < position) {
+        split(node->right, position, &node->right, after);
+        *before = node;
+    } else {
+        split(node->left, position, before, &node->left);
+        *after = node;
+    }
+    update(node);
+}
+
+static BracketNode merge(BracketNode a, BracketNode b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->priority > b->priority) {
+        push(a);
+        a->right = merge(a->right, b);
+        update(a);
+        return a;
+    }
+    push(b);
+    b->left = merge(a, b->left);
+    update(b);
+    return b;
+}
+
+static void free_nodes(BracketNode node) {
+    if (!node) return;
+    free_nodes(node->left);
+    free_nodes(node->right);
+    free(node);
+}
+
+static void update_all(BracketNode node) {
+    if (!node) return;
+    update_all(node->left);
+    update_all(node->right);
+    update(node);
+}
+
+/*
+ * Builds a treap of count brackets in linear time: positions arrive sorted, so
+ * the tree is assembled along its right spine.
+ */
+static BracketNode build(BracketIndex index, const int *positions, const char *chars, int count) {
+    BracketNode *spine = NULL;
+    int depth = 0, capacity = 0;
+    BracketNode root = NULL;
+
+    for (int i = 0; i < count; i++) {
+        int type = bracket_type(chars[i]);
+        if (type < 0) continue;
+        BracketNode node = calloc(1, sizeof(struct bracket_node));
+        node->priority = next_priority(index);
+        node->position = positions[i];
+        node->type = type;
+        node->sign = bracket_chars[type] == chars[i] ? 1 : -1;
+
+        BracketNode last = NULL;
+        while (depth > 0 && spine[depth - 1]->priority < node->priority) last = spine[--depth];
+        node->left = last;
+        if (depth > 0) spine[depth - 1]->right = node;
+        else root = node;
+        if (depth == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            spine = realloc(spine, capacity * sizeof(BracketNode));
+        }
+        spine[depth++] = node;
+        index->count++;
+    }
+    free(spine);
+    update_all(root);
+    return root;
+}
+
+BracketIndex bracket_index_create(void) {
+    BracketIndex index = malloc(sizeof(struct bracket_index));
+    index->root = NULL;
+    index->count = 0;
+    index->seed = 2463534242u;
+    return index;
+}
+
+void bracket_index_free(BracketIndex index) {
+    free_nodes(index->root);
+    free(index);
+}
+
+// Follows the insertion of count characters at offset at; the brackets among them are added separately
+void bracket_index_insert_gap(BracketIndex index, int at, int count) {
+    if (count <= 0) return;
+    BracketNode before, after;
+    split(index->root, at, &before, &after);
+    if (after) after->shift += count;
+    index->root = merge(before, after);
+}
+
+/*
+ * Adds count brackets at sorted character positions, where the index has no
+ * brackets yet (a range just cleared or inserted)
+ */
+void bracket_index_add(BracketIndex index, const int *positions, const char *chars, int count) {
+    if (count <= 0) return;
+    BracketNode added = build(index, positions, chars, count);
+    BracketNode before, after;
+    split(index->root, positions[0], &before, &after);
+    index->root = merge(merge(before, added), after);
+}
+
+static int count_nodes(BracketNode node) {
+    return node ? 1 + count_nodes(node->left) + count_nodes(node->right) : 0;
+}
+
+// Follows the deletion of count characters at offset at
+void bracket_index_delete(BracketIndex index, int at, int count) {
+    if (count <= 0) return;
+    BracketNode before, removed, after;
+    split(index->root, at, &before, &after);
+    split(after, at + count, &removed, &after);
+    if (after) after->shift -= count;
+    index->count -= count_nodes(removed);
+    free_nodes(removed);
+    index->root = merge(before, after);
+}
+
+// Forgets the brackets in [from, to) without moving the ones after, so the range can be re-lexed
+void bracket_index_clear(BracketIndex index, int from, int to) {
+    BracketNode before, removed, after;
+    split(index->root, from, &before, &after);
+    split(after, to, &removed, &after);
+    index->count -= count_nodes(removed);
+    free_nodes(removed);
+    index->root = merge(before, after);
+}
+
+// First bracket whose running sum of type t, counted from the start of node, reaches -1
+static int find_closing(BracketNode node, int t) {
+    int sum = 0;
+    while (node) {
+        push(node);
+        if (node->left && sum + node->left->min_prefix[t] <= -1) {
+            node = node->left;
+            continue;
+        }
+        if (node->left) sum += node->left->sum[t];
+        if (node->type == t) sum += node->sign;
+        if (sum == -1) return node->position;
+        node = node->right;
+    }
+    return BRACKET_UNMATCHED;
+}
+
+// Last bracket whose running sum of type t, counted back from the end of node, reaches +1
+static int find_opening(BracketNode node, int t) {
+    int sum = 0;
+    while (node) {
+        push(node);
+        if (node->right && sum + node->right->max_suffix[t] >= 1) {
+            node = node->right;
+            continue;
+        }
+        if (node->right) sum += node->right->sum[t];
+        if (node->type == t) sum += node->sign;
+        if (sum == 1) return node->position;
+        node = node->left;
+    }
+    return BRACKET_UNMATCHED;
+}
+
+// Returns the offset of the partner of the bracket at offset, BRACKET_UNMATCHED or BRACKET_NONE
+int bracket_index_match(BracketIndex index, int offset) {
+    BracketNode before, bracket, after;
+    split(index->root, offset, &before, &after);
+    split(after, offset + 1, &bracket, &after);
+
+    int partner = BRACKET_NONE;
+    if (bracket) {
+        partner = bracket->sign > 0 ? find_closing(after, bracket->type) : find_opening(before, bracket->type);
+    }
+    index->root = merge(merge(before, bracket), after);
+    return partner;
+}
+
+// Returns how many (, [ and { before offset are still open; <> are left out as likely operators
+int bracket_index_depth(BracketIndex index, int offset) {
+    int depth = 0;
+    BracketNode node = index->root;
+    while (node) {
+        push(node);
+        if (node->position < offset) {
+            for (int t = 0; t < 3; t++) {
+                if (node->left) depth += node->left->sum[t];
+                if (node->type == t) depth += node->sign;
+            }
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return depth;
+}
@@ -0,0 +1,41 @@
+#ifndef BRACKET_INDEX_H
+#define BRACKET_INDEX_H
+
+#define BRACKET_TYPES 4        // (), [], {} and <>
+#define BRACKET_NONE -2        // No bracket at the queried offset
+#define BRACKET_UNMATCHED -1   // The bracket has no partner
+
+// One bracket of the document, kept in a treap ordered by position
+typedef struct bracket_node {
+    struct bracket_node *left;
+    struct bracket_node *right;
+    unsigned priority;
+    int position;     // Character offset, once the ancestors' shifts are pushed down
+    int shift;        // Pending offset change for the whole subtree
+    signed char type;
+    signed char sign; // +1 for an opening bracket, -1 for a closing one
+
+    // Per bracket type, over the subtree in order: sum of signs, lowest prefix sum, highest suffix sum
+    int sum[BRACKET_TYPES];
+    int min_prefix[BRACKET_TYPES];
+    int max_suffix[BRACKET_TYPES];
+} *BracketNode;
+
+// Positions of every bracket, updated per edit, so a partner is found in O(log n)
+typedef struct bracket_index {
+    BracketNode root;
+    int count;
+    unsigned seed;
+} *BracketIndex;
+
+BracketIndex bracket_index_create(void);
+void bracket_index_free(BracketIndex index);
+void bracket_index_insert_gap(BracketIndex index, int at, int count);
+void bracket_index_delete(BracketIndex index, int at, int count);
+void bracket_index_clear(BracketIndex index, int from, int to);
+void bracket_index_add(BracketIndex index, const int *positions, const char *chars, int count);
+int bracket_index_match(BracketIndex index, int offset);
+int bracket_index_depth(BracketIndex index, int offset);
+int bracket_type(char c);
+
+#endif // BRACKET_INDEX_H
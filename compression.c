@@ -0,0 +1,321 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compression.h"
+
+/*
+ * Files compressed with gzip or zstd are told apart by their first bytes and
+ * read and written as streams, a buffer at a time, so neither side holds the
+ * compressed and the plain text of a whole file at once. A file's level is
+ * not stored in it: gzip's header says only whether the fastest or the best
+ * level made it, and zstd's says nothing, so such files are written back at
+ * the codec's default.
+ */
+
+#define INPUT_SLICE (1 << 30)             // Most bytes handed to the codec per call; zlib counts in 32 bits
+#define COMPRESS_BUFFER (256 * 1024)     // Compressed bytes gathered per write
+
+#define GZIP_XFL_BEST 2   // Header flag of a gzip file made at level 9
+#define GZIP_XFL_FAST 4   // And at level 1
+
+struct decompressor {
+    Compression compression;
+    const unsigned char *data;
+    gsize length;
+    gsize consumed;
+    int ended;
+    z_stream zlib;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+};
+
+struct compressor {
+    Compression compression;
+    int fd;
+    char *buffer;
+    z_stream zlib;
+#ifdef HAVE_ZSTD
+    ZSTD_CStream *zstd;
+#endif
+};
+
+/**
+ * Return how data, the start of a file, is compressed
+ */
+Compression compression_detect(const char *data, gsize length) {
+    const unsigned char *s = (const unsigned char *)data;
+    Compression compression = {COMPRESSION_NONE, COMPRESSION_DEFAULT_LEVEL};
+    if (length >= 10 && s[0] == 0x1F && s[1] == 0x8B && s[2] == 8) {
+        compression.codec = COMPRESSION_GZIP;
+        if (s[8] == GZIP_XFL_BEST) compression.level = 9;
+        else if (s[8] == GZIP_XFL_FAST) compression.level = 1;
+    } else if (length >= 4 && s[0] == 0x28 && s[1] == 0xB5 && s[2] == 0x2F && s[3] == 0xFD) {
+        compression.codec = COMPRESSION_ZSTD;
+    }
+    return compression;
+}
+
+// Like compression_detect, from the first bytes of filename
+Compression compression_detect_file(const char *filename) {
+    char start[10];
+    int fd = open(filename, O_RDONLY);
+    ssize_t n = fd >= 0 ? read(fd, start, sizeof(start)) : -1;
+    if (fd >= 0) close(fd);
+    return compression_detect(start, n > 0 ? n : 0);
+}
+
+/**
+ * Return the bytes the compressed data says it holds, -1 if it does not say.
+ * gzip keeps the length of its last member modulo 4 GB and zstd that of its
+ * first frame, so this is only a guess for files made of several.
+ */
+gint64 compression_content_length(Compression compression, const char *data, gsize length) {
+    const unsigned char *s = (const unsigned char *)data;
+    switch (compression.codec) {
+    case COMPRESSION_GZIP:
+        if (length < 18) return -1;
+        s += length - 4;
+        return (guint32)(s[0] | s[1] << 8 | s[2] << 16 | (guint32)s[3] << 24);
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD: {
+        unsigned long long size = ZSTD_getFrameContentSize(data, length);
+        return size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ? -1 : (gint64)size;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+const char *compression_name(Compression compression) {
+    switch (compression.codec) {
+    case COMPRESSION_GZIP: return "gzip";
+    case COMPRESSION_ZSTD: return "zstd";
+    default: return "uncompressed";
+    }
+}
+
+// --- Reading ---
+
+/**
+ * Start decompressing the length bytes of data, which must stay valid until
+ * the decompressor is freed; returns NULL with error set if the codec is not
+ * built in
+ */
+Decompressor decompressor_new(Compression compression, const char *data, gsize length, GError **error) {
+    Decompressor decompressor = g_new0(struct decompressor, 1);
+    decompressor->compression = compression;
+    decompressor->data = (const unsigned char *)data;
+    decompressor->length = length;
+    if (compression.codec == COMPRESSION_GZIP) {
+        // 16 above the window size takes a gzip header and trailer
+        if (inflateInit2(&decompressor->zlib, 15 + 16) == Z_OK) return decompressor;
+#ifdef HAVE_ZSTD
+    } else if (compression.codec == COMPRESSION_ZSTD) {
+        decompressor->zstd = ZSTD_createDStream();
+        if (decompressor->zstd && !ZSTD_isError(ZSTD_initDStream(decompressor->zstd))) return decompressor;
+#endif
+    }
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "%s files cannot be read in this build",
+                compression_name(compression));
+    decompressor_free(decompressor);
+    return NULL;
+}
+
+static int gzip_read(Decompressor decompressor, char *out, int space, GError **error) {
+    z_stream *zlib = &decompressor->zlib;
+    zlib->next_out = (Bytef *)out;
+    zlib->avail_out = space;
+    while (zlib->avail_out > 0 && !decompressor->ended) {
+        if (zlib->avail_in == 0) {
+            zlib->next_in = (Bytef *)decompressor->data + decompressor->consumed;
+            zlib->avail_in = MIN(decompressor->length - decompressor->consumed, INPUT_SLICE);
+        }
+        uInt before = zlib->avail_in;
+        int status = inflate(zlib, Z_NO_FLUSH);
+        decompressor->consumed += before - zlib->avail_in;
+        if (status == Z_STREAM_END) {
+            // Concatenated members, as gzip makes of appended files, are read one after another
+            const unsigned char *next = decompressor->data + decompressor->consumed;
+            if (decompressor->length - decompressor->consumed >= 2 && next[0] == 0x1F && next[1] == 0x8B)
+                inflateReset(zlib);
+            else
+                decompressor->ended = 1;
+        } else if (status != Z_OK) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s",
+                        status == Z_BUF_ERROR ? "the compressed data is cut short"
+                                              : zlib->msg ? zlib->msg : "the compressed data is corrupt");
+            return -1;
+        }
+    }
+    return space - zlib->avail_out;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_read(Decompressor decompressor, char *out, int space, GError **error) {
+    ZSTD_outBuffer output = {out, space, 0};
+    while (output.pos < output.size && !decompressor->ended) {
+        ZSTD_inBuffer input = {decompressor->data + decompressor->consumed,
+                               MIN(decompressor->length - decompressor->consumed, INPUT_SLICE), 0};
+        size_t written = output.pos;
+        size_t more = ZSTD_decompressStream(decompressor->zstd, &output, &input);
+        decompressor->consumed += input.pos;
+        if (ZSTD_isError(more)) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s", ZSTD_getErrorName(more));
+            return -1;
+        }
+        // A finished frame with no other after it ends the data; running out of input inside one cuts it short
+        if (more == 0 && decompressor->consumed == decompressor->length) {
+            decompressor->ended = 1;
+        } else if (input.size == 0 && output.pos == written) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "the compressed data is cut short");
+            return -1;
+        }
+    }
+    return output.pos;
+}
+#endif
+
+/**
+ * Decompress the next bytes into out, filling it unless the data ends first;
+ * returns how many were written, 0 once all were, or -1 with error set if
+ * the data is corrupt or cut short
+ */
+int decompressor_read(Decompressor decompressor, char *out, int space, GError **error) {
+#ifdef HAVE_ZSTD
+    if (decompressor->compression.codec == COMPRESSION_ZSTD) return zstd_read(decompressor, out, space, error);
+#endif
+    return gzip_read(decompressor, out, space, error);
+}
+
+// Returns how many of the compressed bytes have been read so far
+gsize decompressor_consumed(Decompressor decompressor) {
+    return decompressor->consumed;
+}
+
+void decompressor_free(Decompressor decompressor) {
+    if (!decompressor) return;
+    if (decompressor->compression.codec == COMPRESSION_GZIP) inflateEnd(&decompressor->zlib);
+#ifdef HAVE_ZSTD
+    if (decompressor->zstd) ZSTD_freeDStream(decompressor->zstd);
+#endif
+    g_free(decompressor);
+}
+
+// --- Writing ---
+
+static int write_all(int fd, const char *text, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, text, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        text += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * Start compressing text to be written to fd; returns NULL if the codec is
+ * not built in
+ */
+Compressor compressor_new(Compression compression, int fd) {
+    Compressor compressor = g_new0(struct compressor, 1);
+    compressor->compression = compression;
+    compressor->fd = fd;
+    compressor->buffer = g_malloc(COMPRESS_BUFFER);
+    if (compression.codec == COMPRESSION_GZIP) {
+        int level = compression.level == COMPRESSION_DEFAULT_LEVEL ? Z_DEFAULT_COMPRESSION : compression.level;
+        if (deflateInit2(&compressor->zlib, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+            return compressor;
+#ifdef HAVE_ZSTD
+    } else if (compression.codec == COMPRESSION_ZSTD) {
+        int level = compression.level == COMPRESSION_DEFAULT_LEVEL ? ZSTD_CLEVEL_DEFAULT : compression.level;
+        compressor->zstd = ZSTD_createCStream();
+        if (compressor->zstd && !ZSTD_isError(ZSTD_initCStream(compressor->zstd, level))) return compressor;
+#endif
+    }
+    compressor_free(compressor);
+    return NULL;
+}
+
+// Compresses length bytes of data, writing each buffer it fills; finish ends the stream
+static int gzip_write(Compressor compressor, const char *data, gsize length, int finish) {
+    z_stream *zlib = &compressor->zlib;
+    zlib->next_in = (Bytef *)data;
+    zlib->avail_in = 0;
+    int status;
+    do {
+        if (zlib->avail_in == 0 && length > 0) {
+            zlib->avail_in = MIN(length, INPUT_SLICE);
+            length -= zlib->avail_in;
+        }
+        zlib->next_out = (Bytef *)compressor->buffer;
+        zlib->avail_out = COMPRESS_BUFFER;
+        status = deflate(zlib, finish && length == 0 ? Z_FINISH : Z_NO_FLUSH);
+        if (status == Z_STREAM_ERROR) {
+            errno = EIO;
+            return -1;
+        }
+        if (write_all(compressor->fd, compressor->buffer, COMPRESS_BUFFER - zlib->avail_out) < 0) return -1;
+    } while (zlib->avail_in > 0 || length > 0 || zlib->avail_out == 0 || (finish && status != Z_STREAM_END));
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_write(Compressor compressor, const char *data, gsize length, int finish) {
+    ZSTD_inBuffer input = {data, length, 0};
+    size_t left;
+    do {
+        ZSTD_outBuffer output = {compressor->buffer, COMPRESS_BUFFER, 0};
+        left = ZSTD_compressStream2(compressor->zstd, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(left)) {
+            errno = EIO;
+            return -1;
+        }
+        if (write_all(compressor->fd, compressor->buffer, output.pos) < 0) return -1;
+    } while (input.pos < input.size || (finish && left > 0));
+    return 0;
+}
+#endif
+
+/**
+ * Compress length bytes of data and write what that makes; returns -1 with
+ * errno set if writing fails
+ */
+int compressor_write(Compressor compressor, const char *data, int length) {
+#ifdef HAVE_ZSTD
+    if (compressor->compression.codec == COMPRESSION_ZSTD) return zstd_write(compressor, data, length, FALSE);
+#endif
+    return gzip_write(compressor, data, length, FALSE);
+}
+
+/**
+ * Write the rest of the compressed data and its end; returns -1 with errno
+ * set if writing fails
+ */
+int compressor_finish(Compressor compressor) {
+#ifdef HAVE_ZSTD
+    if (compressor->compression.codec == COMPRESSION_ZSTD) return zstd_write(compressor, NULL, 0, TRUE);
+#endif
+    return gzip_write(compressor, NULL, 0, TRUE);
+}
+
+void compressor_free(Compressor compressor) {
+    if (!compressor) return;
+    if (compressor->compression.codec == COMPRESSION_GZIP) deflateEnd(&compressor->zlib);
+#ifdef HAVE_ZSTD
+    if (compressor->zstd) ZSTD_freeCStream(compressor->zstd);
+#endif
+    g_free(compressor->buffer);
+    g_free(compressor);
+}
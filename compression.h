@@ -0,0 +1,38 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <glib.h>
+
+#define COMPRESSION_DEFAULT_LEVEL -1  // The codec's own default level
+
+typedef enum {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD,  // Read and written only when built with HAVE_ZSTD
+} CompressionCodec;
+
+// How a file is compressed, so that it can be written back the same way
+typedef struct {
+    CompressionCodec codec;
+    int level;  // COMPRESSION_DEFAULT_LEVEL if the file does not tell
+} Compression;
+
+typedef struct decompressor *Decompressor;
+typedef struct compressor *Compressor;
+
+Compression compression_detect(const char *data, gsize length);
+Compression compression_detect_file(const char *filename);
+gint64 compression_content_length(Compression compression, const char *data, gsize length);
+const char *compression_name(Compression compression);
+
+Decompressor decompressor_new(Compression compression, const char *data, gsize length, GError **error);
+int decompressor_read(Decompressor decompressor, char *out, int space, GError **error);
+gsize decompressor_consumed(Decompressor decompressor);
+void decompressor_free(Decompressor decompressor);
+
+Compressor compressor_new(Compression compression, int fd);
+int compressor_write(Compressor compressor, const char *data, int length);
+int compressor_finish(Compressor compressor);
+void compressor_free(Compressor compressor);
+
+#endif // COMPRESSION_H
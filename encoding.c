@@ -0,0 +1,332 @@
+#include <stdint.h>
+#include <string.h>
+#include "encoding.h"
+#include "unicode.h"
+
+/*
+ * The editor works on UTF-8 only. A file in another encoding is decoded to
+ * UTF-8 chunk by chunk as it is read and encoded back the same way as it is
+ * written, so neither side needs a whole second copy of the document.
+ *
+ * Checking UTF-8 is the common case and has to keep up with reading the file:
+ * ASCII, which is most of any text, is tested 16 bytes at a time with two
+ * 64-bit words and only bytes of multi-byte characters are decoded one by one.
+ */
+
+#define ASCII_HIGH 0x8080808080808080ULL
+#define ASCII_ONES 0x0101010101010101ULL
+
+// True if the 8 bytes hold a byte with the high bit set or a NUL
+static int word_is_not_ascii(uint64_t word) {
+    return ((word | (word - ASCII_ONES)) & ASCII_HIGH) != 0;
+}
+
+// Returns the bytes in the UTF-8 sequence starting with lead, 0 if it cannot start one
+static int utf8_sequence_length(unsigned char lead) {
+    if (lead < 0x80) return 1;
+    if (lead >= 0xC2 && lead <= 0xDF) return 2;
+    if (lead >= 0xE0 && lead <= 0xEF) return 3;
+    if (lead >= 0xF0 && lead <= 0xF4) return 4;
+    return 0;
+}
+
+/**
+ * Return how many bytes at the start of text are valid UTF-8 without NUL
+ * characters, which GtkTextBuffer does not take; a character cut by the end
+ * of text is not counted
+ */
+int encoding_utf8_valid_length(const char *text, int length) {
+    const unsigned char *s = (const unsigned char *)text;
+    int i = 0;
+    while (i < length) {
+        while (i + 16 <= length) {
+            uint64_t a, b;
+            memcpy(&a, s + i, 8);
+            memcpy(&b, s + i + 8, 8);
+            if (word_is_not_ascii(a) || word_is_not_ascii(b)) break;
+            i += 16;
+        }
+        if (i == length) break;
+
+        unsigned char c = s[i];
+        if (c > 0 && c < 0x80) {
+            i++;
+            continue;
+        }
+        int size = utf8_sequence_length(c);
+        if (size < 2 || i + size > length) return i;
+        unsigned char second = s[i + 1];
+        // The second byte rules out overlong forms, surrogates and code points past U+10FFFF
+        if (c == 0xE0 && second < 0xA0) return i;
+        if (c == 0xED && second > 0x9F) return i;
+        if (c == 0xF0 && second < 0x90) return i;
+        if (c == 0xF4 && second > 0x8F) return i;
+        for (int k = 1; k < size; k++) {
+            if ((s[i + k] & 0xC0) != 0x80) return i;
+        }
+        i += size;
+    }
+    return i;
+}
+
+/**
+ * Guess the encoding of a file from its first bytes: a byte order mark, the
+ * zero bytes of mostly-ASCII UTF-16, or UTF-8 that checks out. Anything else
+ * is taken to be Latin-1, in which every byte is a character.
+ */
+Encoding encoding_detect(const char *data, int length) {
+    const unsigned char *s = (const unsigned char *)data;
+    if (length >= 3 && s[0] == 0xEF && s[1] == 0xBB && s[2] == 0xBF) return ENCODING_UTF8 | ENCODING_BOM;
+    if (length >= 2 && s[0] == 0xFF && s[1] == 0xFE) return ENCODING_UTF16LE | ENCODING_BOM;
+    if (length >= 2 && s[0] == 0xFE && s[1] == 0xFF) return ENCODING_UTF16BE | ENCODING_BOM;
+
+    int sample = length < ENCODING_SNIFF_BYTES ? length : ENCODING_SNIFF_BYTES;
+    int zero_even = 0, zero_odd = 0;
+    for (int i = 0; i < sample; i++) {
+        if (s[i] == 0) {
+            if (i & 1) zero_odd++;
+            else zero_even++;
+        }
+    }
+    int units = sample / 2;
+    if (units >= 2 && zero_odd > units / 2 && zero_even < units / 16) return ENCODING_UTF16LE;
+    if (units >= 2 && zero_even > units / 2 && zero_odd < units / 16) return ENCODING_UTF16BE;
+
+    // A character cut by the end of the sample does not count against UTF-8
+    int valid = encoding_utf8_valid_length(data, sample);
+    if (valid == sample) return ENCODING_UTF8;
+    if (sample < length && sample - valid < 4 && utf8_sequence_length(s[valid]) > sample - valid)
+        return ENCODING_UTF8;
+    return ENCODING_LATIN1;
+}
+
+/**
+ * Tell whether a file is binary rather than text from its first bytes: a zero
+ * byte that UTF-16 does not explain, or more control bytes than text has.
+ */
+int encoding_looks_binary(const char *data, int length) {
+    int kind = ENCODING_KIND(encoding_detect(data, length));
+    if (kind == ENCODING_UTF16LE || kind == ENCODING_UTF16BE) return 0;
+
+    const unsigned char *s = (const unsigned char *)data;
+    int sample = length < ENCODING_SNIFF_BYTES ? length : ENCODING_SNIFF_BYTES;
+    int control = 0;
+    for (int i = 0; i < sample; i++) {
+        if (s[i] == 0) return 1;
+        // Tabs, line breaks, form feeds and escapes all turn up in text
+        if ((s[i] < 0x20 && !(s[i] >= '\t' && s[i] <= '\r') && s[i] != 0x1B) || s[i] == 0x7F) control++;
+    }
+    return control > sample / 16;
+}
+
+// Writes the byte order mark of encoding, if it has one, to out; returns its length
+int encoding_bom(Encoding encoding, char *out) {
+    if (!(encoding & ENCODING_BOM)) return 0;
+    switch (ENCODING_KIND(encoding)) {
+    case ENCODING_UTF8: memcpy(out, "\xEF\xBB\xBF", 3); return 3;
+    case ENCODING_UTF16LE: memcpy(out, "\xFF\xFE", 2); return 2;
+    case ENCODING_UTF16BE: memcpy(out, "\xFE\xFF", 2); return 2;
+    default: return 0;
+    }
+}
+
+const char *encoding_name(Encoding encoding) {
+    int bom = (encoding & ENCODING_BOM) != 0;
+    switch (ENCODING_KIND(encoding)) {
+    case ENCODING_UTF8: return bom ? "UTF-8 with BOM" : "UTF-8";
+    case ENCODING_UTF16LE: return bom ? "UTF-16LE" : "UTF-16LE without BOM";
+    case ENCODING_UTF16BE: return bom ? "UTF-16BE" : "UTF-16BE without BOM";
+    case ENCODING_LATIN1: return "Latin-1";
+    default: return "unknown encoding";
+    }
+}
+
+const char *line_ending_name(LineEnding line_ending) {
+    switch (line_ending) {
+    case LINE_ENDING_LF: return "LF";
+    case LINE_ENDING_CRLF: return "CRLF";
+    case LINE_ENDING_CR: return "CR";
+    default: return "mixed line endings";
+    }
+}
+
+// Most bytes of UTF-8 that length bytes in encoding can decode to
+long encoding_max_utf8_length(Encoding encoding, long length) {
+    switch (ENCODING_KIND(encoding)) {
+    case ENCODING_UTF16LE:
+    case ENCODING_UTF16BE: return length / 2 * 3 + 3;
+    case ENCODING_LATIN1: return length * 2;
+    default: return length;
+    }
+}
+
+static int utf16_unit(const unsigned char *s, int big_endian) {
+    return big_endian ? (s[0] << 8 | s[1]) : (s[1] << 8 | s[0]);
+}
+
+/**
+ * Decode the start of in to UTF-8 in out, which must hold
+ * encoding_max_utf8_length() bytes; *written is set to the bytes produced.
+ * Returns the bytes of in used. Decoding stops before a NUL character, which
+ * the editor cannot show, and, unless final is set, before a character cut
+ * by the end of in, which the next call is to be given again. Unpaired UTF-16
+ * surrogates become U+FFFD.
+ */
+int encoding_to_utf8(Encoding encoding, const char *in, int length, int final, char *out, int *written) {
+    const unsigned char *s = (const unsigned char *)in;
+    unsigned char *o = (unsigned char *)out;
+    int i = 0, n = 0;
+
+    switch (ENCODING_KIND(encoding)) {
+    case ENCODING_LATIN1:
+        while (i < length) {
+            while (i + 8 <= length) {
+                uint64_t word;
+                memcpy(&word, s + i, 8);
+                if (word_is_not_ascii(word)) break;
+                memcpy(o + n, &word, 8);
+                i += 8;
+                n += 8;
+            }
+            if (i == length || s[i] == 0) break;
+            n += unicode_encode_utf8(s[i], o + n);
+            i++;
+        }
+        break;
+
+    case ENCODING_UTF16LE:
+    case ENCODING_UTF16BE: {
+        int big_endian = ENCODING_KIND(encoding) == ENCODING_UTF16BE;
+        while (i + 2 <= length) {
+            int cp = utf16_unit(s + i, big_endian), size = 2;
+            if (cp == 0) break;
+            if (cp >= 0xD800 && cp < 0xDC00) {
+                if (i + 4 > length) {
+                    if (!final) break;
+                    cp = 0xFFFD;
+                } else {
+                    int low = utf16_unit(s + i + 2, big_endian);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        size = 4;
+                    } else {
+                        cp = 0xFFFD;
+                    }
+                }
+            } else if (cp >= 0xDC00 && cp < 0xE000) {
+                cp = 0xFFFD;
+            }
+            n += unicode_encode_utf8(cp, o + n);
+            i += size;
+        }
+        // An odd byte at the end of the file
+        if (final && i + 1 == length) {
+            n += unicode_encode_utf8(0xFFFD, o + n);
+            i++;
+        }
+        break;
+    }
+
+    default:
+        i = n = encoding_utf8_valid_length(in, length);
+        memcpy(out, in, n);
+        break;
+    }
+    *written = n;
+    return i;
+}
+
+/**
+ * Tell whether rest, the bytes encoding_to_utf8() left undecoded, is a
+ * character cut short that more bytes will complete, rather than a NUL
+ * character or bytes that can never be decoded
+ */
+int encoding_cut_short(Encoding encoding, const char *rest, int length) {
+    const unsigned char *s = (const unsigned char *)rest;
+    if (length <= 0) return 0;
+    switch (ENCODING_KIND(encoding)) {
+    case ENCODING_UTF16LE:
+    case ENCODING_UTF16BE: {
+        if (length < 2) return 1;
+        int unit = utf16_unit(s, ENCODING_KIND(encoding) == ENCODING_UTF16BE);
+        return unit >= 0xD800 && unit < 0xDC00 && length < 4;
+    }
+    case ENCODING_UTF8: {
+        int size = utf8_sequence_length(s[0]);
+        if (size < 2 || length >= size) return 0;
+        for (int k = 1; k < length; k++) {
+            if ((s[k] & 0xC0) != 0x80) return 0;
+        }
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Encode the start of the UTF-8 text in into out, writing at most space
+ * bytes; *written is set to the bytes produced. Returns the bytes of in
+ * used, stopping before a character cut by the end of in, or before one the
+ * encoding cannot hold, which sets *unrepresentable.
+ */
+int encoding_from_utf8(Encoding encoding, const char *in, int length, char *out, int space, int *written,
+                       int *unrepresentable) {
+    const unsigned char *s = (const unsigned char *)in;
+    unsigned char *o = (unsigned char *)out;
+    int kind = ENCODING_KIND(encoding);
+    int i = 0, n = 0;
+    *unrepresentable = 0;
+
+    if (kind != ENCODING_UTF16LE && kind != ENCODING_UTF16BE && kind != ENCODING_LATIN1) {
+        n = i = length < space ? length : space;
+        memcpy(out, in, n);
+        *written = n;
+        return i;
+    }
+
+    while (i < length && n + 4 <= space) {
+        if (kind == ENCODING_LATIN1) {
+            while (i + 8 <= length && n + 8 <= space) {
+                uint64_t word;
+                memcpy(&word, s + i, 8);
+                if (word & ASCII_HIGH) break;
+                memcpy(o + n, &word, 8);
+                i += 8;
+                n += 8;
+            }
+            if (i == length || n + 4 > space) break;
+        }
+
+        int size = utf8_sequence_length(s[i]);
+        if (size == 0) size = 1;
+        if (i + size > length) break;
+        int cp;
+        size = unicode_decode_utf8(s + i, &cp);
+
+        if (kind == ENCODING_LATIN1) {
+            if (cp > 0xFF) {
+                *unrepresentable = 1;
+                break;
+            }
+            o[n++] = cp;
+        } else {
+            int big_endian = kind == ENCODING_UTF16BE;
+            int units[2], count = 1;
+            units[0] = cp;
+            if (cp >= 0x10000) {
+                units[0] = 0xD800 + ((cp - 0x10000) >> 10);
+                units[1] = 0xDC00 + ((cp - 0x10000) & 0x3FF);
+                count = 2;
+            }
+            for (int k = 0; k < count; k++) {
+                o[n + !big_endian] = units[k] >> 8;
+                o[n + big_endian] = units[k] & 0xFF;
+                n += 2;
+            }
+        }
+        i += size;
+    }
+    *written = n;
+    return i;
+}
@@ -0,0 +1,40 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#define ENCODING_SNIFF_BYTES (64 * 1024)  // Bytes looked at to guess the encoding of a file
+
+// Encodings files are read from and written back in; or'ed with ENCODING_BOM
+enum {
+    ENCODING_DETECT = -1,
+    ENCODING_UTF8 = 0,
+    ENCODING_UTF16LE,
+    ENCODING_UTF16BE,
+    ENCODING_LATIN1,
+};
+#define ENCODING_BOM 0x100             // The file starts with a byte order mark
+#define ENCODING_KIND(encoding) ((encoding) & 0xFF)
+
+typedef int Encoding;
+
+// How a file breaks its lines; the text keeps its line breaks as they are in the file
+typedef enum {
+    LINE_ENDING_LF,
+    LINE_ENDING_CRLF,
+    LINE_ENDING_CR,
+    LINE_ENDING_MIXED,   // More than one kind; written back as the text has them
+} LineEnding;
+
+int encoding_utf8_valid_length(const char *text, int length);
+Encoding encoding_detect(const char *data, int length);
+int encoding_looks_binary(const char *data, int length);
+int encoding_bom(Encoding encoding, char *out);
+const char *encoding_name(Encoding encoding);
+long encoding_max_utf8_length(Encoding encoding, long length);
+const char *line_ending_name(LineEnding line_ending);
+
+int encoding_to_utf8(Encoding encoding, const char *in, int length, int final, char *out, int *written);
+int encoding_cut_short(Encoding encoding, const char *rest, int length);
+int encoding_from_utf8(Encoding encoding, const char *in, int length, char *out, int space, int *written,
+                       int *unrepresentable);
+
+#endif // ENCODING_H
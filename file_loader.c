@@ -0,0 +1,298 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "file_loader.h"
+
+/*
+ * The file is mapped on the calling thread, which takes no time, and a worker
+ * then walks it FILE_LOAD_CHUNK bytes at a time: each chunk is paged in,
+ * checked to be UTF-8 and appended to a line index. The UI polls how far the
+ * worker has got and may show that prefix of the text while the rest is read;
+ * the text does not change, only the scanned count grows. A character cut by
+ * the end of a chunk is checked again with the next one.
+ *
+ * A file in another encoding is decoded the same way, chunk by chunk, into a
+ * buffer allocated for the most its text can take, so the part already shown
+ * never moves.
+ *
+ * A compressed file is decompressed a chunk at a time on the worker, which
+ * then checks or decodes the chunk as above into a buffer that becomes the
+ * piece table's original text. How much text that is may only be known at
+ * the end, so the buffer grows as needed; the UI holds the text lock while
+ * it reads the text of a load that is still running.
+ */
+
+// Records why the text stops being readable at byte at, where it holds bad
+static void fail_at(FileLoad load, int at, char bad) {
+    int utf8 = ENCODING_KIND(load->encoding) == ENCODING_UTF8;
+    if (utf8 && !(load->encoding & ENCODING_BOM)) {
+        // Only the start of the file was checked when UTF-8 was guessed
+        load->not_utf8 = 1;
+        load->error = g_strdup_printf("%s is not valid UTF-8 (byte %d)", load->filename, at);
+    } else if (!utf8 || bad == 0) {
+        load->error = g_strdup_printf("%s has a NUL character (byte %d); it may be a binary file", load->filename,
+                                      at);
+    } else {
+        load->error = g_strdup_printf("%s is not valid UTF-8 (byte %d)", load->filename, at);
+    }
+}
+
+static gpointer load_thread(gpointer data) {
+    FileLoad load = data;
+    int position = 0, produced = 0;
+    char *out = load->converted ? load->converted : (char *)load->source;
+    while (position < load->source_length && !g_atomic_int_get(&load->cancelled)) {
+        int end = MIN(load->source_length, position + FILE_LOAD_CHUNK);
+        int final = end == load->source_length;
+        int written, used;
+        if (load->converted) {
+            used = encoding_to_utf8(load->encoding, load->source + position, end - position, final,
+                                    out + produced, &written);
+        } else {
+            used = written = encoding_utf8_valid_length(load->source + position, end - position);
+        }
+        if (used < end - position && (final || end - position - used >= 4)) {
+            fail_at(load, position + used, load->source[position + used]);
+            break;
+        }
+        line_index_append(load->lines, out + produced, written);
+        position += used;
+        produced += written;
+        g_atomic_int_set(&load->consumed, position);
+        g_atomic_int_set(&load->scanned, produced);
+    }
+    load->length = produced;
+    load->finished = g_get_monotonic_time();
+    g_atomic_int_set(&load->running, 0);
+    return NULL;
+}
+
+// Makes room for needed bytes of text, moving it under the text lock; returns 0 past 2 GB
+static int reserve_text(FileLoad load, long needed) {
+    if (needed <= load->capacity) return 1;
+    if (needed > G_MAXINT) return 0;
+    long capacity = MIN(MAX(needed, load->capacity * 2), G_MAXINT);
+    g_mutex_lock(&load->text_lock);
+    load->converted = realloc(load->converted, capacity);
+    load->text = load->converted;
+    load->capacity = capacity;
+    g_mutex_unlock(&load->text_lock);
+    return 1;
+}
+
+static gpointer decompress_thread(gpointer data) {
+    FileLoad load = data;
+    char *chunk = malloc(FILE_LOAD_CHUNK);
+    int pending = 0, produced = 0, first = 1;
+    long decompressed = 0;
+    GError *error = NULL;
+    while (!g_atomic_int_get(&load->cancelled)) {
+        int n = decompressor_read(load->decompressor, chunk + pending, FILE_LOAD_CHUNK - pending, &error);
+        if (n < 0) {
+            load->error = g_strdup_printf("%s: %s", load->filename, error->message);
+            g_clear_error(&error);
+            break;
+        }
+        int available = pending + n, skip = 0;
+        int final = available < FILE_LOAD_CHUNK;
+        if (first) {
+            // The encoding is told from the decompressed text, and its byte order mark is not text
+            char bom[4];
+            if (load->encoding == ENCODING_DETECT) load->encoding = encoding_detect(chunk, available);
+            skip = MIN(available, encoding_bom(load->encoding, bom));
+            first = 0;
+        }
+        if (!reserve_text(load, produced + encoding_max_utf8_length(load->encoding, available - skip) + 1)) {
+            load->error = g_strdup_printf("%s is larger than 2 GB decompressed", load->filename);
+            break;
+        }
+
+        int written;
+        int used = encoding_to_utf8(load->encoding, chunk + skip, available - skip, final,
+                                    load->converted + produced, &written);
+        if (used < available - skip && (final || available - skip - used >= 4)) {
+            fail_at(load, decompressed + skip + used, chunk[skip + used]);
+            break;
+        }
+        line_index_append(load->lines, load->converted + produced, written);
+        produced += written;
+        decompressed += skip + used;
+        pending = available - skip - used;
+        memmove(chunk, chunk + skip + used, pending);
+        int consumed = final ? load->source_length : (int)decompressor_consumed(load->decompressor);
+        g_atomic_int_set(&load->consumed, consumed);
+        g_atomic_int_set(&load->scanned, produced);
+        if (final) break;
+    }
+    free(chunk);
+    // The room left for text that did not come is given back
+    g_mutex_lock(&load->text_lock);
+    load->converted = realloc(load->converted, produced + 1);
+    load->text = load->converted;
+    load->capacity = produced + 1;
+    g_mutex_unlock(&load->text_lock);
+    load->length = produced;
+    load->finished = g_get_monotonic_time();
+    g_atomic_int_set(&load->running, 0);
+    return NULL;
+}
+
+// Starts decompressing the mapped file on a worker, into text that grows as it comes
+static FileLoad start_decompressing(FileLoad load, Compression compression, GError **error) {
+    load->decompressor = decompressor_new(compression, load->source, load->source_length, error);
+    if (!load->decompressor) return NULL;
+    gint64 content = compression_content_length(compression, load->source, load->source_length);
+    // Deflate and zstd shrink text at most about a thousandfold; a larger length is not to be believed
+    if (content < 0 || content > (gint64)load->source_length * 1032) content = (gint64)load->source_length * 4;
+    load->compression = compression;
+    load->expected_length = MIN(content, G_MAXINT);
+    load->capacity = MIN(MAX(content + 1, FILE_LOAD_CHUNK), G_MAXINT);
+    load->converted = malloc(load->capacity);
+    load->text = load->converted;
+    load->length = -1;
+    load->lines = line_index_create();
+    load->running = 1;
+    load->started = g_get_monotonic_time();
+    load->worker = g_thread_new("file-load", decompress_thread, load);
+    return load;
+}
+
+/*
+ * Maps filename and starts reading it in encoding, or in the one it seems to
+ * be in for ENCODING_DETECT, decompressing it first if it is compressed;
+ * returns NULL with error set if it cannot be opened
+ */
+FileLoad file_load_start(const char *filename, Encoding encoding, GError **error) {
+    GMappedFile *mapping = g_mapped_file_new(filename, FALSE, error);
+    if (!mapping) return NULL;
+    const char *contents = g_mapped_file_get_contents(mapping);
+    gsize size = g_mapped_file_get_length(mapping);
+    if (size > G_MAXINT) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "%s is larger than 2 GB", filename);
+        g_mapped_file_unref(mapping);
+        return NULL;
+    }
+
+    Compression compression = compression_detect(contents, size);
+    if (compression.codec != COMPRESSION_NONE) {
+        FileLoad load = g_new0(struct file_load, 1);
+        load->filename = g_strdup(filename);
+        load->mapping = mapping;
+        load->encoding = encoding;
+        load->source = contents;
+        load->source_length = size;
+        g_mutex_init(&load->text_lock);
+        madvise((void *)contents, size, MADV_SEQUENTIAL);
+        if (!start_decompressing(load, compression, error)) {
+            file_load_free(load);
+            return NULL;
+        }
+        return load;
+    }
+
+    if (encoding == ENCODING_DETECT) encoding = encoding_detect(contents, size);
+    char bom[4];
+    int bom_length = encoding_bom(encoding, bom);
+    long capacity = encoding_max_utf8_length(encoding, size - bom_length);
+    if (capacity > G_MAXINT) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "%s is too large to decode from %s", filename,
+                    encoding_name(encoding));
+        g_mapped_file_unref(mapping);
+        return NULL;
+    }
+
+    FileLoad load = g_new0(struct file_load, 1);
+    load->filename = g_strdup(filename);
+    load->mapping = mapping;
+    load->encoding = encoding;
+    load->source = contents + bom_length;
+    load->source_length = size - bom_length;
+    load->expected_length = load->source_length;
+    g_mutex_init(&load->text_lock);
+    if (ENCODING_KIND(encoding) == ENCODING_UTF8) {
+        load->text = load->source;
+        load->length = load->source_length;
+    } else {
+        load->converted = malloc(capacity + 1);
+        load->text = load->converted;
+        load->length = -1;
+    }
+    if (size > 0) madvise((void *)contents, size, MADV_SEQUENTIAL);
+    load->lines = line_index_create();
+    load->running = 1;
+    load->started = g_get_monotonic_time();
+    load->worker = g_thread_new("file-load", load_thread, load);
+    return load;
+}
+
+// Sets scanned to the bytes validated so far; returns 1 while the worker is still running
+int file_load_poll(FileLoad load, int *scanned) {
+    int running = g_atomic_int_get(&load->running);
+    *scanned = g_atomic_int_get(&load->scanned);
+    return running;
+}
+
+// Blocks until the worker has finished
+void file_load_wait(FileLoad load) {
+    if (load->worker) g_thread_join(load->worker);
+    load->worker = NULL;
+}
+
+void file_load_cancel(FileLoad load) {
+    g_atomic_int_set(&load->cancelled, 1);
+}
+
+/**
+ * Keep the text where it is until file_load_unlock_text(), so the part read
+ * so far can be read while the worker runs
+ */
+void file_load_lock_text(FileLoad load) {
+    g_mutex_lock(&load->text_lock);
+}
+
+void file_load_unlock_text(FileLoad load) {
+    g_mutex_unlock(&load->text_lock);
+}
+
+/**
+ * Take ownership of the mapped text, which stays valid after the load is freed
+ */
+GMappedFile *file_load_take_mapping(FileLoad load) {
+    GMappedFile *mapping = load->mapping;
+    load->mapping = NULL;
+    return mapping;
+}
+
+/**
+ * Take ownership of the line index; call only once the worker has finished
+ */
+LineIndex file_load_take_lines(FileLoad load) {
+    file_load_wait(load);
+    LineIndex lines = load->lines;
+    load->lines = NULL;
+    return lines;
+}
+
+/**
+ * Take ownership of the decoded text, to be released with free(); NULL if
+ * the file was UTF-8
+ */
+char *file_load_take_converted(FileLoad load) {
+    file_load_wait(load);
+    char *converted = load->converted;
+    load->converted = NULL;
+    return converted;
+}
+
+void file_load_free(FileLoad load) {
+    file_load_cancel(load);
+    file_load_wait(load);
+    if (load->lines) line_index_free(load->lines);
+    decompressor_free(load->decompressor);
+    if (load->mapping) g_mapped_file_unref(load->mapping);
+    free(load->converted);
+    g_mutex_clear(&load->text_lock);
+    g_free(load->error);
+    g_free(load->filename);
+    g_free(load);
+}
@@ -0,0 +1,53 @@
+#ifndef FILE_LOADER_H
+#define FILE_LOADER_H
+
+#include <glib.h>
+#include "compression.h"
+#include "encoding.h"
+#include "line_index.h"
+
+#define FILE_LOAD_CHUNK (1024 * 1024)  // Bytes validated and indexed per step
+
+/*
+ * A file being opened: a worker thread checks that the mapped file is UTF-8,
+ * or decompresses it and decodes it to UTF-8 if it is compressed or in
+ * another encoding, and indexes its lines
+ */
+typedef struct file_load {
+    char *filename;
+    GMappedFile *mapping;
+    Encoding encoding;   // For a compressed file, known once the first text is decompressed
+    Compression compression;
+    const char *source;  // The file's bytes after any byte order mark, or its compressed bytes
+    int source_length;
+    int expected_length; // Bytes of text the file is expected to hold, a guess if it is compressed
+    char *converted;     // The decoded text if the file is not UTF-8 or is compressed, NULL otherwise
+    long capacity;       // Bytes allocated for converted
+    GMutex text_lock;    // Held while a decompressing worker moves converted to grow it
+    Decompressor decompressor;
+    const char *text;    // The UTF-8 text: source itself, or converted
+    int length;          // Bytes of text; for a decoded file known only once the load is done
+    LineIndex lines;     // Built by the worker; read it only once the load is done
+    GThread *worker;
+    int consumed;        // Bytes of source read so far, updated atomically
+    int scanned;         // Bytes of text ready so far, updated atomically; always on a character boundary
+    int running;
+    int cancelled;
+    int not_utf8;        // Set if a file guessed to be UTF-8 turned out not to be
+    char *error;         // Why the load failed, once it is done
+    gint64 started;
+    gint64 finished;
+} *FileLoad;
+
+FileLoad file_load_start(const char *filename, Encoding encoding, GError **error);
+int file_load_poll(FileLoad load, int *scanned);
+void file_load_wait(FileLoad load);
+void file_load_cancel(FileLoad load);
+void file_load_lock_text(FileLoad load);
+void file_load_unlock_text(FileLoad load);
+GMappedFile *file_load_take_mapping(FileLoad load);
+LineIndex file_load_take_lines(FileLoad load);
+char *file_load_take_converted(FileLoad load);
+void file_load_free(FileLoad load);
+
+#endif // FILE_LOADER_H
@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "file_saver.h"
+
+/*
+ * The worker writes the snapshot to a temporary file next to the target and
+ * renames it over the target once it is complete and synced, so a failed or
+ * interrupted save leaves the old file as it was, and a file the editor has
+ * mapped keeps its old contents. Pieces are written straight from the
+ * snapshot's buffers; only runs of small pieces are copied, to gather them
+ * into fewer writes. A file in another encoding than UTF-8 is encoded into
+ * that same buffer as it goes, and new lines are given the file's line
+ * breaks the same way. A compressed file is compressed again as the text
+ * goes out, with the codec it was read with. When it is done the worker
+ * hands the save back to the main loop, which runs the done callback.
+ */
+
+static int write_all(int fd, const char *text, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, text, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        text += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Where the text goes on its way to the file
+typedef struct {
+    int fd;
+    Compressor compressor;   // Set if the file is compressed; the text goes through it to fd
+    Encoding encoding;
+    char *buffer;            // Gathers small pieces, and holds text being encoded
+    int used;
+    char pending[8];
+    int pending_length;      // Start of a character cut by the end of the last text put
+    int result;              // -1 once writing failed, 1 once a character the encoding cannot hold was met
+} Writer;
+
+static int writer_output(Writer *writer, const char *text, int length) {
+    if (writer->compressor) return compressor_write(writer->compressor, text, length);
+    return write_all(writer->fd, text, length);
+}
+
+static void writer_flush(Writer *writer) {
+    if (writer->result == 0 && writer->used) writer->result = writer_output(writer, writer->buffer, writer->used);
+    writer->used = 0;
+}
+
+// Large runs of UTF-8 are written from where they are, small ones gathered
+static void put_utf8(Writer *writer, const char *text, int length) {
+    if (writer->used + length > FILE_SAVE_BUFFER) writer_flush(writer);
+    if (writer->result) return;
+    if (length >= FILE_SAVE_BUFFER / 2) {
+        writer->result = writer_output(writer, text, length);
+    } else {
+        memcpy(writer->buffer + writer->used, text, length);
+        writer->used += length;
+    }
+}
+
+// Encodes text into the buffer, carrying a character cut by its end over to the next call
+static void put_encoded(Writer *writer, const char *text, int length) {
+    int at = 0;
+    while (at < length && writer->result == 0) {
+        if (writer->used + 8 > FILE_SAVE_BUFFER) {
+            writer_flush(writer);
+            continue;
+        }
+        const char *in = text + at;
+        int available = length - at, borrowed = 0;
+        if (writer->pending_length) {
+            // Complete the cut character from this text
+            borrowed = MIN(available, 4 - writer->pending_length);
+            memcpy(writer->pending + writer->pending_length, in, borrowed);
+            in = writer->pending;
+            available = writer->pending_length + borrowed;
+        }
+        int written, unrepresentable;
+        int consumed = encoding_from_utf8(writer->encoding, in, available, writer->buffer + writer->used,
+                                          FILE_SAVE_BUFFER - writer->used, &written, &unrepresentable);
+        writer->used += written;
+        if (unrepresentable) {
+            writer->result = 1;
+        } else if (writer->pending_length && consumed == 0) {
+            writer->pending_length += borrowed;
+            at += borrowed;
+        } else if (writer->pending_length) {
+            at += consumed - writer->pending_length;
+            writer->pending_length = 0;
+        } else if (consumed == 0) {
+            memcpy(writer->pending, in, available);
+            writer->pending_length = available;
+            at = length;
+        } else {
+            at += consumed;
+        }
+    }
+}
+
+static void writer_put(Writer *writer, const char *text, int length) {
+    if (ENCODING_KIND(writer->encoding) == ENCODING_UTF8) put_utf8(writer, text, length);
+    else put_encoded(writer, text, length);
+}
+
+/*
+ * Puts the snapshot through the writer. The text keeps the line breaks the
+ * file had, but the text view breaks new lines with a bare \n, so in a CRLF
+ * or CR file each \n not already after a \r is written as the file's break.
+ * Only pieces that have such a \n are split; the rest go through as they are.
+ */
+static void write_snapshot(Writer *writer, PiecetableSnapshot snapshot, LineEnding line_ending) {
+    const char *line_break = line_ending == LINE_ENDING_CRLF ? "\r\n" : "\r";
+    int convert = line_ending == LINE_ENDING_CRLF || line_ending == LINE_ENDING_CR;
+    char last = 0;  // Last byte of the text before this piece
+    for (int i = 0; i < snapshot->count && writer->result == 0; i++) {
+        const char *text = piecetable_snapshot_piece_text(snapshot, i);
+        int length = snapshot->pieces[i].length;
+        if (length == 0) continue;
+        int start = 0, at = 0;
+        const char *newline;
+        while (convert && (newline = memchr(text + at, '\n', length - at)) != NULL) {
+            at = newline - text;
+            char before = at > 0 ? text[at - 1] : last;
+            if (before != '\r') {
+                writer_put(writer, text + start, at - start);
+                writer_put(writer, line_break, strlen(line_break));
+                start = at + 1;
+            }
+            at++;
+        }
+        writer_put(writer, text + start, length - start);
+        last = text[length - 1];
+    }
+}
+
+/*
+ * Writes the snapshot in the save's encoding, line-ending style and
+ * compression, or as UTF-8 if the encoding cannot hold the text
+ */
+static int write_text(int fd, FileSave save) {
+    Writer writer = {.fd = fd, .encoding = save->encoding, .buffer = g_malloc(FILE_SAVE_BUFFER)};
+    if (save->compression.codec != COMPRESSION_NONE) {
+        writer.compressor = compressor_new(save->compression, fd);
+        if (!writer.compressor) {
+            g_free(writer.buffer);
+            errno = ENOTSUP;
+            return -1;
+        }
+    }
+    writer.used = encoding_bom(save->encoding, writer.buffer);
+    write_snapshot(&writer, save->snapshot, save->line_ending);
+    writer_flush(&writer);
+    if (writer.result == 0 && writer.compressor) writer.result = compressor_finish(writer.compressor);
+    compressor_free(writer.compressor);
+
+    if (writer.result > 0) {
+        g_free(writer.buffer);
+        if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) return -1;
+        save->encoding = ENCODING_UTF8;
+        save->reencoded = 1;
+        return write_text(fd, save);
+    }
+    g_free(writer.buffer);
+    return writer.result;
+}
+
+static gboolean save_finished(gpointer data) {
+    FileSave save = data;
+    file_save_wait(save);
+    save->idle = 0;
+    save->done(save, save->error, save->data);
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer save_thread(gpointer data) {
+    FileSave save = data;
+    char *temp = g_strdup_printf("%s.XXXXXX", save->filename);
+    int fd = g_mkstemp(temp);
+    if (fd < 0) {
+        save->error = g_strdup_printf("%s: %s", save->filename, g_strerror(errno));
+    } else {
+        fchmod(fd, save->mode);
+        if (write_text(fd, save) < 0 || fsync(fd) < 0) {
+            save->error = g_strdup_printf("%s: %s", save->filename, g_strerror(errno));
+            close(fd);
+        } else if (close(fd) < 0 || g_rename(temp, save->filename) < 0) {
+            save->error = g_strdup_printf("%s: %s", save->filename, g_strerror(errno));
+        }
+        if (save->error) g_unlink(temp);
+    }
+    g_free(temp);
+    save->finished = g_get_monotonic_time();
+    save->idle = g_idle_add(save_finished, save);
+    return NULL;
+}
+
+/**
+ * Start writing snapshot to filename in encoding and line_ending, compressed
+ * as compression says, on a worker thread, taking a reference to the
+ * snapshot; done runs on the main loop when the file is written or failed
+ */
+FileSave file_save_start(const char *filename, PiecetableSnapshot snapshot, Encoding encoding,
+                         LineEnding line_ending, Compression compression, FileSaveDone done, gpointer data) {
+    FileSave save = g_new0(struct file_save, 1);
+    save->filename = g_strdup(filename);
+    save->snapshot = piecetable_snapshot_ref(snapshot);
+    save->encoding = encoding;
+    save->line_ending = line_ending;
+    save->compression = compression;
+    save->done = done;
+    save->data = data;
+    save->started = g_get_monotonic_time();
+
+    // The permissions of the file being replaced, or those a new file would get
+    struct stat st;
+    if (stat(filename, &st) == 0) {
+        save->mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        save->mode = 0666 & ~mask;
+    }
+    save->worker = g_thread_new("file-save", save_thread, save);
+    return save;
+}
+
+// Blocks until the worker has finished
+void file_save_wait(FileSave save) {
+    if (save->worker) g_thread_join(save->worker);
+    save->worker = NULL;
+}
+
+void file_save_free(FileSave save) {
+    file_save_wait(save);
+    // A save waited for and freed before the main loop ran must not be reported
+    if (save->idle) g_source_remove(save->idle);
+    piecetable_snapshot_unref(save->snapshot);
+    g_free(save->error);
+    g_free(save->filename);
+    g_free(save);
+}
@@ -0,0 +1,39 @@
+#ifndef FILE_SAVER_H
+#define FILE_SAVER_H
+
+#include <glib.h>
+#include "compression.h"
+#include "encoding.h"
+#include "piecetable.h"
+
+#define FILE_SAVE_BUFFER (256 * 1024)  // Small pieces are gathered into writes of up to this size
+
+typedef struct file_save *FileSave;
+
+// Called on the main loop once a save has finished; error is NULL on success
+typedef void (*FileSaveDone)(FileSave save, const char *error, gpointer data);
+
+// A snapshot being written to a file by a worker thread
+struct file_save {
+    char *filename;
+    PiecetableSnapshot snapshot;
+    int mode;                // Permissions given to the written file
+    Encoding encoding;       // Encoding the file is written in
+    LineEnding line_ending;  // Line breaks given to lines the text view added
+    Compression compression; // How the written file is compressed
+    int reencoded;           // Set if the text had characters the encoding cannot hold, so it was written as UTF-8
+    GThread *worker;
+    guint idle;              // Reports the finished save on the main loop
+    char *error;             // Why the save failed, set by the worker
+    FileSaveDone done;
+    gpointer data;
+    gint64 started;
+    gint64 finished;
+};
+
+FileSave file_save_start(const char *filename, PiecetableSnapshot snapshot, Encoding encoding,
+                         LineEnding line_ending, Compression compression, FileSaveDone done, gpointer data);
+void file_save_wait(FileSave save);
+void file_save_free(FileSave save);
+
+#endif // FILE_SAVER_H
@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "file_watch.h"
+
+/*
+ * GFileMonitor reports each write another program makes, so a burst of them
+ * is let settle before the owner is told, though for no longer than
+ * FILE_WATCH_MAX_DELAY: a log written to without pause is still looked at as
+ * it grows. The owner then asks how the file changed: a file that only grew
+ * and still has the bytes it ended with is taken to have been appended to,
+ * and only the new bytes are read and decoded, or mapped where they are.
+ * Anything else needs the whole file compared with the document. A file cut
+ * short in place is reported at once instead of after settling, since reading
+ * a mapping of it past the new end kills the process.
+ */
+
+static int read_at(int fd, char *out, int length, gint64 offset) {
+    int done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, out + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Reads the last bytes before the remembered end of the file into tail
+static int read_tail(FileWatch watch, int fd) {
+    watch->tail_length = MIN(watch->size, FILE_WATCH_TAIL);
+    return read_at(fd, watch->tail, watch->tail_length, watch->size - watch->tail_length);
+}
+
+// True if the file is still the one remembered but now shorter than it was
+static int file_shrunk(FileWatch watch) {
+    struct stat st;
+    return watch->size > 0 && stat(watch->filename, &st) == 0 && st.st_ino == watch->inode &&
+           st.st_size < watch->size;
+}
+
+static gboolean on_settled(gpointer data) {
+    FileWatch watch = data;
+    watch->settle = 0;
+    watch->changed(watch, watch->data);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_monitor_event(GFileMonitor *monitor, GFile *file, GFile *other, GFileMonitorEvent event,
+                             gpointer data) {
+    FileWatch watch = data;
+    if (event == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED || event == G_FILE_MONITOR_EVENT_PRE_UNMOUNT ||
+        event == G_FILE_MONITOR_EVENT_UNMOUNTED)
+        return;
+    if (file_shrunk(watch)) {
+        if (watch->settle) g_source_remove(watch->settle);
+        watch->settle = 0;
+        watch->changed(watch, watch->data);
+        return;
+    }
+    gint64 now = g_get_monotonic_time();
+    if (watch->settle) g_source_remove(watch->settle);
+    else watch->first_event = now;
+    // Settling never delays the look past FILE_WATCH_MAX_DELAY after the first event
+    gint64 left = FILE_WATCH_MAX_DELAY - (now - watch->first_event) / 1000;
+    watch->settle = g_timeout_add(CLAMP(left, 0, FILE_WATCH_SETTLE), on_settled, watch);
+}
+
+/**
+ * Start watching filename, which the document now matches; changed runs on
+ * the main loop after another program has changed it
+ */
+FileWatch file_watch_start(const char *filename, FileWatchChanged changed, gpointer data) {
+    FileWatch watch = g_new0(struct file_watch, 1);
+    watch->filename = g_strdup(filename);
+    watch->changed = changed;
+    watch->data = data;
+    file_watch_sync(watch);
+
+    GFile *file = g_file_new_for_path(filename);
+    GError *error = NULL;
+    watch->monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, &error);
+    if (watch->monitor) {
+        g_signal_connect(watch->monitor, "changed", G_CALLBACK(on_monitor_event), watch);
+    } else {
+        g_print("Cannot watch %s: %s\n", filename, error->message);
+        g_clear_error(&error);
+    }
+    g_object_unref(file);
+    return watch;
+}
+
+/**
+ * Remember the file as it is now, after the document was made to match it
+ */
+void file_watch_sync(FileWatch watch) {
+    struct stat st;
+    int fd = open(watch->filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        watch->size = watch->mtime = -1;
+        watch->inode = 0;
+        watch->tail_length = 0;
+    } else {
+        watch->size = st.st_size;
+        watch->mtime = st.st_mtime;
+        watch->inode = st.st_ino;
+        if (read_tail(watch, fd) < 0) watch->tail_length = -1;
+    }
+    if (fd >= 0) close(fd);
+}
+
+/**
+ * Return how the file differs from the one last remembered
+ */
+FileWatchChange file_watch_check(FileWatch watch) {
+    struct stat st;
+    int fd = open(watch->filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return FILE_WATCH_DELETED;
+    }
+    FileWatchChange change;
+    if (st.st_ino != watch->inode || watch->size < 0) {
+        change = FILE_WATCH_REPLACED;
+    } else if (st.st_size == watch->size && st.st_mtime == watch->mtime) {
+        change = FILE_WATCH_UNCHANGED;
+    } else if (st.st_size < watch->size) {
+        change = FILE_WATCH_SHRUNK;
+    } else if (st.st_size > watch->size && watch->tail_length >= 0) {
+        char tail[FILE_WATCH_TAIL];
+        int same = read_at(fd, tail, watch->tail_length, watch->size - watch->tail_length) == 0 &&
+                   memcmp(tail, watch->tail, watch->tail_length) == 0;
+        change = same ? FILE_WATCH_APPENDED : FILE_WATCH_REWRITTEN;
+    } else {
+        change = FILE_WATCH_REWRITTEN;
+    }
+    close(fd);
+    return change;
+}
+
+/**
+ * Read and decode the bytes appended to the file since it was last matched,
+ * at most limit of them, returning them as UTF-8 to be released with free().
+ * A character cut by the end of the file or the limit is left for the next
+ * call. Returns NULL with error set if the new bytes cannot be read or
+ * decoded.
+ */
+char *file_watch_read_appended(FileWatch watch, Encoding encoding, int limit, int *length, GError **error) {
+    int fd = open(watch->filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "%s: %s", watch->filename,
+                    g_strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    gint64 count = st.st_size - watch->size;
+    if (count < 0 || encoding_max_utf8_length(encoding, count) > G_MAXINT) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "%s grew too much to read the new text alone",
+                    watch->filename);
+        close(fd);
+        return NULL;
+    }
+    count = MIN(count, limit);
+    char *bytes = malloc(count + 1);
+    char *text = malloc(encoding_max_utf8_length(encoding, count) + 1);
+    int failed = read_at(fd, bytes, count, watch->size) < 0;
+    if (failed) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "%s: cannot read the new text", watch->filename);
+    } else {
+        int used = encoding_to_utf8(encoding, bytes, count, FALSE, text, length);
+        // Only a character cut by the end of what was read waits for more bytes
+        failed = used < count && !encoding_cut_short(encoding, bytes + used, count - used);
+        if (failed) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s: the new text is not %s (byte %d)",
+                        watch->filename, encoding_name(encoding), (int)(watch->size + used));
+        } else {
+            watch->size += used;
+            watch->mtime = st.st_mtime;
+            if (read_tail(watch, fd) < 0) watch->tail_length = -1;
+        }
+    }
+    free(bytes);
+    close(fd);
+    if (failed) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+/**
+ * Map the file again after text was appended to it, for a document that
+ * reads the UTF-8 file in place, and check the new bytes, at most limit of
+ * them. Those are then taken as read, as by file_watch_read_appended(), and
+ * *length is set to how many there are. Returns the new mapping, which holds
+ * the old bytes where they were, or NULL with error set.
+ */
+GMappedFile *file_watch_map_appended(FileWatch watch, int limit, int *length, GError **error) {
+    int fd = open(watch->filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "%s: %s", watch->filename,
+                    g_strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    if (st.st_ino != watch->inode) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "%s was replaced", watch->filename);
+        close(fd);
+        return NULL;
+    }
+    GMappedFile *mapping = g_mapped_file_new_from_fd(fd, FALSE, error);
+    close(fd);
+    if (!mapping) return NULL;
+
+    // The file may have grown again since fstat; the mapping has what it had when made
+    gint64 size = g_mapped_file_get_length(mapping);
+    if (size < watch->size || size > G_MAXINT) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "%s grew too much to read the new text alone",
+                    watch->filename);
+        g_mapped_file_unref(mapping);
+        return NULL;
+    }
+    const char *contents = g_mapped_file_get_contents(mapping);
+    int count = MIN(size - watch->size, limit);
+    int used = encoding_utf8_valid_length(contents + watch->size, count);
+    if (used < count && !encoding_cut_short(ENCODING_UTF8, contents + watch->size + used, count - used)) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s: the new text is not UTF-8 (byte %d)",
+                    watch->filename, (int)(watch->size + used));
+        g_mapped_file_unref(mapping);
+        return NULL;
+    }
+    watch->size += used;
+    watch->mtime = st.st_mtime;
+    watch->tail_length = MIN(watch->size, FILE_WATCH_TAIL);
+    memcpy(watch->tail, contents + watch->size - watch->tail_length, watch->tail_length);
+    *length = used;
+    return mapping;
+}
+
+void file_watch_free(FileWatch watch) {
+    if (!watch) return;
+    if (watch->settle) g_source_remove(watch->settle);
+    if (watch->monitor) {
+        g_file_monitor_cancel(watch->monitor);
+        g_object_unref(watch->monitor);
+    }
+    g_free(watch->filename);
+    g_free(watch);
+}
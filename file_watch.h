@@ -0,0 +1,53 @@
+#ifndef FILE_WATCH_H
+#define FILE_WATCH_H
+
+#include <gio/gio.h>
+#include "encoding.h"
+
+#define FILE_WATCH_SETTLE 200   // Milliseconds without change events before the file is looked at
+#define FILE_WATCH_MAX_DELAY 1000  // Most milliseconds a file written to without pause goes unlooked at
+#define FILE_WATCH_TAIL 4096    // Bytes before the old end compared to tell an append from a rewrite
+
+typedef struct file_watch *FileWatch;
+
+// Called on the main loop once the file has stopped changing for a moment
+typedef void (*FileWatchChanged)(FileWatch watch, gpointer data);
+
+// How the file differs from the one the document last matched
+typedef enum {
+    FILE_WATCH_UNCHANGED,
+    FILE_WATCH_APPENDED,   // Only grew; the old bytes are as they were
+    FILE_WATCH_REWRITTEN,  // Changed in place; a mapping of it no longer holds the old text
+    FILE_WATCH_SHRUNK,     // Cut short in place; a mapping of it faults (SIGBUS) where read past the new end
+    FILE_WATCH_REPLACED,   // Another file was put in its place
+    FILE_WATCH_DELETED,
+} FileWatchChange;
+
+/*
+ * Watches a document's file for changes by other programs. It remembers the
+ * file as the document last matched it: its size, time, inode and last few
+ * bytes, which are enough to tell text appended to it from other changes
+ * without reading the rest.
+ */
+struct file_watch {
+    char *filename;
+    GFileMonitor *monitor;
+    guint settle;                 // Runs changed once events have stopped
+    gint64 first_event;           // When the first event since changed last ran came
+    gint64 size;                  // The file as the document last matched it
+    gint64 mtime;
+    guint64 inode;
+    char tail[FILE_WATCH_TAIL];   // Its last bytes
+    int tail_length;
+    FileWatchChanged changed;
+    gpointer data;
+};
+
+FileWatch file_watch_start(const char *filename, FileWatchChanged changed, gpointer data);
+void file_watch_sync(FileWatch watch);
+FileWatchChange file_watch_check(FileWatch watch);
+char *file_watch_read_appended(FileWatch watch, Encoding encoding, int limit, int *length, GError **error);
+GMappedFile *file_watch_map_appended(FileWatch watch, int limit, int *length, GError **error);
+void file_watch_free(FileWatch watch);
+
+#endif // FILE_WATCH_H
@@ -0,0 +1,193 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "find_in_files.h"
+#include "piecetable.h"
+
+/*
+ * One walker thread lists the tree and queues file paths while several worker
+ * threads map and scan the files with the same KMP kernel kmp_search uses, so
+ * walking, reading and matching overlap. Workers push FileMatch records to a
+ * second queue the UI drains with find_in_files_poll.
+ */
+
+#define BINARY_PROBE 4096 // Leading bytes checked for NUL to skip binary files
+
+static char end_of_paths; // Queued once per worker after the last path
+
+static void walk_directory(FindInFiles job, const char *dir_path) {
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    if (!dir) return;
+
+    const char *name;
+    while ((name = g_dir_read_name(dir)) && !g_atomic_int_get(&job->cancelled)) {
+        if (name[0] == '.') continue; // Hidden files and VCS directories
+        char *path = g_build_filename(dir_path, name, NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_SYMLINK)) {
+            g_free(path);
+        } else if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+            walk_directory(job, path);
+            g_free(path);
+        } else {
+            g_async_queue_push(job->paths, path);
+        }
+    }
+    g_dir_close(dir);
+}
+
+// The last thread to stop sets finished under the lock, so a poll that sees none running sees the time too
+static void thread_done(FindInFiles job) {
+    g_mutex_lock(&job->lock);
+    if (--job->active == 0) job->finished = g_get_monotonic_time();
+    g_mutex_unlock(&job->lock);
+}
+
+static gpointer walker_thread(gpointer data) {
+    FindInFiles job = data;
+    walk_directory(job, job->root);
+    for (int i = 0; i < job->nworkers; i++) g_async_queue_push(job->paths, &end_of_paths);
+    thread_done(job);
+    return NULL;
+}
+
+static FileMatch *make_match(const char *path, const char *text, int length, int line, int line_start,
+                             int offset) {
+    const char *newline = memchr(text + line_start, '\n', length - line_start);
+    int line_end = newline ? newline - text : length;
+    if (line_end > line_start && text[line_end - 1] == '\r') line_end--;
+    if (line_end - line_start > FIND_IN_FILES_LINE_MAX) {
+        // Cut before the character that would pass the limit, not inside it
+        const char *cut = g_utf8_find_prev_char(text + line_start, text + line_start + FIND_IN_FILES_LINE_MAX + 1);
+        line_end = cut ? cut - text : line_start;
+    }
+
+    FileMatch *match = g_new(FileMatch, 1);
+    match->path = g_strdup(path);
+    match->line = line;
+    match->column = offset - line_start;
+    // The files are not checked to be UTF-8, and the list shows only valid text
+    match->text = g_utf8_make_valid(text + line_start, line_end - line_start);
+    return match;
+}
+
+static void scan_file(FindInFiles job, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > G_MAXINT) {
+        close(fd);
+        return;
+    }
+    int length = st.st_size;
+    const char *text = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) return;
+    madvise((void *)text, length, MADV_SEQUENTIAL);
+    madvise((void *)text, length, MADV_WILLNEED);
+
+    if (!memchr(text, '\0', length < BINARY_PROBE ? length : BINARY_PROBE)) {
+        Piecetable view = piecetable_create_view(text, length);
+        PiecetableCursor cursor;
+        piecetable_cursor_init(view, &cursor);
+        SearchResults results;
+        search_results_init(&results, FIND_IN_FILES_FILE_LIMIT);
+        kmp_scan(job->kmp, view, &cursor, 0, length, &results);
+
+        // Line numbers are counted only up to the matches that get reported
+        SearchCursor match;
+        int line = 1, line_start = 0, counted = 0;
+        search_cursor_first(&results, &match);
+        for (int i = 0; i < results.count; i++, search_cursor_next(&results, &match)) {
+            int offset = search_cursor_offset(&match);
+            if (g_atomic_int_add(&job->matches_reported, 1) >= FIND_IN_FILES_MAX_MATCHES) break;
+            const char *newline;
+            while ((newline = memchr(text + counted, '\n', offset - counted))) {
+                line++;
+                counted = newline - text + 1;
+                line_start = counted;
+            }
+            counted = offset;
+            g_async_queue_push(job->matches, make_match(path, text, length, line, line_start, offset));
+        }
+        g_atomic_int_add(&job->matches_found, results.total);
+        if (results.total > 0) g_atomic_int_inc(&job->files_matched);
+        search_results_free(&results);
+        piecetable_free(view);
+    }
+
+    munmap((void *)text, length);
+    g_atomic_int_inc(&job->files_scanned);
+    g_atomic_pointer_add(&job->bytes_scanned, length);
+}
+
+static gpointer worker_thread(gpointer data) {
+    FindInFiles job = data;
+    for (;;) {
+        char *path = g_async_queue_pop(job->paths);
+        if (path == &end_of_paths) break;
+        if (!g_atomic_int_get(&job->cancelled)) scan_file(job, path);
+        g_free(path);
+    }
+    thread_done(job);
+    return NULL;
+}
+
+FindInFiles find_in_files_start(const char *root, const char *pattern, int flags) {
+    FindInFiles job = g_new0(struct find_in_files, 1);
+    job->root = g_strdup(root);
+    job->kmp = kmp_create(pattern, strlen(pattern), flags);
+    job->paths = g_async_queue_new();
+    job->matches = g_async_queue_new();
+    job->started = g_get_monotonic_time();
+
+    // At least two workers, so one can scan while another waits for the disk
+    job->nworkers = MAX(2, (int)g_get_num_processors());
+    job->workers = g_new(GThread *, job->nworkers);
+    g_mutex_init(&job->lock);
+    job->active = job->nworkers + 1;
+    job->walker = g_thread_new("find-walk", walker_thread, job);
+    for (int i = 0; i < job->nworkers; i++) job->workers[i] = g_thread_new("find-scan", worker_thread, job);
+    return job;
+}
+
+// Moves the matches found so far into out; returns 1 while the search is still running
+int find_in_files_poll(FindInFiles job, GPtrArray *out) {
+    g_mutex_lock(&job->lock);
+    int running = job->active > 0;
+    g_mutex_unlock(&job->lock);
+    FileMatch *match;
+    while ((match = g_async_queue_try_pop(job->matches))) g_ptr_array_add(out, match);
+    return running;
+}
+
+void find_in_files_cancel(FindInFiles job) {
+    g_atomic_int_set(&job->cancelled, 1);
+}
+
+void find_in_files_free(FindInFiles job) {
+    find_in_files_cancel(job);
+    g_thread_join(job->walker);
+    for (int i = 0; i < job->nworkers; i++) g_thread_join(job->workers[i]);
+
+    FileMatch *match;
+    while ((match = g_async_queue_try_pop(job->matches))) file_match_free(match);
+    char *path;
+    while ((path = g_async_queue_try_pop(job->paths))) {
+        if (path != &end_of_paths) g_free(path);
+    }
+    g_async_queue_unref(job->paths);
+    g_async_queue_unref(job->matches);
+    g_free(job->workers);
+    g_mutex_clear(&job->lock);
+    kmp_free(job->kmp);
+    g_free(job->root);
+    g_free(job);
+}
+
+void file_match_free(FileMatch *match) {
+    g_free(match->path);
+    g_free(match->text);
+    g_free(match);
+}
@@ -0,0 +1,47 @@
+#ifndef FIND_IN_FILES_H
+#define FIND_IN_FILES_H
+
+#include <glib.h>
+#include "search.h"
+
+#define FIND_IN_FILES_FILE_LIMIT 1000      // Matches reported per file
+#define FIND_IN_FILES_MAX_MATCHES 100000   // Matches reported per search, the rest are only counted
+#define FIND_IN_FILES_LINE_MAX 200         // Bytes of the matching line kept for display
+
+typedef struct {
+    char *path;
+    int line;     // 1-based
+    int column;   // Byte offset of the match in its line
+    char *text;   // The matching line as valid UTF-8, cut to at most FIND_IN_FILES_LINE_MAX bytes of the file
+} FileMatch;
+
+// A running multi-file search: a walker thread feeds paths to scanning workers
+typedef struct find_in_files {
+    char *root;
+    Kmp kmp;
+    GAsyncQueue *paths;     // Files waiting to be scanned
+    GAsyncQueue *matches;   // FileMatch results waiting for the UI
+    GThread *walker;
+    GThread **workers;
+    int nworkers;
+    GMutex lock;            // Guards active and finished
+    int active;             // Threads still running
+    int cancelled;
+
+    // Statistics, updated atomically by the workers
+    int files_scanned;
+    int files_matched;
+    int matches_found;
+    int matches_reported;   // Matches queued for the UI, at most FIND_IN_FILES_MAX_MATCHES
+    gsize bytes_scanned;
+    gint64 started;
+    gint64 finished;        // Monotonic time the last thread stopped, 0 while running; set under lock
+} *FindInFiles;
+
+FindInFiles find_in_files_start(const char *root, const char *pattern, int flags);
+int find_in_files_poll(FindInFiles job, GPtrArray *out);
+void find_in_files_cancel(FindInFiles job);
+void find_in_files_free(FindInFiles job);
+void file_match_free(FileMatch *match);
+
+#endif // FIND_IN_FILES_H
@@ -1,23 +1,82 @@
 #include <gtk/gtk.h>
+#include <glib/gstdio.h>
 #include <string.h>
 #include "gui.h"
+#include "autosave.h"
 #include "piecetable.h"
 #include "search.h"
+#include "regex_engine.h"
+#include "search_index.h"
+#include "replace.h"
+#include "session.h"
+#include "text_diff.h"
+#include "encoding.h"
+#include "file_loader.h"
+#include "file_saver.h"
+#include "file_watch.h"
+#include "find_in_files.h"
+#include "matching.h"
+#include "highlight.h"
+#include "large_file.h"
+#include "hex_view.h"
+#include "text_color.h"
 #include "undo_redo.h"
 #include "window_title.h"
 
 // --- Global Widgets and State ---
 
 static char *current_filename = NULL; // Tracks the current opened/saved file
+static GMappedFile *doc_mapping = NULL; // Holds the text of a file open in large-file mode
+static int doc_mapping_is_session = 0;  // doc_mapping is the session file the document was restored from
+static Encoding doc_encoding = ENCODING_UTF8; // Encoding the document's file is read and written in
+static LineEnding doc_line_ending = LINE_ENDING_LF; // Line breaks the document's file uses, given to new lines on save
+static Compression doc_compression = {COMPRESSION_NONE, COMPRESSION_DEFAULT_LEVEL}; // How the file is compressed
+
+static void release_doc_mapping(void) {
+    if (doc_mapping) g_mapped_file_unref(doc_mapping);
+    doc_mapping = NULL;
+    doc_mapping_is_session = 0;
+}
 
 GtkWidget *text_view = NULL;
 GtkWidget *search_bar = NULL;
 GtkWidget *search_entry = NULL;
 GtkWidget *replace_entry = NULL;
+GtkWidget *search_count_label = NULL;
+GtkWidget *search_regex_toggle = NULL;
+GtkWidget *search_case_toggle = NULL;
+GtkWidget *search_word_toggle = NULL;
 Piecetable doc_piecetable = NULL;
+StyleSpans doc_styles = NULL; // Character formatting of the document, shown by text_color.c
 UndoRedoStack *undo_stack = NULL;
 
 static char *prev_text = NULL;
+static StyleRuns *prev_styles = NULL;
+static int suspend_edit_tracking = 0; // Set while the piece table already holds an edit being shown
+static int doc_version = 0;     // Counts edits to the document
+static int saved_version = 0;   // doc_version when the document last matched its file
+static int doc_generation = 0;  // Counts documents opened in the editor
+static int doc_following = 0;   // Follow mode: the view is read-only and takes in text appended to the file
+static LineIndex doc_lines = NULL; // Byte line starts of the buffer's text outside large-file mode, built when needed
+
+static void forget_doc_lines(void) {
+    if (doc_lines) line_index_free(doc_lines);
+    doc_lines = NULL;
+}
+
+// Shows the file name with its unsaved and saving state
+static void refresh_window_title(void);
+// Shows the document's encoding and line endings, or where the hex view's cursor is
+static void refresh_status_bar(void);
+// Counts an edit towards the next autosave
+static void note_autosave_edit(void);
+
+static void mark_document_changed(void) {
+    int was_dirty = doc_version != saved_version;
+    doc_version++;
+    if (!was_dirty) refresh_window_title();
+    note_autosave_edit();
+}
 
 // -----For Zoom in and Zoom out------
 static int current_font_size = 12; // Default font size
@@ -45,137 +104,70 @@ void initialize_font_system() {
 
 // --- Individual Text Formatting Functions ---
 
-// Apply formatting to selected text or at cursor position
-void apply_formatting_to_selection(const char *tag_name, const char *property, const char *value) {
-    if (!text_view) return;
-    
+// Apply a formatting tag to selected text, or keep it for typing at the cursor
+static void apply_tag_to_selection(GtkTextTag *tag) {
     GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
     GtkTextIter start, end;
-    gboolean has_selection;
-    
-    // Check if there's a selection
-    has_selection = gtk_text_buffer_get_selection_bounds(buffer, &start, &end);
-    
-    if (has_selection) {
-        // Apply to selection
-        GtkTextTag *tag = gtk_text_buffer_create_tag(buffer, NULL, property, value, NULL);
-        gtk_text_buffer_apply_tag(buffer, tag, &start, &end);
+
+    if (gtk_text_buffer_get_selection_bounds(buffer, &start, &end)) {
+        text_styles_format(gtk_text_iter_get_offset(&start), gtk_text_iter_get_offset(&end), tag, 1);
     } else {
-        // No selection - create a tag for future typing
-        GtkTextMark *cursor = gtk_text_buffer_get_insert(buffer);
-        gtk_text_buffer_get_iter_at_mark(buffer, &start, cursor);
-        
-        GtkTextTag *tag = gtk_text_buffer_create_tag(buffer, NULL, property, value, NULL);
-        // Store tag for current typing position
+        // No selection - store tag for current typing position
         g_object_set_data(G_OBJECT(buffer), "current_format_tag", tag);
     }
 }
 
+// Apply formatting to selected text or at cursor position
+void apply_formatting_to_selection(const char *property, const char *value) {
+    if (!text_view) return;
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    apply_tag_to_selection(text_style_tag(buffer, property, value));
+}
+
 // Font family for selection
 void apply_font_family_to_selection(const char *family) {
-    apply_formatting_to_selection(NULL, "family", family);
+    apply_formatting_to_selection("family", family);
 }
 
 // Font size for selection
-void apply_font_size_to_selection_new(int size) {
-    char size_str[16];
-    snprintf(size_str, sizeof(size_str), "%d", size * PANGO_SCALE);
-    apply_formatting_to_selection(NULL, "size", size_str);
+void apply_font_size_to_selection(int size) {
+    if (!text_view) return;
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    apply_tag_to_selection(text_style_tag_int(buffer, "size", size * PANGO_SCALE));
 }
 
-// Bold for selection
-void apply_bold_to_selection() {
+// Toggle an int-valued style (bold weight, italic style) on the selection
+static void toggle_style_on_selection(const char *property, int value) {
     if (!text_view) return;
     
     GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
     GtkTextIter start, end;
-    gboolean has_selection;
-    
-    has_selection = gtk_text_buffer_get_selection_bounds(buffer, &start, &end);
     
-    if (has_selection) {
-        // Check if selection is already bold
-        GtkTextTag *bold_tag = NULL;
-        
-        // Look for existing bold tag
-        GSList *tags = gtk_text_iter_get_tags(&start);
-        for (GSList *l = tags; l != NULL; l = l->next) {
-            GtkTextTag *tag = GTK_TEXT_TAG(l->data);
-            gboolean is_bold;
-            g_object_get(tag, "weight-set", &is_bold, NULL);
-            if (is_bold) {
-                PangoWeight weight;
-                g_object_get(tag, "weight", &weight, NULL);
-                if (weight >= PANGO_WEIGHT_BOLD) {
-                    bold_tag = tag;
-                    break;
-                }
-            }
-        }
-        g_slist_free(tags);
-        
-        if (bold_tag) {
-            // Remove bold
-            gtk_text_buffer_remove_tag(buffer, bold_tag, &start, &end);
-        } else {
-            // Add bold
-            GtkTextTag *tag = gtk_text_buffer_create_tag(buffer, NULL, 
-                "weight", PANGO_WEIGHT_BOLD, NULL);
-            gtk_text_buffer_apply_tag(buffer, tag, &start, &end);
-        }
+    if (gtk_text_buffer_get_selection_bounds(buffer, &start, &end)) {
+        GtkTextTag *tag = text_style_tag_int(buffer, property, value);
+        int from = gtk_text_iter_get_offset(&start);
+        text_styles_format(from, gtk_text_iter_get_offset(&end), tag, !text_styles_has(from, tag));
     }
 }
 
+// Bold for selection
+void apply_bold_to_selection() {
+    toggle_style_on_selection("weight", PANGO_WEIGHT_BOLD);
+}
+
 // Italic for selection
 void apply_italic_to_selection() {
-    if (!text_view) return;
-    
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-    GtkTextIter start, end;
-    gboolean has_selection;
-    
-    has_selection = gtk_text_buffer_get_selection_bounds(buffer, &start, &end);
-    
-    if (has_selection) {
-        // Check if selection is already italic
-        GtkTextTag *italic_tag = NULL;
-        
-        GSList *tags = gtk_text_iter_get_tags(&start);
-        for (GSList *l = tags; l != NULL; l = l->next) {
-            GtkTextTag *tag = GTK_TEXT_TAG(l->data);
-            gboolean is_italic;
-            g_object_get(tag, "style-set", &is_italic, NULL);
-            if (is_italic) {
-                PangoStyle style;
-                g_object_get(tag, "style", &style, NULL);
-                if (style == PANGO_STYLE_ITALIC || style == PANGO_STYLE_OBLIQUE) {
-                    italic_tag = tag;
-                    break;
-                }
-            }
-        }
-        g_slist_free(tags);
-        
-        if (italic_tag) {
-            // Remove italic
-            gtk_text_buffer_remove_tag(buffer, italic_tag, &start, &end);
-        } else {
-            // Add italic
-            GtkTextTag *tag = gtk_text_buffer_create_tag(buffer, NULL, 
-                "style", PANGO_STYLE_ITALIC, NULL);
-            gtk_text_buffer_apply_tag(buffer, tag, &start, &end);
-        }
-    }
+    toggle_style_on_selection("style", PANGO_STYLE_ITALIC);
 }
 
 // Color for selection
 void apply_color_to_selection(const char *color) {
-    apply_formatting_to_selection(NULL, "foreground", color);
+    apply_formatting_to_selection("foreground", color);
 }
 
 // Background color for selection
 void apply_background_to_selection(const char *color) {
-    apply_formatting_to_selection(NULL, "background", color);
+    apply_formatting_to_selection("background", color);
 }
 
 // Remove all formatting from selection
@@ -190,6 +182,7 @@ void clear_formatting_from_selection() {
     
     if (has_selection) {
         gtk_text_buffer_remove_all_tags(buffer, &start, &end);
+        text_styles_clear(gtk_text_iter_get_offset(&start), gtk_text_iter_get_offset(&end));
     }
 }
 
@@ -227,35 +220,35 @@ void on_selection_italic(GtkWidget *widget, gpointer data) {
 }
 
 void on_selection_font_size_8(GtkWidget *widget, gpointer data) {
-    apply_font_size_to_selection_new(8);
+    apply_font_size_to_selection(8);
 }
 
 void on_selection_font_size_10(GtkWidget *widget, gpointer data) {
-    apply_font_size_to_selection_new(10);
+    apply_font_size_to_selection(10);
 }
 
 void on_selection_font_size_12(GtkWidget *widget, gpointer data) {
-    apply_font_size_to_selection_new(12);
+    apply_font_size_to_selection(12);
 }
 
 void on_selection_font_size_14(GtkWidget *widget, gpointer data) {
-    apply_font_size_to_selection_new(14);
+    apply_font_size_to_selection(14);
 }
 
 void on_selection_font_size_16(GtkWidget *widget, gpointer data) {
-    apply_font_size_to_selection_new(16);
+    apply_font_size_to_selection(16);
 }
 
 void on_selection_font_size_18(GtkWidget *widget, gpointer data) {
-    apply_font_size_to_selection_new(18);
+    apply_font_size_to_selection(18);
 }
 
 void on_selection_font_size_24(GtkWidget *widget, gpointer data) {
-    apply_font_size_to_selection_new(24);
+    apply_font_size_to_selection(24);
 }
 
 void on_selection_font_size_36(GtkWidget *widget, gpointer data) {
-    apply_font_size_to_selection_new(36);
+    apply_font_size_to_selection(36);
 }
 
 void on_clear_formatting(GtkWidget *widget, gpointer data) {
@@ -507,11 +500,14 @@ void on_zoom_out(GtkWidget *widget, gpointer data) {
 
 // For search results navigation
 static SearchResults current_results = {0};
+static SearchCursor current_cursor = {0};
 static int current_match = -1;
+static int current_results_stale = 0; // Regex results are rebuilt lazily after edits
+static int search_from_selection = 0; // The next search selects the match at the selection, not the first
 
 // --- Utility Functions ---
 
-void update_piece_table_from_buffer(void) {
+static void rebuild_piece_table(void) {
     GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
     GtkTextIter start, end;
     gtk_text_buffer_get_bounds(buffer, &start, &end);
@@ -524,12 +520,21 @@ void update_piece_table_from_buffer(void) {
     g_free(text);
 }
 
+// For text put in the buffer wholesale; the edit hooks keep doc_lines in step with single edits
+void update_piece_table_from_buffer(void) {
+    rebuild_piece_table();
+    forget_doc_lines();
+}
+
 // --- Undo/Redo Integration ---
 
 void on_begin_user_action(GtkTextBuffer *buffer, gpointer user_data) {
+    // The buffer holds only part of a large file, so its text cannot be an undo snapshot
+    if (large_file_active()) return;
     GtkTextIter start, end;
     gtk_text_buffer_get_bounds(buffer, &start, &end);
     prev_text = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
+    prev_styles = style_spans_snapshot(doc_styles);
 }
 
 void on_end_user_action(GtkTextBuffer *buffer, gpointer user_data) {
@@ -538,63 +543,64 @@ void on_end_user_action(GtkTextBuffer *buffer, gpointer user_data) {
     char *new_text = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
 
     if (prev_text)
-        undo_redo_push(undo_stack, prev_text, new_text);
+        undo_redo_push(undo_stack, prev_text, new_text, prev_styles, style_spans_snapshot(doc_styles));
+    else
+        style_runs_free(prev_styles);
 
     g_free(prev_text);
     prev_text = NULL;
+    prev_styles = NULL;
     g_free(new_text);
 }
 
 void on_undo(GtkWidget *widget, gpointer data) {
-    const char *text = undo_redo_undo(undo_stack);
+    // The view is read-only while it follows the file
+    if (doc_following) return;
+    const StyleRuns *styles = NULL;
+    const char *text = undo_redo_undo(undo_stack, &styles);
     if (text) {
+        // Let the piece table follow so the search edit hooks see the restored text
         GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-        g_signal_handlers_block_by_func(buffer, on_buffer_changed, NULL);
         gtk_text_buffer_set_text(buffer, text, -1);
-        g_signal_handlers_unblock_by_func(buffer, on_buffer_changed, NULL);
+        // Setting the text left it unstyled; put back the formatting it had
+        if (styles) text_styles_restore(styles);
     }
 }
 
 void on_redo(GtkWidget *widget, gpointer data) {
-    const char *text = undo_redo_redo(undo_stack);
+    // The view is read-only while it follows the file
+    if (doc_following) return;
+    const StyleRuns *styles = NULL;
+    const char *text = undo_redo_redo(undo_stack, &styles);
     if (text) {
+        // Let the piece table follow so the search edit hooks see the restored text
         GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-        g_signal_handlers_block_by_func(buffer, on_buffer_changed, NULL);
         gtk_text_buffer_set_text(buffer, text, -1);
-        g_signal_handlers_unblock_by_func(buffer, on_buffer_changed, NULL);
-    }
-}
-
-// This is done to select text for individual font size change
-void apply_font_size_to_selection(GtkTextBuffer *buffer, int font_size) {
-    GtkTextIter start, end;
-    if (!gtk_text_buffer_get_selection_bounds(buffer, &start, &end))
-        return;
-
-    // Create a unique tag for this font size if not already created
-    char tag_name[32];
-    snprintf(tag_name, sizeof(tag_name), "font_%d", font_size);
-
-    GtkTextTagTable *tag_table = gtk_text_buffer_get_tag_table(buffer);
-    GtkTextTag *tag = gtk_text_tag_table_lookup(tag_table, tag_name);
-
-    if (!tag) {
-        tag = gtk_text_buffer_create_tag(buffer, tag_name, "font", NULL, NULL);
-
-        char font_desc[64];
-        snprintf(font_desc, sizeof(font_desc), "Monospace %d", font_size);
-        g_object_set(tag, "font", font_desc, NULL);
+        // Setting the text left it unstyled; put back the formatting it had
+        if (styles) text_styles_restore(styles);
     }
-
-    gtk_text_buffer_apply_tag(buffer, tag, &start, &end);
 }
 
 void on_buffer_changed(GtkTextBuffer *buffer, gpointer user_data) {
-    update_piece_table_from_buffer();
+    if (suspend_edit_tracking || large_file_active()) return;
+    // The piece table follows first, so an autosave started by the edit includes it
+    rebuild_piece_table();
+    mark_document_changed();
 }
 
 // --- File Operations ---
 
+static void track_index_edit(int at, int removed, int inserted);
+static void track_search_edit(int at, int removed, int inserted);
+static void forget_search_state(void);
+static void stop_file_load(void);
+static void close_document(void);
+static void reset_autosave(PiecetableSnapshot base);
+static void reset_autosave_to_document(void);
+static void watch_document(void);
+static void unwatch_document(void);
+static void scroll_to_end(void);
+
 void on_new(GtkWidget *widget, gpointer data) {
     GtkWidget *dialog;
     GtkFileChooser *chooser;
@@ -620,21 +626,16 @@ void on_new(GtkWidget *widget, gpointer data) {
             g_printerr("Error creating file: %s\n", error->message);
             g_clear_error(&error);
         } else {
-            // Clear the text buffer
-            buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-            gtk_text_buffer_set_text(buffer, "", -1);
-
-            // Free and reset the piece table
-            if (doc_piecetable != NULL)
-                piecetable_free(doc_piecetable);
-            doc_piecetable = piecetable_create("");
-
-            // Free and update filename
-            if (current_filename)
-                g_free(current_filename);
+            // Clear the text buffer, piece table and filename
+            stop_file_load();
+            close_document();
             current_filename = g_strdup(filename);
+            set_bracket_language(GTK_TEXT_VIEW(text_view), current_filename);
+            set_highlight_language(GTK_TEXT_VIEW(text_view), current_filename);
+            reset_autosave_to_document();
+            watch_document();
 
-            update_window_title(GTK_WINDOW(data), current_filename);
+            refresh_window_title();
         }
 
         g_free(filename);
@@ -643,12 +644,279 @@ void on_new(GtkWidget *widget, gpointer data) {
     gtk_widget_destroy(dialog);
 }
 
+// --- Asynchronous open ---
+
+#define LOAD_POLL_INTERVAL 50                 // Milliseconds between looks at the loading worker
+#define LOAD_PREVIEW_BYTES (64 * 1024)        // Shown of a large file while its line index is built
+#define LOAD_APPEND_BYTES (4 * 1024 * 1024)   // Most bytes added to the buffer per look
+
+static FileLoad doc_load = NULL;
+static guint load_poll_source = 0;
+static int load_large = 0;            // The file opens in large-file mode
+static int load_shown = 0;            // Bytes of the file in the buffer so far
+static GtkWidget *load_bar = NULL;
+static GtkWidget *load_progress = NULL;
+
+// Empties the editor before another document is shown in it
+static void close_document(void) {
+    large_file_close();
+    hex_view_close();
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    suspend_edit_tracking = 1;
+    gtk_text_buffer_set_text(buffer, "", -1);
+    suspend_edit_tracking = 0;
+
+    if (doc_piecetable != NULL)
+        piecetable_free(doc_piecetable);
+    doc_piecetable = piecetable_create("");
+    forget_doc_lines();
+    if (current_filename) g_free(current_filename);
+    current_filename = NULL;
+    doc_encoding = ENCODING_UTF8;
+    doc_line_ending = LINE_ENDING_LF;
+    doc_compression = (Compression){COMPRESSION_NONE, COMPRESSION_DEFAULT_LEVEL};
+    unwatch_document();
+    // The old journal's worker may still read the mapped text
+    reset_autosave_to_document();
+    release_doc_mapping();
+    forget_search_state();
+
+    // Undo entries are snapshots of the previous document
+    undo_redo_stack_free(undo_stack);
+    undo_stack = undo_redo_stack_create();
+
+    doc_generation++;
+    saved_version = doc_version;
+}
+
+static void stop_file_load(void) {
+    if (load_poll_source) {
+        g_source_remove(load_poll_source);
+        load_poll_source = 0;
+    }
+    if (doc_load) {
+        file_load_free(doc_load);
+        doc_load = NULL;
+        suspend_edit_tracking = 0;
+        gtk_text_view_set_editable(GTK_TEXT_VIEW(text_view), !doc_following);
+        gtk_widget_hide(load_bar);
+    }
+}
+
+static void append_to_buffer(const char *text, int length) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    GtkTextIter iter;
+    gtk_text_buffer_get_end_iter(buffer, &iter);
+    gtk_text_buffer_insert(buffer, &iter, text, length);
+    if (load_shown == 0) {
+        // Keep the view at the top while the rest is appended
+        gtk_text_buffer_get_start_iter(buffer, &iter);
+        gtk_text_buffer_place_cursor(buffer, &iter);
+    }
+    load_shown += length;
+}
+
+/*
+ * Returns where to stop showing text validated up to scanned, at most limit:
+ * after the last line break before that if there is one, never between \r
+ * and \n nor inside a character
+ */
+static int loaded_text_end(int scanned, int limit) {
+    const char *text = doc_load->text;
+    int end = MIN(scanned, limit);
+    if (end == doc_load->length) return end;
+    for (int i = end; i > load_shown; i--) {
+        if (text[i - 1] == '\n') return i;
+    }
+    while (end > load_shown && (text[end] & 0xC0) == 0x80) end--;
+    if (end > load_shown && text[end - 1] == '\r') end--;
+    return end;
+}
+
+/*
+ * Shows what the worker has validated so far: a small file is appended to the
+ * buffer as it comes in, a large one shows its first lines until its line
+ * index is complete. Returns TRUE once there is nothing more to show.
+ */
+static gboolean advance_file_load(void) {
+    int scanned;
+    int running = file_load_poll(doc_load, &scanned);
+    int complete = !running && scanned == doc_load->length;
+
+    // A compressed file's text may move as it grows
+    file_load_lock_text(doc_load);
+    if (load_large) {
+        if (load_shown == 0 && (scanned >= LOAD_PREVIEW_BYTES || !running)) {
+            int end = loaded_text_end(scanned, LOAD_PREVIEW_BYTES);
+            if (end > 0) append_to_buffer(doc_load->text, end);
+        }
+    } else if (scanned > load_shown) {
+        int end = loaded_text_end(scanned, load_shown + LOAD_APPEND_BYTES);
+        if (end > load_shown) append_to_buffer(doc_load->text + load_shown, end - load_shown);
+    }
+    file_load_unlock_text(doc_load);
+
+    char status[256];
+    char *name = g_path_get_basename(doc_load->filename);
+    int consumed = g_atomic_int_get(&doc_load->consumed);
+    double fraction = doc_load->source_length ? (double)consumed / doc_load->source_length : 1.0;
+    snprintf(status, sizeof(status), "Opening %s: %.0f%%", name, 100.0 * fraction);
+    g_free(name);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(load_progress), fraction);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(load_progress), status);
+
+    if (running) return FALSE;
+    return !complete || load_large || load_shown == doc_load->length;
+}
+
+/*
+ * Makes the loaded file the document, or empties the editor if the load failed
+ * or was cancelled; returns whether the file was opened
+ */
+static gboolean start_file_load(const char *filename, Encoding encoding);
+
+static gboolean finish_file_load(void) {
+    FileLoad load = doc_load;
+    file_load_wait(load);
+    if (load->not_utf8) {
+        // UTF-8 was guessed from the start of the file; every byte is a character in Latin-1
+        char *filename = g_strdup(load->filename);
+        g_print("%s, reading it as Latin-1\n", load->error);
+        gboolean started = start_file_load(filename, ENCODING_LATIN1);
+        g_free(filename);
+        if (started) return FALSE;
+    }
+    if (load->error || load->consumed < load->source_length) {
+        g_print("Error reading file: %s\n", load->error ? load->error : "cancelled");
+        stop_file_load();
+        close_document();
+        refresh_window_title();
+        return FALSE;
+    }
+
+    LineIndex lines = file_load_take_lines(load);
+    doc_encoding = load->encoding;
+    doc_line_ending = line_index_line_ending(lines);
+    refresh_status_bar();
+    doc_compression = load->compression;
+    if (load_large) {
+        // The piece table reads the mapped file, or its decoded text, in place and the buffer shows a window of it
+        piecetable_free(doc_piecetable);
+        if (load->converted) {
+            doc_piecetable = piecetable_create_owned(file_load_take_converted(load), load->length);
+        } else {
+            doc_mapping = file_load_take_mapping(load);
+            doc_piecetable = piecetable_create_view(load->text, load->length);
+        }
+        large_file_open(doc_piecetable, lines);
+    } else {
+        line_index_free(lines);
+        update_piece_table_from_buffer();
+    }
+    stop_file_load();
+    reset_autosave_to_document();
+    watch_document();
+    track_index_edit(0, 0, doc_piecetable->length);
+    track_search_edit(0, 0, doc_piecetable->length);
+    if (doc_following) scroll_to_end();
+    return TRUE;
+}
+
+static gboolean poll_file_load(gpointer data) {
+    if (!advance_file_load()) return G_SOURCE_CONTINUE;
+    load_poll_source = 0;
+    finish_file_load();
+    return G_SOURCE_REMOVE;
+}
+
+// Shows a binary file read-only in the hex view instead of loading it as text
+static gboolean open_hex_view(const char *filename) {
+    GError *error = NULL;
+    stop_file_load();
+    close_document();
+    if (!hex_view_open(filename, &error)) {
+        g_print("Error reading file: %s\n", error->message);
+        g_clear_error(&error);
+        refresh_window_title();
+        return FALSE;
+    }
+    // The status bar says the file is shown read-only as hex
+    current_filename = g_strdup(filename);
+    refresh_window_title();
+    return TRUE;
+}
+
+/*
+ * Starts loading filename in the background, in encoding or in the one it
+ * seems to be in for ENCODING_DETECT; returns FALSE if it cannot be opened.
+ * A file that looks binary is shown in the hex view instead.
+ */
+static gboolean start_file_load(const char *filename, Encoding encoding) {
+    if (encoding == ENCODING_DETECT && hex_view_detect(filename)) return open_hex_view(filename);
+    GError *error = NULL;
+    FileLoad load = file_load_start(filename, encoding, &error);
+    if (!load) {
+        g_print("Error reading file: %s\n", error->message);
+        g_clear_error(&error);
+        return FALSE;
+    }
+
+    stop_file_load();
+    close_document();
+    doc_load = load;
+    load_large = load->expected_length >= LARGE_FILE_THRESHOLD;
+    load_shown = 0;
+
+    current_filename = g_strdup(filename);
+    set_bracket_language(GTK_TEXT_VIEW(text_view), current_filename);
+    set_highlight_language(GTK_TEXT_VIEW(text_view), current_filename);
+    refresh_window_title();
+
+    // The buffer is filled from the file, not edited, until the load finishes
+    suspend_edit_tracking = 1;
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(text_view), FALSE);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(load_progress), 0.0);
+    gtk_widget_show(load_bar);
+    load_poll_source = g_timeout_add(LOAD_POLL_INTERVAL, poll_file_load, NULL);
+    return TRUE;
+}
+
+static void on_load_cancel(GtkWidget *widget, gpointer data) {
+    if (doc_load) file_load_cancel(doc_load);
+}
+
+// Builds the bar with progress and a cancel button shown while a file is opened
+GtkWidget *init_load_bar(void) {
+    load_progress = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(load_progress), TRUE);
+    GtkWidget *cancel = gtk_button_new_with_label("Cancel");
+    g_signal_connect(cancel, "clicked", G_CALLBACK(on_load_cancel), NULL);
+
+    load_bar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(load_bar), load_progress, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(load_bar), cancel, FALSE, FALSE, 0);
+    gtk_widget_show(load_progress);
+    gtk_widget_show(cancel);
+    gtk_widget_set_no_show_all(load_bar, TRUE);
+    return load_bar;
+}
+
+// Loads filename into the editor and waits for it; returns FALSE if it could not be read
+gboolean open_file_in_editor(GtkWindow *window, const char *filename) {
+    if (!start_file_load(filename, ENCODING_DETECT)) return FALSE;
+    // A binary file is shown at once, without a load
+    gboolean opened = doc_load == NULL;
+    // Finishing may start the load over in another encoding
+    while (doc_load) {
+        file_load_wait(doc_load);
+        while (!advance_file_load());
+        opened = finish_file_load();
+    }
+    return opened;
+}
+
 void on_open(GtkWidget *widget, gpointer window) {
     GtkWidget *dialog;
-    GtkTextBuffer *buffer;
-    gchar *contents = NULL;
-    gsize length;
-    GError *error = NULL;
 
     dialog = gtk_file_chooser_dialog_new("Open File",
         GTK_WINDOW(window),
@@ -659,80 +927,159 @@ void on_open(GtkWidget *widget, gpointer window) {
 
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-        if (g_file_get_contents(filename, &contents, &length, &error)) {
-            buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-            gtk_text_buffer_set_text(buffer, contents, -1);
+        start_file_load(filename, ENCODING_DETECT);
+        g_free(filename);
+    }
+    gtk_widget_destroy(dialog);
+}
 
-            if (doc_piecetable != NULL)
-                piecetable_free(doc_piecetable);
+// --- Background save ---
 
-            doc_piecetable = piecetable_create(contents);
+static FileSave save_job = NULL;
+static GMappedFile *save_mapping = NULL;  // Keeps a large file's text mapped while its snapshot is written
+static int save_version = 0;              // doc_version of the snapshot being written
+static int save_generation = 0;           // doc_generation it was taken from
 
-            // Store filename
-            if (current_filename) g_free(current_filename);
-            current_filename = g_strdup(filename);
+// --- Status bar ---
 
-            update_window_title(GTK_WINDOW(window), current_filename); // Update title
+static GtkWidget *status_label = NULL;
 
-            g_free(contents);
-        } else {
-            g_print("Error reading file: %s\n", error->message);
-            g_clear_error(&error);
-        }
-        g_free(filename);
+static void refresh_status_bar(void) {
+    if (!status_label) return;
+    char *status;
+    if (hex_view_active()) {
+        status = g_strdup_printf("Read-only hex view    Offset 0x%" G_GINT64_MODIFIER "x of %" G_GINT64_FORMAT " bytes",
+                                 hex_view_cursor(), hex_view_size());
+    } else {
+        status = g_strdup_printf("%s    %s", encoding_name(doc_encoding), line_ending_name(doc_line_ending));
     }
-    gtk_widget_destroy(dialog);
+    gtk_label_set_text(GTK_LABEL(status_label), status);
+    g_free(status);
 }
 
-void on_save(GtkWidget *widget, gpointer window) {
-    GtkTextBuffer *buffer;
-    GtkTextIter start, end;
-    gchar *text;
+// Builds the bar under the text that shows the document's format, or the hex view's cursor
+GtkWidget *init_status_bar(void) {
+    status_label = gtk_label_new("");
+    gtk_label_set_xalign(GTK_LABEL(status_label), 1.0);
+    gtk_widget_set_margin_end(status_label, 6);
+    hex_view_on_cursor_moved(refresh_status_bar);
+    refresh_status_bar();
+    return status_label;
+}
 
-    buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-    gtk_text_buffer_get_bounds(buffer, &start, &end);
-    text = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
+// The title and the status bar change together: a document opened, saved or restored may have another format
+static void refresh_window_title(void) {
+    GtkWidget *window = gtk_widget_get_toplevel(text_view);
+    update_window_title_state(GTK_WINDOW(window), current_filename, doc_version != saved_version, save_job != NULL);
+    refresh_status_bar();
+}
 
-    if (current_filename) {
-        // Save to the current file
-        if (!g_file_set_contents(current_filename, text, -1, NULL)) {
-            g_print("Error saving file!\n");
-        } else {
-            update_window_title(GTK_WINDOW(window), current_filename);
-        }
+static void on_save_finished(FileSave save, const char *error, gpointer window) {
+    if (error) {
+        g_print("Error saving file: %s\n", error);
     } else {
-        // No file yet: prompt user to choose a file
-        GtkWidget *dialog = gtk_file_chooser_dialog_new("Save File",
-            GTK_WINDOW(window),
-            GTK_FILE_CHOOSER_ACTION_SAVE,
-            "_Cancel", GTK_RESPONSE_CANCEL,
-            "_Save", GTK_RESPONSE_ACCEPT,
-            NULL);
-
-        GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
-        gtk_file_chooser_set_do_overwrite_confirmation(chooser, TRUE);
-        gtk_file_chooser_set_current_name(chooser, "Untitled.txt");
-
-        if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
-            char *filename = gtk_file_chooser_get_filename(chooser);
-            if (!g_file_set_contents(filename, text, -1, NULL)) {
-                g_print("Error saving file!\n");
-            } else {
-                // Store filename and update title
+        if (save->reencoded) g_print("The text has characters the file's encoding cannot hold, so it was saved as UTF-8\n");
+        // The editor may have moved on to another document meanwhile
+        if (save_generation == doc_generation) {
+            saved_version = save_version;
+            doc_encoding = save->encoding;
+            if (!current_filename || strcmp(current_filename, save->filename) != 0) {
                 if (current_filename) g_free(current_filename);
-                current_filename = g_strdup(filename);
-                update_window_title(GTK_WINDOW(window), current_filename);
+                current_filename = g_strdup(save->filename);
+                set_bracket_language(GTK_TEXT_VIEW(text_view), current_filename);
+                set_highlight_language(GTK_TEXT_VIEW(text_view), current_filename);
             }
-            g_free(filename);
+            // The file now holds the saved text; edits made since are journalled against it
+            reset_autosave(save->snapshot);
+            if (doc_version != saved_version) note_autosave_edit();
+            watch_document();
         }
-        gtk_widget_destroy(dialog);
     }
-    g_free(text);
+    file_save_free(save);
+    save_job = NULL;
+    if (save_mapping) g_mapped_file_unref(save_mapping);
+    save_mapping = NULL;
+    refresh_window_title();
+}
+
+// Asks where to save a document that has no file yet; returns NULL if cancelled
+static char *choose_save_filename(GtkWindow *window) {
+    GtkWidget *dialog = gtk_file_chooser_dialog_new("Save File",
+        window,
+        GTK_FILE_CHOOSER_ACTION_SAVE,
+        "_Cancel", GTK_RESPONSE_CANCEL,
+        "_Save", GTK_RESPONSE_ACCEPT,
+        NULL);
+
+    GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
+    gtk_file_chooser_set_do_overwrite_confirmation(chooser, TRUE);
+    gtk_file_chooser_set_current_name(chooser, "Untitled.txt");
+
+    char *filename = NULL;
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT)
+        filename = gtk_file_chooser_get_filename(chooser);
+    gtk_widget_destroy(dialog);
+    return filename;
+}
+
+/*
+ * Writes a snapshot of the piece table on a worker thread, so editing goes on
+ * during the save. The piece table is the whole document in both modes; in
+ * large-file mode the buffer holds only part of it.
+ */
+void on_save(GtkWidget *widget, gpointer window) {
+    // The buffer holds only part of a file still being opened
+    if (doc_load) return;
+    if (hex_view_active()) {
+        g_print("%s is open read-only in the hex view\n", current_filename);
+        return;
+    }
+    if (save_job) {
+        g_print("Still saving %s\n", save_job->filename);
+        return;
+    }
+
+    char *filename = current_filename ? g_strdup(current_filename) : choose_save_filename(GTK_WINDOW(window));
+    if (!filename) return;
+
+    PiecetableSnapshot snapshot = piecetable_snapshot(doc_piecetable);
+    save_version = doc_version;
+    save_generation = doc_generation;
+    if (doc_mapping) save_mapping = g_mapped_file_ref(doc_mapping);
+    save_job = file_save_start(filename, snapshot, doc_encoding, doc_line_ending, doc_compression, on_save_finished,
+                               window);
+    piecetable_snapshot_unref(snapshot);
+    g_free(filename);
+    refresh_window_title();
+}
+
+/*
+ * Waits for a save still being written, so quitting does not cut it short.
+ * The window may be gone by now, so only the outcome is reported.
+ */
+void finish_pending_save(void) {
+    if (!save_job) return;
+    file_save_wait(save_job);
+    if (save_job->error) g_print("Error saving file: %s\n", save_job->error);
+    else if (save_generation == doc_generation) saved_version = save_version;
+    file_save_free(save_job);
+    save_job = NULL;
+    if (save_mapping) g_mapped_file_unref(save_mapping);
+    save_mapping = NULL;
 }
 
 void on_quit(GtkWidget *widget, gpointer data) {
+    finish_pending_save();
+    finish_session();
+    finish_autosave();
+    stop_file_load();
+    large_file_close();
+    hex_view_close();
     if (doc_piecetable != NULL)
         piecetable_free(doc_piecetable);
+    release_doc_mapping();
+    if (doc_styles != NULL)
+        style_spans_free(doc_styles);
     if (undo_stack != NULL)
         undo_redo_stack_free(undo_stack);
     if (current_font_family)
@@ -740,6 +1087,617 @@ void on_quit(GtkWidget *widget, gpointer data) {
     gtk_main_quit();
 }
 
+// --- Autosave and recovery ---
+
+static Autosave doc_journal = NULL;
+static guint autosave_timer = 0;
+static int autosave_edits = 0;       // Edits since the last autosave
+static int autosave_pending = 0;     // An autosave fell due while the last one was written
+
+// Starts a new journal for the document, whose file now holds base
+static void reset_autosave(PiecetableSnapshot base) {
+    if (autosave_timer) g_source_remove(autosave_timer);
+    autosave_timer = 0;
+    autosave_edits = 0;
+    autosave_pending = 0;
+    if (doc_journal) autosave_free(doc_journal, TRUE);
+    doc_journal = autosave_create(current_filename, doc_encoding, doc_line_ending, base);
+}
+
+static void reset_autosave_to_document(void) {
+    PiecetableSnapshot base = piecetable_snapshot(doc_piecetable);
+    reset_autosave(base);
+    piecetable_snapshot_unref(base);
+}
+
+static void run_autosave(void);
+
+static void on_autosave_written(Autosave journal, const char *error, gpointer data) {
+    if (error) {
+        g_print("Autosave failed, no more changes are kept for recovery: %s\n", error);
+        return;
+    }
+    if (autosave_pending) run_autosave();
+}
+
+/*
+ * Hands the current text to the journal's worker, which writes what changed
+ * since its last write. Taking the snapshot is all the UI thread does.
+ */
+static void run_autosave(void) {
+    if (autosave_timer) g_source_remove(autosave_timer);
+    autosave_timer = 0;
+    autosave_edits = 0;
+    autosave_pending = 0;
+    // The piece table is filled only once the file being opened is complete
+    if (!doc_journal || doc_load) return;
+    if (autosave_busy(doc_journal)) {
+        autosave_pending = 1;
+        return;
+    }
+
+    PiecetableSnapshot current = piecetable_snapshot(doc_piecetable);
+    autosave_write(doc_journal, current, on_autosave_written, NULL);
+    piecetable_snapshot_unref(current);
+}
+
+static gboolean on_autosave_timer(gpointer data) {
+    autosave_timer = 0;
+    run_autosave();
+    return G_SOURCE_REMOVE;
+}
+
+static void note_autosave_edit(void) {
+    if (++autosave_edits >= AUTOSAVE_EDITS)
+        run_autosave();
+    else if (!autosave_timer)
+        autosave_timer = g_timeout_add_seconds(AUTOSAVE_INTERVAL, on_autosave_timer, NULL);
+}
+
+/*
+ * Closes the journal when the editor exits: a document with unsaved changes
+ * has them written and its journal kept for the next start, otherwise the
+ * journal is removed. Does not touch widgets, which may be gone by now.
+ */
+void finish_autosave(void) {
+    if (!doc_journal) return;
+    int dirty = doc_version != saved_version;
+    if (autosave_timer) g_source_remove(autosave_timer);
+    autosave_timer = 0;
+    if (dirty && !doc_load && !autosave_busy(doc_journal)) {
+        PiecetableSnapshot current = piecetable_snapshot(doc_piecetable);
+        autosave_write(doc_journal, current, on_autosave_written, NULL);
+        piecetable_snapshot_unref(current);
+    }
+    // Waits for the write to finish
+    autosave_free(doc_journal, !dirty);
+    doc_journal = NULL;
+}
+
+// Makes a document rebuilt from a journal the one in the editor, with its changes unsaved
+static void restore_document(const char *path, Piecetable pt, char *filename, Encoding encoding,
+                             LineEnding line_ending, GMappedFile *mapping) {
+    stop_file_load();
+    close_document();
+    current_filename = filename;
+    doc_encoding = encoding;
+    doc_line_ending = line_ending;
+    // The journal does not say; a file compressed before is saved compressed again
+    if (current_filename) doc_compression = compression_detect_file(current_filename);
+
+    if (pt->length >= LARGE_FILE_THRESHOLD) {
+        piecetable_free(doc_piecetable);
+        doc_piecetable = pt;
+        doc_mapping = mapping;
+        large_file_open(doc_piecetable, NULL);
+    } else {
+        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+        char *text = piecetable_value(pt);
+        suspend_edit_tracking = 1;
+        gtk_text_buffer_set_text(buffer, text, pt->length);
+        suspend_edit_tracking = 0;
+        free(text);
+        piecetable_free(pt);
+        if (mapping) g_mapped_file_unref(mapping);
+        update_piece_table_from_buffer();
+    }
+    set_bracket_language(GTK_TEXT_VIEW(text_view), current_filename);
+    set_highlight_language(GTK_TEXT_VIEW(text_view), current_filename);
+
+    // Later autosaves go on appending to the journal the document came from
+    autosave_free(doc_journal, TRUE);
+    PiecetableSnapshot recovered = piecetable_snapshot(doc_piecetable);
+    doc_journal = autosave_resume(path, current_filename, recovered);
+    piecetable_snapshot_unref(recovered);
+    watch_document();
+
+    doc_version++;
+    track_index_edit(0, 0, doc_piecetable->length);
+    track_search_edit(0, 0, doc_piecetable->length);
+    refresh_window_title();
+}
+
+// Asks whether to restore the changes a journal holds; returns TRUE if they were restored
+static gboolean offer_recovery(GtkWindow *window, const char *path) {
+    char *filename;
+    GMappedFile *mapping;
+    GError *error = NULL;
+    Encoding encoding;
+    LineEnding line_ending;
+    Piecetable pt = autosave_recover(path, &filename, &encoding, &line_ending, &mapping, &error);
+    if (!pt) {
+        g_print("Cannot recover %s: %s\n", path, error->message);
+        g_clear_error(&error);
+        return FALSE;
+    }
+
+    GStatBuf st;
+    char *when = NULL;
+    if (g_stat(path, &st) == 0) {
+        GDateTime *time = g_date_time_new_from_unix_local(st.st_mtime);
+        when = g_date_time_format(time, "%c");
+        g_date_time_unref(time);
+    }
+    GtkWidget *dialog = gtk_message_dialog_new(window, GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION, GTK_BUTTONS_NONE,
+                                               "Unsaved changes to %s were found.",
+                                               filename ? filename : "an untitled document");
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog),
+                                             "They were last autosaved on %s (%d bytes).",
+                                             when ? when : "an unknown date", pt->length);
+    gtk_dialog_add_buttons(GTK_DIALOG(dialog), "_Discard", GTK_RESPONSE_REJECT, "_Keep for Later", GTK_RESPONSE_CANCEL,
+                           "_Restore", GTK_RESPONSE_ACCEPT, NULL);
+    int response = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+    g_free(when);
+
+    if (response == GTK_RESPONSE_ACCEPT) {
+        restore_document(path, pt, filename, encoding, line_ending, mapping);
+        return TRUE;
+    }
+    piecetable_free(pt);
+    if (mapping) g_mapped_file_unref(mapping);
+    g_free(filename);
+    if (response == GTK_RESPONSE_REJECT) autosave_discard(path);
+    return FALSE;
+}
+
+/*
+ * Offers to restore what an editor that did not exit cleanly left in its
+ * journals, then starts autosaving the document in the editor
+ */
+void init_autosave(GtkWindow *window) {
+    GPtrArray *paths = autosave_find_recoverable();
+    gboolean restored = FALSE;
+    for (guint i = 0; i < paths->len && !restored; i++)
+        restored = offer_recovery(window, g_ptr_array_index(paths, i));
+    g_ptr_array_free(paths, TRUE);
+    if (!doc_journal) reset_autosave_to_document();
+}
+
+// --- Watching the file ---
+
+#define FOLLOW_STEP_BYTES (4 * 1024 * 1024)   // Most appended bytes taken in per step while following
+
+static FileWatch doc_watch = NULL;
+static FileLoad reload_job = NULL;      // Reads the file again after another program rewrote it
+static guint reload_poll_source = 0;
+static int reload_again = 0;            // The file changed again while it was being read
+static int reload_asking = 0;           // The user is being asked whether to reload
+static guint follow_source = 0;         // Takes in the rest of an append too big for one step
+static GtkCheckMenuItem *follow_menu_item = NULL; // The follow mode toggle, to turn it off from here
+
+static void on_file_changed(FileWatch watch, gpointer data);
+
+static void unwatch_document(void) {
+    if (reload_poll_source) g_source_remove(reload_poll_source);
+    reload_poll_source = 0;
+    if (follow_source) g_source_remove(follow_source);
+    follow_source = 0;
+    if (reload_job) file_load_free(reload_job);
+    reload_job = NULL;
+    file_watch_free(doc_watch);
+    doc_watch = NULL;
+}
+
+// Watches the document's file, which it now matches, for changes by other programs
+static void watch_document(void) {
+    if (doc_watch && current_filename && strcmp(doc_watch->filename, current_filename) == 0) {
+        file_watch_sync(doc_watch);
+        return;
+    }
+    unwatch_document();
+    if (current_filename) doc_watch = file_watch_start(current_filename, on_file_changed, NULL);
+}
+
+// The document holds the file's text again; the journal starts over from it
+static void document_matches_file(void) {
+    saved_version = doc_version;
+    PiecetableSnapshot base = piecetable_snapshot(doc_piecetable);
+    reset_autosave(base);
+    piecetable_snapshot_unref(base);
+    refresh_window_title();
+}
+
+/*
+ * Applies the hunks turning the document into text, from the last so the
+ * offsets of the others stay put. In the buffer they are one user action, so
+ * one undo takes them all back; in large-file mode they go to the piece table
+ * and the window follows, and an append costs only the appended text.
+ */
+static void apply_file_diff(const TextDiff *diff, const char *text) {
+    if (diff->count == 0) return;
+    if (large_file_active()) {
+        for (int h = diff->count - 1; h >= 0; h--) {
+            const TextHunk *hunk = &diff->hunks[h];
+            if (hunk->old_length) piecetable_delete(doc_piecetable, hunk->old_start, hunk->old_length);
+            if (hunk->new_length)
+                piecetable_insert_text(doc_piecetable, text + hunk->new_start, hunk->new_length, hunk->old_start);
+            large_file_edited(hunk->old_start, hunk->old_length, hunk->new_length);
+            track_index_edit(hunk->old_start, hunk->old_length, hunk->new_length);
+            track_search_edit(hunk->old_start, hunk->old_length, hunk->new_length);
+        }
+        return;
+    }
+
+    // Buffer offsets count characters; find those of the hunks along the old text
+    char *old = piecetable_value(doc_piecetable);
+    int *starts = g_new(int, diff->count), *removed = g_new(int, diff->count);
+    int bytes = 0, chars = 0, growth = 0;
+    for (int h = 0; h < diff->count; h++) {
+        const TextHunk *hunk = &diff->hunks[h];
+        chars += g_utf8_strlen(old + bytes, hunk->old_start - bytes);
+        bytes = hunk->old_start;
+        starts[h] = chars;
+        removed[h] = g_utf8_strlen(old + hunk->old_start, hunk->old_length);
+    }
+    free(old);
+
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    suspend_edit_tracking = 1;
+    gtk_text_buffer_begin_user_action(buffer);
+    for (int h = diff->count - 1; h >= 0; h--) {
+        const TextHunk *hunk = &diff->hunks[h];
+        GtkTextIter start, end;
+        gtk_text_buffer_get_iter_at_offset(buffer, &start, starts[h]);
+        gtk_text_buffer_get_iter_at_offset(buffer, &end, starts[h] + removed[h]);
+        gtk_text_buffer_delete(buffer, &start, &end);
+        gtk_text_buffer_insert(buffer, &start, text + hunk->new_start, hunk->new_length);
+        growth += hunk->new_length - hunk->old_length;
+    }
+    gtk_text_buffer_end_user_action(buffer);
+    suspend_edit_tracking = 0;
+    update_piece_table_from_buffer();
+
+    // One edit from the first hunk to the end of the last, in bytes, tells the search state
+    const TextHunk *last = &diff->hunks[diff->count - 1];
+    int first = diff->hunks[0].old_start, span = last->old_start + last->old_length - first;
+    track_index_edit(first, span, span + growth);
+    track_search_edit(first, span, span + growth);
+    g_free(starts);
+    g_free(removed);
+}
+
+static gboolean poll_reload(gpointer data);
+
+// Reads the whole file again on a worker, to compare it with the document when done
+static void start_reload(void) {
+    GError *error = NULL;
+    // Changes made from here on are picked up by the next look at the file
+    file_watch_sync(doc_watch);
+    reload_again = 0;
+    reload_job = file_load_start(current_filename, doc_encoding, &error);
+    if (!reload_job) {
+        g_print("Error reloading file: %s\n", error->message);
+        g_clear_error(&error);
+        return;
+    }
+    reload_poll_source = g_timeout_add(LOAD_POLL_INTERVAL, poll_reload, NULL);
+}
+
+static void finish_reload(void) {
+    FileLoad load = reload_job;
+    reload_job = NULL;
+    file_load_wait(load);
+    if (load->error || load->consumed < load->source_length) {
+        g_print("Error reloading file: %s\n", load->error ? load->error : "cancelled");
+    } else {
+        PiecetableSnapshot old = piecetable_snapshot(doc_piecetable);
+        TextDiff diff = text_diff(old, load->text, load->length);
+        piecetable_snapshot_unref(old);
+        apply_file_diff(&diff, load->text);
+        if (diff.count) mark_document_changed();
+        doc_compression = load->compression;
+        document_matches_file();
+        text_diff_free(&diff);
+    }
+    file_load_free(load);
+    if (reload_again) on_file_changed(doc_watch, NULL);
+}
+
+static gboolean poll_reload(gpointer data) {
+    int scanned;
+    if (file_load_poll(reload_job, &scanned)) return G_SOURCE_CONTINUE;
+    reload_poll_source = 0;
+    finish_reload();
+    return G_SOURCE_REMOVE;
+}
+
+// Adds the text another program appended to the file to the end of the document
+static void append_from_file(void) {
+    GError *error = NULL;
+    int length;
+    char *text = file_watch_read_appended(doc_watch, doc_encoding, G_MAXINT, &length, &error);
+    if (!text) {
+        g_print("%s; reading the whole file again\n", error->message);
+        g_clear_error(&error);
+        start_reload();
+        return;
+    }
+    if (length > 0) {
+        int clean = doc_version == saved_version;
+        TextHunk hunk = {doc_piecetable->length, 0, 0, length};
+        TextDiff diff = {&hunk, 1};
+        apply_file_diff(&diff, text);
+        mark_document_changed();
+        // With unsaved edits the document still differs from the file
+        if (clean) document_matches_file();
+    }
+    free(text);
+}
+
+/*
+ * True if the document is its mapped UTF-8 file as it was opened, one piece
+ * of original text over all of it, so text appended to the file can be read
+ * in place as well
+ */
+static int document_is_mapped_file(void) {
+    if (!doc_mapping || ENCODING_KIND(doc_encoding) != ENCODING_UTF8 || doc_version != saved_version) return FALSE;
+    char bom[4];
+    int skip = encoding_bom(doc_encoding, bom);
+    Piece piece = (Piece)list_get_first(doc_piecetable->pieces)->value;
+    return doc_piecetable->pieces->length == 1 && piece->which == ORIGINAL && piece->start == 0 &&
+           doc_piecetable->original == g_mapped_file_get_contents(doc_mapping) + skip &&
+           piece->length == doc_watch->size - skip;
+}
+
+// True if the last line of the document is in view
+static int view_at_end(void) {
+    if (large_file_active()) return large_file_at_end();
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    GdkRectangle visible;
+    GtkTextIter iter;
+    gtk_text_view_get_visible_rect(GTK_TEXT_VIEW(text_view), &visible);
+    gtk_text_view_get_line_at_y(GTK_TEXT_VIEW(text_view), &iter, visible.y + visible.height, NULL);
+    return gtk_text_iter_get_line(&iter) >= gtk_text_buffer_get_line_count(buffer) - 1;
+}
+
+static void scroll_to_end(void) {
+    if (large_file_active()) {
+        large_file_show_end();
+        return;
+    }
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    GtkTextIter end;
+    gtk_text_buffer_get_end_iter(buffer, &end);
+    GtkTextMark *mark = gtk_text_buffer_get_mark(buffer, "follow_end");
+    if (mark) gtk_text_buffer_move_mark(buffer, mark, &end);
+    else mark = gtk_text_buffer_create_mark(buffer, "follow_end", &end, FALSE);
+    gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(text_view), mark, 0.0, TRUE, 0.0, 1.0);
+}
+
+/*
+ * Adds text to the end of the buffer and the piece table as it is, without
+ * an undo entry or rebuilding the piece table from the buffer, and keeps the
+ * selection where it was rather than growing with the text
+ */
+static void append_followed_text(const char *text, int length) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    GtkTextIter insert, bound, end;
+    gtk_text_buffer_get_iter_at_mark(buffer, &insert, gtk_text_buffer_get_insert(buffer));
+    gtk_text_buffer_get_iter_at_mark(buffer, &bound, gtk_text_buffer_get_selection_bound(buffer));
+    int insert_offset = gtk_text_iter_get_offset(&insert), bound_offset = gtk_text_iter_get_offset(&bound);
+    int at = doc_piecetable->length;
+
+    gtk_text_buffer_get_end_iter(buffer, &end);
+    suspend_edit_tracking = 1;
+    gtk_text_buffer_insert(buffer, &end, text, length);
+    suspend_edit_tracking = 0;
+    piecetable_insert_text(doc_piecetable, text, length, doc_piecetable->length);
+    if (doc_lines && doc_lines->length == at) line_index_edit(doc_lines, doc_piecetable, at, 0, length);
+
+    gtk_text_buffer_get_iter_at_offset(buffer, &insert, insert_offset);
+    gtk_text_buffer_get_iter_at_offset(buffer, &bound, bound_offset);
+    gtk_text_buffer_select_range(buffer, &insert, &bound);
+    track_index_edit(at, 0, length);
+    track_search_edit(at, 0, length);
+}
+
+static gboolean follow_more(gpointer data) {
+    follow_source = 0;
+    on_file_changed(doc_watch, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Takes in text appended to the file while following it, at most
+ * FOLLOW_STEP_BYTES a step so a burst of output cannot stall the editor; the
+ * rest comes in steps from the main loop. A file read in place is mapped
+ * again and the piece table's original text extended over the new bytes, so
+ * nothing is copied and the document stays one piece; other files have the
+ * new text decoded and added. The view scrolls along if it showed the end.
+ * A step that takes nothing, as when the file ends in part of a character,
+ * waits for the file to change again; one that finds text that can never be
+ * decoded stops following.
+ */
+static void follow_file(void) {
+    int at_end = view_at_end(), clean = doc_version == saved_version;
+    int at = doc_piecetable->length, length = 0;
+    GMappedFile *retired = NULL;
+    GError *error = NULL;
+
+    if (large_file_active() && document_is_mapped_file()) {
+        char bom[4];
+        int skip = encoding_bom(doc_encoding, bom);
+        gint64 start = doc_watch->size;
+        GMappedFile *mapping = file_watch_map_appended(doc_watch, FOLLOW_STEP_BYTES, &length, &error);
+        if (mapping && length == 0) {
+            g_mapped_file_unref(mapping);
+        } else if (mapping) {
+            piecetable_append_original(doc_piecetable, g_mapped_file_get_contents(mapping) + skip, start - skip,
+                                       length);
+            retired = doc_mapping;
+            doc_mapping = mapping;
+        }
+    } else {
+        char *text = file_watch_read_appended(doc_watch, doc_encoding, FOLLOW_STEP_BYTES, &length, &error);
+        if (text && length > 0) {
+            if (large_file_active()) piecetable_insert_text(doc_piecetable, text, length, at);
+            else append_followed_text(text, length);
+        }
+        free(text);
+    }
+    if (error && g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_INVAL)) {
+        g_print("%s; no longer following it\n", error->message);
+        g_clear_error(&error);
+        if (follow_menu_item) gtk_check_menu_item_set_active(follow_menu_item, FALSE);
+        return;
+    }
+    if (error) {
+        g_print("%s; reading the whole file again\n", error->message);
+        g_clear_error(&error);
+        start_reload();
+        return;
+    }
+
+    if (length > 0) {
+        if (large_file_active()) {
+            large_file_edited(at, 0, length);
+            track_index_edit(at, 0, length);
+            track_search_edit(at, 0, length);
+        }
+        mark_document_changed();
+        if (clean) document_matches_file();
+        if (at_end) scroll_to_end();
+    }
+    // The journal now starts from the new mapping, so nothing reads the old one
+    if (retired) g_mapped_file_unref(retired);
+    if (length > 0 && file_watch_check(doc_watch) == FILE_WATCH_APPENDED) {
+        follow_source = g_idle_add(follow_more, NULL);
+    }
+}
+
+/**
+ * Turns follow mode on or off. While on, the view is read-only, text another
+ * program appends to the file is taken in as it comes, and the view keeps the
+ * end in sight unless scrolled away from it.
+ */
+void on_follow_toggled(GtkCheckMenuItem *item, gpointer data) {
+    follow_menu_item = item;
+    doc_following = gtk_check_menu_item_get_active(item);
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(text_view), !doc_following && !doc_load);
+    if (!doc_following || doc_load) return;
+    scroll_to_end();
+    // Catch up with what was appended since the file was last looked at
+    if (doc_watch) on_file_changed(doc_watch, NULL);
+}
+
+static gboolean confirm_reload(const char *filename) {
+    GtkWidget *window = gtk_widget_get_toplevel(text_view);
+    GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(window), GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION,
+                                               GTK_BUTTONS_NONE, "%s was changed by another program.", filename);
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog),
+                                             "Reloading it replaces your unsaved changes.");
+    gtk_dialog_add_buttons(GTK_DIALOG(dialog), "_Keep My Changes", GTK_RESPONSE_REJECT, "_Reload",
+                           GTK_RESPONSE_ACCEPT, NULL);
+    reload_asking = 1;
+    int response = gtk_dialog_run(GTK_DIALOG(dialog));
+    reload_asking = 0;
+    gtk_widget_destroy(dialog);
+    return response == GTK_RESPONSE_ACCEPT;
+}
+
+// Opens the document's file again in place of a document that reads it mapped
+static void reopen_document_file(void) {
+    char *filename = g_strdup(doc_watch->filename);
+    start_file_load(filename, doc_encoding);
+    g_free(filename);
+}
+
+/*
+ * Brings the document in line with its file after another program changed
+ * it. Appended text is added as it is; other changes are diffed in, after
+ * asking if that would overwrite unsaved edits.
+ */
+static void on_file_changed(FileWatch watch, gpointer data) {
+    // A save or load of the document is followed by a fresh look at the file anyway
+    if (save_job || doc_load || reload_asking || follow_source) return;
+    if (reload_job) {
+        reload_again = 1;
+        return;
+    }
+
+    FileWatchChange change = file_watch_check(watch);
+    // Bytes added to a compressed file are not text to add to the document
+    if (change == FILE_WATCH_APPENDED && doc_compression.codec != COMPRESSION_NONE) change = FILE_WATCH_REWRITTEN;
+    switch (change) {
+    case FILE_WATCH_UNCHANGED:
+        return;
+    case FILE_WATCH_DELETED:
+        g_print("%s was deleted; the document keeps its text\n", watch->filename);
+        file_watch_sync(watch);
+        return;
+    case FILE_WATCH_APPENDED:
+        if (doc_following) follow_file();
+        else append_from_file();
+        return;
+    case FILE_WATCH_SHRUNK:
+        if (doc_mapping && !doc_mapping_is_session) {
+            // Reading the mapping past the new end would fault, so the file is opened again before anything
+            // can, unasked: even a dialog redraws the view from the mapping, and the old text is gone anyway
+            g_print("%s was cut short by another program; reading it again\n", watch->filename);
+            reopen_document_file();
+            return;
+        }
+        // Fall through
+    default:
+        if (doc_version != saved_version && !confirm_reload(watch->filename)) {
+            file_watch_sync(watch);
+            return;
+        }
+        if (change != FILE_WATCH_REPLACED && doc_mapping) {
+            // The document reads the mapped file, which no longer holds the old text to compare
+            reopen_document_file();
+            return;
+        }
+        start_reload();
+    }
+}
+
+// --- Background search index ---
+
+#define SEARCH_INDEX_SLICE 64 // Index blocks built per idle callback
+
+static SearchIndex search_index = NULL;
+static guint search_index_idle = 0;
+
+static gboolean build_search_index_slice(gpointer user_data) {
+    if (search_index_build_step(search_index, doc_piecetable, SEARCH_INDEX_SLICE)) return G_SOURCE_CONTINUE;
+    search_index_idle = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// Keeps the index in step with an edit, creating it once the document is large enough
+static void track_index_edit(int at, int removed, int inserted) {
+    if (search_index) {
+        search_index_apply_edit(search_index, at, removed, inserted);
+    } else if (doc_piecetable && doc_piecetable->length >= SEARCH_INDEX_MIN_LENGTH) {
+        search_index = search_index_create(doc_piecetable->length);
+    } else {
+        return;
+    }
+    if (!search_index_idle) search_index_idle = g_idle_add(build_search_index_slice, NULL);
+}
+
 // --- Search Integration ---
 
 void show_search_bar(GtkWidget *widget, gpointer data) {
@@ -747,64 +1705,356 @@ void show_search_bar(GtkWidget *widget, gpointer data) {
     gtk_widget_grab_focus(GTK_WIDGET(search_entry));
 }
 
-void on_search_text_changed(GtkEntry *entry, gpointer user_data) {
-    const gchar *text = gtk_entry_get_text(GTK_ENTRY(entry));
-    search_results_free(&current_results);
+// Shows "current of total" next to the search entry
+static void update_search_count_label(void) {
+    if (!search_count_label) return;
 
-    if (strlen(text) > 0) {
-        current_results = kmp_search(text, doc_piecetable);
-        current_match = current_results.count > 0 ? 0 : -1;
+    char status[64];
+    if (current_results.total == 0) {
+        status[0] = '\0';
+    } else if (current_results.total > current_results.count) {
+        snprintf(status, sizeof(status), "%d of %d (%d shown)",
+                 current_match + 1, current_results.total, current_results.count);
     } else {
-        current_match = -1;
+        snprintf(status, sizeof(status), "%d of %d", current_match + 1, current_results.total);
     }
+    gtk_label_set_text(GTK_LABEL(search_count_label), status);
+}
+
+/*
+ * The buffer counts characters and the piece table, which holds the same
+ * text outside large-file mode, bytes. A line index of the text, which breaks
+ * lines where the buffer does, turns a byte offset into a line and a byte
+ * index in it that the buffer resolves, and back, in time growing with the
+ * log of the lines rather than the document. The edit hooks keep it in step;
+ * text replaced wholesale has it built again on next use.
+ */
+static LineIndex doc_line_index(void) {
+    if (doc_lines && doc_lines->length == doc_piecetable->length) return doc_lines;
+    forget_doc_lines();
+    doc_lines = line_index_create();
+    PiecetableCursor cursor;
+    piecetable_cursor_init(doc_piecetable, &cursor);
+    for (int at = 0; at < doc_piecetable->length;) {
+        int available;
+        const char *text = piecetable_cursor_seek(doc_piecetable, &cursor, at, &available);
+        line_index_append(doc_lines, text, available);
+        at += available;
+    }
+    return doc_lines;
+}
 
-    if (current_match != -1) {
-        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-        int match_offset = current_results.indices[current_match];
-        int match_length = strlen(gtk_entry_get_text(entry));
+// Search results are byte offsets in the document; in large-file mode the buffer holds only a window of it
+static void doc_iter_at_offset(GtkTextBuffer *buffer, GtkTextIter *iter, int offset) {
+    if (large_file_active()) {
+        large_file_iter_at_offset(iter, offset);
+        return;
+    }
+    LineIndex lines = doc_line_index();
+    offset = CLAMP(offset, 0, lines->length);
+    int line = line_index_line_at(lines, offset);
+    gtk_text_buffer_get_iter_at_line_index(buffer, iter, line, offset - line_index_start(lines, line));
+}
 
-        GtkTextIter match_start, match_end;
-        gtk_text_buffer_get_iter_at_offset(buffer, &match_start, match_offset);
-        match_end = match_start;
-        gtk_text_iter_forward_chars(&match_end, match_length);
+static int doc_offset_at_iter(const GtkTextIter *iter) {
+    if (large_file_active()) return large_file_offset_at_iter(iter);
+    return line_index_start(doc_line_index(), gtk_text_iter_get_line(iter)) + gtk_text_iter_get_line_index(iter);
+}
 
-        gtk_text_buffer_select_range(buffer, &match_start, &match_end);
-        gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(text_view), &match_start, 0.0, FALSE, 0.0, 0.0);
+// Moves the large-file window onto a match, then returns the buffer range of it
+static void doc_match_range(GtkTextBuffer *buffer, int offset, int length, GtkTextIter *start, GtkTextIter *end) {
+    if (large_file_active()) {
+        large_file_reveal(offset);
+        large_file_iter_at_offset(start, offset);
+        large_file_iter_at_offset(end, offset + length);
+    } else {
+        // A case-folded match may differ in length from the pattern; it ends at its end byte
+        doc_iter_at_offset(buffer, start, offset);
+        doc_iter_at_offset(buffer, end, offset + length);
     }
 }
 
-void on_next_match(GtkWidget *widget, gpointer data) {
-    if (current_results.count == 0) return;
-    current_match = (current_match + 1) % current_results.count;
+// Selects the match under current_cursor and scrolls it into view
+static void select_current_match(void) {
+    update_search_count_label();
+    if (current_match < 0) return;
 
     GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-    int match_offset = current_results.indices[current_match];
-    int match_length = strlen(gtk_entry_get_text(GTK_ENTRY(search_entry)));
+    int match_offset = search_cursor_offset(&current_cursor);
+    int match_length = search_cursor_length(&current_results, &current_cursor);
 
     GtkTextIter match_start, match_end;
-    gtk_text_buffer_get_iter_at_offset(buffer, &match_start, match_offset);
-    match_end = match_start;
-    gtk_text_iter_forward_chars(&match_end, match_length);
+    doc_match_range(buffer, match_offset, match_length, &match_start, &match_end);
 
     gtk_text_buffer_select_range(buffer, &match_start, &match_end);
     gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(text_view), &match_start, 0.0, FALSE, 0.0, 0.0);
 }
 
+static int search_is_regex(void) {
+    return search_regex_toggle && gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(search_regex_toggle));
+}
+
+static int search_flags(void) {
+    int flags = 0;
+    if (search_case_toggle && gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(search_case_toggle)))
+        flags |= SEARCH_CASE_INSENSITIVE;
+    if (search_word_toggle && gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(search_word_toggle)))
+        flags |= SEARCH_WHOLE_WORD;
+    return flags;
+}
+
+// Runs the search for pattern over the whole document; returns 0 if the regex does not compile
+static int run_search(const gchar *pattern) {
+    int flags = search_flags();
+    current_results_stale = 0;
+
+    if (!search_is_regex()) {
+        if (search_index)
+            current_results = search_index_find(search_index, pattern, flags, doc_piecetable, SEARCH_DEFAULT_LIMIT);
+        else
+            current_results = kmp_search(pattern, flags, doc_piecetable, SEARCH_DEFAULT_LIMIT);
+        return 1;
+    }
+
+    char error[128];
+    Regex rx = regex_compile(pattern, flags, error, sizeof(error));
+    if (!rx) {
+        search_results_init(&current_results, SEARCH_DEFAULT_LIMIT);
+        if (search_count_label) gtk_label_set_text(GTK_LABEL(search_count_label), error);
+        return 0;
+    }
+    current_results = regex_search(rx, doc_piecetable, SEARCH_DEFAULT_LIMIT);
+    regex_free(rx);
+    return 1;
+}
+
+static int selection_start_offset(void) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    GtkTextIter start, end;
+    gtk_text_buffer_get_selection_bounds(buffer, &start, &end);
+    return doc_offset_at_iter(&start);
+}
+
+/*
+ * In the hex view the pattern is bytes written in hex, or else the bytes of
+ * the text itself; the search runs from the cursor rather than listing every
+ * match, which in a file of gigabytes would take too long to wait for
+ */
+static void find_in_hex_view(int direction) {
+    const char *text = gtk_entry_get_text(GTK_ENTRY(search_entry));
+    int length;
+    char *bytes = hex_view_parse_bytes(text, &length);
+    gint64 found = bytes ? hex_view_find(bytes, length, 0, direction)
+                         : hex_view_find(text, strlen(text), search_flags() & SEARCH_CASE_INSENSITIVE, direction);
+    g_free(bytes);
+
+    char status[64];
+    if (*text == '\0') status[0] = '\0';
+    else if (found < 0) snprintf(status, sizeof(status), "Not found");
+    else snprintf(status, sizeof(status), "At 0x%" G_GINT64_MODIFIER "x", found);
+    if (search_count_label) gtk_label_set_text(GTK_LABEL(search_count_label), status);
+}
+
+void on_search_text_changed(GtkEntry *entry, gpointer user_data) {
+    if (hex_view_active()) {
+        find_in_hex_view(0);
+        return;
+    }
+    const gchar *text = gtk_entry_get_text(GTK_ENTRY(search_entry));
+    search_results_free(&current_results);
+    current_match = -1;
+
+    int from_selection = search_from_selection;
+    search_from_selection = 0;
+    if (strlen(text) > 0) {
+        if (!run_search(text)) return;
+        if (from_selection)
+            current_match = search_cursor_seek(&current_results, &current_cursor, selection_start_offset())
+                                ? current_cursor.index : -1;
+        else
+            current_match = search_cursor_first(&current_results, &current_cursor) ? 0 : -1;
+    }
+
+    select_current_match();
+}
+
+void on_search_mode_toggled(GtkToggleButton *button, gpointer user_data) {
+    on_search_text_changed(GTK_ENTRY(search_entry), NULL);
+}
+
+// Re-runs a regex search invalidated by edits, keeping the position near anchor
+static void refresh_stale_results(int anchor) {
+    if (!current_results_stale) return;
+    search_results_free(&current_results);
+    current_match = -1;
+    if (!run_search(gtk_entry_get_text(GTK_ENTRY(search_entry)))) return;
+    current_match = search_cursor_seek(&current_results, &current_cursor, anchor) ? current_cursor.index : -1;
+}
+
+void on_next_match(GtkWidget *widget, gpointer data) {
+    if (hex_view_active()) {
+        find_in_hex_view(1);
+        return;
+    }
+    if (current_results_stale) {
+        refresh_stale_results(selection_start_offset());
+        select_current_match();
+        return;
+    }
+    if (current_results.count == 0) return;
+    search_cursor_next(&current_results, &current_cursor);
+    current_match = current_cursor.index;
+    select_current_match();
+}
+
 void on_previous_match(GtkWidget *widget, gpointer data) {
+    if (hex_view_active()) {
+        find_in_hex_view(-1);
+        return;
+    }
+    if (current_results_stale) {
+        refresh_stale_results(selection_start_offset());
+        if (current_results.count == 0) {
+            select_current_match();
+            return;
+        }
+    }
     if (current_results.count == 0) return;
-    current_match = (current_match - 1 + current_results.count) % current_results.count;
+    search_cursor_prev(&current_results, &current_cursor);
+    current_match = current_cursor.index;
+    select_current_match();
+}
+
+// Asks for a byte offset, in decimal or in hex after 0x, and moves the cursor there
+void show_goto_offset(GtkWidget *widget, gpointer window) {
+    GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(window), GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION,
+                                               GTK_BUTTONS_OK_CANCEL, "Go to offset");
+    gtk_message_dialog_format_secondary_text(GTK_MESSAGE_DIALOG(dialog), "In decimal, or in hex starting with 0x.");
+    GtkWidget *entry = gtk_entry_new();
+    gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_OK);
+    gtk_box_pack_start(GTK_BOX(gtk_message_dialog_get_message_area(GTK_MESSAGE_DIALOG(dialog))), entry, FALSE,
+                       FALSE, 0);
+    gtk_widget_show(entry);
+    int response = gtk_dialog_run(GTK_DIALOG(dialog));
+    char *text = g_strstrip(g_strdup(gtk_entry_get_text(GTK_ENTRY(entry))));
+    gtk_widget_destroy(dialog);
+
+    char *end;
+    int hex = g_ascii_strncasecmp(text, "0x", 2) == 0;
+    gint64 offset = g_ascii_strtoll(text, &end, hex ? 16 : 10);
+    gboolean valid = end != text && *end == '\0' && offset >= 0;
+    g_free(text);
+    if (response != GTK_RESPONSE_OK || !valid) return;
 
+    if (hex_view_active()) {
+        hex_view_goto(offset);
+        return;
+    }
     GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-    int match_offset = current_results.indices[current_match];
-    int match_length = strlen(gtk_entry_get_text(GTK_ENTRY(search_entry)));
+    GtkTextIter iter;
+    int at = MIN(offset, doc_piecetable->length);
+    if (large_file_active()) large_file_reveal(at);
+    doc_iter_at_offset(buffer, &iter, at);
+    gtk_text_buffer_place_cursor(buffer, &iter);
+    gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(text_view), gtk_text_buffer_get_insert(buffer), 0.1, FALSE, 0.0, 0.0);
+}
 
-    GtkTextIter match_start, match_end;
-    gtk_text_buffer_get_iter_at_offset(buffer, &match_start, match_offset);
-    match_end = match_start;
-    gtk_text_iter_forward_chars(&match_end, match_length);
+// --- Keeping search results in step with edits ---
 
-    gtk_text_buffer_select_range(buffer, &match_start, &match_end);
-    gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(text_view), &match_start, 0.0, FALSE, 0.0, 0.0);
+static int pending_delete_at = 0;
+static int pending_delete_length = 0;
+
+// Shifts the current results past an edit and re-searches only around it
+static void track_search_edit(int at, int removed, int inserted) {
+    if (!search_entry) return;
+    const gchar *pattern = gtk_entry_get_text(GTK_ENTRY(search_entry));
+    if (!pattern || !*pattern) return;
+
+    // A regex match can span any distance, so its results are rebuilt on the next navigation
+    if (search_is_regex()) {
+        current_results_stale = 1;
+        return;
+    }
+
+    int anchor = current_match >= 0 ? search_cursor_offset(&current_cursor) : at;
+    int flags = search_flags();
+    if (!search_results_apply_edit(&current_results, pattern, flags, doc_piecetable, at, removed, inserted)) {
+        search_results_free(&current_results);
+        current_results = kmp_search(pattern, flags, doc_piecetable, SEARCH_DEFAULT_LIMIT);
+    }
+
+    if (anchor >= at + removed) anchor += inserted - removed;
+    else if (anchor > at) anchor = at;
+    current_match = search_cursor_seek(&current_results, &current_cursor, anchor) ? current_cursor.index : -1;
+    update_search_count_label();
+}
+
+// Drops the results and index of a document that is being replaced
+static void forget_search_state(void) {
+    if (search_index_idle) {
+        g_source_remove(search_index_idle);
+        search_index_idle = 0;
+    }
+    if (search_index) {
+        search_index_free(search_index);
+        search_index = NULL;
+    }
+    search_results_free(&current_results);
+    current_match = -1;
+    current_results_stale = 0;
+    update_search_count_label();
+}
+
+// Connected after the default handler, so location points past the new text
+void on_buffer_insert_text(GtkTextBuffer *buffer, GtkTextIter *location, gchar *text, gint len, gpointer user_data) {
+    if (suspend_edit_tracking) return;
+    if (large_file_active()) {
+        // The document takes the text in bytes, at the offset the window maps the insertion to
+        GtkTextIter start = *location;
+        gtk_text_iter_backward_chars(&start, g_utf8_strlen(text, len));
+        int at = large_file_insert(&start, text, len);
+        if (at < 0) return;
+        mark_document_changed();
+        track_index_edit(at, 0, len);
+        track_search_edit(at, 0, len);
+        return;
+    }
+    // The text before the insertion is where it was, so the line index finds it before taking in the edit
+    GtkTextIter start = *location;
+    gtk_text_iter_backward_chars(&start, g_utf8_strlen(text, len));
+    int at;
+    if (doc_lines && doc_lines->length + len == doc_piecetable->length) {
+        at = line_index_start(doc_lines, gtk_text_iter_get_line(&start)) + gtk_text_iter_get_line_index(&start);
+        line_index_edit(doc_lines, doc_piecetable, at, 0, len);
+    } else {
+        at = doc_offset_at_iter(&start);
+    }
+    track_index_edit(at, 0, len);
+    track_search_edit(at, 0, len);
+}
+
+// Connected before the default handler to record how much is being removed
+void on_buffer_delete_range_before(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, gpointer user_data) {
+    if (suspend_edit_tracking) return;
+    // The piece table does not have the deletion yet, so both ends are found in bytes
+    pending_delete_at = doc_offset_at_iter(start);
+    pending_delete_length = doc_offset_at_iter(end) - pending_delete_at;
+}
+
+void on_buffer_delete_range(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, gpointer user_data) {
+    if (suspend_edit_tracking) return;
+    if (large_file_active()) {
+        if (large_file_delete(pending_delete_at, pending_delete_length) < 0) return;
+        mark_document_changed();
+        track_index_edit(pending_delete_at, pending_delete_length, 0);
+        track_search_edit(pending_delete_at, pending_delete_length, 0);
+        return;
+    }
+    if (doc_lines && doc_lines->length - pending_delete_length == doc_piecetable->length)
+        line_index_edit(doc_lines, doc_piecetable, pending_delete_at, pending_delete_length, 0);
+    track_index_edit(pending_delete_at, pending_delete_length, 0);
+    track_search_edit(pending_delete_at, pending_delete_length, 0);
 }
 
 void on_search_bar_close(GtkSearchBar *search_bar, gpointer user_data) {
@@ -815,22 +2065,57 @@ void on_replace_clicked(GtkWidget *widget, gpointer user_data) {
     GtkEntry *replace_entry_local = GTK_ENTRY(user_data);
     const gchar *replace_text = gtk_entry_get_text(replace_entry_local);
 
+    if (current_results_stale) {
+        // The selection may no longer be a match; show the one there now first
+        refresh_stale_results(selection_start_offset());
+        select_current_match();
+        return;
+    }
     if (current_results.count == 0 || current_match < 0) return;
 
     GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-    int match_offset = current_results.indices[current_match];
-    int match_length = strlen(gtk_entry_get_text(GTK_ENTRY(search_entry)));
+    int match_offset = search_cursor_offset(&current_cursor);
+    int match_length = search_cursor_length(&current_results, &current_cursor);
 
     GtkTextIter start, end;
-    gtk_text_buffer_get_iter_at_offset(buffer, &start, match_offset);
-    end = start;
-    gtk_text_iter_forward_chars(&end, match_length);
+    doc_match_range(buffer, match_offset, match_length, &start, &end);
+
+    // In regex mode group references expand against the match being replaced
+    char *expanded = NULL;
+    if (search_is_regex()) {
+        char error[128];
+        Regex rx = regex_compile(gtk_entry_get_text(GTK_ENTRY(search_entry)), search_flags(), error, sizeof(error));
+        int expanded_length;
+        if (rx) {
+            expanded = replace_regex_expand(doc_piecetable, rx, replace_text, match_offset, &expanded_length, error,
+                                            sizeof(error));
+            regex_free(rx);
+        }
+        if (!rx || error[0]) {
+            if (search_count_label) gtk_label_set_text(GTK_LABEL(search_count_label), error);
+            return;
+        }
+        if (!expanded) {
+            // No match starts here any more; search again and show the one there now instead
+            current_results_stale = 1;
+            refresh_stale_results(match_offset);
+            select_current_match();
+            return;
+        }
+        replace_text = expanded;
+    }
 
     gtk_text_buffer_delete(buffer, &start, &end);
     gtk_text_buffer_insert(buffer, &start, replace_text, -1);
+    int replaced_end = match_offset + strlen(replace_text);
+    free(expanded);
 
-    // Refresh search results after replacement
-    on_search_text_changed(GTK_ENTRY(search_entry), NULL);
+    // The edit hooks already updated the results; continue after the replacement
+    refresh_stale_results(replaced_end);
+    if (current_results.count == 0) return;
+    search_cursor_seek(&current_results, &current_cursor, replaced_end);
+    current_match = current_cursor.index;
+    select_current_match();
 }
 
 void on_replace_all_clicked(GtkWidget *widget, gpointer user_data) {
@@ -838,23 +2123,400 @@ void on_replace_all_clicked(GtkWidget *widget, gpointer user_data) {
     const gchar *replace_text = gtk_entry_get_text(replace_entry_local);
     const gchar *search_text = gtk_entry_get_text(GTK_ENTRY(search_entry));
 
-    if (!search_text || strlen(search_text) == 0) return;
+    // The piece table is filled only once the file being opened is complete
+    if (!search_text || strlen(search_text) == 0 || doc_load) return;
 
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-    GtkTextIter start, match_start, match_end;
-    gtk_text_buffer_get_start_iter(buffer, &start);
+    int old_length = doc_piecetable->length;
+    int replaced;
+
+    // Rewrite the piece table in one pass instead of editing the buffer per match
+    if (search_is_regex()) {
+        char error[128];
+        Regex rx = regex_compile(search_text, search_flags(), error, sizeof(error));
+        if (!rx) {
+            if (search_count_label) gtk_label_set_text(GTK_LABEL(search_count_label), error);
+            return;
+        }
+        replaced = replace_regex(doc_piecetable, rx, replace_text, error, sizeof(error));
+        regex_free(rx);
+        if (replaced < 0) {
+            if (search_count_label) gtk_label_set_text(GTK_LABEL(search_count_label), error);
+            return;
+        }
+    } else {
+        SearchResults matches = kmp_search(search_text, search_flags(), doc_piecetable, SEARCH_NO_LIMIT);
+        replaced = replace_all(doc_piecetable, &matches, replace_text);
+        search_results_free(&matches);
+    }
+    if (replaced == 0) return;
+    mark_document_changed();
 
-    while (gtk_text_iter_forward_search(&start, search_text, GTK_TEXT_SEARCH_VISIBLE_ONLY, &match_start, &match_end, NULL)) {
-        gtk_text_buffer_delete(buffer, &match_start, &match_end);
-        gtk_text_buffer_insert(buffer, &match_start, replace_text, -1);
-        // Move start to after the replaced text
-        start = match_start;
-        gtk_text_iter_forward_chars(&start, strlen(replace_text));
+    if (large_file_active()) {
+        // Only the window is in the buffer; it is refilled from the rewritten piece table
+        large_file_reload();
+    } else {
+        // Show the result as one user action, so it is a single undo entry
+        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+        char *text = piecetable_value(doc_piecetable);
+        suspend_edit_tracking = 1;
+        gtk_text_buffer_begin_user_action(buffer);
+        gtk_text_buffer_set_text(buffer, text, -1);
+        gtk_text_buffer_end_user_action(buffer);
+        suspend_edit_tracking = 0;
+        free(text);
+        forget_doc_lines();
     }
+    track_index_edit(0, old_length, doc_piecetable->length);
+
     // Refresh search results
     on_search_text_changed(GTK_ENTRY(search_entry), NULL);
 }
 
+// --- Session ---
+
+static int session_finished = 0;
+
+/**
+ * Write the document, its undo history and the view to the session file as
+ * the editor exits, for the next start to put back; the document's journal
+ * is kept with it for recovery should that fail
+ */
+void finish_session(void) {
+    if (session_finished) return;
+    session_finished = 1;
+    // A document still being read has nothing to put back yet, nor does a binary file
+    if (doc_load || hex_view_active() || (!current_filename && doc_piecetable->length == 0 && !undo_redo_can_undo(undo_stack))) {
+        session_discard();
+        return;
+    }
+
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    GtkTextIter insert, bound;
+    gtk_text_buffer_get_iter_at_mark(buffer, &insert, gtk_text_buffer_get_insert(buffer));
+    gtk_text_buffer_get_iter_at_mark(buffer, &bound, gtk_text_buffer_get_selection_bound(buffer));
+    const char *pattern = gtk_entry_get_text(GTK_ENTRY(search_entry));
+    struct session session = {
+        .filename = current_filename,
+        .journal = doc_journal ? doc_journal->path : NULL,
+        .encoding = doc_encoding,
+        .line_ending = doc_line_ending,
+        .compression = doc_compression,
+        .modified = doc_version != saved_version,
+        .pt = doc_piecetable,
+        .original_mapping = doc_mapping_is_session ? NULL : doc_mapping,
+        .lines = large_file_lines(),
+        .undo = undo_stack,
+        .cursor = doc_offset_at_iter(&insert),
+        .selection_bound = doc_offset_at_iter(&bound),
+        .search_text = *pattern ? (char *)pattern : NULL,
+        .search_shown = gtk_search_bar_get_search_mode(GTK_SEARCH_BAR(search_bar)),
+        .search_regex = search_is_regex(),
+        .search_flags = search_flags(),
+    };
+    GError *error = NULL;
+    if (session_write(&session, &error) < 0) {
+        g_print("Cannot write the session: %s\n", error->message);
+        g_clear_error(&error);
+    }
+}
+
+/*
+ * Journals the restored document's unsaved changes. The journal kept for it
+ * at exit already holds them; without one the new journal's base is empty,
+ * never the file, so its first autosave records the whole text.
+ */
+static void resume_autosave(const char *journal) {
+    if (journal) {
+        autosave_free(doc_journal, TRUE);
+        PiecetableSnapshot recovered = piecetable_snapshot(doc_piecetable);
+        doc_journal = autosave_resume(journal, current_filename, recovered);
+        piecetable_snapshot_unref(recovered);
+        return;
+    }
+    Piecetable empty = piecetable_create("");
+    PiecetableSnapshot base = piecetable_snapshot(empty);
+    reset_autosave(base);
+    piecetable_snapshot_unref(base);
+    piecetable_free(empty);
+    note_autosave_edit();
+}
+
+// Puts the view back where the session left it, and the search bar as it was
+static void restore_session_view(Session session) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    GtkTextIter insert, bound;
+    if (large_file_active()) large_file_reveal(session->cursor);
+    doc_iter_at_offset(buffer, &insert, session->cursor);
+    doc_iter_at_offset(buffer, &bound, session->selection_bound);
+    gtk_text_buffer_select_range(buffer, &insert, &bound);
+    gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(text_view), gtk_text_buffer_get_insert(buffer), 0.1, FALSE, 0.0, 0.0);
+
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(search_regex_toggle), session->search_regex);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(search_case_toggle),
+                                 (session->search_flags & SEARCH_CASE_INSENSITIVE) != 0);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(search_word_toggle),
+                                 (session->search_flags & SEARCH_WHOLE_WORD) != 0);
+    if (session->search_text) {
+        // The search runs once the entry settles, and keeps the restored selection
+        search_from_selection = 1;
+        gtk_entry_set_text(GTK_ENTRY(search_entry), session->search_text);
+    }
+    if (session->search_shown) gtk_search_bar_set_search_mode(GTK_SEARCH_BAR(search_bar), TRUE);
+}
+
+/**
+ * Put back the document, undo history and view the editor had when it last
+ * exited. The session is used once: a crash from here on is for recovery.
+ */
+void init_session(GtkWindow *window) {
+    GError *error = NULL;
+    Session session = session_read(&error);
+    if (!session) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_print("Cannot restore the last session: %s\n", error->message);
+        g_clear_error(&error);
+        session_discard();
+        return;
+    }
+    session_discard();
+    // A file that changed since it was last seen unedited is opened as it is now
+    if (session->file_changed && !session->modified) {
+        open_file_in_editor(window, session->filename);
+        session_free(session);
+        return;
+    }
+
+    stop_file_load();
+    close_document();
+    current_filename = session->filename;
+    session->filename = NULL;
+    doc_encoding = session->encoding;
+    doc_line_ending = session->line_ending;
+    doc_compression = session->compression;
+    if (session->lines) {
+        // A large document is read where it lies, in its file or in the session
+        piecetable_free(doc_piecetable);
+        doc_piecetable = session->pt;
+        doc_mapping = session->original_mapping;
+        doc_mapping_is_session = !session->original_in_file;
+        large_file_open(doc_piecetable, session->lines);
+        session->pt = NULL;
+        session->original_mapping = NULL;
+        session->lines = NULL;
+    } else {
+        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+        char *text = piecetable_value(session->pt);
+        suspend_edit_tracking = 1;
+        gtk_text_buffer_set_text(buffer, text, session->pt->length);
+        suspend_edit_tracking = 0;
+        free(text);
+        update_piece_table_from_buffer();
+    }
+    undo_redo_stack_free(undo_stack);
+    undo_stack = session->undo;
+    session->undo = NULL;
+    set_bracket_language(GTK_TEXT_VIEW(text_view), current_filename);
+    set_highlight_language(GTK_TEXT_VIEW(text_view), current_filename);
+
+    doc_version++;
+    if (session->modified) {
+        resume_autosave(session->journal);
+    } else {
+        if (session->journal) autosave_discard(session->journal);
+        document_matches_file();
+    }
+    watch_document();
+    track_index_edit(0, 0, doc_piecetable->length);
+    track_search_edit(0, 0, doc_piecetable->length);
+    restore_session_view(session);
+    refresh_window_title();
+    session_free(session);
+}
+
+// --- Find in Files ---
+
+enum { FILES_COL_PATH, FILES_COL_LINE, FILES_COL_COLUMN, FILES_COL_TEXT, FILES_N_COLS };
+
+static FindInFiles files_job = NULL;
+static guint files_poll_source = 0;
+static GtkWidget *files_window = NULL;
+static GtkWidget *files_folder_button = NULL;
+static GtkWidget *files_entry = NULL;
+static GtkWidget *files_case_toggle = NULL;
+static GtkWidget *files_word_toggle = NULL;
+static GtkWidget *files_status_label = NULL;
+static GtkListStore *files_store = NULL;
+static GtkWindow *files_editor_window = NULL;
+
+static void stop_files_search(void) {
+    if (files_poll_source) {
+        g_source_remove(files_poll_source);
+        files_poll_source = 0;
+    }
+    if (files_job) {
+        find_in_files_free(files_job);
+        files_job = NULL;
+    }
+}
+
+static void update_files_status(int running) {
+    gint64 end = running ? g_get_monotonic_time() : files_job->finished;
+    double seconds = (end - files_job->started) / (double)G_USEC_PER_SEC;
+    int files = g_atomic_int_get(&files_job->files_scanned);
+    double bytes = g_atomic_pointer_get(&files_job->bytes_scanned);
+    double files_per_second = seconds > 0 ? files / seconds : 0;
+    double gb_per_second = seconds > 0 ? bytes / seconds / 1e9 : 0;
+
+    char status[256];
+    snprintf(status, sizeof(status), "%s%d matches in %d files, %d files scanned (%.0f files/s, %.2f GB/s)",
+             running ? "Searching... " : "", g_atomic_int_get(&files_job->matches_found),
+             g_atomic_int_get(&files_job->files_matched), files, files_per_second, gb_per_second);
+    gtk_label_set_text(GTK_LABEL(files_status_label), status);
+}
+
+// Moves the matches found since the last call into the results list
+static gboolean poll_files_search(gpointer data) {
+    GPtrArray *batch = g_ptr_array_new();
+    int running = find_in_files_poll(files_job, batch);
+    for (guint i = 0; i < batch->len; i++) {
+        FileMatch *match = g_ptr_array_index(batch, i);
+        gtk_list_store_insert_with_values(files_store, NULL, -1,
+                                          FILES_COL_PATH, match->path,
+                                          FILES_COL_LINE, match->line,
+                                          FILES_COL_COLUMN, match->column,
+                                          FILES_COL_TEXT, match->text, -1);
+        file_match_free(match);
+    }
+    g_ptr_array_free(batch, TRUE);
+
+    update_files_status(running);
+    if (running) return G_SOURCE_CONTINUE;
+    files_poll_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void on_files_search_clicked(GtkWidget *widget, gpointer data) {
+    const gchar *pattern = gtk_entry_get_text(GTK_ENTRY(files_entry));
+    char *folder = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(files_folder_button));
+    if (!folder || strlen(pattern) == 0) {
+        g_free(folder);
+        return;
+    }
+
+    stop_files_search();
+    gtk_list_store_clear(files_store);
+
+    int flags = 0;
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(files_case_toggle))) flags |= SEARCH_CASE_INSENSITIVE;
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(files_word_toggle))) flags |= SEARCH_WHOLE_WORD;
+    files_job = find_in_files_start(folder, pattern, flags);
+    files_poll_source = g_timeout_add(100, poll_files_search, NULL);
+    g_free(folder);
+}
+
+// Opens the file of the activated result with the cursor on the match
+static void on_files_row_activated(GtkTreeView *view, GtkTreePath *path, GtkTreeViewColumn *column,
+                                   gpointer data) {
+    GtkTreeIter row;
+    if (!gtk_tree_model_get_iter(GTK_TREE_MODEL(files_store), &row, path)) return;
+
+    char *file;
+    int line, line_index;
+    gtk_tree_model_get(GTK_TREE_MODEL(files_store), &row, FILES_COL_PATH, &file, FILES_COL_LINE, &line,
+                       FILES_COL_COLUMN, &line_index, -1);
+
+    if (!current_filename || strcmp(current_filename, file) != 0) {
+        if (!open_file_in_editor(files_editor_window, file)) {
+            g_free(file);
+            return;
+        }
+    }
+    g_free(file);
+
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+    GtkTextIter iter, end;
+    if (doc_load && !large_file_active()) {
+        // The piece table is filled only once the file is complete; the lines shown so far are in the buffer
+        gtk_text_buffer_get_iter_at_line(buffer, &iter, line - 1);
+        if (line_index < gtk_text_iter_get_bytes_in_line(&iter))
+            gtk_text_buffer_get_iter_at_line_index(buffer, &iter, line - 1, line_index);
+    } else {
+        // In large-file mode the buffer holds only a window, so the hit is found in the document's lines
+        LineIndex lines = large_file_active() ? large_file_lines() : doc_line_index();
+        int start = line_index_start(lines, line - 1);
+        int length = line_index_start(lines, line) - start;
+        doc_match_range(buffer, start + (line_index < length ? line_index : 0), 0, &iter, &end);
+    }
+    gtk_text_buffer_place_cursor(buffer, &iter);
+    gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(text_view), gtk_text_buffer_get_insert(buffer), 0.1, TRUE, 0.0, 0.3);
+    gtk_window_present(files_editor_window);
+}
+
+static void on_files_window_destroy(GtkWidget *widget, gpointer data) {
+    stop_files_search();
+    files_window = NULL;
+    files_store = NULL;
+}
+
+void show_find_in_files(GtkWidget *widget, gpointer window) {
+    files_editor_window = GTK_WINDOW(window);
+    if (files_window) {
+        gtk_window_present(GTK_WINDOW(files_window));
+        return;
+    }
+
+    files_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_title(GTK_WINDOW(files_window), "Find in Files");
+    gtk_window_set_transient_for(GTK_WINDOW(files_window), GTK_WINDOW(window));
+    gtk_window_set_default_size(GTK_WINDOW(files_window), 700, 450);
+    g_signal_connect(files_window, "destroy", G_CALLBACK(on_files_window_destroy), NULL);
+
+    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    GtkWidget *controls = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    files_folder_button = gtk_file_chooser_button_new("Folder", GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER);
+    if (current_filename) {
+        char *folder = g_path_get_dirname(current_filename);
+        gtk_file_chooser_set_filename(GTK_FILE_CHOOSER(files_folder_button), folder);
+        g_free(folder);
+    }
+    files_entry = gtk_entry_new();
+    files_case_toggle = gtk_toggle_button_new_with_label("Ignore case");
+    files_word_toggle = gtk_toggle_button_new_with_label("Whole word");
+    GtkWidget *search_button = gtk_button_new_with_label("Search");
+
+    gtk_box_pack_start(GTK_BOX(controls), files_folder_button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(controls), files_entry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(controls), files_case_toggle, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(controls), files_word_toggle, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(controls), search_button, FALSE, FALSE, 0);
+    g_signal_connect(search_button, "clicked", G_CALLBACK(on_files_search_clicked), NULL);
+    g_signal_connect(files_entry, "activate", G_CALLBACK(on_files_search_clicked), NULL);
+
+    // Results: one row per match
+    files_store = gtk_list_store_new(FILES_N_COLS, G_TYPE_STRING, G_TYPE_INT, G_TYPE_INT, G_TYPE_STRING);
+    GtkWidget *results_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(files_store));
+    g_object_unref(files_store);
+    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+    gtk_tree_view_append_column(GTK_TREE_VIEW(results_view),
+        gtk_tree_view_column_new_with_attributes("File", renderer, "text", FILES_COL_PATH, NULL));
+    gtk_tree_view_append_column(GTK_TREE_VIEW(results_view),
+        gtk_tree_view_column_new_with_attributes("Line", renderer, "text", FILES_COL_LINE, NULL));
+    gtk_tree_view_append_column(GTK_TREE_VIEW(results_view),
+        gtk_tree_view_column_new_with_attributes("Text", renderer, "text", FILES_COL_TEXT, NULL));
+    g_signal_connect(results_view, "row-activated", G_CALLBACK(on_files_row_activated), NULL);
+
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_container_add(GTK_CONTAINER(scrolled), results_view);
+    files_status_label = gtk_label_new("");
+    gtk_label_set_xalign(GTK_LABEL(files_status_label), 0.0);
+
+    gtk_box_pack_start(GTK_BOX(vbox), controls, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), scrolled, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), files_status_label, FALSE, FALSE, 0);
+    gtk_container_add(GTK_CONTAINER(files_window), vbox);
+    gtk_widget_show_all(files_window);
+}
+
 // --- Key Press Handler (Undo/Redo, Bracket Auto-close, Search) ---
 
 gboolean on_text_view_key_press(GtkWidget *widget, GdkEventKey *event, gpointer user_data) {
@@ -922,62 +2584,11 @@ gboolean on_text_view_key_press(GtkWidget *widget, GdkEventKey *event, gpointer
     }
 
     // Font size shortcuts (Ctrl+1 through Ctrl+9)
-    if ((event->state & GDK_CONTROL_MASK) && (event->keyval == GDK_KEY_1)) {
-        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widget));
-        apply_font_size_to_selection(buffer, 10);
-        return TRUE;
-    }
-
-    if ((event->state & GDK_CONTROL_MASK) && (event->keyval == GDK_KEY_2)) {
-        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widget));
-        apply_font_size_to_selection(buffer, 15);
-        return TRUE;
-    }
-
-    if ((event->state & GDK_CONTROL_MASK) && (event->keyval == GDK_KEY_3)) {
-        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widget));
-        apply_font_size_to_selection(buffer, 20);
-        return TRUE;
-    }
-
-    if ((event->state & GDK_CONTROL_MASK) && (event->keyval == GDK_KEY_4)) {
-        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widget));
-        apply_font_size_to_selection(buffer, 30);
-        return TRUE;
-    }
-
-    if ((event->state & GDK_CONTROL_MASK) && (event->keyval == GDK_KEY_5)) {
-        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widget));
-        apply_font_size_to_selection(buffer, 40);
-        return TRUE;
-    }
-
-    if ((event->state & GDK_CONTROL_MASK) && (event->keyval == GDK_KEY_6)) {
-        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widget));
-        apply_font_size_to_selection(buffer, 50);
+    if ((event->state & GDK_CONTROL_MASK) && event->keyval >= GDK_KEY_1 && event->keyval <= GDK_KEY_9) {
+        static const int shortcut_sizes[] = {10, 15, 20, 30, 40, 50, 60, 70, 80};
+        apply_font_size_to_selection(shortcut_sizes[event->keyval - GDK_KEY_1]);
         return TRUE;
     }
 
-// Ctrl+7 → font size 60
-if ((event->state & GDK_CONTROL_MASK) && (event->keyval == GDK_KEY_7)) {
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widget));
-    apply_font_size_to_selection(buffer, 30);
-    return TRUE;
-}
-// Ctrl+8 → font size 70
-if ((event->state & GDK_CONTROL_MASK) && (event->keyval == GDK_KEY_8)) {
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widget));
-    apply_font_size_to_selection(buffer, 30);
-    return TRUE;
-}
-// Ctrl+9 → font size 80
-if ((event->state & GDK_CONTROL_MASK) && (event->keyval == GDK_KEY_9)) {
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(widget));
-    apply_font_size_to_selection(buffer, 80);
-    return TRUE;
-}
-
-
-
     return FALSE; // Let normal keys pass through
 }
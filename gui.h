@@ -4,32 +4,50 @@
 #include <gtk/gtk.h>
 #include "piecetable.h"
 #include "undo_redo.h"
+#include "style_spans.h"
 #include "search.h"
 extern GtkWidget *text_view;
 extern Piecetable doc_piecetable;
+extern StyleSpans doc_styles;
 extern UndoRedoStack *undo_stack;
 extern GtkWidget *search_bar;
 extern GtkWidget *search_entry;
 extern GtkWidget *replace_entry;
+extern GtkWidget *search_count_label;
+extern GtkWidget *search_regex_toggle;
+extern GtkWidget *search_case_toggle;
+extern GtkWidget *search_word_toggle;
 
 gboolean on_text_view_key_press(GtkWidget *widget, GdkEventKey *event, gpointer user_data);
 void show_search_bar(GtkWidget *widget, gpointer data);
+void show_goto_offset(GtkWidget *widget, gpointer window);
 void on_search_text_changed(GtkEntry *entry, gpointer user_data);
+void on_search_mode_toggled(GtkToggleButton *button, gpointer user_data);
 void on_next_match(GtkWidget *widget, gpointer data);
 void on_previous_match(GtkWidget *widget, gpointer data);
 void on_replace_clicked(GtkWidget *widget, gpointer user_data);
 void on_replace_all_clicked(GtkWidget *widget, gpointer user_data);
+void show_find_in_files(GtkWidget *widget, gpointer window);
 
 void update_piece_table_from_buffer(void);
 void on_buffer_changed(GtkTextBuffer *buffer, gpointer user_data);
 void on_new(GtkWidget *widget, gpointer data);
+gboolean open_file_in_editor(GtkWindow *window, const char *filename);
+GtkWidget *init_load_bar(void);
+GtkWidget *init_status_bar(void);
 void on_open(GtkWidget *widget, gpointer window);
 void on_save(GtkWidget *widget, gpointer window);
+void finish_pending_save(void);
+void init_autosave(GtkWindow *window);
+void finish_autosave(void);
+void init_session(GtkWindow *window);
+void finish_session(void);
 void on_quit(GtkWidget *widget, gpointer data);
 void on_search_bar_close(GtkSearchBar *search_bar, gpointer user_data);
 // Zoom operations
 void on_zoom_in(GtkWidget *widget, gpointer data);
 void on_zoom_out(GtkWidget *widget, gpointer data);
+void on_follow_toggled(GtkCheckMenuItem *item, gpointer data);
 void initialize_textview_font_size(void);
 
 // Edit operations
@@ -38,6 +56,9 @@ void on_redo(GtkWidget *widget, gpointer data);
 
 // Text buffer callbacks
 void on_buffer_changed(GtkTextBuffer *buffer, gpointer user_data);
+void on_buffer_insert_text(GtkTextBuffer *buffer, GtkTextIter *location, gchar *text, gint len, gpointer user_data);
+void on_buffer_delete_range_before(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, gpointer user_data);
+void on_buffer_delete_range(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, gpointer user_data);
 void on_begin_user_action(GtkTextBuffer *buffer, gpointer user_data);
 void on_end_user_action(GtkTextBuffer *buffer, gpointer user_data);
 
@@ -52,7 +73,6 @@ void setup_parenthesis_matching(GtkWidget *text_view, GtkTextBuffer *buffer);
 void on_mark_set(GtkTextBuffer *buffer, GtkTextIter *location, GtkTextMark *mark, gpointer data);
 void find_matching_opening_bracket(GtkTextBuffer *buffer, GtkTextIter *close_pos, char close_char);
 void find_matching_closing_bracket(GtkTextBuffer *buffer, GtkTextIter *open_pos, char open_char);
-void apply_font_size_to_selection(GtkTextBuffer *buffer, int font_size);
 
 //adding fonts
 void initialize_font_system(void);
@@ -81,9 +101,9 @@ void on_font_size_36(GtkWidget *widget, gpointer data);
 // Add these declarations to your gui.h file
 
 // Individual text formatting functions
-void apply_formatting_to_selection(const char *tag_name, const char *property, const char *value);
+void apply_formatting_to_selection(const char *property, const char *value);
 void apply_font_family_to_selection(const char *family);
-void apply_font_size_to_selection_new(int size);
+void apply_font_size_to_selection(int size);
 void apply_bold_to_selection(void);
 void apply_italic_to_selection(void);
 void apply_color_to_selection(const char *color);
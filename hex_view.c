@@ -0,0 +1,386 @@
+#include <gtk/gtk.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "hex_view.h"
+#include "compression.h"
+#include "encoding.h"
+#include "search.h"
+
+/*
+ * A binary file is shown read-only as rows of HEX_VIEW_ROW_BYTES bytes: the
+ * offset of the row, its bytes in hex and the same bytes as ASCII. Row n
+ * always starts at byte n * HEX_VIEW_ROW_BYTES, so the view needs no index of
+ * the file. The file is mapped, the scrollbar counts rows, and a redraw
+ * formats only the rows in sight straight from the mapping, so opening and
+ * scrolling cost the same for any size of file and only the pages shown or
+ * searched are ever read. Searches run the KMP kernel through piece tables
+ * over windows of the mapping, which keeps their offsets within an int.
+ */
+
+#define OFFSET_MIN_DIGITS 8
+#define OFFSET_MAX_DIGITS 16
+#define ROW_MAX_CHARS (OFFSET_MAX_DIGITS + 2 + 50 + HEX_VIEW_ROW_BYTES)
+#define SCROLL_ROWS 3                            // Rows a step of the mouse wheel scrolls
+#define SEARCH_WINDOW_BYTES (64 * 1024 * 1024)   // Bytes searched through one piece table
+
+static GtkWidget *text_area = NULL;
+static GtkWidget *hex_box = NULL;
+static GtkWidget *drawing = NULL;
+static GtkAdjustment *row_adjustment = NULL;  // Rows; the value is the top visible row
+static PangoFontDescription *font = NULL;
+static int char_width = 1;
+static int row_height = 1;
+
+static GMappedFile *mapping = NULL;  // Set while a file is shown
+static const unsigned char *data = NULL;
+static gint64 size = 0;
+static int offset_digits = OFFSET_MIN_DIGITS;
+static gint64 cursor = 0;            // Byte at the cursor
+static int mark_length = 0;          // Bytes from the cursor highlighted as a match
+static void (*cursor_moved)(void) = NULL;
+
+static gint64 row_count(void) {
+    return (size + HEX_VIEW_ROW_BYTES - 1) / HEX_VIEW_ROW_BYTES;
+}
+
+static gint64 top_row(void) {
+    return (gint64)gtk_adjustment_get_value(row_adjustment);
+}
+
+// Columns of a byte of the row in hex, with a gap after the first half, and as ASCII
+static int hex_column(int i) {
+    return offset_digits + 2 + i * 3 + (i >= HEX_VIEW_ROW_BYTES / 2);
+}
+
+static int ascii_column(int i) {
+    return hex_column(HEX_VIEW_ROW_BYTES - 1) + 4 + i;
+}
+
+// Writes row into out, padded for a short last row; returns its length
+static int format_row(char *out, gint64 row) {
+    static const char digits[] = "0123456789abcdef";
+    int length = ascii_column(HEX_VIEW_ROW_BYTES);
+    memset(out, ' ', length);
+    gint64 start = row * HEX_VIEW_ROW_BYTES;
+    for (int d = offset_digits - 1; d >= 0; d--) out[offset_digits - 1 - d] = digits[(start >> (d * 4)) & 15];
+    int count = MIN(HEX_VIEW_ROW_BYTES, size - start);
+    for (int i = 0; i < count; i++) {
+        unsigned char c = data[start + i];
+        out[hex_column(i)] = digits[c >> 4];
+        out[hex_column(i) + 1] = digits[c & 15];
+        out[ascii_column(i)] = c >= 0x20 && c < 0x7F ? c : '.';
+    }
+    return length;
+}
+
+static void mark_range(PangoAttrList *attrs, int start, int end, gboolean match) {
+    PangoAttribute *attr = match ? pango_attr_background_new(0xFFFF, 0xE0E0, 0x6060)
+                                 : pango_attr_background_new(0xC0C0, 0xD8D8, 0xFFFF);
+    attr->start_index = start;
+    attr->end_index = end;
+    pango_attr_list_insert(attrs, attr);
+}
+
+// Highlights the bytes of row, which starts at at in the layout, under the cursor or the match
+static void mark_row(PangoAttrList *attrs, int at, gint64 row) {
+    gint64 start = row * HEX_VIEW_ROW_BYTES;
+    gint64 from = MAX(cursor, start);
+    gint64 to = MIN(cursor + MAX(mark_length, 1), start + HEX_VIEW_ROW_BYTES);
+    for (gint64 byte = from; byte < to; byte++) {
+        int i = byte - start;
+        mark_range(attrs, at + hex_column(i), at + hex_column(i) + 2, mark_length > 0);
+        mark_range(attrs, at + ascii_column(i), at + ascii_column(i) + 1, mark_length > 0);
+    }
+}
+
+static gboolean on_draw(GtkWidget *widget, cairo_t *cr, gpointer user_data) {
+    GtkStyleContext *style = gtk_widget_get_style_context(widget);
+    int height = gtk_widget_get_allocated_height(widget);
+    gtk_render_background(style, cr, 0, 0, gtk_widget_get_allocated_width(widget), height);
+    if (!mapping) return FALSE;
+
+    gint64 top = top_row();
+    gint64 end = MIN(row_count(), top + height / row_height + 1);
+    GString *text = g_string_sized_new((end - top) * (ROW_MAX_CHARS + 1));
+    PangoAttrList *attrs = pango_attr_list_new();
+    char row[ROW_MAX_CHARS];
+    for (gint64 r = top; r < end; r++) {
+        int at = text->len;
+        g_string_append_len(text, row, format_row(row, r));
+        g_string_append_c(text, '\n');
+        mark_row(attrs, at, r);
+    }
+    PangoLayout *layout = gtk_widget_create_pango_layout(widget, text->str);
+    pango_layout_set_font_description(layout, font);
+    pango_layout_set_attributes(layout, attrs);
+    gtk_render_layout(style, cr, 0, 0, layout);
+    g_object_unref(layout);
+    pango_attr_list_unref(attrs);
+    g_string_free(text, TRUE);
+    return FALSE;
+}
+
+// Rows fill the height of the view; the scrollbar pages by them
+static void update_rows(void) {
+    PangoLayout *layout = gtk_widget_create_pango_layout(drawing, "0");
+    pango_layout_set_font_description(layout, font);
+    pango_layout_get_pixel_size(layout, &char_width, &row_height);
+    g_object_unref(layout);
+    char_width = MAX(1, char_width);
+    row_height = MAX(1, row_height);
+
+    double page = MAX(1, gtk_widget_get_allocated_height(drawing) / row_height);
+    gtk_adjustment_configure(row_adjustment, gtk_adjustment_get_value(row_adjustment), 0, row_count(), 1,
+                             MAX(1, page - 1), page);
+}
+
+static void on_size_allocate(GtkWidget *widget, GdkRectangle *allocation, gpointer user_data) {
+    update_rows();
+}
+
+static void on_rows_scrolled(GtkAdjustment *adjustment, gpointer user_data) {
+    gtk_widget_queue_draw(drawing);
+}
+
+// Scrolls so the row of offset is in view, in the middle if it was not
+static void reveal(gint64 offset) {
+    gint64 row = offset / HEX_VIEW_ROW_BYTES;
+    gint64 top = top_row();
+    gint64 page = (gint64)gtk_adjustment_get_page_size(row_adjustment);
+    if (row < top || row >= top + page) gtk_adjustment_set_value(row_adjustment, MAX(0, row - page / 2));
+}
+
+static gboolean on_scroll(GtkWidget *widget, GdkEventScroll *event, gpointer user_data) {
+    double delta;
+    if (event->direction == GDK_SCROLL_UP) delta = -SCROLL_ROWS;
+    else if (event->direction == GDK_SCROLL_DOWN) delta = SCROLL_ROWS;
+    else if (event->direction == GDK_SCROLL_SMOOTH) delta = event->delta_y * SCROLL_ROWS;
+    else return FALSE;
+    gtk_adjustment_set_value(row_adjustment, gtk_adjustment_get_value(row_adjustment) + delta);
+    return TRUE;
+}
+
+// The byte of the row at y, in the hex or the ASCII column at x
+static gint64 byte_at(double x, double y) {
+    gint64 row = top_row() + (gint64)(y / row_height);
+    int column = x / char_width;
+    int i;
+    if (column >= ascii_column(0)) i = column - ascii_column(0);
+    else if (column >= hex_column(HEX_VIEW_ROW_BYTES / 2))
+        i = HEX_VIEW_ROW_BYTES / 2 + (column - hex_column(HEX_VIEW_ROW_BYTES / 2)) / 3;
+    else i = column < hex_column(0) ? 0 : (column - hex_column(0)) / 3;
+    return row * HEX_VIEW_ROW_BYTES + CLAMP(i, 0, HEX_VIEW_ROW_BYTES - 1);
+}
+
+static gboolean on_button_press(GtkWidget *widget, GdkEventButton *event, gpointer user_data) {
+    gtk_widget_grab_focus(widget);
+    if (event->button == GDK_BUTTON_PRIMARY) hex_view_goto(byte_at(event->x, event->y));
+    return TRUE;
+}
+
+static gboolean on_key_press(GtkWidget *widget, GdkEventKey *event, gpointer user_data) {
+    gint64 page = (gint64)MAX(1, gtk_adjustment_get_page_size(row_adjustment)) * HEX_VIEW_ROW_BYTES;
+    gint64 row_start = cursor - cursor % HEX_VIEW_ROW_BYTES;
+    int ctrl = (event->state & GDK_CONTROL_MASK) != 0;
+    gint64 to;
+    switch (event->keyval) {
+    case GDK_KEY_Left: to = cursor - 1; break;
+    case GDK_KEY_Right: to = cursor + 1; break;
+    case GDK_KEY_Up: to = cursor - HEX_VIEW_ROW_BYTES; break;
+    case GDK_KEY_Down: to = cursor + HEX_VIEW_ROW_BYTES; break;
+    case GDK_KEY_Page_Up: to = cursor - page; break;
+    case GDK_KEY_Page_Down: to = cursor + page; break;
+    case GDK_KEY_Home: to = ctrl ? 0 : row_start; break;
+    case GDK_KEY_End: to = ctrl ? size - 1 : row_start + HEX_VIEW_ROW_BYTES - 1; break;
+    default: return FALSE;
+    }
+    hex_view_goto(to);
+    return TRUE;
+}
+
+GtkWidget *init_hex_view(GtkWidget *text_view_area) {
+    text_area = text_view_area;
+    font = pango_font_description_from_string("Monospace");
+    row_adjustment = gtk_adjustment_new(0, 0, 1, 1, 1, 1);
+    g_signal_connect(row_adjustment, "value-changed", G_CALLBACK(on_rows_scrolled), NULL);
+
+    drawing = gtk_drawing_area_new();
+    gtk_widget_set_name(drawing, "hex_view");
+    gtk_widget_set_can_focus(drawing, TRUE);
+    gtk_widget_add_events(drawing, GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK | GDK_BUTTON_PRESS_MASK |
+                                   GDK_KEY_PRESS_MASK);
+    g_signal_connect(drawing, "draw", G_CALLBACK(on_draw), NULL);
+    g_signal_connect(drawing, "size-allocate", G_CALLBACK(on_size_allocate), NULL);
+    g_signal_connect(drawing, "scroll-event", G_CALLBACK(on_scroll), NULL);
+    g_signal_connect(drawing, "button-press-event", G_CALLBACK(on_button_press), NULL);
+    g_signal_connect(drawing, "key-press-event", G_CALLBACK(on_key_press), NULL);
+
+    hex_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    GtkWidget *scrollbar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, row_adjustment);
+    gtk_box_pack_start(GTK_BOX(hex_box), drawing, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hex_box), scrollbar, FALSE, FALSE, 0);
+    gtk_widget_show(drawing);
+    gtk_widget_show(scrollbar);
+    gtk_widget_set_no_show_all(hex_box, TRUE);
+    return hex_box;
+}
+
+gboolean hex_view_detect(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return FALSE;
+    char *head = g_malloc(ENCODING_SNIFF_BYTES);
+    ssize_t length = read(fd, head, ENCODING_SNIFF_BYTES);
+    close(fd);
+    gboolean binary = length > 0 && compression_detect(head, length).codec == COMPRESSION_NONE &&
+                      encoding_looks_binary(head, length);
+    g_free(head);
+    return binary;
+}
+
+gboolean hex_view_open(const char *filename, GError **error) {
+    GMappedFile *file = g_mapped_file_new(filename, FALSE, error);
+    if (!file) return FALSE;
+    hex_view_close();
+    mapping = file;
+    data = (const unsigned char *)g_mapped_file_get_contents(mapping);
+    size = g_mapped_file_get_length(mapping);
+    offset_digits = OFFSET_MIN_DIGITS;
+    while (offset_digits < OFFSET_MAX_DIGITS && ((size - 1) >> (offset_digits * 4)) > 0) offset_digits++;
+    cursor = 0;
+    mark_length = 0;
+
+    update_rows();
+    gtk_adjustment_set_value(row_adjustment, 0);
+    gtk_widget_hide(text_area);
+    gtk_widget_show(hex_box);
+    gtk_widget_grab_focus(drawing);
+    gtk_widget_queue_draw(drawing);
+    return TRUE;
+}
+
+void hex_view_close(void) {
+    if (!mapping) return;
+    g_mapped_file_unref(mapping);
+    mapping = NULL;
+    data = NULL;
+    size = 0;
+    cursor = 0;
+    mark_length = 0;
+    gtk_widget_hide(hex_box);
+    gtk_widget_show(text_area);
+}
+
+int hex_view_active(void) {
+    return mapping != NULL;
+}
+
+gint64 hex_view_size(void) {
+    return size;
+}
+
+gint64 hex_view_cursor(void) {
+    return cursor;
+}
+
+void hex_view_goto(gint64 offset) {
+    if (!mapping) return;
+    cursor = CLAMP(offset, 0, MAX(0, size - 1));
+    mark_length = 0;
+    reveal(cursor);
+    gtk_widget_queue_draw(drawing);
+    if (cursor_moved) cursor_moved();
+}
+
+void hex_view_on_cursor_moved(void (*moved)(void)) {
+    cursor_moved = moved;
+}
+
+// --- Search ---
+
+/*
+ * A match in [from, to) of the file: the first, or with limit >= 0 the last
+ * starting before limit. The piece table reads the mapping in place.
+ */
+static gint64 find_in_window(Kmp kmp, gint64 from, gint64 to, gint64 limit) {
+    Piecetable window = piecetable_create_view((const char *)data + from, to - from);
+    PiecetableCursor position;
+    piecetable_cursor_init(window, &position);
+    gint64 found = -1;
+    for (int at = kmp_find(kmp, window, &position, 0, to - from); at >= 0 && (limit < 0 || from + at < limit);
+         at = kmp_find(kmp, window, &position, at + 1, to - from)) {
+        found = from + at;
+        if (limit < 0) break;
+    }
+    piecetable_free(window);
+    return found;
+}
+
+// Windows overlap by a match less a byte, so every match lies inside one of them
+static gint64 find_forward(Kmp kmp, gint64 from, gint64 to) {
+    while (to - from >= kmp->length) {
+        gint64 end = MIN(to, from + SEARCH_WINDOW_BYTES);
+        gint64 found = find_in_window(kmp, from, end, -1);
+        if (found >= 0 || end == to) return found;
+        from = end - (kmp->span - 1);
+    }
+    return -1;
+}
+
+static gint64 find_backward(Kmp kmp, gint64 from, gint64 to, gint64 limit) {
+    while (to - from >= kmp->length) {
+        gint64 start = MAX(from, to - SEARCH_WINDOW_BYTES);
+        gint64 found = find_in_window(kmp, start, to, limit);
+        if (found >= 0 || start == from) return found;
+        to = start + (kmp->span - 1);
+    }
+    return -1;
+}
+
+gint64 hex_view_find(const char *pattern, int length, int flags, int direction) {
+    if (!mapping || length <= 0) return -1;
+    Kmp kmp = kmp_create(pattern, length, flags);
+    gint64 found;
+    if (direction >= 0) {
+        gint64 from = MIN(size, cursor + (direction > 0));
+        found = find_forward(kmp, from, size);
+        if (found < 0) found = find_forward(kmp, 0, MIN(size, from + kmp->span - 1));
+    } else {
+        found = find_backward(kmp, 0, MIN(size, cursor + kmp->span - 1), cursor);
+        if (found < 0) found = find_backward(kmp, 0, size, size);
+    }
+    kmp_free(kmp);
+    if (found < 0) return -1;
+
+    cursor = found;
+    mark_length = length;
+    reveal(cursor);
+    gtk_widget_queue_draw(drawing);
+    if (cursor_moved) cursor_moved();
+    return found;
+}
+
+char *hex_view_parse_bytes(const char *text, int *length) {
+    char *bytes = g_malloc(strlen(text) / 2 + 1);
+    int count = 0, high = -1;
+    for (const char *p = text; *p; p++) {
+        if (g_ascii_isspace(*p) && high < 0) continue;
+        int digit = g_ascii_xdigit_value(*p);
+        if (digit < 0) {
+            count = 0;
+            break;
+        }
+        if (high < 0) {
+            high = digit;
+        } else {
+            bytes[count++] = high << 4 | digit;
+            high = -1;
+        }
+    }
+    if (count == 0 || high >= 0) {
+        g_free(bytes);
+        return NULL;
+    }
+    *length = count;
+    return bytes;
+}
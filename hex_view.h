@@ -0,0 +1,56 @@
+#ifndef HEX_VIEW_H
+#define HEX_VIEW_H
+
+#include <gtk/gtk.h>
+
+#define HEX_VIEW_ROW_BYTES 16  // Bytes shown per row
+
+/**
+ * Set up the hex view; returns it to pack beside text_area, the text view it
+ * stands in for while a binary file is shown
+ */
+GtkWidget *init_hex_view(GtkWidget *text_area);
+
+/**
+ * Tell whether filename looks binary from its first bytes; a compressed file
+ * is taken for the text inside it
+ */
+gboolean hex_view_detect(const char *filename);
+
+/**
+ * Map filename and show it read-only in place of the text view; returns FALSE
+ * with error set if it cannot be mapped
+ */
+gboolean hex_view_open(const char *filename, GError **error);
+
+/**
+ * Unmap the file and show the text view again
+ */
+void hex_view_close(void);
+
+int hex_view_active(void);
+gint64 hex_view_size(void);
+gint64 hex_view_cursor(void);
+void hex_view_goto(gint64 offset);
+
+/**
+ * Have moved called whenever the cursor moves, by a click, a key, a go-to or
+ * a find
+ */
+void hex_view_on_cursor_moved(void (*moved)(void));
+
+/**
+ * Find length bytes of pattern from the cursor, after it if direction is 1,
+ * before it if -1, or at it or after if 0, wrapping around the file; a match
+ * found becomes the cursor. Returns its offset, or -1 if there is none.
+ */
+gint64 hex_view_find(const char *pattern, int length, int flags, int direction);
+
+/**
+ * Read text as bytes written in hex, pairs of digits with or without spaces
+ * between them; returns them with their count in length, or NULL if text is
+ * not written that way
+ */
+char *hex_view_parse_bytes(const char *text, int *length);
+
+#endif /* HEX_VIEW_H */
@@ -0,0 +1,285 @@
+#include <gtk/gtk.h>
+#include <string.h>
+#include "highlight.h"
+#include "lexer.h"
+
+/*
+ * Highlighting keeps the lexer state at the start of every line. Lines
+ * [0, tagged) carry current tags; the lines around the viewport may be tagged
+ * ahead of that frontier (the island), after their start state is found by a
+ * tag-free pass over the lines above. An idle callback moves the frontier on a
+ * few milliseconds at a time. An edit re-highlights from its line until a line
+ * ends in the state the next one already starts with, and at most
+ * HIGHLIGHT_EDIT_LINES lines, so typing costs the same in any size of file;
+ * what is left is redone in idle time.
+ */
+
+#define HIGHLIGHT_SLICE_US 5000     // Idle time spent per slice on lines outside the viewport
+#define HIGHLIGHT_EDIT_LINES 500    // Lines re-highlighted during an edit before the rest is left to idle time
+#define HIGHLIGHT_MARGIN_LINES 50   // Lines highlighted with the viewport above and below it
+
+static const char *const style_tags[LEX_STYLES] = {
+    [LEX_STYLE_KEYWORD] = "syntax_keyword", [LEX_STYLE_TYPE] = "syntax_type",
+    [LEX_STYLE_CONSTANT] = "syntax_constant", [LEX_STYLE_NUMBER] = "syntax_number",
+    [LEX_STYLE_STRING] = "syntax_string", [LEX_STYLE_KEY] = "syntax_key",
+    [LEX_STYLE_COMMENT] = "syntax_comment", [LEX_STYLE_PREPROCESSOR] = "syntax_preprocessor",
+};
+
+static const char *const style_colors[LEX_STYLES] = {
+    [LEX_STYLE_KEYWORD] = "#569CD6", [LEX_STYLE_TYPE] = "#4EC9B0", [LEX_STYLE_CONSTANT] = "#569CD6",
+    [LEX_STYLE_NUMBER] = "#B5CEA8", [LEX_STYLE_STRING] = "#CE9178", [LEX_STYLE_KEY] = "#9CDCFE",
+    [LEX_STYLE_COMMENT] = "#6A9955", [LEX_STYLE_PREPROCESSOR] = "#C586C0",
+};
+
+static GtkTextView *highlight_view = NULL;
+static GtkTextTag *style_tag[LEX_STYLES];
+static Lexer lexer = NULL;
+static int tagged = 0;            // Lines [0, tagged) carry current tags
+static int known = 1;             // Lines [0, known) have a known start state
+static int island_first = 0;      // Lines [island_first, island_end) are tagged ahead of the frontier
+static int island_end = 0;
+static int deleted_from_line = 0; // First line to re-highlight once a deletion is done
+static guint viewport_source = 0;   // Highlights the viewport before the next frame
+static guint highlight_source = 0;  // Moves the frontier on when nothing else is pending
+
+// Walks forward through a line as its tokens are tagged, so a long line is crossed once
+typedef struct {
+    GtkTextBuffer *buffer;
+    const gchar *text;
+    GtkTextIter iter;
+    int iter_byte;
+} LineTags;
+
+static void apply_token(int start, int end, LexStyle style, void *data) {
+    LineTags *line = data;
+    gtk_text_iter_forward_chars(&line->iter, g_utf8_strlen(line->text + line->iter_byte, start - line->iter_byte));
+    GtkTextIter from = line->iter;
+    gtk_text_iter_forward_chars(&line->iter, g_utf8_strlen(line->text + start, end - start));
+    line->iter_byte = end;
+    gtk_text_buffer_apply_tag(line->buffer, style_tag[style], &from, &line->iter);
+}
+
+/**
+ * Retag one line from its recorded start state; returns 1 if the next line's start state changed
+ */
+static int highlight_line(GtkTextBuffer *buffer, int line) {
+    GtkTextIter start, end;
+    gtk_text_buffer_get_iter_at_line(buffer, &start, line);
+    end = start;
+    gtk_text_iter_forward_line(&end);
+
+    for (int s = 1; s < LEX_STYLES; s++) gtk_text_buffer_remove_tag(buffer, style_tag[s], &start, &end);
+    gchar *text = gtk_text_buffer_get_slice(buffer, &start, &end, TRUE);
+    LineTags tags = {buffer, text, start, 0};
+    int changed = lexer_scan_line_tokens(lexer, line, text, strlen(text), apply_token, &tags);
+    g_free(text);
+    return changed;
+}
+
+/**
+ * Retag from line until the lines through last_line are done and the lexer
+ * state converges, or limit lines are done. Returns the first line not retagged.
+ */
+static int retag_lines(GtkTextBuffer *buffer, int line, int last_line, int limit, int *converged) {
+    int lines = gtk_text_buffer_get_line_count(buffer);
+    for (int done = 0;; done++, line++) {
+        if (done == limit) {
+            *converged = 0;
+            return line;
+        }
+        int changed = highlight_line(buffer, line);
+        // Past the known states there is nothing an edit could have left stale
+        if (line + 1 >= lines || (line >= last_line && (!changed || line + 1 >= known))) {
+            if (known < MIN(lines, line + 2)) known = MIN(lines, line + 2);
+            *converged = 1;
+            return line + 1;
+        }
+    }
+}
+
+/**
+ * Find the start state of line without tagging the lines above it
+ */
+static void lex_states_to(GtkTextBuffer *buffer, int line) {
+    GtkTextIter start, end;
+    gtk_text_buffer_get_iter_at_line(buffer, &start, known - 1);
+    gtk_text_buffer_get_iter_at_line(buffer, &end, line);
+    gchar *text = gtk_text_buffer_get_slice(buffer, &start, &end, TRUE);
+    lexer_scan_lines(lexer, known - 1, text, strlen(text), 0, NULL, NULL);
+    g_free(text);
+    known = line + 1;
+}
+
+/**
+ * Tag the lines around the viewport that the frontier or the island do not cover yet
+ */
+static void highlight_viewport(GtkTextBuffer *buffer) {
+    GdkRectangle visible;
+    GtkTextIter top, bottom;
+    gtk_text_view_get_visible_rect(highlight_view, &visible);
+    gtk_text_view_get_line_at_y(highlight_view, &top, visible.y, NULL);
+    gtk_text_view_get_line_at_y(highlight_view, &bottom, visible.y + visible.height, NULL);
+
+    int lines = gtk_text_buffer_get_line_count(buffer);
+    int first = MAX(0, gtk_text_iter_get_line(&top) - HIGHLIGHT_MARGIN_LINES);
+    int end = MIN(lines, gtk_text_iter_get_line(&bottom) + 1 + HIGHLIGHT_MARGIN_LINES);
+    if (end <= tagged || (island_first <= first && end <= island_end)) return;
+
+    if (first <= tagged) {
+        while (tagged < end) highlight_line(buffer, tagged++);
+    } else {
+        if (island_first < island_end && island_first <= first && first <= island_end) {
+            first = island_end; // Grow the island down
+        } else {
+            island_first = first;
+        }
+        if (known <= first) lex_states_to(buffer, first);
+        for (int line = first; line < end; line++) highlight_line(buffer, line);
+        island_end = end;
+    }
+    if (known < MIN(lines, end + 1)) known = MIN(lines, end + 1);
+}
+
+static gboolean viewport_idle(gpointer data) {
+    viewport_source = 0;
+    highlight_viewport(gtk_text_view_get_buffer(highlight_view));
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean highlight_idle(gpointer data) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(highlight_view);
+    int lines = gtk_text_buffer_get_line_count(buffer);
+
+    gint64 deadline = g_get_monotonic_time() + HIGHLIGHT_SLICE_US;
+    while (tagged < lines && g_get_monotonic_time() < deadline) {
+        if (island_first < island_end && tagged >= island_first) {
+            tagged = MAX(tagged, island_end);
+            island_first = island_end = 0;
+            continue;
+        }
+        int stop = MIN(lines, tagged + 64);
+        if (island_first < island_end && stop > island_first) stop = island_first;
+        while (tagged < stop) highlight_line(buffer, tagged++);
+        if (known < MIN(lines, tagged + 1)) known = MIN(lines, tagged + 1);
+    }
+    if (tagged < lines) return G_SOURCE_CONTINUE;
+
+    highlight_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// The viewport pass runs ahead of redraws; the frontier yields to them and to input
+static void schedule_highlight(void) {
+    if (!highlight_view) return;
+    if (!viewport_source) viewport_source = g_idle_add_full(G_PRIORITY_HIGH_IDLE, viewport_idle, NULL, NULL);
+    if (!highlight_source) highlight_source = g_idle_add(highlight_idle, NULL);
+}
+
+/**
+ * Forget all tags and states; the idle callback highlights the buffer again
+ */
+static void restart_highlighting(GtkTextBuffer *buffer) {
+    int lines = gtk_text_buffer_get_line_count(buffer);
+    lexer_remove_lines(lexer, 0, lexer->lines - 1);
+    lexer_insert_lines(lexer, 0, lines - 1);
+    tagged = 0;
+    known = 1;
+    island_first = island_end = 0;
+    schedule_highlight();
+}
+
+static void shift_line(int *value, int line, int delta) {
+    if (*value > line) *value = MAX(line + 1, *value + delta);
+}
+
+/**
+ * Follow an edit from line to last_line, once it is in the buffer
+ */
+static void highlight_edit(GtkTextBuffer *buffer, int line, int last_line) {
+    int delta = gtk_text_buffer_get_line_count(buffer) - lexer->lines;
+    if (delta > 0) lexer_insert_lines(lexer, line, delta);
+    else lexer_remove_lines(lexer, line, -delta);
+
+    int in_frontier = line < tagged;
+    int in_island = island_first <= line && line < island_end;
+    shift_line(&tagged, line, delta);
+    shift_line(&known, line, delta);
+    shift_line(&island_first, line, delta);
+    shift_line(&island_end, line, delta);
+
+    if (!in_frontier && !in_island) {
+        // Untagged anyway; only states below the edit may be stale
+        if (known > line + 1) known = line + 1;
+        if (line < island_first) island_first = island_end = 0;
+        schedule_highlight();
+        return;
+    }
+
+    int converged;
+    int stop = retag_lines(buffer, line, last_line, HIGHLIGHT_EDIT_LINES, &converged);
+    if (converged) {
+        if (in_frontier && tagged < stop) tagged = stop;
+        if (in_island && island_end < stop) island_end = stop;
+    } else {
+        // States below stop are stale; idle time redoes them, viewport first
+        known = stop + 1;
+        if (in_frontier) tagged = stop;
+        if (island_end > stop) island_end = MAX(island_first, stop);
+        if (island_first >= island_end) island_first = island_end = 0;
+    }
+    schedule_highlight();
+}
+
+static int line_before(GtkTextBuffer *buffer, int offset) {
+    GtkTextIter iter;
+    gtk_text_buffer_get_iter_at_offset(buffer, &iter, MAX(0, offset - 1));
+    return gtk_text_iter_get_line(&iter);
+}
+
+static void on_highlight_insert_text(GtkTextBuffer *buffer, GtkTextIter *location, gchar *text, gint len,
+                                     gpointer data) {
+    int at = gtk_text_iter_get_offset(location) - g_utf8_strlen(text, len);
+    highlight_edit(buffer, line_before(buffer, at), gtk_text_iter_get_line(location));
+}
+
+static void on_highlight_delete_range(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, gpointer data) {
+    deleted_from_line = line_before(buffer, gtk_text_iter_get_offset(start));
+}
+
+static void on_highlight_range_deleted(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, gpointer data) {
+    highlight_edit(buffer, deleted_from_line, gtk_text_iter_get_line(start));
+}
+
+static void on_highlight_scrolled(GtkAdjustment *adjustment, gpointer data) {
+    schedule_highlight();
+}
+
+static void on_highlight_resized(GtkWidget *widget, GdkRectangle *allocation, gpointer data) {
+    schedule_highlight();
+}
+
+void set_highlight_language(GtkTextView *text_view, const char *filename) {
+    const LexGrammar *grammar = lexer_grammar_for_file(filename);
+    if (!lexer || lexer->grammar == grammar) return;
+    lexer->grammar = grammar;
+    restart_highlighting(gtk_text_view_get_buffer(text_view));
+}
+
+void init_highlighting(GtkTextView *text_view) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(text_view);
+    for (int s = 1; s < LEX_STYLES; s++) {
+        style_tag[s] = gtk_text_buffer_create_tag(buffer, style_tags[s], "foreground", style_colors[s], NULL);
+    }
+    g_object_set(style_tag[LEX_STYLE_COMMENT], "style", PANGO_STYLE_ITALIC, NULL);
+
+    highlight_view = text_view;
+    lexer = lexer_create(lexer_grammar_for_file(NULL));
+    g_signal_connect_after(buffer, "insert-text", G_CALLBACK(on_highlight_insert_text), NULL);
+    g_signal_connect(buffer, "delete-range", G_CALLBACK(on_highlight_delete_range), NULL);
+    g_signal_connect_after(buffer, "delete-range", G_CALLBACK(on_highlight_range_deleted), NULL);
+
+    GtkAdjustment *vadjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(text_view));
+    if (vadjustment) g_signal_connect(vadjustment, "value-changed", G_CALLBACK(on_highlight_scrolled), NULL);
+    g_signal_connect(text_view, "size-allocate", G_CALLBACK(on_highlight_resized), NULL);
+    restart_highlighting(buffer);
+}
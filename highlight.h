@@ -0,0 +1,16 @@
+#ifndef HIGHLIGHT_H
+#define HIGHLIGHT_H
+
+#include <gtk/gtk.h>
+
+/**
+ * Start syntax highlighting a text view; the buffer is highlighted in idle time
+ */
+void init_highlighting(GtkTextView *text_view);
+
+/**
+ * Highlight the buffer with the grammar filename's extension names
+ */
+void set_highlight_language(GtkTextView *text_view, const char *filename);
+
+#endif /* HIGHLIGHT_H */
@@ -0,0 +1,421 @@
+#include <gtk/gtk.h>
+#include <stdlib.h>
+#include <string.h>
+#include "large_file.h"
+#include "line_index.h"
+
+/*
+ * In large-file mode the piece table is the document and the buffer holds only
+ * a window of whole lines around the viewport, document lines [window_first,
+ * window_first + window_count). GtkTextBuffer breaks lines where the line index
+ * does, so buffer line n is document line window_first + n and a buffer
+ * position maps to a document offset by its line and byte in the line. The
+ * text view's own scrollbar is hidden; a separate one counts document lines.
+ * When the view comes near the edge of the window, or the scrollbar is dragged
+ * outside it, the window is refilled around the line to show. Edits in the
+ * window go to the piece table and line index, which the buffer then mirrors.
+ */
+
+#define WINDOW_LINES 4000                    // Lines held in the buffer
+#define WINDOW_MAX_BYTES (4 * 1024 * 1024)   // Fewer lines when they are longer than this in total
+#define WINDOW_MARGIN_LINES 500              // The window slides when the view comes this close to its edge
+
+static GtkTextView *window_view = NULL;
+static GtkScrolledWindow *window_scrolled = NULL;
+static GtkWidget *scrollbar = NULL;
+static GtkAdjustment *line_adjustment = NULL;  // Document lines; the value is the top visible line
+
+static Piecetable doc = NULL;   // Set while in large-file mode
+static LineIndex lines = NULL;
+static int window_first = 0;
+static int window_count = 0;
+static int loading = 0;         // Set while the buffer is refilled, so its edits are not the document's
+static int syncing = 0;         // Set while the scrollbar is moved to follow the view
+static int settling = 0;        // Set from a refill until the view has scrolled to its new position
+static guint check_source = 0;  // Checks the window against the viewport once the view has settled
+static guint jump_source = 0;   // Follows the scrollbar
+static guint reload_source = 0; // Refills the window after an edit the buffer could not mirror
+static int jump_line = 0;
+
+static int document_lines(void) {
+    return line_index_count(lines);
+}
+
+// Byte where a document line starts, or the document length past the last line
+static int line_start(int line) {
+    return line_index_start(lines, line);
+}
+
+static int window_margin(void) {
+    return MIN(WINDOW_MARGIN_LINES, window_count / 4);
+}
+
+static char *copy_range(int from, int to) {
+    char *text = malloc(to - from + 1);
+    PiecetableCursor cursor;
+    piecetable_cursor_init(doc, &cursor);
+    for (int offset = from; offset < to;) {
+        int available;
+        const char *piece = piecetable_cursor_seek(doc, &cursor, offset, &available);
+        int n = MIN(available, to - offset);
+        memcpy(text + (offset - from), piece, n);
+        offset += n;
+    }
+    text[to - from] = '\0';
+    return text;
+}
+
+// Buffer lines at the top and bottom of the viewport
+static void visible_lines(int *top, int *bottom) {
+    GdkRectangle visible;
+    GtkTextIter iter;
+    gtk_text_view_get_visible_rect(window_view, &visible);
+    gtk_text_view_get_line_at_y(window_view, &iter, visible.y, NULL);
+    *top = gtk_text_iter_get_line(&iter);
+    gtk_text_view_get_line_at_y(window_view, &iter, visible.y + visible.height, NULL);
+    *bottom = gtk_text_iter_get_line(&iter);
+}
+
+static void sync_scrollbar(int top, int page) {
+    page = MAX(1, page);
+    syncing = 1;
+    gtk_adjustment_configure(line_adjustment, top, 0, document_lines(), 1, page, page);
+    syncing = 0;
+}
+
+static void scroll_to_window_line(int line) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(window_view);
+    GtkTextIter iter;
+    gtk_text_buffer_get_iter_at_line(buffer, &iter, line);
+    GtkTextMark *mark = gtk_text_buffer_get_mark(buffer, "large_file_top");
+    if (mark) gtk_text_buffer_move_mark(buffer, mark, &iter);
+    else mark = gtk_text_buffer_create_mark(buffer, "large_file_top", &iter, TRUE);
+    gtk_text_view_scroll_to_mark(window_view, mark, 0.0, TRUE, 0.0, 0.0);
+}
+
+// Lines [first, end) for a window around top, fewer if they hold more than WINDOW_MAX_BYTES
+static void window_around(int top, int *first, int *end) {
+    int n = document_lines();
+    int span = WINDOW_LINES / 2;
+    do {
+        *first = MAX(0, top - span);
+        *end = MIN(n, top + span);
+        span /= 2;
+    } while (span > 0 && line_start(*end) - line_start(*first) > WINDOW_MAX_BYTES);
+    if (*end <= top) *end = MIN(n, top + 1);
+}
+
+static gboolean check_window(gpointer data);
+
+static void queue_check(void) {
+    // After GTK has laid out and scrolled the view, which it does at higher priorities
+    if (!check_source) check_source = g_idle_add_full(G_PRIORITY_LOW, check_window, NULL, NULL);
+}
+
+// Refills the buffer with the window around document line top and shows top at the top
+static void load_window(int top) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(window_view);
+    top = CLAMP(top, 0, document_lines() - 1);
+    int first, end;
+    window_around(top, &first, &end);
+
+    // The cursor and selection keep their document positions when they stay in the window
+    GtkTextIter iter, bound_iter;
+    gtk_text_buffer_get_iter_at_mark(buffer, &iter, gtk_text_buffer_get_insert(buffer));
+    gtk_text_buffer_get_iter_at_mark(buffer, &bound_iter, gtk_text_buffer_get_selection_bound(buffer));
+    int cursor = window_count ? large_file_offset_at_iter(&iter) : -1;
+    int bound = window_count ? large_file_offset_at_iter(&bound_iter) : -1;
+
+    int from = line_start(first), to = line_start(end);
+    char *text = copy_range(from, to);
+    loading = 1;
+    gtk_text_buffer_set_text(buffer, text, to - from);
+    loading = 0;
+    free(text);
+    window_first = first;
+    window_count = end - first;
+
+    if (cursor >= from && cursor <= to) large_file_iter_at_offset(&iter, cursor);
+    else gtk_text_buffer_get_iter_at_line(buffer, &iter, top - first);
+    if (cursor >= from && cursor <= to && bound >= from && bound <= to) large_file_iter_at_offset(&bound_iter, bound);
+    else bound_iter = iter;
+    gtk_text_buffer_select_range(buffer, &iter, &bound_iter);
+
+    settling = 1;
+    scroll_to_window_line(top - first);
+    sync_scrollbar(top, gtk_adjustment_get_page_size(line_adjustment));
+    queue_check();
+}
+
+static gboolean check_window(gpointer data) {
+    check_source = 0;
+    settling = 0;
+    if (!doc) return G_SOURCE_REMOVE;
+
+    int top, bottom;
+    visible_lines(&top, &bottom);
+    sync_scrollbar(window_first + top, bottom - top + 1);
+
+    int margin = window_margin();
+    if ((top < margin && window_first > 0) ||
+        (bottom >= window_count - margin && window_first + window_count < document_lines())) {
+        // Refill only if that moves the window, or a few long lines would refill forever
+        int first, end;
+        window_around(window_first + top, &first, &end);
+        if (first != window_first || end != window_first + window_count) load_window(window_first + top);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void on_view_scrolled(GtkAdjustment *adjustment, gpointer data) {
+    if (!doc || settling) return;
+    queue_check();
+}
+
+static gboolean jump_idle(gpointer data) {
+    jump_source = 0;
+    if (!doc) return G_SOURCE_REMOVE;
+    if (jump_line >= window_first && jump_line < window_first + window_count) {
+        settling = 1;
+        scroll_to_window_line(jump_line - window_first);
+        queue_check();
+    } else {
+        load_window(jump_line);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void on_scrollbar_changed(GtkAdjustment *adjustment, gpointer data) {
+    if (!doc || syncing) return;
+    jump_line = (int)gtk_adjustment_get_value(adjustment);
+    if (!jump_source) jump_source = g_idle_add_full(G_PRIORITY_HIGH_IDLE, jump_idle, NULL, NULL);
+}
+
+static gboolean reload_idle(gpointer data) {
+    reload_source = 0;
+    if (!doc) return G_SOURCE_REMOVE;
+    int top, bottom;
+    visible_lines(&top, &bottom);
+    load_window(window_first + top);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Updates the window after an edit ending at offset edit_end changed the
+ * document from lines_before lines. The buffer mirrors the document unless the
+ * edit reached the last line of a window that ends before the document (a line
+ * break there may join the window to the line after it, or text typed after it
+ * belongs to that line), or joined a \r and a \n across the start of the
+ * window; then the window is refilled before the next event.
+ */
+static void follow_edit(int edit_end, int lines_before, int last_line_start) {
+    window_count += document_lines() - lines_before;
+    int after_window = window_first + window_count < document_lines();
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(window_view);
+    if ((after_window && edit_end >= last_line_start) ||
+        gtk_text_buffer_get_line_count(buffer) != window_count + after_window) {
+        if (!reload_source) reload_source = g_idle_add_full(G_PRIORITY_HIGH, reload_idle, NULL, NULL);
+    }
+    sync_scrollbar(gtk_adjustment_get_value(line_adjustment), gtk_adjustment_get_page_size(line_adjustment));
+}
+
+/**
+ * Apply text just inserted into the buffer at start to the document; returns
+ * its document offset, or -1 if the buffer was being refilled
+ */
+int large_file_insert(const GtkTextIter *start, const char *text, int length) {
+    if (loading) return -1;
+    // start is before the new text, so its line and byte in the line are as they were
+    int at = large_file_offset_at_iter(start);
+    int lines_before = document_lines(), last_line_start = line_start(window_first + window_count - 1);
+    piecetable_insert_text(doc, text, length, at);
+    line_index_edit(lines, doc, at, 0, length);
+    follow_edit(at, lines_before, last_line_start);
+    return at;
+}
+
+/**
+ * Apply the deletion of length bytes at document offset at, found before the
+ * buffer deleted them; returns -1 if the buffer was being refilled
+ */
+int large_file_delete(int at, int length) {
+    if (loading) return -1;
+    int lines_before = document_lines(), last_line_start = line_start(window_first + window_count - 1);
+    piecetable_delete(doc, at, length);
+    line_index_edit(lines, doc, at, length, 0);
+    follow_edit(at + length, lines_before, last_line_start);
+    return 0;
+}
+
+/*
+ * Adds the length bytes appended to the document at at to the end of the
+ * window, which holds the old last line; the selection stays as it was
+ * rather than growing with the text
+ */
+static void append_to_window(int at, int length) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(window_view);
+    GtkTextIter insert, bound, end;
+    gtk_text_buffer_get_iter_at_mark(buffer, &insert, gtk_text_buffer_get_insert(buffer));
+    gtk_text_buffer_get_iter_at_mark(buffer, &bound, gtk_text_buffer_get_selection_bound(buffer));
+    int insert_offset = gtk_text_iter_get_offset(&insert), bound_offset = gtk_text_iter_get_offset(&bound);
+
+    char *text = copy_range(at, at + length);
+    gtk_text_buffer_get_end_iter(buffer, &end);
+    loading = 1;
+    gtk_text_buffer_insert(buffer, &end, text, length);
+    loading = 0;
+    free(text);
+    window_count = document_lines() - window_first;
+
+    gtk_text_buffer_get_iter_at_offset(buffer, &insert, insert_offset);
+    gtk_text_buffer_get_iter_at_offset(buffer, &bound, bound_offset);
+    gtk_text_buffer_select_range(buffer, &insert, &bound);
+    // A \r the window ended with and a \n the text starts with are one line break to the index
+    if (gtk_text_buffer_get_line_count(buffer) != window_count) {
+        if (!reload_source) reload_source = g_idle_add_full(G_PRIORITY_HIGH, reload_idle, NULL, NULL);
+    }
+}
+
+/**
+ * Follow an edit made to the piece table rather than the buffer, of removed
+ * bytes at at replaced by inserted ones: the line index takes it in and the
+ * window is refilled if the edit reached it. An edit after the window costs
+ * only its own lines, and so does text added at the end of the file while the
+ * window holds the end, which is added to the buffer until the window has
+ * grown to twice its size.
+ */
+void large_file_edited(int at, int removed, int inserted) {
+    if (!doc) return;
+    int window_end = line_start(window_first + window_count);
+    int holds_end = window_first + window_count == document_lines();
+    line_index_edit(lines, doc, at, removed, inserted);
+    if (holds_end && removed == 0 && at == window_end && document_lines() - window_first <= 2 * WINDOW_LINES &&
+        doc->length - line_start(window_first) <= 2 * WINDOW_MAX_BYTES) {
+        append_to_window(at, inserted);
+    } else if (at <= window_end) {
+        if (!reload_source) reload_source = g_idle_add_full(G_PRIORITY_HIGH, reload_idle, NULL, NULL);
+    }
+    sync_scrollbar(gtk_adjustment_get_value(line_adjustment), gtk_adjustment_get_page_size(line_adjustment));
+}
+
+// True if the viewport shows the last line of the document
+int large_file_at_end(void) {
+    if (!doc) return FALSE;
+    int top, bottom;
+    visible_lines(&top, &bottom);
+    return window_first + window_count == document_lines() && bottom >= window_count - 1;
+}
+
+/**
+ * Scroll to the end of the document, refilling the window around it if it
+ * does not hold it or is about to be refilled
+ */
+void large_file_show_end(void) {
+    if (!doc) return;
+    int last = document_lines() - 1;
+    if (reload_source || last >= window_first + window_count) {
+        if (reload_source) g_source_remove(reload_source);
+        reload_source = 0;
+        load_window(last);
+        return;
+    }
+    settling = 1;
+    scroll_to_window_line(last - window_first);
+    queue_check();
+}
+
+// Returns the document's line index, which stays the module's; NULL outside large-file mode
+LineIndex large_file_lines(void) {
+    return doc ? lines : NULL;
+}
+
+int large_file_active(void) {
+    return doc != NULL;
+}
+
+// Returns the document offset of a buffer position
+int large_file_offset_at_iter(const GtkTextIter *iter) {
+    return line_start(window_first + gtk_text_iter_get_line(iter)) + gtk_text_iter_get_line_index(iter);
+}
+
+/**
+ * Move the window so it holds document offset offset, if it does not already
+ */
+void large_file_reveal(int offset) {
+    int line = line_index_line_at(lines, offset);
+    if (line < window_first || line >= window_first + window_count) load_window(line);
+}
+
+// Sets iter to a document offset, clamped to the window
+void large_file_iter_at_offset(GtkTextIter *iter, int offset) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(window_view);
+    int line = line_index_line_at(lines, offset);
+    if (line < window_first) {
+        gtk_text_buffer_get_start_iter(buffer, iter);
+    } else if (line >= window_first + window_count) {
+        gtk_text_buffer_get_end_iter(buffer, iter);
+    } else {
+        gtk_text_buffer_get_iter_at_line_index(buffer, iter, line - window_first, offset - line_start(line));
+    }
+}
+
+static void build_line_index(void) {
+    if (lines) line_index_free(lines);
+    lines = line_index_create();
+    PiecetableCursor cursor;
+    piecetable_cursor_init(doc, &cursor);
+    for (int offset = 0; offset < doc->length;) {
+        int available;
+        const char *text = piecetable_cursor_seek(doc, &cursor, offset, &available);
+        line_index_append(lines, text, available);
+        offset += available;
+    }
+}
+
+void large_file_open(Piecetable pt, LineIndex index) {
+    doc = pt;
+    if (index) {
+        if (lines) line_index_free(lines);
+        lines = index;
+    } else {
+        build_line_index();
+    }
+    gtk_scrolled_window_set_policy(window_scrolled, GTK_POLICY_AUTOMATIC, GTK_POLICY_EXTERNAL);
+    gtk_widget_show(scrollbar);
+    window_first = window_count = 0;
+    load_window(0);
+}
+
+/**
+ * Re-read the whole piece table after it was rewritten in place, as by replace all
+ */
+void large_file_reload(void) {
+    if (!doc) return;
+    int top, bottom;
+    visible_lines(&top, &bottom);
+    build_line_index();
+    load_window(window_first + top);
+}
+
+void large_file_close(void) {
+    if (!doc) return;
+    doc = NULL;
+    line_index_free(lines);
+    lines = NULL;
+    window_first = window_count = 0;
+    gtk_scrolled_window_set_policy(window_scrolled, GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_widget_hide(scrollbar);
+}
+
+GtkWidget *init_large_file(GtkTextView *text_view, GtkScrolledWindow *scrolled_window) {
+    window_view = text_view;
+    window_scrolled = scrolled_window;
+    line_adjustment = gtk_adjustment_new(0, 0, 1, 1, 1, 1);
+    scrollbar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, line_adjustment);
+    gtk_widget_set_no_show_all(scrollbar, TRUE);
+    g_signal_connect(line_adjustment, "value-changed", G_CALLBACK(on_scrollbar_changed), NULL);
+
+    GtkAdjustment *vadjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(text_view));
+    if (vadjustment) g_signal_connect(vadjustment, "value-changed", G_CALLBACK(on_view_scrolled), NULL);
+    return scrollbar;
+}
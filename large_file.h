@@ -0,0 +1,40 @@
+#ifndef LARGE_FILE_H
+#define LARGE_FILE_H
+
+#include <gtk/gtk.h>
+#include "piecetable.h"
+#include "line_index.h"
+
+#define LARGE_FILE_THRESHOLD (64 * 1024 * 1024)  // Files this big open in large-file mode
+
+/**
+ * Set up large-file mode for a text view in a scrolled window; returns the
+ * scrollbar to pack beside the scrolled window, shown only in that mode
+ */
+GtkWidget *init_large_file(GtkTextView *text_view, GtkScrolledWindow *scrolled_window);
+
+/**
+ * Show a piece table through a window of lines in the buffer; the piece table
+ * stays the document and buffer edits are applied to it. index, if not NULL,
+ * is its line index already built and is taken over.
+ */
+void large_file_open(Piecetable pt, LineIndex index);
+
+/**
+ * Leave large-file mode; the caller then fills the buffer as usual
+ */
+void large_file_close(void);
+
+int large_file_active(void);
+LineIndex large_file_lines(void);
+int large_file_offset_at_iter(const GtkTextIter *iter);
+void large_file_reveal(int offset);
+void large_file_iter_at_offset(GtkTextIter *iter, int offset);
+int large_file_insert(const GtkTextIter *start, const char *text, int length);
+int large_file_delete(int at, int length);
+void large_file_edited(int at, int removed, int inserted);
+int large_file_at_end(void);
+void large_file_show_end(void);
+void large_file_reload(void);
+
+#endif /* LARGE_FILE_H */
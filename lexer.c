@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lexer.h"
+
+/*
+ * A grammar is a transition table from (state, character class) to the next
+ * state, so lexing is one table lookup per byte. Only the state at the start
+ * of each line is kept: re-lexing a line needs nothing else, and after an edit
+ * lines are re-lexed from the edited one until a line ends in the state the
+ * next line already starts with.
+ */
+
+#define UNKNOWN LEX_STATES // Start state of a line not lexed yet
+
+static const unsigned char char_class[256] = {
+    ['"'] = LEX_QUOTE, ['\''] = LEX_APOSTROPHE, ['/'] = LEX_SLASH_CHAR, ['*'] = LEX_STAR,
+    ['\\'] = LEX_BACKSLASH, ['\r'] = LEX_CR, ['\n'] = LEX_NEWLINE,
+};
+
+static const unsigned char is_bracket[256] = {
+    ['('] = 1, [')'] = 1, ['['] = 1, [']'] = 1, ['{'] = 1, ['}'] = 1, ['<'] = 1, ['>'] = 1,
+};
+
+static const LexWord c_words[] = {
+    {"NULL", LEX_STYLE_CONSTANT}, {"auto", LEX_STYLE_KEYWORD}, {"bool", LEX_STYLE_TYPE},
+    {"break", LEX_STYLE_KEYWORD}, {"case", LEX_STYLE_KEYWORD}, {"catch", LEX_STYLE_KEYWORD},
+    {"char", LEX_STYLE_TYPE}, {"class", LEX_STYLE_KEYWORD}, {"const", LEX_STYLE_KEYWORD},
+    {"continue", LEX_STYLE_KEYWORD}, {"default", LEX_STYLE_KEYWORD}, {"delete", LEX_STYLE_KEYWORD},
+    {"do", LEX_STYLE_KEYWORD}, {"double", LEX_STYLE_TYPE}, {"else", LEX_STYLE_KEYWORD},
+    {"enum", LEX_STYLE_KEYWORD}, {"extern", LEX_STYLE_KEYWORD}, {"false", LEX_STYLE_CONSTANT},
+    {"float", LEX_STYLE_TYPE}, {"for", LEX_STYLE_KEYWORD}, {"goto", LEX_STYLE_KEYWORD},
+    {"if", LEX_STYLE_KEYWORD}, {"inline", LEX_STYLE_KEYWORD}, {"int", LEX_STYLE_TYPE},
+    {"int16_t", LEX_STYLE_TYPE}, {"int32_t", LEX_STYLE_TYPE}, {"int64_t", LEX_STYLE_TYPE},
+    {"int8_t", LEX_STYLE_TYPE}, {"long", LEX_STYLE_TYPE}, {"namespace", LEX_STYLE_KEYWORD},
+    {"new", LEX_STYLE_KEYWORD}, {"nullptr", LEX_STYLE_CONSTANT}, {"operator", LEX_STYLE_KEYWORD},
+    {"private", LEX_STYLE_KEYWORD}, {"protected", LEX_STYLE_KEYWORD}, {"public", LEX_STYLE_KEYWORD},
+    {"register", LEX_STYLE_KEYWORD}, {"restrict", LEX_STYLE_KEYWORD}, {"return", LEX_STYLE_KEYWORD},
+    {"short", LEX_STYLE_TYPE}, {"signed", LEX_STYLE_TYPE}, {"size_t", LEX_STYLE_TYPE},
+    {"sizeof", LEX_STYLE_KEYWORD}, {"ssize_t", LEX_STYLE_TYPE}, {"static", LEX_STYLE_KEYWORD},
+    {"struct", LEX_STYLE_KEYWORD}, {"switch", LEX_STYLE_KEYWORD}, {"template", LEX_STYLE_KEYWORD},
+    {"this", LEX_STYLE_KEYWORD}, {"throw", LEX_STYLE_KEYWORD}, {"true", LEX_STYLE_CONSTANT},
+    {"try", LEX_STYLE_KEYWORD}, {"typedef", LEX_STYLE_KEYWORD}, {"uint16_t", LEX_STYLE_TYPE},
+    {"uint32_t", LEX_STYLE_TYPE}, {"uint64_t", LEX_STYLE_TYPE}, {"uint8_t", LEX_STYLE_TYPE},
+    {"union", LEX_STYLE_KEYWORD}, {"unsigned", LEX_STYLE_TYPE}, {"using", LEX_STYLE_KEYWORD},
+    {"virtual", LEX_STYLE_KEYWORD}, {"void", LEX_STYLE_TYPE}, {"volatile", LEX_STYLE_KEYWORD},
+    {"while", LEX_STYLE_KEYWORD},
+};
+
+// Columns: other " ' / * \ CR LF
+const LexGrammar lex_grammar_c = {
+    "C", ".c .h .cc .cpp .cxx .hpp .hh .java .js .ts .cs .go .rs .swift .kt .scala .css",
+    {
+        [LEX_CODE]          = {LEX_CODE, LEX_STRING, LEX_CHAR, LEX_SLASH, LEX_CODE, LEX_CODE, LEX_CODE, LEX_CODE},
+        [LEX_SLASH]         = {LEX_CODE, LEX_STRING, LEX_CHAR, LEX_LINE_COMMENT, LEX_BLOCK_COMMENT,
+                               LEX_CODE, LEX_CODE, LEX_CODE},
+        [LEX_LINE_COMMENT]  = {LEX_LINE_COMMENT, LEX_LINE_COMMENT, LEX_LINE_COMMENT, LEX_LINE_COMMENT,
+                               LEX_LINE_COMMENT, LEX_LINE_COMMENT, LEX_LINE_COMMENT, LEX_CODE},
+        [LEX_BLOCK_COMMENT] = {LEX_BLOCK_COMMENT, LEX_BLOCK_COMMENT, LEX_BLOCK_COMMENT, LEX_BLOCK_COMMENT,
+                               LEX_BLOCK_STAR, LEX_BLOCK_COMMENT, LEX_BLOCK_COMMENT, LEX_BLOCK_COMMENT},
+        [LEX_BLOCK_STAR]    = {LEX_BLOCK_COMMENT, LEX_BLOCK_COMMENT, LEX_BLOCK_COMMENT, LEX_CODE,
+                               LEX_BLOCK_STAR, LEX_BLOCK_COMMENT, LEX_BLOCK_COMMENT, LEX_BLOCK_COMMENT},
+        // An unterminated string or character ends with its line unless the newline is escaped
+        [LEX_STRING]        = {LEX_STRING, LEX_CODE, LEX_STRING, LEX_STRING, LEX_STRING,
+                               LEX_STRING_ESCAPE, LEX_STRING, LEX_CODE},
+        [LEX_STRING_ESCAPE] = {LEX_STRING, LEX_STRING, LEX_STRING, LEX_STRING, LEX_STRING,
+                               LEX_STRING, LEX_STRING_ESCAPE, LEX_STRING},
+        [LEX_CHAR]          = {LEX_CHAR, LEX_CHAR, LEX_CODE, LEX_CHAR, LEX_CHAR,
+                               LEX_CHAR_ESCAPE, LEX_CHAR, LEX_CODE},
+        [LEX_CHAR_ESCAPE]   = {LEX_CHAR, LEX_CHAR, LEX_CHAR, LEX_CHAR, LEX_CHAR,
+                               LEX_CHAR, LEX_CHAR_ESCAPE, LEX_CHAR},
+    },
+    {
+        [LEX_LINE_COMMENT] = LEX_STYLE_COMMENT, [LEX_BLOCK_COMMENT] = LEX_STYLE_COMMENT,
+        [LEX_BLOCK_STAR] = LEX_STYLE_COMMENT, [LEX_STRING] = LEX_STYLE_STRING,
+        [LEX_STRING_ESCAPE] = LEX_STYLE_STRING, [LEX_CHAR] = LEX_STYLE_STRING, [LEX_CHAR_ESCAPE] = LEX_STYLE_STRING,
+    },
+    c_words, sizeof(c_words) / sizeof(c_words[0]),
+    LEX_PREPROCESSOR,
+};
+
+static const LexWord json_words[] = {
+    {"false", LEX_STYLE_CONSTANT}, {"null", LEX_STYLE_CONSTANT}, {"true", LEX_STYLE_CONSTANT},
+};
+
+// Strings are the only multi-character tokens that change state; JSON has no comments
+const LexGrammar lex_grammar_json = {
+    "JSON", ".json .geojson",
+    {
+        [LEX_CODE]          = {LEX_CODE, LEX_STRING, LEX_CODE, LEX_CODE, LEX_CODE, LEX_CODE, LEX_CODE, LEX_CODE},
+        [LEX_STRING]        = {LEX_STRING, LEX_CODE, LEX_STRING, LEX_STRING, LEX_STRING,
+                               LEX_STRING_ESCAPE, LEX_STRING, LEX_CODE},
+        [LEX_STRING_ESCAPE] = {LEX_STRING, LEX_STRING, LEX_STRING, LEX_STRING, LEX_STRING,
+                               LEX_STRING, LEX_STRING_ESCAPE, LEX_STRING},
+    },
+    {[LEX_STRING] = LEX_STYLE_STRING, [LEX_STRING_ESCAPE] = LEX_STYLE_STRING},
+    json_words, sizeof(json_words) / sizeof(json_words[0]),
+    LEX_STRING_KEYS,
+};
+
+// Everything is code: prose has apostrophes that are not character literals
+const LexGrammar lex_grammar_plain = {"Plain text", "", {{0}}, {0}, NULL, 0, 0};
+
+static const LexGrammar *grammars[] = {&lex_grammar_c, &lex_grammar_json};
+
+// Picks a grammar by file extension; an unnamed buffer is lexed as C
+const LexGrammar *lexer_grammar_for_file(const char *filename) {
+    if (!filename) return &lex_grammar_c;
+    const char *slash = strrchr(filename, '/');
+    const char *dot = strrchr(slash ? slash : filename, '.');
+    if (!dot) return &lex_grammar_plain;
+    size_t length = strlen(dot);
+
+    for (size_t g = 0; g < sizeof(grammars) / sizeof(grammars[0]); g++) {
+        const char *ext = grammars[g]->extensions;
+        while ((ext = strstr(ext, dot))) {
+            if (ext[length] == ' ' || ext[length] == '\0') return grammars[g];
+            ext += length;
+        }
+    }
+    return &lex_grammar_plain;
+}
+
+Lexer lexer_create(const LexGrammar *grammar) {
+    Lexer lexer = malloc(sizeof(struct lexer));
+    lexer->grammar = grammar;
+    lexer->capacity = 64;
+    lexer->line_states = malloc(lexer->capacity);
+    lexer->line_states[0] = LEX_CODE;
+    lexer->lines = 1;
+    return lexer;
+}
+
+void lexer_free(Lexer lexer) {
+    free(lexer->line_states);
+    free(lexer);
+}
+
+static void reserve(Lexer lexer, int lines) {
+    if (lines <= lexer->capacity) return;
+    while (lexer->capacity < lines) lexer->capacity *= 2;
+    lexer->line_states = realloc(lexer->line_states, lexer->capacity);
+}
+
+LexState lexer_line_state(Lexer lexer, int line) {
+    if (line <= 0 || line >= lexer->lines || lexer->line_states[line] == UNKNOWN) return LEX_CODE;
+    return lexer->line_states[line];
+}
+
+// Makes room for count new lines after line, to be lexed next
+void lexer_insert_lines(Lexer lexer, int line, int count) {
+    if (count <= 0) return;
+    reserve(lexer, lexer->lines + count);
+    memmove(lexer->line_states + line + 1 + count, lexer->line_states + line + 1, lexer->lines - line - 1);
+    memset(lexer->line_states + line + 1, UNKNOWN, count);
+    lexer->lines += count;
+}
+
+// Drops the count lines after line, which an edit joined to it
+void lexer_remove_lines(Lexer lexer, int line, int count) {
+    if (count <= 0) return;
+    memmove(lexer->line_states + line + 1, lexer->line_states + line + 1 + count, lexer->lines - line - 1 - count);
+    lexer->lines -= count;
+}
+
+/*
+ * Lexes length bytes of text from state and returns the state after them.
+ * Brackets lexed as code are reported with their character offset, counted
+ * from offset.
+ */
+LexState lexer_scan(const LexGrammar *grammar, LexState state, const char *text, int length, int offset,
+                    LexBracketFunc on_bracket, void *data) {
+    unsigned char s = state;
+    for (int i = 0; i < length; i++) {
+        unsigned char c = text[i];
+        s = grammar->next[s][char_class[c]];
+        if (is_bracket[c] && s == LEX_CODE && on_bracket) on_bracket(offset, c, data);
+        if ((c & 0xC0) != 0x80) offset++;
+    }
+    return s;
+}
+
+/*
+ * Re-lexes one line from its recorded start state and records the start state
+ * of the next line. Returns 1 if that state changed, so the next line needs
+ * lexing too.
+ */
+int lexer_scan_line(Lexer lexer, int line, const char *text, int length, int offset,
+                    LexBracketFunc on_bracket, void *data) {
+    LexState end = lexer_scan(lexer->grammar, lexer_line_state(lexer, line), text, length, offset, on_bracket, data);
+    if (line + 1 >= lexer->lines) return 0;
+    int changed = lexer->line_states[line + 1] != end;
+    lexer->line_states[line + 1] = end;
+    return changed;
+}
+
+static int is_word_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+static LexStyle word_style(const LexGrammar *grammar, const char *word, int length) {
+    int low = 0, high = grammar->word_count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        const char *candidate = grammar->words[mid].word;
+        int cmp = strncmp(candidate, word, length);
+        if (cmp == 0) cmp = (unsigned char)candidate[length];
+        if (cmp == 0) return grammar->words[mid].style;
+        if (cmp < 0) low = mid + 1;
+        else high = mid - 1;
+    }
+    return LEX_STYLE_NONE;
+}
+
+// Adjacent bytes of one style are reported as one token
+typedef struct {
+    int start;
+    int end;
+    LexStyle style;
+    LexTokenFunc on_token;
+    void *data;
+} TokenRun;
+
+static void run_add(TokenRun *run, int start, int end, LexStyle style) {
+    if (style == run->style && start == run->end) {
+        run->end = end;
+        return;
+    }
+    if (run->style != LEX_STYLE_NONE && run->end > run->start) run->on_token(run->start, run->end, run->style, run->data);
+    run->start = start;
+    run->end = end;
+    run->style = style;
+}
+
+/*
+ * Lexes like lexer_scan and reports styled tokens: text in comment and string
+ * states takes the state's style, and words and numbers in code are
+ * classified as they are met. Returns the state after text.
+ */
+LexState lexer_scan_tokens(const LexGrammar *grammar, LexState state, const char *text, int length,
+                           LexTokenFunc on_token, void *data) {
+    TokenRun run = {0, 0, LEX_STYLE_NONE, on_token, data};
+    const unsigned char *p = (const unsigned char *)text;
+    unsigned char s = state;
+    int line_start = 1; // Only blanks so far on this line
+
+    for (int i = 0; i < length;) {
+        unsigned char c = p[i];
+        if (s == LEX_CODE || s == LEX_SLASH) {
+            int j = i + 1;
+            if ((c >= '0' && c <= '9') || (c == '.' && i + 1 < length && p[i + 1] >= '0' && p[i + 1] <= '9')) {
+                while (j < length && (is_word_char(p[j]) || p[j] == '.' ||
+                                      ((p[j] == '+' || p[j] == '-') && (p[j - 1] | 0x20) == 'e'))) j++;
+                run_add(&run, i, j, LEX_STYLE_NUMBER);
+                s = LEX_CODE;
+                i = j;
+                line_start = 0;
+                continue;
+            }
+            if (is_word_char(c)) {
+                while (j < length && is_word_char(p[j])) j++;
+                run_add(&run, i, j, word_style(grammar, text + i, j - i));
+                s = LEX_CODE;
+                i = j;
+                line_start = 0;
+                continue;
+            }
+            if (c == '#' && line_start && (grammar->flags & LEX_PREPROCESSOR)) {
+                while (j < length && (p[j] == ' ' || p[j] == '\t')) j++;
+                while (j < length && is_word_char(p[j])) j++;
+                run_add(&run, i, j, LEX_STYLE_PREPROCESSOR);
+                i = j;
+                line_start = 0;
+                continue;
+            }
+        }
+
+        unsigned char next = grammar->next[s][char_class[c]];
+        LexStyle style = grammar->state_style[s] ? grammar->state_style[s] : grammar->state_style[next];
+        // The '/' of a comment opener is lexed in code, before the next byte reveals the comment
+        if (next == LEX_SLASH && i + 1 < length &&
+            grammar->state_style[grammar->next[LEX_SLASH][char_class[p[i + 1]]]] == LEX_STYLE_COMMENT) {
+            style = LEX_STYLE_COMMENT;
+        }
+        run_add(&run, i, i + 1, style);
+
+        // A closing quote followed by ':' makes the string a key
+        if ((grammar->flags & LEX_STRING_KEYS) && s == LEX_STRING && next == LEX_CODE && c == '"') {
+            int j = i + 1;
+            while (j < length && (p[j] == ' ' || p[j] == '\t')) j++;
+            if (j < length && p[j] == ':') run.style = LEX_STYLE_KEY;
+        }
+
+        if (c == '\n' || c == '\r') line_start = 1;
+        else if (c != ' ' && c != '\t') line_start = 0;
+        s = next;
+        i++;
+    }
+    run_add(&run, length, length, LEX_STYLE_NONE);
+    return s;
+}
+
+/*
+ * Like lexer_scan_line, reporting styled tokens with byte offsets in the line
+ */
+int lexer_scan_line_tokens(Lexer lexer, int line, const char *text, int length, LexTokenFunc on_token, void *data) {
+    LexState end = lexer_scan_tokens(lexer->grammar, lexer_line_state(lexer, line), text, length, on_token, data);
+    if (line + 1 >= lexer->lines) return 0;
+    int changed = lexer->line_states[line + 1] != end;
+    lexer->line_states[line + 1] = end;
+    return changed;
+}
+
+/*
+ * Lexes text that begins at the start of line, recording the start state of
+ * every line after it. Lines end where GtkTextBuffer ends them: at \n, \r,
+ * \r\n and U+2029.
+ */
+void lexer_scan_lines(Lexer lexer, int line, const char *text, int length, int offset,
+                      LexBracketFunc on_bracket, void *data) {
+    LexState state = lexer_line_state(lexer, line);
+    int line_start = 0;
+
+    for (int i = 0; i < length; i++) {
+        int next;
+        if (text[i] == '\n') next = i + 1;
+        else if (text[i] == '\r') next = i + 1 < length && text[i + 1] == '\n' ? i + 2 : i + 1;
+        else if ((unsigned char)text[i] == 0xE2 && i + 2 < length && (unsigned char)text[i + 1] == 0x80 &&
+                 (unsigned char)text[i + 2] == 0xA9) next = i + 3;
+        else continue;
+
+        state = lexer_scan(lexer->grammar, state, text + line_start, next - line_start, offset, on_bracket, data);
+        for (int j = line_start; j < next; j++) {
+            if (((unsigned char)text[j] & 0xC0) != 0x80) offset++;
+        }
+        line++;
+        reserve(lexer, line + 1);
+        if (line >= lexer->lines) lexer->lines = line + 1;
+        lexer->line_states[line] = state;
+        line_start = next;
+        i = next - 1;
+    }
+    if (on_bracket) lexer_scan(lexer->grammar, state, text + line_start, length - line_start, offset, on_bracket, data);
+}
+
+// Lexes a whole document, recording the start state of every line
+void lexer_scan_document(Lexer lexer, const char *text, int length, LexBracketFunc on_bracket, void *data) {
+    lexer->lines = 1;
+    lexer->line_states[0] = LEX_CODE;
+    lexer_scan_lines(lexer, 0, text, length, 0, on_bracket, data);
+}
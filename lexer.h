@@ -0,0 +1,90 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+// Lexer states; a line's start state is one of these
+typedef enum {
+    LEX_CODE,
+    LEX_SLASH,           // After '/' in code, a comment may start
+    LEX_LINE_COMMENT,
+    LEX_BLOCK_COMMENT,
+    LEX_BLOCK_STAR,      // After '*' in a block comment, it may end
+    LEX_STRING,
+    LEX_STRING_ESCAPE,
+    LEX_CHAR,
+    LEX_CHAR_ESCAPE,
+    LEX_STATES
+} LexState;
+
+// Character classes the transition tables are indexed by
+enum { LEX_OTHER, LEX_QUOTE, LEX_APOSTROPHE, LEX_SLASH_CHAR, LEX_STAR, LEX_BACKSLASH, LEX_CR, LEX_NEWLINE, LEX_CLASSES };
+
+// Highlighting styles of tokens
+typedef enum {
+    LEX_STYLE_NONE,
+    LEX_STYLE_KEYWORD,
+    LEX_STYLE_TYPE,
+    LEX_STYLE_CONSTANT,
+    LEX_STYLE_NUMBER,
+    LEX_STYLE_STRING,
+    LEX_STYLE_KEY,           // A string used as an object key
+    LEX_STYLE_COMMENT,
+    LEX_STYLE_PREPROCESSOR,
+    LEX_STYLES
+} LexStyle;
+
+// Grammar flags
+#define LEX_PREPROCESSOR 1   // '#' first on a line starts a directive
+#define LEX_STRING_KEYS 2    // A string followed by ':' is a key
+
+typedef struct {
+    const char *word;
+    unsigned char style;
+} LexWord;
+
+typedef struct {
+    const char *name;
+    const char *extensions;  // Space separated, each with its dot
+    unsigned char next[LEX_STATES][LEX_CLASSES];
+    unsigned char state_style[LEX_STATES];  // Style of text lexed in each state
+    const LexWord *words;    // Identifiers with a style, sorted
+    int word_count;
+    int flags;
+} LexGrammar;
+
+extern const LexGrammar lex_grammar_c;
+extern const LexGrammar lex_grammar_json;
+extern const LexGrammar lex_grammar_plain;
+
+// Start state of every line, kept per buffer so edits re-lex only what changed
+typedef struct lexer {
+    const LexGrammar *grammar;
+    unsigned char *line_states;
+    int lines;
+    int capacity;
+} *Lexer;
+
+// Called for each bracket lexed as code, with its character offset
+typedef void (*LexBracketFunc)(int offset, char bracket, void *data);
+
+// Called for each styled token, with its byte range in the scanned text
+typedef void (*LexTokenFunc)(int start, int end, LexStyle style, void *data);
+
+const LexGrammar *lexer_grammar_for_file(const char *filename);
+Lexer lexer_create(const LexGrammar *grammar);
+void lexer_free(Lexer lexer);
+LexState lexer_line_state(Lexer lexer, int line);
+void lexer_insert_lines(Lexer lexer, int line, int count);
+void lexer_remove_lines(Lexer lexer, int line, int count);
+
+LexState lexer_scan(const LexGrammar *grammar, LexState state, const char *text, int length, int offset,
+                    LexBracketFunc on_bracket, void *data);
+LexState lexer_scan_tokens(const LexGrammar *grammar, LexState state, const char *text, int length,
+                           LexTokenFunc on_token, void *data);
+int lexer_scan_line(Lexer lexer, int line, const char *text, int length, int offset,
+                    LexBracketFunc on_bracket, void *data);
+int lexer_scan_line_tokens(Lexer lexer, int line, const char *text, int length, LexTokenFunc on_token, void *data);
+void lexer_scan_lines(Lexer lexer, int line, const char *text, int length, int offset,
+                      LexBracketFunc on_bracket, void *data);
+void lexer_scan_document(Lexer lexer, const char *text, int length, LexBracketFunc on_bracket, void *data);
+
+#endif // LEXER_H
@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <string.h>
+#include "line_index.h"
+
+/*
+ * Line lengths are kept in blocks of at most LINE_INDEX_BLOCK lines, at four
+ * bytes per line. Fenwick trees over the blocks' line and byte counts find the
+ * block holding a line or an offset in O(log blocks), and then one block is
+ * walked. Changes inside blocks update the trees; when blocks are added or
+ * removed the trees are rebuilt by the next lookup, in O(blocks). An edit
+ * re-reads only the lines it touched, plus one on either side since \r and \n
+ * on two sides of an edit can join into one line break.
+ */
+
+// Line lengths found by scanning text, the last one still open
+typedef struct {
+    int *lengths;
+    int count;
+    int capacity;
+    int after_cr;
+    int partial;
+    int lf;      // Line breaks of each kind found
+    int crlf;
+    int cr;
+} LineScan;
+
+static void scan_push(LineScan *scan) {
+    if (scan->count == scan->capacity) {
+        scan->capacity *= 2;
+        scan->lengths = realloc(scan->lengths, scan->capacity * sizeof(int));
+    }
+    scan->lengths[scan->count++] = 0;
+}
+
+static void scan_init(LineScan *scan) {
+    scan->capacity = 64;
+    scan->lengths = malloc(scan->capacity * sizeof(int));
+    scan->count = 0;
+    scan->after_cr = 0;
+    scan->partial = 0;
+    scan->lf = scan->crlf = scan->cr = 0;
+    scan_push(scan);
+}
+
+static void scan_text(LineScan *scan, const char *text, int length) {
+    for (int i = 0; i < length; i++) {
+        unsigned char c = text[i];
+        if (scan->after_cr) {
+            scan->after_cr = 0;
+            if (c == '\n') {
+                scan->lengths[scan->count - 2]++;
+                scan->cr--;
+                scan->crlf++;
+                continue;
+            }
+        }
+        scan->lengths[scan->count - 1]++;
+
+        // U+2029 is E2 80 A9
+        if (c == 0xA9 && scan->partial == 2) {
+            scan->partial = 0;
+            scan_push(scan);
+            continue;
+        }
+        scan->partial = c == 0xE2 ? 1 : (c == 0x80 && scan->partial == 1 ? 2 : 0);
+        if (c == '\n') {
+            scan_push(scan);
+            scan->lf++;
+        } else if (c == '\r') {
+            scan_push(scan);
+            scan->after_cr = 1;
+            scan->cr++;
+        }
+    }
+}
+
+static LineBlock new_block(const int *lengths, int count) {
+    LineBlock block;
+    block.lengths = malloc(LINE_INDEX_BLOCK * sizeof(int));
+    block.count = count;
+    block.length = 0;
+    for (int i = 0; i < count; i++) {
+        block.lengths[i] = lengths[i];
+        block.length += lengths[i];
+    }
+    return block;
+}
+
+static void rebuild_sums(LineIndex index) {
+    int n = index->block_count;
+    index->line_sums = realloc(index->line_sums, (n + 1) * sizeof(int));
+    index->byte_sums = realloc(index->byte_sums, (n + 1) * sizeof(int));
+    for (int i = 1; i <= n; i++) {
+        index->line_sums[i] = index->blocks[i - 1].count;
+        index->byte_sums[i] = index->blocks[i - 1].length;
+    }
+    for (int i = 1; i <= n; i++) {
+        int j = i + (i & -i);
+        if (j <= n) {
+            index->line_sums[j] += index->line_sums[i];
+            index->byte_sums[j] += index->byte_sums[i];
+        }
+    }
+    index->sums_valid = 1;
+}
+
+static void add_to_sums(LineIndex index, int block, int lines, int bytes) {
+    if (!index->sums_valid) return;
+    for (int i = block + 1; i <= index->block_count; i += i & -i) {
+        index->line_sums[i] += lines;
+        index->byte_sums[i] += bytes;
+    }
+}
+
+// Makes room for count blocks at position at
+static void insert_blocks(LineIndex index, int at, int count) {
+    if (index->block_count + count > index->block_capacity) {
+        while (index->block_count + count > index->block_capacity) index->block_capacity *= 2;
+        index->blocks = realloc(index->blocks, index->block_capacity * sizeof(LineBlock));
+    }
+    memmove(index->blocks + at + count, index->blocks + at, (index->block_count - at) * sizeof(LineBlock));
+    index->block_count += count;
+    index->sums_valid = 0;
+}
+
+/*
+ * Returns the block holding a line (by_bytes 0) or a byte offset (by_bytes 1),
+ * with the line and byte its block starts at; positions past the end map to
+ * the last block
+ */
+static int find_block(LineIndex index, int position, int by_bytes, int *first_line, int *first_byte) {
+    if (!index->sums_valid) rebuild_sums(index);
+    const int *sums = by_bytes ? index->byte_sums : index->line_sums;
+    int n = index->block_count, b = 0, lines = 0, bytes = 0, step = 1;
+    while (step * 2 <= n) step *= 2;
+    for (; step; step /= 2) {
+        if (b + step <= n && (by_bytes ? bytes : lines) + sums[b + step] <= position) {
+            b += step;
+            lines += index->line_sums[b];
+            bytes += index->byte_sums[b];
+        }
+    }
+    if (b == n) {
+        b--;
+        lines -= index->blocks[b].count;
+        bytes -= index->blocks[b].length;
+    }
+    *first_line = lines;
+    if (first_byte) *first_byte = bytes;
+    return b;
+}
+
+// Replaces lines [first, last), last > first, with count lines of the given lengths
+static void replace_lines(LineIndex index, int first, int last, const int *lengths, int count) {
+    int bf_first, bl_first;
+    int bf = find_block(index, first, 0, &bf_first, NULL);
+    int bl = find_block(index, last - 1, 0, &bl_first, NULL);
+    int before = first - bf_first;
+    int after = index->blocks[bl].count - (last - bl_first);
+
+    int total = before + count + after;
+    int *all = malloc(total * sizeof(int));
+    memcpy(all, index->blocks[bf].lengths, before * sizeof(int));
+    memcpy(all + before, lengths, count * sizeof(int));
+    memcpy(all + before + count, index->blocks[bl].lengths + (last - bl_first), after * sizeof(int));
+
+    int pieces = (total + LINE_INDEX_BLOCK - 1) / LINE_INDEX_BLOCK;
+    int removed = bl - bf + 1;
+    if (pieces == removed) {
+        // Same blocks, new contents: only the sums change
+        for (int p = 0; p < pieces; p++) {
+            int from = (long)total * p / pieces, to = (long)total * (p + 1) / pieces;
+            LineBlock *block = &index->blocks[bf + p];
+            int old_count = block->count, old_length = block->length;
+            block->count = to - from;
+            block->length = 0;
+            for (int i = 0; i < block->count; i++) block->length += block->lengths[i] = all[from + i];
+            add_to_sums(index, bf + p, block->count - old_count, block->length - old_length);
+        }
+        free(all);
+        index->lines += count - (last - first);
+        return;
+    }
+    for (int b = bf; b <= bl; b++) free(index->blocks[b].lengths);
+    if (pieces > removed) {
+        insert_blocks(index, bl + 1, pieces - removed);
+    } else if (pieces < removed) {
+        memmove(index->blocks + bf + pieces, index->blocks + bl + 1, (index->block_count - bl - 1) * sizeof(LineBlock));
+        index->block_count -= removed - pieces;
+        index->sums_valid = 0;
+    }
+    for (int p = 0; p < pieces; p++) {
+        int from = (long)total * p / pieces, to = (long)total * (p + 1) / pieces;
+        index->blocks[bf + p] = new_block(all + from, to - from);
+    }
+    free(all);
+    index->lines += count - (last - first);
+}
+
+// Adds delta bytes to line
+static void add_to_line(LineIndex index, int line, int delta) {
+    int first;
+    int b = find_block(index, line, 0, &first, NULL);
+    index->blocks[b].lengths[line - first] += delta;
+    index->blocks[b].length += delta;
+    add_to_sums(index, b, 0, delta);
+    index->length += delta;
+}
+
+LineIndex line_index_create(void) {
+    LineIndex index = malloc(sizeof(struct line_index));
+    index->block_capacity = 16;
+    index->blocks = malloc(index->block_capacity * sizeof(LineBlock));
+    int empty = 0;
+    index->blocks[0] = new_block(&empty, 1);
+    index->block_count = 1;
+    index->lines = 1;
+    index->length = 0;
+    index->after_cr = 0;
+    index->partial = 0;
+    index->lf_breaks = index->crlf_breaks = index->cr_breaks = 0;
+    index->line_sums = NULL;
+    index->byte_sums = NULL;
+    index->sums_valid = 0;
+    return index;
+}
+
+/**
+ * Rebuild an index from the lengths of its lines, saved from another one, and
+ * its after_cr and partial state at the end of the text, for appending to it
+ */
+LineIndex line_index_restore(const int *lengths, int lines, int after_cr, int partial) {
+    LineIndex index = line_index_create();
+    if (lines < 1) return index;
+    free(index->blocks[0].lengths);
+    int count = (lines + LINE_INDEX_BLOCK - 1) / LINE_INDEX_BLOCK;
+    if (count > index->block_capacity) {
+        index->block_capacity = count;
+        index->blocks = realloc(index->blocks, count * sizeof(LineBlock));
+    }
+    index->length = 0;
+    for (int b = 0; b < count; b++) {
+        int first = b * LINE_INDEX_BLOCK;
+        int n = lines - first < LINE_INDEX_BLOCK ? lines - first : LINE_INDEX_BLOCK;
+        index->blocks[b] = new_block(lengths + first, n);
+        index->length += index->blocks[b].length;
+    }
+    index->block_count = count;
+    index->lines = lines;
+    index->after_cr = after_cr;
+    index->partial = partial;
+    return index;
+}
+
+void line_index_free(LineIndex index) {
+    for (int b = 0; b < index->block_count; b++) free(index->blocks[b].lengths);
+    free(index->blocks);
+    free(index->line_sums);
+    free(index->byte_sums);
+    free(index);
+}
+
+// Adds text to the end of the document; a file can be indexed chunk by chunk as it is read
+void line_index_append(LineIndex index, const char *text, int length) {
+    if (length <= 0) return;
+    if (index->after_cr && text[0] == '\n') {
+        add_to_line(index, index->lines - 2, 1);
+        index->cr_breaks--;
+        index->crlf_breaks++;
+        text++;
+        length--;
+    }
+    LineScan scan;
+    scan_init(&scan);
+    scan.partial = index->partial;
+    scan_text(&scan, text, length);
+
+    add_to_line(index, index->lines - 1, scan.lengths[0]);
+    for (int i = 1; i < scan.count; i++) {
+        LineBlock *last = &index->blocks[index->block_count - 1];
+        if (last->count == LINE_INDEX_BLOCK) {
+            insert_blocks(index, index->block_count, 1);
+            last = &index->blocks[index->block_count - 1];
+            *last = new_block(NULL, 0);
+        }
+        last->lengths[last->count++] = scan.lengths[i];
+        last->length += scan.lengths[i];
+        add_to_sums(index, index->block_count - 1, 1, scan.lengths[i]);
+        index->length += scan.lengths[i];
+        index->lines++;
+    }
+    index->after_cr = scan.after_cr;
+    index->partial = scan.partial;
+    index->lf_breaks += scan.lf;
+    index->crlf_breaks += scan.crlf;
+    index->cr_breaks += scan.cr;
+    free(scan.lengths);
+}
+
+/**
+ * Return the line-ending style of the text appended so far: the one kind of
+ * line break it has, LF if it has none
+ */
+LineEnding line_index_line_ending(LineIndex index) {
+    int kinds = (index->lf_breaks > 0) + (index->crlf_breaks > 0) + (index->cr_breaks > 0);
+    if (kinds > 1) return LINE_ENDING_MIXED;
+    if (index->crlf_breaks) return LINE_ENDING_CRLF;
+    if (index->cr_breaks) return LINE_ENDING_CR;
+    return LINE_ENDING_LF;
+}
+
+/*
+ * Follows an edit that replaced removed bytes at offset at with inserted ones;
+ * pt already holds the edited text
+ */
+void line_index_edit(LineIndex index, Piecetable pt, int at, int removed, int inserted) {
+    int first = line_index_line_at(index, at);
+    int last = line_index_line_at(index, at + removed);
+    if (first > 0) first--;
+    if (last < index->lines - 1) last++;
+    int from = line_index_start(index, first);
+    int to = last + 1 < index->lines ? line_index_start(index, last + 1) : index->length;
+    int new_to = to - removed + inserted;
+
+    LineScan scan;
+    scan_init(&scan);
+    PiecetableCursor cursor;
+    piecetable_cursor_init(pt, &cursor);
+    for (int offset = from; offset < new_to;) {
+        int available;
+        const char *text = piecetable_cursor_seek(pt, &cursor, offset, &available);
+        int n = available < new_to - offset ? available : new_to - offset;
+        scan_text(&scan, text, n);
+        offset += n;
+    }
+
+    // The range ends with a line break unless it runs to the end of the document
+    if (last + 1 < index->lines) {
+        scan.count--;
+    } else {
+        index->after_cr = scan.after_cr;
+        index->partial = scan.partial;
+    }
+    replace_lines(index, first, last + 1, scan.lengths, scan.count);
+    index->length += inserted - removed;
+    free(scan.lengths);
+}
+
+int line_index_count(LineIndex index) {
+    return index->lines;
+}
+
+// Returns the byte offset where line starts
+int line_index_start(LineIndex index, int line) {
+    if (line >= index->lines) return index->length;
+    int first, offset;
+    LineBlock *block = &index->blocks[find_block(index, line, 0, &first, &offset)];
+    for (int i = 0; i < line - first; i++) offset += block->lengths[i];
+    return offset;
+}
+
+// Returns the line holding the byte at offset; the end of the document is on the last line
+int line_index_line_at(LineIndex index, int offset) {
+    int line, start;
+    LineBlock *block = &index->blocks[find_block(index, offset, 1, &line, &start)];
+    int i = 0;
+    while (i < block->count - 1 && start + block->lengths[i] <= offset) start += block->lengths[i++];
+    return line + i;
+}
@@ -0,0 +1,47 @@
+#ifndef LINE_INDEX_H
+#define LINE_INDEX_H
+
+#include "encoding.h"
+#include "piecetable.h"
+
+#define LINE_INDEX_BLOCK 1024   // Most lines kept in one block
+
+// A run of consecutive lines
+typedef struct {
+    int count;     // Lines in the block
+    int length;    // Bytes in those lines
+    int *lengths;  // Bytes of each line, its line break included
+} LineBlock;
+
+/*
+ * Line lengths of a document, broken where GtkTextBuffer breaks lines (\n,
+ * \r\n, a lone \r and U+2029), so line n of a buffer holding the text is line
+ * n here. There is always at least one line; the last has no line break.
+ */
+typedef struct line_index {
+    LineBlock *blocks;
+    int block_count;
+    int block_capacity;
+    int *line_sums;  // Fenwick trees over the blocks' line and byte counts
+    int *byte_sums;
+    int sums_valid;  // 0 after blocks were added or removed
+    int lines;
+    int length;
+    int after_cr;  // While appending: the text so far ends in \r, which a \n would join
+    int partial;   // While appending: bytes of a U+2029 the text so far ends with
+    int lf_breaks;    // While appending: line breaks of each kind, which tell the file's line-ending style
+    int crlf_breaks;
+    int cr_breaks;
+} *LineIndex;
+
+LineIndex line_index_create(void);
+LineIndex line_index_restore(const int *lengths, int lines, int after_cr, int partial);
+void line_index_free(LineIndex index);
+void line_index_append(LineIndex index, const char *text, int length);
+void line_index_edit(LineIndex index, Piecetable pt, int at, int removed, int inserted);
+int line_index_count(LineIndex index);
+int line_index_start(LineIndex index, int line);
+int line_index_line_at(LineIndex index, int offset);
+LineEnding line_index_line_ending(LineIndex index);
+
+#endif // LINE_INDEX_H
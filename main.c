@@ -5,10 +5,14 @@
 #include "search.h"
 #include "window_title.h"
 #include "matching.h"
+#include "highlight.h"
 #include "text_color.h"
+#include "large_file.h"
+#include "hex_view.h"
 
 // Forward declaration
 static void on_color_menu_activate(GtkMenuItem *item, gpointer user_data);
+static gboolean on_window_delete(GtkWidget *widget, GdkEvent *event, gpointer user_data);
 
 int main(int argc, char *argv[])
 {
@@ -27,12 +31,14 @@ int main(int argc, char *argv[])
 
     undo_stack = undo_redo_stack_create();
     doc_piecetable = piecetable_create("");
+    doc_styles = style_spans_create(0);
 
     window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(window), "Simple GTK Text Editor");
     gtk_window_set_default_size(GTK_WINDOW(window), 800, 600);
     update_window_title(GTK_WINDOW(window), NULL);
 
+    g_signal_connect(window, "delete-event", G_CALLBACK(on_window_delete), NULL);
     g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
 
     vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
@@ -276,6 +282,12 @@ int main(int argc, char *argv[])
     gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), zoom_in_item);
     gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), zoom_out_item);
 
+    // Shows text other programs append to the file, like tail -f
+    GtkWidget *follow_item = gtk_check_menu_item_new_with_label("Follow File");
+    g_signal_connect(follow_item, "toggled", G_CALLBACK(on_follow_toggled), NULL);
+    gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), gtk_separator_menu_item_new());
+    gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), follow_item);
+
     gtk_menu_shell_append(GTK_MENU_SHELL(menubar), view_item);
 
     // --- Search menu ---
@@ -287,6 +299,14 @@ int main(int argc, char *argv[])
     search_toggle_item = gtk_menu_item_new_with_label("Find...");
     g_signal_connect(search_toggle_item, "activate", G_CALLBACK(show_search_bar), NULL);
     gtk_menu_shell_append(GTK_MENU_SHELL(search_menu), search_toggle_item);
+
+    GtkWidget *goto_offset_item = gtk_menu_item_new_with_label("Go to Offset...");
+    g_signal_connect(goto_offset_item, "activate", G_CALLBACK(show_goto_offset), window);
+    gtk_menu_shell_append(GTK_MENU_SHELL(search_menu), goto_offset_item);
+
+    GtkWidget *find_in_files_item = gtk_menu_item_new_with_label("Find in Files...");
+    g_signal_connect(find_in_files_item, "activate", G_CALLBACK(show_find_in_files), window);
+    gtk_menu_shell_append(GTK_MENU_SHELL(search_menu), find_in_files_item);
     gtk_menu_shell_append(GTK_MENU_SHELL(menubar), search_item);
 
     gtk_box_pack_start(GTK_BOX(vbox), menubar, FALSE, FALSE, 0);
@@ -296,16 +316,27 @@ int main(int argc, char *argv[])
     search_entry = gtk_search_entry_new();
     GtkWidget *search_prev = gtk_button_new_with_label("Previous");
     GtkWidget *search_next = gtk_button_new_with_label("Next");
+    search_count_label = gtk_label_new("");
+    search_regex_toggle = gtk_toggle_button_new_with_label("Regex");
+    search_case_toggle = gtk_toggle_button_new_with_label("Ignore case");
+    search_word_toggle = gtk_toggle_button_new_with_label("Whole word");
     GtkWidget *search_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
 
     gtk_box_pack_start(GTK_BOX(search_box), search_entry, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(search_box), search_prev, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(search_box), search_next, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(search_box), search_regex_toggle, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(search_box), search_case_toggle, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(search_box), search_word_toggle, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(search_box), search_count_label, FALSE, FALSE, 0);
     gtk_container_add(GTK_CONTAINER(search_bar), search_box);
 
     g_signal_connect(search_entry, "search-changed", G_CALLBACK(on_search_text_changed), NULL);
     g_signal_connect(search_prev, "clicked", G_CALLBACK(on_previous_match), NULL);
     g_signal_connect(search_next, "clicked", G_CALLBACK(on_next_match), NULL);
+    g_signal_connect(search_regex_toggle, "toggled", G_CALLBACK(on_search_mode_toggled), NULL);
+    g_signal_connect(search_case_toggle, "toggled", G_CALLBACK(on_search_mode_toggled), NULL);
+    g_signal_connect(search_word_toggle, "toggled", G_CALLBACK(on_search_mode_toggled), NULL);
 
     gtk_box_pack_start(GTK_BOX(vbox), search_bar, FALSE, FALSE, 0);
     gtk_search_bar_set_show_close_button(GTK_SEARCH_BAR(search_bar), TRUE);
@@ -331,12 +362,30 @@ int main(int argc, char *argv[])
     g_signal_connect(buffer, "begin-user-action", G_CALLBACK(on_begin_user_action), NULL);
     g_signal_connect(buffer, "end-user-action", G_CALLBACK(on_end_user_action), NULL);
     g_signal_connect(buffer, "changed", G_CALLBACK(on_buffer_changed), NULL);
+    g_signal_connect_after(buffer, "insert-text", G_CALLBACK(on_buffer_insert_text), NULL);
+    g_signal_connect(buffer, "delete-range", G_CALLBACK(on_buffer_delete_range_before), NULL);
+    g_signal_connect_after(buffer, "delete-range", G_CALLBACK(on_buffer_delete_range), NULL);
     g_signal_connect(color_item, "activate", G_CALLBACK(on_color_menu_activate), text_view);
     scrolled_window = gtk_scrolled_window_new(NULL, NULL);
     gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
                                    GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
     gtk_container_add(GTK_CONTAINER(scrolled_window), text_view);
-    gtk_box_pack_start(GTK_BOX(vbox), scrolled_window, TRUE, TRUE, 0);
+
+    // --- Large files: a window of lines, scrolled by a scrollbar over the whole file ---
+    GtkWidget *view_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    GtkWidget *large_file_scrollbar = init_large_file(GTK_TEXT_VIEW(text_view), GTK_SCROLLED_WINDOW(scrolled_window));
+    gtk_box_pack_start(GTK_BOX(view_box), scrolled_window, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(view_box), large_file_scrollbar, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), view_box, TRUE, TRUE, 0);
+
+    // --- Binary files: read-only rows of hex drawn from the mapped file ---
+    gtk_box_pack_start(GTK_BOX(vbox), init_hex_view(view_box), TRUE, TRUE, 0);
+
+    // --- Progress of a file being opened ---
+    gtk_box_pack_start(GTK_BOX(vbox), init_load_bar(), FALSE, FALSE, 0);
+
+    // --- Encoding and line endings of the document ---
+    gtk_box_pack_start(GTK_BOX(vbox), init_status_bar(), FALSE, FALSE, 0);
 
     // --- Bracket matching ---
     init_bracket_matching(GTK_TEXT_VIEW(text_view));
@@ -347,15 +396,35 @@ int main(int argc, char *argv[])
     GtkTextTag *tag2 = gtk_text_buffer_create_tag(buffer, "bracket_level_2", "foreground", "green", NULL);
     GtkTextTag *tag3 = gtk_text_buffer_create_tag(buffer, "bracket_level_3", "foreground", "orange", NULL);
 
+    // --- Syntax highlighting ---
+    init_highlighting(GTK_TEXT_VIEW(text_view));
+
+    // --- Formatting kept as style spans ---
+    init_text_styles(GTK_TEXT_VIEW(text_view), doc_styles);
+
     // --- Initialize font system AFTER text_view is created ---
     initialize_font_system();
 
     gtk_widget_show_all(window);
+
+    // --- The last session, then recovery of unsaved changes and autosave ---
+    init_session(GTK_WINDOW(window));
+    init_autosave(GTK_WINDOW(window));
+
     gtk_main();
+    finish_pending_save();
+    finish_autosave();
 
     return 0;
 }
 
+// The session is written while the window and its widgets still exist
+static gboolean on_window_delete(GtkWidget *widget, GdkEvent *event, gpointer user_data)
+{
+    finish_session();
+    return FALSE;
+}
+
 static void on_color_menu_activate(GtkMenuItem *item, gpointer user_data)
 {
     GtkTextView *text_view = GTK_TEXT_VIEW(user_data);
@@ -1,6 +1,8 @@
 #include <gtk/gtk.h>
 #include <string.h>
 #include "matching.h"
+#include "bracket_index.h"
+#include "lexer.h"
 
 // Tag names for parenthesis highlighting
 #define HIGHLIGHT_TAG "paren_highlight"
@@ -12,6 +14,39 @@ static GtkTextTag *mismatch_tag = NULL;
 static GtkTextMark *last_highlight_mark_start = NULL;
 static GtkTextMark *last_highlight_mark_end = NULL;
 
+// Bracket positions of the buffer, kept in step with every edit
+static BracketIndex bracket_index = NULL;
+
+// Lexer state at each line start, so brackets in strings and comments are left out
+static Lexer lexer = NULL;
+static int deleted_from_line = 0;  // First line to re-lex once a deletion is done
+static int stale_line = G_MAXINT;  // Lines from here on keep stale states and brackets until idle time re-lexes them
+static guint relex_source = 0;
+
+#define RELEX_LINE_LIMIT 2000  // Lines re-lexed during an edit before the rest is left to idle time
+#define RELEX_SLICE_US 5000    // Idle time spent per slice re-lexing stale lines
+#define RELEX_SLICE_LINES 256  // Stale lines lexed together
+
+// Code brackets reported by the lexer, in order
+typedef struct {
+    int *positions;
+    char *chars;
+    int count;
+    int capacity;
+} BracketList;
+
+static void collect_bracket(int offset, char bracket, void *data) {
+    BracketList *list = data;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->positions = g_renew(int, list->positions, list->capacity);
+        list->chars = g_renew(char, list->chars, list->capacity);
+    }
+    list->positions[list->count] = offset;
+    list->chars[list->count] = bracket;
+    list->count++;
+}
+
 /**
  * Checks if the character is an opening bracket
  */
@@ -45,48 +80,123 @@ static gchar get_matching_bracket(gchar ch) {
 }
 
 
-void highlight_brackets(GtkTextBuffer *buffer) {
-    GtkTextIter start, end;
-    gtk_text_buffer_get_start_iter(buffer, &start);
-    gtk_text_buffer_get_end_iter(buffer, &end);
+// --- Rainbow brackets ---
 
-    // First remove old bracket tags
-    gtk_text_buffer_remove_tag_by_name(buffer, "bracket_level_1", &start, &end);
-    gtk_text_buffer_remove_tag_by_name(buffer, "bracket_level_2", &start, &end);
-    gtk_text_buffer_remove_tag_by_name(buffer, "bracket_level_3", &start, &end);
+#define RAINBOW_LEVELS 3          // Depths with a bracket_level_N tag
+#define RAINBOW_MARGIN_LINES 50   // Lines tagged above and below the visible ones
 
-    GtkTextIter iter = start;
-    int level = 0;
+static GtkTextView *rainbow_view = NULL;
+static GtkTextTag *rainbow_tags[RAINBOW_LEVELS];
+static int rainbow_first_line = 0;  // Lines [first, end) carry up-to-date rainbow tags
+static int rainbow_end_line = 0;
+static guint rainbow_source = 0;
 
-    while (!gtk_text_iter_equal(&iter, &end)) {
-        gunichar ch = gtk_text_iter_get_char(&iter);
-        const char *tag_name = NULL;
+typedef struct {
+    GtkTextBuffer *buffer;
+    GtkTextIter iter;  // Kept near the last tagged bracket, so moving to the next is short
+    int iter_offset;
+    int level;
+} RainbowPass;
 
-        if (ch == '(' || ch == '[' || ch == '{') {
-            level++;
-        }
+static void tag_rainbow_bracket(int offset, char bracket, void *data) {
+    RainbowPass *pass = data;
+    int tag_level = 0;
+    if (bracket == '(' || bracket == '[' || bracket == '{') tag_level = ++pass->level;
+    else if (bracket == ')' || bracket == ']' || bracket == '}') tag_level = pass->level--;
+    if (tag_level < 1 || tag_level > RAINBOW_LEVELS) return;
+
+    gtk_text_iter_forward_chars(&pass->iter, offset - pass->iter_offset);
+    pass->iter_offset = offset;
+    GtkTextIter next = pass->iter;
+    gtk_text_iter_forward_char(&next);
+    gtk_text_buffer_apply_tag(pass->buffer, rainbow_tags[tag_level - 1], &pass->iter, &next);
+}
 
-        if (ch == ')' || ch == ']' || ch == '}') {
-            // Assign current level before decrementing
-            if (level <= 3) {
-                tag_name = g_strdup_printf("bracket_level_%d", level);
-                gtk_text_buffer_apply_tag_by_name(buffer, tag_name, &iter, gtk_text_iter_copy(&iter) + 1);
-                g_free((char *)tag_name);
-            }
-            level--;
-        } else if (ch == '(' || ch == '[' || ch == '{') {
-            if (level <= 3) {
-                tag_name = g_strdup_printf("bracket_level_%d", level);
-                gtk_text_buffer_apply_tag_by_name(buffer, tag_name, &iter, gtk_text_iter_copy(&iter) + 1);
-                g_free((char *)tag_name);
-            }
+/**
+ * Tags the code brackets of lines [from, to), starting from the depth the bracket index gives
+ */
+static void tag_bracket_lines(GtkTextBuffer *buffer, int from, int to) {
+    GtkTextIter start, end;
+    gtk_text_buffer_get_iter_at_line(buffer, &start, from);
+    if (to < gtk_text_buffer_get_line_count(buffer)) gtk_text_buffer_get_iter_at_line(buffer, &end, to);
+    else gtk_text_buffer_get_end_iter(buffer, &end);
+
+    for (int i = 0; i < RAINBOW_LEVELS; i++) gtk_text_buffer_remove_tag(buffer, rainbow_tags[i], &start, &end);
+
+    RainbowPass pass = {buffer, start, gtk_text_iter_get_offset(&start), 0};
+    pass.level = bracket_index_depth(bracket_index, pass.iter_offset);
+    gchar *text = gtk_text_buffer_get_slice(buffer, &start, &end, TRUE);
+    lexer_scan(lexer->grammar, lexer_line_state(lexer, from), text, strlen(text), pass.iter_offset,
+               tag_rainbow_bracket, &pass);
+    g_free(text);
+}
+
+/**
+ * Retags the lines near the viewport whose rainbow tags are missing or out of date
+ */
+void highlight_brackets(GtkTextView *text_view) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(text_view);
+    if (!rainbow_tags[0]) {
+        GtkTextTagTable *table = gtk_text_buffer_get_tag_table(buffer);
+        for (int i = 0; i < RAINBOW_LEVELS; i++) {
+            char name[32];
+            g_snprintf(name, sizeof(name), "bracket_level_%d", i + 1);
+            rainbow_tags[i] = gtk_text_tag_table_lookup(table, name);
+            if (!rainbow_tags[i]) return; // Tags not created yet
         }
+    }
+
+    GdkRectangle visible;
+    GtkTextIter top, bottom;
+    gtk_text_view_get_visible_rect(text_view, &visible);
+    gtk_text_view_get_line_at_y(text_view, &top, visible.y, NULL);
+    gtk_text_view_get_line_at_y(text_view, &bottom, visible.y + visible.height, NULL);
+
+    int lines = gtk_text_buffer_get_line_count(buffer);
+    int first = MAX(0, gtk_text_iter_get_line(&top) - RAINBOW_MARGIN_LINES);
+    int end = MIN(lines, gtk_text_iter_get_line(&bottom) + 1 + RAINBOW_MARGIN_LINES);
+
+    // Stale lines are tagged once idle time has re-lexed them
+    if (end > stale_line) end = MAX(first, stale_line);
 
-        gtk_text_iter_forward_char(&iter);
+    // Only the wanted lines outside the up-to-date range are touched
+    if (rainbow_end_line <= first || rainbow_first_line >= end) {
+        tag_bracket_lines(buffer, first, end);
+    } else {
+        if (first < rainbow_first_line) tag_bracket_lines(buffer, first, rainbow_first_line);
+        if (rainbow_end_line < end) tag_bracket_lines(buffer, rainbow_end_line, end);
     }
+    rainbow_first_line = first;
+    rainbow_end_line = end;
 }
 
+static gboolean rainbow_idle(gpointer data) {
+    rainbow_source = 0;
+    highlight_brackets(rainbow_view);
+    return G_SOURCE_REMOVE;
+}
 
+// Runs before GTK lays out and redraws, so each frame shows current tags
+static void schedule_rainbow(void) {
+    if (rainbow_view && !rainbow_source) rainbow_source = g_idle_add_full(G_PRIORITY_HIGH_IDLE, rainbow_idle, NULL, NULL);
+}
+
+/**
+ * An edit changes bracket depths from its line on
+ */
+static void invalidate_rainbow_from(int line) {
+    if (rainbow_end_line > line) rainbow_end_line = line;
+    if (rainbow_first_line > rainbow_end_line) rainbow_first_line = rainbow_end_line;
+    schedule_rainbow();
+}
+
+static void on_rainbow_scrolled(GtkAdjustment *adjustment, gpointer data) {
+    schedule_rainbow();
+}
+
+static void on_rainbow_resized(GtkWidget *widget, GdkRectangle *allocation, gpointer data) {
+    schedule_rainbow();
+}
 
 /**
  * Remove existing highlight tags from the buffer
@@ -110,6 +220,180 @@ static void remove_highlight_tags(GtkTextBuffer *buffer) {
         last_highlight_mark_end = NULL;
     }
 }
+
+/**
+ * Lex the whole buffer and index its code brackets from scratch
+ */
+static void rebuild_bracket_index(GtkTextBuffer *buffer) {
+    if (relex_source) {
+        g_source_remove(relex_source);
+        relex_source = 0;
+    }
+    stale_line = G_MAXINT;
+
+    GtkTextIter start, end;
+    gtk_text_buffer_get_bounds(buffer, &start, &end);
+    gchar *text = gtk_text_buffer_get_slice(buffer, &start, &end, TRUE);
+    BracketList list = {0};
+    lexer_scan_document(lexer, text, strlen(text), collect_bracket, &list);
+    bracket_index_clear(bracket_index, 0, G_MAXINT);
+    bracket_index_add(bracket_index, list.positions, list.chars, list.count);
+    g_free(list.positions);
+    g_free(list.chars);
+    g_free(text);
+}
+
+/**
+ * Character offset where the stale lines start, G_MAXINT if none are; the
+ * bracket index still holds the brackets lexed there before the last edits
+ */
+static int stale_offset(GtkTextBuffer *buffer) {
+    if (stale_line == G_MAXINT) return G_MAXINT;
+    GtkTextIter iter;
+    gtk_text_buffer_get_iter_at_line(buffer, &iter, stale_line);
+    return gtk_text_iter_get_offset(&iter);
+}
+
+/**
+ * Re-lex a slice of stale lines at a time until none are left
+ */
+static gboolean relex_idle(gpointer data) {
+    GtkTextBuffer *buffer = data;
+    int lines = gtk_text_buffer_get_line_count(buffer);
+    BracketList list = {0};
+
+    gint64 deadline = g_get_monotonic_time() + RELEX_SLICE_US;
+    while (stale_line < lines && g_get_monotonic_time() < deadline) {
+        int stop = MIN(lines, stale_line + RELEX_SLICE_LINES);
+        GtkTextIter start, end;
+        gtk_text_buffer_get_iter_at_line(buffer, &start, stale_line);
+        if (stop < lines) gtk_text_buffer_get_iter_at_line(buffer, &end, stop);
+        else gtk_text_buffer_get_end_iter(buffer, &end);
+
+        int from = gtk_text_iter_get_offset(&start);
+        gchar *text = gtk_text_buffer_get_slice(buffer, &start, &end, TRUE);
+        list.count = 0;
+        lexer_scan_lines(lexer, stale_line, text, strlen(text), from, collect_bracket, &list);
+        g_free(text);
+
+        bracket_index_clear(bracket_index, from, stop < lines ? gtk_text_iter_get_offset(&end) : G_MAXINT);
+        bracket_index_add(bracket_index, list.positions, list.chars, list.count);
+        stale_line = stop;
+    }
+    g_free(list.positions);
+    g_free(list.chars);
+    schedule_rainbow();
+    if (stale_line < lines) return G_SOURCE_CONTINUE;
+
+    stale_line = G_MAXINT;
+    relex_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * Leave the lines from line on to idle time
+ */
+static void mark_stale_from(GtkTextBuffer *buffer, int line) {
+    if (line < stale_line) stale_line = line;
+    if (!relex_source) relex_source = g_idle_add(relex_idle, buffer);
+}
+
+/**
+ * Re-lex from line until the edited lines are done and a line ends in the state
+ * the next one already starts with, re-indexing the brackets of each lexed line.
+ * Lexing stops at the stale lines, which idle time is already redoing.
+ */
+static void relex_lines(GtkTextBuffer *buffer, int line, int last_line) {
+    BracketList list = {0};
+    GtkTextIter start, end;
+    gtk_text_buffer_get_iter_at_line(buffer, &start, line);
+    for (int relexed = 0; line < stale_line; relexed++, line++) {
+        if (relexed == RELEX_LINE_LIMIT) {
+            // A comment or string opened or closed far above; the lines below wait for idle time
+            mark_stale_from(buffer, line);
+            break;
+        }
+        end = start;
+        gboolean more = gtk_text_iter_forward_line(&end);
+        int from = gtk_text_iter_get_offset(&start);
+        gchar *text = gtk_text_buffer_get_slice(buffer, &start, &end, TRUE);
+        list.count = 0;
+        int changed = lexer_scan_line(lexer, line, text, strlen(text), from, collect_bracket, &list);
+        g_free(text);
+
+        bracket_index_clear(bracket_index, from, more ? gtk_text_iter_get_offset(&end) : G_MAXINT);
+        bracket_index_add(bracket_index, list.positions, list.chars, list.count);
+        if (!more || (!changed && line >= last_line)) break;
+        start = end;
+    }
+    g_free(list.positions);
+    g_free(list.chars);
+}
+
+/**
+ * Match the lexer's line count to the buffer's after an edit at line
+ */
+static void sync_lexer_lines(GtkTextBuffer *buffer, int line) {
+    int added = gtk_text_buffer_get_line_count(buffer) - lexer->lines;
+    if (added > 0) lexer_insert_lines(lexer, line, added);
+    else lexer_remove_lines(lexer, line, -added);
+    if (stale_line != G_MAXINT && stale_line > line) stale_line = MAX(line + 1, stale_line + added);
+}
+
+/**
+ * Line of the character before offset: an edit at a line start can change how
+ * the previous line ends (a \r followed by a new \n, say)
+ */
+static int line_before(GtkTextBuffer *buffer, int offset) {
+    GtkTextIter iter;
+    gtk_text_buffer_get_iter_at_offset(buffer, &iter, MAX(0, offset - 1));
+    return gtk_text_iter_get_line(&iter);
+}
+
+/**
+ * Re-lex the lines an insertion touched, once it is in the buffer
+ */
+static void on_bracket_insert_text(GtkTextBuffer *buffer, GtkTextIter *location, gchar *text, gint len,
+                                   gpointer data) {
+    int chars = g_utf8_strlen(text, len);
+    int at = gtk_text_iter_get_offset(location) - chars;
+    int line = line_before(buffer, at);
+
+    bracket_index_insert_gap(bracket_index, at, chars);
+    sync_lexer_lines(buffer, line);
+    relex_lines(buffer, line, gtk_text_iter_get_line(location));
+    invalidate_rainbow_from(line);
+}
+
+/**
+ * Drop the deleted brackets, before the buffer changes
+ */
+static void on_bracket_delete_range(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, gpointer data) {
+    int at = gtk_text_iter_get_offset(start);
+    bracket_index_delete(bracket_index, at, gtk_text_iter_get_offset(end) - at);
+    deleted_from_line = line_before(buffer, at);
+}
+
+/**
+ * Re-lex the line a deletion joined, once it is done
+ */
+static void on_bracket_range_deleted(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, gpointer data) {
+    sync_lexer_lines(buffer, deleted_from_line);
+    relex_lines(buffer, deleted_from_line, gtk_text_iter_get_line(start));
+    invalidate_rainbow_from(deleted_from_line);
+}
+
+/**
+ * Pick the lexer grammar from filename's extension and re-lex the buffer if it changed
+ */
+void set_bracket_language(GtkTextView *text_view, const char *filename) {
+    const LexGrammar *grammar = lexer_grammar_for_file(filename);
+    if (!lexer || lexer->grammar == grammar) return;
+    lexer->grammar = grammar;
+    rebuild_bracket_index(gtk_text_view_get_buffer(text_view));
+    invalidate_rainbow_from(0);
+}
+
 static void ensure_tags_created(GtkTextBuffer *buffer) {
     if (!highlight_tag) {
         highlight_tag = gtk_text_buffer_create_tag(buffer, HIGHLIGHT_TAG,
@@ -153,42 +437,23 @@ void highlight_matching_bracket(GtkTextView *text_view, GtkTextIter *iter) {
     match_char = get_matching_bracket(current_char);
     match_pos = cursor;
     
-    // Find the matching bracket
-    if (is_opening_bracket(current_char)) {
-        // Search forward for closing bracket
-        int bracket_level = 1;
-        
-        while (gtk_text_iter_forward_char(&match_pos)) {
-            gchar ch = gtk_text_iter_get_char(&match_pos);
-            
-            if (ch == current_char) {
-                bracket_level++;
-            } else if (ch == match_char) {
-                bracket_level--;
-                if (bracket_level == 0) {
-                    found_match = TRUE;
-                    break;
-                }
-            }
-        }
-    } else if (is_closing_bracket(current_char)) {
-        // Search backward for opening bracket
-        int bracket_level = 1;
-        
-        while (gtk_text_iter_backward_char(&match_pos)) {
-            gchar ch = gtk_text_iter_get_char(&match_pos);
-            
-            if (ch == current_char) {
-                bracket_level++;
-            } else if (ch == match_char) {
-                bracket_level--;
-                if (bracket_level == 0) {
-                    found_match = TRUE;
-                    break;
-                }
-            }
-        }
+    // Find the matching bracket in the index; brackets in strings and comments are not in it
+    int stale = stale_offset(buffer);
+    if (gtk_text_iter_get_offset(&cursor) >= stale) return;
+    int partner = bracket_index_match(bracket_index, gtk_text_iter_get_offset(&cursor));
+    if (partner == BRACKET_NONE) return;
+    // An opening bracket's partner may be among the stale lines, which have not been re-lexed yet
+    if (partner >= stale) return;
+    if (partner == BRACKET_UNMATCHED && stale != G_MAXINT && is_opening_bracket(current_char)) return;
+    if (partner >= 0) gtk_text_buffer_get_iter_at_offset(buffer, &match_pos, partner);
+    if (partner >= 0 && gtk_text_iter_get_char(&match_pos) != match_char) {
+        // The index disagrees with the buffer; rebuild it rather than show a wrong partner
+        g_warning("Bracket index out of step with the buffer, rebuilding");
+        rebuild_bracket_index(buffer);
+        partner = bracket_index_match(bracket_index, gtk_text_iter_get_offset(&cursor));
+        if (partner >= 0) gtk_text_buffer_get_iter_at_offset(buffer, &match_pos, partner);
     }
+    found_match = partner >= 0;
     
     // Apply the tags to highlight the brackets
     GtkTextIter start_cursor = cursor;
@@ -232,7 +497,22 @@ void init_bracket_matching(GtkTextView *text_view) {
     
     // // Create the tags for highlighting
     ensure_tags_created(buffer);
+
+    // Lex and index the brackets once; the edit handlers keep both current
+    if (!bracket_index) bracket_index = bracket_index_create();
+    if (!lexer) lexer = lexer_create(lexer_grammar_for_file(NULL));
+    rebuild_bracket_index(buffer);
+    g_signal_connect_after(buffer, "insert-text", G_CALLBACK(on_bracket_insert_text), NULL);
+    g_signal_connect(buffer, "delete-range", G_CALLBACK(on_bracket_delete_range), NULL);
+    g_signal_connect_after(buffer, "delete-range", G_CALLBACK(on_bracket_range_deleted), NULL);
     
     // Connect to the mark-set signal to track cursor movement
     g_signal_connect(buffer, "mark-set", G_CALLBACK(on_mark_set), text_view);
+
+    // Rainbow tags follow the viewport
+    rainbow_view = text_view;
+    GtkAdjustment *vadjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(text_view));
+    if (vadjustment) g_signal_connect(vadjustment, "value-changed", G_CALLBACK(on_rainbow_scrolled), NULL);
+    g_signal_connect(text_view, "size-allocate", G_CALLBACK(on_rainbow_resized), NULL);
+    schedule_rainbow();
 }
\ No newline at end of file
@@ -18,8 +18,16 @@ void on_mark_set(GtkTextBuffer *buffer, GtkTextIter *location, GtkTextMark *mark
  */
 void init_bracket_matching(GtkTextView *text_view);
 
+/**
+ * Lex the buffer as the language filename's extension names, for bracket matching
+ */
+void set_bracket_language(GtkTextView *text_view, const char *filename);
+
 
-void highlight_brackets(GtkTextBuffer *buffer);
+/**
+ * Retag rainbow bracket levels in the lines around the viewport that need it
+ */
+void highlight_brackets(GtkTextView *text_view);
 void init_bracket_tags(GtkTextBuffer *buffer);
 
 #endif /* MATCHING_H */
\ No newline at end of file
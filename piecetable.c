@@ -3,10 +3,28 @@
 #include "piecetable.h"
 #include "list.h"
 
+static PiecetableBuffer buffer_create(char *text, int owned) {
+    PiecetableBuffer buffer = malloc(sizeof(struct piecetable_buffer));
+    buffer->text = text;
+    buffer->refs = 1;
+    buffer->owned = owned;
+    return buffer;
+}
+
+static void buffer_unref(PiecetableBuffer buffer) {
+    if (!buffer || --buffer->refs > 0) return;
+    if (buffer->owned) free(buffer->text);
+    free(buffer);
+}
+
 Piecetable piecetable_create(char *original) {
     Piecetable pt = malloc(sizeof(struct piecetable));
-    pt->original = strdup(original ? original : "");
-    pt->add = list_create();
+    pt->original_buffer = buffer_create(strdup(original ? original : ""), 1);
+    pt->original = pt->original_buffer->text;
+    pt->add = NULL;
+    pt->add_buffer = NULL;
+    pt->add_length = 0;
+    pt->add_capacity = 0;
     pt->pieces = list_create();
     pt->length = strlen(pt->original);
 
@@ -19,33 +37,139 @@ Piecetable piecetable_create(char *original) {
     return pt;
 }
 
+static Piecetable create_over_buffer(PiecetableBuffer original, int length) {
+    Piecetable pt = malloc(sizeof(struct piecetable));
+    pt->original_buffer = original;
+    pt->original = pt->original_buffer->text;
+    pt->add = NULL;
+    pt->add_buffer = NULL;
+    pt->add_length = 0;
+    pt->add_capacity = 0;
+    pt->pieces = list_create();
+    pt->length = length;
+
+    Piece piece = malloc(sizeof(struct piece));
+    piece->which = ORIGINAL;
+    piece->start = 0;
+    piece->length = length;
+    list_append(pt->pieces, piece);
+    return pt;
+}
+
+// Wraps length bytes of text without copying them; text must outlive the table and its snapshots
+Piecetable piecetable_create_view(const char *text, int length) {
+    return create_over_buffer(buffer_create((char *)text, 0), length);
+}
+
+// Like piecetable_create_view, but text was allocated with malloc() and is freed with the last snapshot
+Piecetable piecetable_create_owned(char *text, int length) {
+    return create_over_buffer(buffer_create(text, 1), length);
+}
+
+/**
+ * Rebuild a table from a piece list saved with it. The original text is read
+ * in place, as by a view, and must outlive the table and its snapshots; the
+ * add_length bytes of add are copied, since the table appends to them.
+ */
+Piecetable piecetable_restore(const char *original, const char *add, int add_length, const struct piece *pieces,
+                              int count) {
+    Piecetable pt = create_over_buffer(buffer_create((char *)original, 0), 0);
+    if (add_length > 0) piecetable_append_add(pt, add, add_length);
+    if (count > 0) {
+        list_free(pt->pieces);
+        pt->pieces = list_create();
+    }
+    for (int i = 0; i < count; i++) {
+        Piece piece = malloc(sizeof(struct piece));
+        *piece = pieces[i];
+        list_append(pt->pieces, piece);
+        pt->length += piece->length;
+    }
+    return pt;
+}
+
 void piecetable_free(Piecetable pt) {
     list_free(pt->pieces);
-    list_free(pt->add);
-    free(pt->original);
+    buffer_unref(pt->add_buffer);
+    buffer_unref(pt->original_buffer);
     free(pt);
 }
 
-int piecetable_add_length(Piecetable pt) {
-    int length = 0;
-    ListItem curr_item = list_get_first(pt->add);
-    while (curr_item) {
-        length += strlen((char *)curr_item->value);
-        curr_item = curr_item->next;
+/*
+ * Copies value to the end of the add buffer and returns where it starts there.
+ * Bytes past add_length are not read by snapshots, so text is appended in
+ * place; a buffer that must grow is only moved if no snapshot shares it.
+ */
+int piecetable_append_add(Piecetable pt, const char *value, int length) {
+    if (pt->add_length + length + 1 > pt->add_capacity) {
+        int capacity = pt->add_capacity ? pt->add_capacity : 256;
+        while (capacity < pt->add_length + length + 1) capacity *= 2;
+        if (pt->add_buffer && pt->add_buffer->refs == 1) {
+            pt->add_buffer->text = realloc(pt->add_buffer->text, capacity);
+        } else {
+            PiecetableBuffer grown = buffer_create(malloc(capacity), 1);
+            if (pt->add_length) memcpy(grown->text, pt->add, pt->add_length);
+            buffer_unref(pt->add_buffer);
+            pt->add_buffer = grown;
+        }
+        pt->add = pt->add_buffer->text;
+        pt->add_capacity = capacity;
     }
-    return length;
+    int start = pt->add_length;
+    memcpy(pt->add + start, value, length);
+    pt->add_length += length;
+    pt->add[pt->add_length] = '\0';
+    return start;
+}
+
+/**
+ * Extend the document with length bytes at offset start of text, a longer
+ * version of the original text such as a new mapping of a file that grew.
+ * The table reads its original text from text from then on, so text must
+ * hold the old one's bytes below start and outlive the table as a view's
+ * does; the old original text must be a view too. Snapshots taken before go
+ * on reading the old text.
+ */
+void piecetable_append_original(Piecetable pt, const char *text, int start, int length) {
+    buffer_unref(pt->original_buffer);
+    pt->original_buffer = buffer_create((char *)text, 0);
+    pt->original = pt->original_buffer->text;
+    if (length <= 0) return;
+
+    // Text appended again and again stays one piece
+    ListItem last = list_get_last(pt->pieces);
+    Piece piece = last ? (Piece)last->value : NULL;
+    if (piece && piece->which == ORIGINAL && piece->start + piece->length == start) {
+        piece->length += length;
+    } else {
+        piece = malloc(sizeof(struct piece));
+        piece->which = ORIGINAL;
+        piece->start = start;
+        piece->length = length;
+        list_append(pt->pieces, piece);
+    }
+    pt->length += length;
 }
 
 void piecetable_insert(Piecetable pt, char *value, int at) {
-    if (at < 0 || at > pt->length) return;
+    piecetable_insert_text(pt, value, strlen(value), at);
+}
 
-    int add_length_before_insert = piecetable_add_length(pt);
-    list_append(pt->add, strdup(value));
+static ListItem new_item(Piece piece, ListItem next) {
+    ListItem item = malloc(sizeof(struct list_item));
+    item->value = piece;
+    item->next = next;
+    return item;
+}
+
+// Inserts length bytes of value at offset at; value need not be terminated
+void piecetable_insert_text(Piecetable pt, const char *value, int length, int at) {
+    if (at < 0 || at > pt->length || length <= 0) return;
 
     Piece newPiece = malloc(sizeof(struct piece));
     newPiece->which = ADD;
-    newPiece->start = add_length_before_insert;
-    newPiece->length = strlen(value);
+    newPiece->start = piecetable_append_add(pt, value, length);
+    newPiece->length = length;
 
     if (at == 0) {
         list_insert(pt->pieces, 0, newPiece);
@@ -58,10 +182,9 @@ void piecetable_insert(Piecetable pt, char *value, int at) {
             if (offset + piece->length >= at) {
                 if (at - offset == piece->length) {
                     // Insert after this piece
-                    ListItem newPieceItem = malloc(sizeof(struct list_item));
-                    newPieceItem->value = newPiece;
-                    newPieceItem->next = piece_item->next;
-                    piece_item->next = newPieceItem;
+                    piece_item->next = new_item(newPiece, piece_item->next);
+                    if (pt->pieces->last == piece_item) pt->pieces->last = piece_item->next;
+                    pt->pieces->length++;
                 } else {
                     // Insert inside this piece
                     int oldLength = piece->length;
@@ -72,15 +195,10 @@ void piecetable_insert(Piecetable pt, char *value, int at) {
                     afterPiece->start = piece->start + piece->length;
                     afterPiece->length = oldLength - piece->length;
 
-                    ListItem newPieceItem = malloc(sizeof(struct list_item));
-                    newPieceItem->value = newPiece;
-                    newPieceItem->next = piece_item->next;
-                    piece_item->next = newPieceItem;
-
-                    ListItem afterPieceItem = malloc(sizeof(struct list_item));
-                    afterPieceItem->value = afterPiece;
-                    afterPieceItem->next = newPieceItem->next;
-                    newPieceItem->next = afterPieceItem;
+                    ListItem afterPieceItem = new_item(afterPiece, piece_item->next);
+                    piece_item->next = new_item(newPiece, afterPieceItem);
+                    if (pt->pieces->last == piece_item) pt->pieces->last = afterPieceItem;
+                    pt->pieces->length += 2;
                 }
                 break;
             } else {
@@ -89,37 +207,146 @@ void piecetable_insert(Piecetable pt, char *value, int at) {
             piece_item = piece_item->next;
         }
     }
-    pt->length += strlen(value);
+    pt->length += length;
+}
+
+// Removes length bytes at offset at, trimming or splitting the pieces they span
+void piecetable_delete(Piecetable pt, int at, int length) {
+    if (at < 0 || length <= 0 || at + length > pt->length) return;
+    int end = at + length;
+    ListItem previous = NULL, item = list_get_first(pt->pieces);
+    int offset = 0;
+
+    while (item && offset < end) {
+        Piece piece = (Piece)item->value;
+        int piece_end = offset + piece->length;
+        ListItem next = item->next;
+
+        if (piece_end <= at) {
+            previous = item;
+        } else if (at <= offset && piece_end <= end) {
+            // Entirely removed
+            if (previous) previous->next = next;
+            else pt->pieces->first = next;
+            if (pt->pieces->last == item) pt->pieces->last = previous;
+            pt->pieces->length--;
+            free(piece);
+            free(item);
+        } else if (offset < at && end < piece_end) {
+            // Removed from the middle: split in two
+            Piece afterPiece = malloc(sizeof(struct piece));
+            afterPiece->which = piece->which;
+            afterPiece->start = piece->start + (end - offset);
+            afterPiece->length = piece_end - end;
+            piece->length = at - offset;
+            item->next = new_item(afterPiece, next);
+            if (pt->pieces->last == item) pt->pieces->last = item->next;
+            pt->pieces->length++;
+            break;
+        } else if (offset < at) {
+            // Tail removed
+            piece->length = at - offset;
+            previous = item;
+        } else {
+            // Head removed
+            piece->start += end - offset;
+            piece->length = piece_end - end;
+            break;
+        }
+        offset = piece_end;
+        item = next;
+    }
+    pt->length -= length;
 }
 
 char *piecetable_value(Piecetable pt) {
     ListItem curr_piece_item = list_get_first(pt->pieces);
     char *value = malloc(pt->length + 1);
-    memset(value, 0, pt->length + 1);
+    int length = 0;
 
     Piece curr_piece;
     while (curr_piece_item) {
         curr_piece = (Piece)curr_piece_item->value;
-        if (curr_piece->which == ORIGINAL) {
-            strncat(value, pt->original + curr_piece->start, curr_piece->length);
-        } else {
-            ListItem curr_add_item = list_get_first(pt->add);
-            int offset = 0;
-            char *curr_add;
-            int curr_add_length;
-            while (curr_add_item) {
-                curr_add = (char *)curr_add_item->value;
-                curr_add_length = strlen(curr_add);
-                if (curr_piece->start < offset + curr_add_length) {
-                    strncat(value, curr_add + (curr_piece->start - offset), curr_piece->length);
-                    break;
-                } else {
-                    offset += curr_add_length;
-                    curr_add_item = curr_add_item->next;
-                }
-            }
-        }
+        memcpy(value + length, piecetable_piece_text(pt, curr_piece), curr_piece->length);
+        length += curr_piece->length;
         curr_piece_item = curr_piece_item->next;
     }
+    value[length] = '\0';
     return value;
 }
+
+// Returns a pointer to the first character of the piece inside its buffer
+const char *piecetable_piece_text(Piecetable pt, Piece piece) {
+    if (piece->which == ORIGINAL)
+        return pt->original + piece->start;
+    return pt->add + piece->start;
+}
+
+// Takes a snapshot in O(pieces) without copying text
+PiecetableSnapshot piecetable_snapshot(Piecetable pt) {
+    PiecetableSnapshot snapshot = malloc(sizeof(struct piecetable_snapshot));
+    snapshot->original = pt->original_buffer;
+    snapshot->original->refs++;
+    snapshot->add = pt->add_buffer;
+    if (snapshot->add) snapshot->add->refs++;
+    snapshot->count = 0;
+    for (ListItem item = list_get_first(pt->pieces); item; item = item->next) snapshot->count++;
+    snapshot->pieces = malloc((snapshot->count ? snapshot->count : 1) * sizeof(struct piece));
+    snapshot->length = pt->length;
+    snapshot->refs = 1;
+
+    int i = 0;
+    for (ListItem item = list_get_first(pt->pieces); item; item = item->next)
+        snapshot->pieces[i++] = *(Piece)item->value;
+    return snapshot;
+}
+
+/**
+ * References are taken and dropped on one thread; a snapshot handed to another
+ * thread is read there and released after it is handed back
+ */
+PiecetableSnapshot piecetable_snapshot_ref(PiecetableSnapshot snapshot) {
+    snapshot->refs++;
+    return snapshot;
+}
+
+void piecetable_snapshot_unref(PiecetableSnapshot snapshot) {
+    if (--snapshot->refs > 0) return;
+    buffer_unref(snapshot->original);
+    buffer_unref(snapshot->add);
+    free(snapshot->pieces);
+    free(snapshot);
+}
+
+// Returns the text of piece index of the snapshot, snapshot->pieces[index].length bytes
+const char *piecetable_snapshot_piece_text(PiecetableSnapshot snapshot, int index) {
+    struct piece *piece = &snapshot->pieces[index];
+    if (piece->which == ORIGINAL)
+        return snapshot->original->text + piece->start;
+    return snapshot->add->text + piece->start;
+}
+
+void piecetable_cursor_init(Piecetable pt, PiecetableCursor *cursor) {
+    cursor->item = list_get_first(pt->pieces);
+    cursor->start = 0;
+}
+
+/*
+ * Returns a pointer to the character at offset and stores in available how many
+ * characters follow it inside the same piece. Seeking forward is amortised O(1);
+ * seeking backwards restarts from the first piece. Returns NULL past the end.
+ */
+const char *piecetable_cursor_seek(Piecetable pt, PiecetableCursor *cursor, int offset, int *available) {
+    if (offset < 0 || offset >= pt->length) return NULL;
+    if (!cursor->item || offset < cursor->start)
+        piecetable_cursor_init(pt, cursor);
+
+    Piece piece = (Piece)cursor->item->value;
+    while (cursor->start + piece->length <= offset) {
+        cursor->start += piece->length;
+        cursor->item = cursor->item->next;
+        piece = (Piece)cursor->item->value;
+    }
+    *available = piece->length - (offset - cursor->start);
+    return piecetable_piece_text(pt, piece) + (offset - cursor->start);
+}
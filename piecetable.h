@@ -12,17 +12,62 @@ typedef struct piece {
     int length;
 } *Piece;
 
+// Text shared by a piece table and its snapshots, freed when the last one lets go
+typedef struct piecetable_buffer {
+    char *text;
+    int refs;
+    int owned;         // 0 if the text belongs to the caller (e.g. an mmapped file) and is not freed
+} *PiecetableBuffer;
+
 typedef struct piecetable {
     char *original;
-    List add;      // List of added strings
-    List pieces;   // List of Piece
-    int length;    // Character count of the current value
+    char *add;         // Added strings, back to back
+    PiecetableBuffer original_buffer;
+    PiecetableBuffer add_buffer;  // Holds add; NULL until something is added
+    int add_length;
+    int add_capacity;
+    List pieces;       // List of Piece
+    int length;        // Character count of the current value
 } *Piecetable;
 
+/*
+ * The text of a piece table at one moment. It copies only the piece list and
+ * shares the buffers, which the table never changes below their current
+ * length, so it can be read on another thread while the table is edited.
+ */
+typedef struct piecetable_snapshot {
+    PiecetableBuffer original;
+    PiecetableBuffer add;
+    struct piece *pieces;
+    int count;
+    int length;
+    int refs;
+} *PiecetableSnapshot;
+
+// Forward-moving position in the piece list, for scanning the document in place
+typedef struct {
+    ListItem item;  // Piece containing the last position sought
+    int start;      // Document offset where that piece begins
+} PiecetableCursor;
+
 Piecetable piecetable_create(char *original);
+Piecetable piecetable_create_view(const char *text, int length);
+Piecetable piecetable_create_owned(char *text, int length);
+Piecetable piecetable_restore(const char *original, const char *add, int add_length, const struct piece *pieces,
+                              int count);
 void piecetable_free(Piecetable pt);
-int piecetable_add_length(Piecetable pt);
+int piecetable_append_add(Piecetable pt, const char *value, int length);
+void piecetable_append_original(Piecetable pt, const char *text, int start, int length);
 void piecetable_insert(Piecetable pt, char *value, int at);
+void piecetable_insert_text(Piecetable pt, const char *value, int length, int at);
+void piecetable_delete(Piecetable pt, int at, int length);
 char *piecetable_value(Piecetable pt);
+const char *piecetable_piece_text(Piecetable pt, Piece piece);
+PiecetableSnapshot piecetable_snapshot(Piecetable pt);
+PiecetableSnapshot piecetable_snapshot_ref(PiecetableSnapshot snapshot);
+void piecetable_snapshot_unref(PiecetableSnapshot snapshot);
+const char *piecetable_snapshot_piece_text(PiecetableSnapshot snapshot, int index);
+void piecetable_cursor_init(Piecetable pt, PiecetableCursor *cursor);
+const char *piecetable_cursor_seek(Piecetable pt, PiecetableCursor *cursor, int offset, int *available);
 
 #endif // PIECETABLE_H
@@ -0,0 +1,1125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "regex_engine.h"
+#include "search.h"
+#include "unicode.h"
+
+/*
+ * Regular expressions without backtracking.
+ *
+ * A pattern is parsed into a syntax tree and compiled into a Thompson NFA
+ * program. Matches are found by a lazily built DFA whose states are sets of
+ * NFA instructions: it tells where a match ends and the last point where no
+ * partial match was alive, and a Pike VM run from that point recovers the
+ * exact leftmost-first match with its capture groups. Both engines read every
+ * byte once, so a search costs O(pattern * text) whatever the pattern.
+ * Patterns with assertions (^ $ \b, whole-word mode) or that can match the
+ * empty string use the Pike VM alone, and so does a scan whose DFA cache keeps
+ * overflowing.
+ * A literal prefix shared by every match lets both engines skip ahead with KMP.
+ */
+
+#define MAX_REPEAT 1000          // Largest {n,m} bound accepted
+#define MAX_NESTING 200          // Deepest nesting of groups and repetitions, which the compiler recurses into
+#define MAX_PROGRAM 100000       // Largest compiled program, in instructions
+#define MAX_CLASS_WIDE 256       // Non-ASCII characters a bracket class may list
+#define MAX_PREFIX 64            // Longest literal prefix used for skipping
+#define DFA_MAX_STATES 2048      // Cached DFA states before the cache is flushed
+#define DFA_BUCKETS 4096
+#define DFA_MAX_FLUSHES 8        // Flushes tolerated before falling back to the NFA
+#define DFA_MIN_BYTES_PER_STATE 16
+
+// --- Syntax tree ---
+
+enum { NODE_EMPTY, NODE_BYTE, NODE_CLASS, NODE_CAT, NODE_ALT, NODE_REPEAT, NODE_GROUP, NODE_ASSERT };
+enum { ASSERT_LINE_START, ASSERT_LINE_END, ASSERT_WORD, ASSERT_NOT_WORD, ASSERT_NO_WORD_BEFORE, ASSERT_NO_WORD_AFTER };
+
+typedef struct node {
+    int type;
+    int value;               // Byte, group index or assertion kind
+    int min, max, greedy;    // Repetition bounds, max = -1 when unbounded
+    unsigned char set[32];   // Single-byte members of a class
+    int any_wide;            // Class matches every multi-byte character
+    int *wide;               // Listed multi-byte code points
+    int nwide;
+    int literal;             // Character a case-insensitive class stands for, 0 for a real class
+    struct node *left, *right;
+} *Node;
+
+typedef struct {
+    const char *p;
+    int flags;               // SEARCH_CASE_INSENSITIVE, SEARCH_WHOLE_WORD
+    int groups;
+    char *names[REGEX_MAX_GROUPS];
+    char *error;
+    int error_size;
+    int failed;
+    int depth;               // Groups and repetitions around the current atom
+} Parser;
+
+static Node node_new(int type) {
+    Node n = calloc(1, sizeof(struct node));
+    n->type = type;
+    return n;
+}
+
+static Node node_pair(int type, Node left, Node right) {
+    Node n = node_new(type);
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+// Concatenations and alternations nest to the right, so a long one is walked rather than recursed into
+static void node_free(Node n) {
+    while (n) {
+        Node right = n->right;
+        node_free(n->left);
+        free(n->wide);
+        free(n);
+        n = right;
+    }
+}
+
+static void parse_fail(Parser *ps, const char *message) {
+    if (ps->failed) return;
+    ps->failed = 1;
+    if (ps->error) snprintf(ps->error, ps->error_size, "%s", message);
+}
+
+static void set_add(unsigned char *set, int byte) { set[byte >> 3] |= 1 << (byte & 7); }
+static int set_has(const unsigned char *set, int byte) { return set[byte >> 3] & (1 << (byte & 7)); }
+
+static void set_add_range(unsigned char *set, int lo, int hi) {
+    for (int b = lo; b <= hi; b++) set_add(set, b);
+}
+
+// Adds the members of \d \w \s (or their negations) to a class
+static void class_add_shorthand(Node n, char kind) {
+    unsigned char set[32] = {0};
+    switch (kind | 0x20) {
+        case 'd': set_add_range(set, '0', '9'); break;
+        case 'w': set_add_range(set, '0', '9'); set_add_range(set, 'a', 'z');
+                  set_add_range(set, 'A', 'Z'); set_add(set, '_'); break;
+        case 's': set_add(set, ' '); set_add_range(set, '\t', '\r'); break;
+    }
+    int negate = kind >= 'A' && kind <= 'Z';
+    for (int b = 0; b < 128; b++) {
+        if (!set_has(set, b) != !negate) set_add(n->set, b);
+    }
+    if (negate) n->any_wide = 1;
+}
+
+// Bytes that never start a valid UTF-8 sequence; "." and negated classes match them alone
+static void class_add_stray_bytes(Node n) {
+    set_add_range(n->set, 0x80, 0xC1);
+    set_add_range(n->set, 0xF5, 0xFF);
+}
+
+static void class_add_wide(Parser *ps, Node n, int cp) {
+    for (int i = 0; i < n->nwide; i++) {
+        if (n->wide[i] == cp) return;
+    }
+    if (n->nwide == MAX_CLASS_WIDE) { parse_fail(ps, "Class lists too many non-ASCII characters"); return; }
+    n->wide = realloc(n->wide, (n->nwide + 1) * sizeof(int));
+    n->wide[n->nwide++] = cp;
+}
+
+// Adds lo..hi to a class, with their other cases when matching case-insensitively
+static void class_add_range(Parser *ps, Node n, int lo, int hi, int negated) {
+    if (hi < lo) { parse_fail(ps, "Invalid range in class"); return; }
+    if (hi >= 128 && hi - (lo < 128 ? 128 : lo) >= MAX_CLASS_WIDE) {
+        parse_fail(ps, "Class lists too many non-ASCII characters");
+        return;
+    }
+    for (int cp = lo; cp <= hi && !ps->failed; cp++) {
+        int variants[UNICODE_MAX_VARIANTS] = {cp};
+        int count = (ps->flags & SEARCH_CASE_INSENSITIVE) ? unicode_fold_variants(cp, variants) : 1;
+        for (int i = 0; i < count; i++) {
+            if (variants[i] < 128) set_add(n->set, variants[i]);
+            else if (!negated || variants[i] == cp) class_add_wide(ps, n, variants[i]); // Negated classes stay ASCII
+        }
+        if (count == 0) set_add(n->set, cp);
+    }
+}
+
+// Reads an escape after the backslash; returns a code point, or -1 for a shorthand class
+static int parse_escape(Parser *ps, char *shorthand) {
+    char c = *ps->p;
+    if (!c) { parse_fail(ps, "Trailing backslash"); return 0; }
+    ps->p++;
+    switch (c) {
+        case 'd': case 'D': case 'w': case 'W': case 's': case 'S': *shorthand = c; return -1;
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case '0': return '\0';
+        case 'x': {
+            int value = 0;
+            for (int i = 0; i < 2; i++) {
+                char h = *ps->p;
+                int digit = (h >= '0' && h <= '9') ? h - '0' : (h | 0x20) >= 'a' && (h | 0x20) <= 'f' ? (h | 0x20) - 'a' + 10 : -1;
+                if (digit < 0) { parse_fail(ps, "Invalid \\x escape"); return 0; }
+                value = value * 16 + digit;
+                ps->p++;
+            }
+            return value;
+        }
+        default:
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+                parse_fail(ps, "Unknown escape");
+                return 0;
+            }
+            return (unsigned char)c;
+    }
+}
+
+static Node literal_node(Parser *ps, int cp) {
+    if (ps->flags & SEARCH_CASE_INSENSITIVE) {
+        int variants[UNICODE_MAX_VARIANTS];
+        if (unicode_fold_variants(cp, variants) > 1) {
+            Node n = node_new(NODE_CLASS);
+            class_add_range(ps, n, cp, cp, 0);
+            n->literal = cp;
+            return n;
+        }
+    }
+
+    unsigned char bytes[4];
+    int len = unicode_encode_utf8(cp, bytes);
+    Node n = NULL;
+    for (int i = 0; i < len; i++) {
+        Node b = node_new(NODE_BYTE);
+        b->value = bytes[i];
+        n = n ? node_pair(NODE_CAT, n, b) : b;
+    }
+    return n;
+}
+
+static Node parse_class(Parser *ps) {
+    Node n = node_new(NODE_CLASS);
+    int negate = 0;
+    if (*ps->p == '^') { negate = 1; ps->p++; }
+
+    int first = 1;
+    while (!ps->failed && (*ps->p != ']' || first)) {
+        first = 0;
+        if (!*ps->p) { parse_fail(ps, "Missing ]"); break; }
+
+        int lo;
+        char shorthand = 0;
+        if (*ps->p == '\\') {
+            ps->p++;
+            lo = parse_escape(ps, &shorthand);
+            if (shorthand) { class_add_shorthand(n, shorthand); continue; }
+        } else {
+            ps->p += unicode_decode_utf8((const unsigned char *)ps->p, &lo);
+        }
+
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            ps->p++;
+            if (*ps->p == '\\') {
+                ps->p++;
+                hi = parse_escape(ps, &shorthand);
+                if (shorthand) { parse_fail(ps, "Invalid range in class"); break; }
+            } else {
+                ps->p += unicode_decode_utf8((const unsigned char *)ps->p, &hi);
+            }
+        }
+        class_add_range(ps, n, lo, hi, negate);
+    }
+    if (*ps->p == ']') ps->p++;
+
+    if (negate) {
+        if (n->nwide) { parse_fail(ps, "Negated classes may only list ASCII characters"); return n; }
+        for (int i = 0; i < 16; i++) n->set[i] = ~n->set[i];
+        class_add_stray_bytes(n);
+        n->any_wide = !n->any_wide;
+    }
+    return n;
+}
+
+static Node parse_alternation(Parser *ps);
+
+static Node parse_atom(Parser *ps) {
+    char c = *ps->p;
+    Node n;
+    switch (c) {
+        case '(': {
+            ps->p++;
+            int group = -1;
+            if (ps->p[0] == '?' && ps->p[1] == ':') {
+                ps->p += 2;
+            } else {
+                char *name = NULL;
+                if (ps->p[0] == '?' && (ps->p[1] == '<' || (ps->p[1] == 'P' && ps->p[2] == '<'))) {
+                    ps->p += ps->p[1] == '<' ? 2 : 3;
+                    const char *end = strchr(ps->p, '>');
+                    if (!end || end == ps->p) { parse_fail(ps, "Invalid group name"); return node_new(NODE_EMPTY); }
+                    name = strndup(ps->p, end - ps->p);
+                    ps->p = end + 1;
+                } else if (ps->p[0] == '?') {
+                    parse_fail(ps, "Unsupported group syntax");
+                    return node_new(NODE_EMPTY);
+                }
+                if (ps->groups >= REGEX_MAX_GROUPS) {
+                    free(name);
+                    parse_fail(ps, "Too many groups");
+                    return node_new(NODE_EMPTY);
+                }
+                group = ps->groups++;
+                ps->names[group] = name;
+            }
+            if (ps->depth >= MAX_NESTING) {
+                parse_fail(ps, "Pattern nests too deeply");
+                return node_new(NODE_EMPTY);
+            }
+            ps->depth++;
+            Node inner = parse_alternation(ps);
+            ps->depth--;
+            if (*ps->p != ')') parse_fail(ps, "Missing )");
+            else ps->p++;
+            if (group < 0) return inner;
+            n = node_new(NODE_GROUP);
+            n->value = group;
+            n->left = inner;
+            return n;
+        }
+        case '[':
+            ps->p++;
+            return parse_class(ps);
+        case '.':
+            ps->p++;
+            n = node_new(NODE_CLASS);
+            set_add_range(n->set, 0, 0x7F);
+            n->set['\n' >> 3] &= ~(1 << ('\n' & 7));
+            n->set['\r' >> 3] &= ~(1 << ('\r' & 7));
+            class_add_stray_bytes(n);
+            n->any_wide = 1;
+            return n;
+        case '^':
+        case '$':
+            ps->p++;
+            n = node_new(NODE_ASSERT);
+            n->value = c == '^' ? ASSERT_LINE_START : ASSERT_LINE_END;
+            return n;
+        case '\\': {
+            if (ps->p[1] == 'b' || ps->p[1] == 'B') {
+                n = node_new(NODE_ASSERT);
+                n->value = ps->p[1] == 'b' ? ASSERT_WORD : ASSERT_NOT_WORD;
+                ps->p += 2;
+                return n;
+            }
+            ps->p++;
+            char shorthand = 0;
+            int cp = parse_escape(ps, &shorthand);
+            if (shorthand) {
+                n = node_new(NODE_CLASS);
+                class_add_shorthand(n, shorthand);
+                return n;
+            }
+            return literal_node(ps, cp);
+        }
+        case '*': case '+': case '?': case '{':
+            parse_fail(ps, "Nothing to repeat");
+            return node_new(NODE_EMPTY);
+        default: {
+            int cp;
+            ps->p += unicode_decode_utf8((const unsigned char *)ps->p, &cp);
+            return literal_node(ps, cp);
+        }
+    }
+}
+
+// Reads a decimal count, which stops growing past MAX_REPEAT so a long one cannot overflow
+static int parse_count(const char **p) {
+    int value = 0;
+    for (; **p >= '0' && **p <= '9'; (*p)++) {
+        value = value * 10 + (**p - '0');
+        if (value > MAX_REPEAT) value = MAX_REPEAT + 1;
+    }
+    return value;
+}
+
+// Parses {n}, {n,} or {n,m}; leaves p untouched and returns 0 if it is not a bound
+static int parse_bounds(Parser *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+    if (*p < '0' || *p > '9') return 0;
+    *min = parse_count(&p);
+    *max = *min;
+    if (*p == ',') {
+        p++;
+        *max = (*p >= '0' && *p <= '9') ? parse_count(&p) : -1;
+    }
+    if (*p != '}') return 0;
+    ps->p = p + 1;
+    if (*min > MAX_REPEAT || *max > MAX_REPEAT || (*max >= 0 && *max < *min))
+        parse_fail(ps, "Invalid repetition bounds");
+    return 1;
+}
+
+static Node parse_repeat(Parser *ps) {
+    Node n = parse_atom(ps);
+    int repeats = 0;
+    while (!ps->failed) {
+        int min, max;
+        char c = *ps->p;
+        if (c == '*') { min = 0; max = -1; ps->p++; }
+        else if (c == '+') { min = 1; max = -1; ps->p++; }
+        else if (c == '?') { min = 0; max = 1; ps->p++; }
+        else if (c == '{' && parse_bounds(ps, &min, &max)) { }
+        else break;
+
+        if (ps->depth + ++repeats > MAX_NESTING) {
+            parse_fail(ps, "Pattern nests too deeply");
+            break;
+        }
+        Node r = node_new(NODE_REPEAT);
+        r->min = min;
+        r->max = max;
+        r->greedy = 1;
+        if (*ps->p == '?') { r->greedy = 0; ps->p++; }
+        r->left = n;
+        n = r;
+    }
+    return n;
+}
+
+// Concatenations and alternations are built nesting to the right: a b c is a (b c)
+static Node parse_concat(Parser *ps) {
+    Node n = NULL, *tail = &n;
+    while (!ps->failed && *ps->p && *ps->p != '|' && *ps->p != ')') {
+        Node next = parse_repeat(ps);
+        if (*tail) {
+            *tail = node_pair(NODE_CAT, *tail, next);
+            tail = &(*tail)->right;
+        } else {
+            *tail = next;
+        }
+    }
+    return n ? n : node_new(NODE_EMPTY);
+}
+
+static Node parse_alternation(Parser *ps) {
+    Node n = parse_concat(ps), *tail = &n;
+    while (!ps->failed && *ps->p == '|') {
+        ps->p++;
+        *tail = node_pair(NODE_ALT, *tail, parse_concat(ps));
+        tail = &(*tail)->right;
+    }
+    return n;
+}
+
+// --- Program ---
+
+enum { OP_BYTE, OP_SET, OP_SPLIT, OP_JMP, OP_SAVE, OP_ASSERT, OP_MATCH };
+
+typedef struct {
+    int op;
+    int x;   // Byte, set index, jump target, save slot or assertion kind
+    int y;   // Second (lower priority) target of a split
+} Inst;
+
+typedef struct dfa_state {
+    int *pcs;          // Threads waiting for the next byte, sorted
+    int npcs;
+    int matching;      // A match ends where this state is entered
+    int next[256];     // Target state for each byte, -1 until built
+    int chain;         // Next state in the same hash bucket
+} DfaState;
+
+struct regex {
+    Inst *prog;
+    int ninst;
+    int cap;
+    unsigned char (*sets)[32];
+    int nsets;
+    int ngroups;
+    char *names[REGEX_MAX_GROUPS];
+    int has_assertions;
+    int nullable;             // The empty string matches
+    char prefix[MAX_PREFIX + 1];
+    Kmp prefix_kmp;
+    int failed;
+
+    // Pike VM scratch space
+    int nslots;
+    int *list_pcs[2];
+    int *list_caps[2];
+    int *marks;
+    int mark_generation;
+    int *stack;
+    int *caps_scratch;
+
+    // Lazy DFA
+    DfaState *states;
+    int nstates;
+    int *buckets;
+    int *closure;
+};
+
+static int emit(Regex rx, int op, int x, int y) {
+    if (rx->ninst >= MAX_PROGRAM) { rx->failed = 1; return rx->ninst - 1; }
+    if (rx->ninst == rx->cap) {
+        rx->cap = rx->cap ? rx->cap * 2 : 64;
+        rx->prog = realloc(rx->prog, rx->cap * sizeof(Inst));
+    }
+    rx->prog[rx->ninst].op = op;
+    rx->prog[rx->ninst].x = x;
+    rx->prog[rx->ninst].y = y;
+    return rx->ninst++;
+}
+
+static int add_set(Regex rx, const unsigned char *set) {
+    for (int i = 0; i < rx->nsets; i++) {
+        if (!memcmp(rx->sets[i], set, 32)) return i;
+    }
+    rx->sets = realloc(rx->sets, (rx->nsets + 1) * sizeof(*rx->sets));
+    memcpy(rx->sets[rx->nsets], set, 32);
+    return rx->nsets++;
+}
+
+static int add_range_set(Regex rx, int lo, int hi) {
+    unsigned char set[32] = {0};
+    set_add_range(set, lo, hi);
+    return add_set(rx, set);
+}
+
+// Emits the alternatives in parts[] as one choice; each entry is a function of the part index
+typedef void (*EmitPart)(Regex rx, Node n, int part);
+
+static void emit_choice(Regex rx, Node n, int parts, EmitPart emit_part) {
+    int *jumps = malloc(parts * sizeof(int));
+    for (int i = 0; i < parts; i++) {
+        int split = -1;
+        if (i < parts - 1) split = emit(rx, OP_SPLIT, rx->ninst + 1, 0);
+        emit_part(rx, n, i);
+        jumps[i] = i < parts - 1 ? emit(rx, OP_JMP, 0, 0) : -1;
+        if (split >= 0) rx->prog[split].y = rx->ninst;
+    }
+    for (int i = 0; i < parts - 1; i++) rx->prog[jumps[i]].x = rx->ninst;
+    free(jumps);
+}
+
+// Any character of part + 2 bytes, whatever the node; n is there to fit EmitPart
+static void emit_multibyte_part(Regex rx, Node n, int part) {
+    (void)n;
+    int cont = add_range_set(rx, 0x80, 0xBF);
+    static const int leads[3][2] = {{0xC2, 0xDF}, {0xE0, 0xEF}, {0xF0, 0xF4}};
+    emit(rx, OP_SET, add_range_set(rx, leads[part][0], leads[part][1]), 0);
+    for (int i = 0; i <= part; i++) emit(rx, OP_SET, cont, 0);
+}
+
+static int class_has_bytes(Node n) {
+    for (int i = 0; i < 32; i++) if (n->set[i]) return 1;
+    return 0;
+}
+
+static void emit_class_part(Regex rx, Node n, int part) {
+    if (class_has_bytes(n)) {
+        if (part == 0) { emit(rx, OP_SET, add_set(rx, n->set), 0); return; }
+        part--;
+    }
+    if (part < n->nwide) {
+        unsigned char bytes[4];
+        int len = unicode_encode_utf8(n->wide[part], bytes);
+        for (int i = 0; i < len; i++) emit(rx, OP_BYTE, bytes[i], 0);
+        return;
+    }
+    emit_choice(rx, n, 3, emit_multibyte_part);
+}
+
+static void compile_node(Regex rx, Node n);
+
+static void compile_repeat(Regex rx, Node n) {
+    Node child = n->left;
+    int min = n->min, max = n->max;
+
+    if (max < 0 && min > 0) {
+        // x{n,}: n-1 copies, then a copy that loops back to itself
+        for (int i = 0; i < min - 1; i++) compile_node(rx, child);
+        int loop = rx->ninst;
+        compile_node(rx, child);
+        if (n->greedy) emit(rx, OP_SPLIT, loop, rx->ninst + 1);
+        else emit(rx, OP_SPLIT, rx->ninst + 1, loop);
+        return;
+    }
+
+    for (int i = 0; i < min; i++) compile_node(rx, child);
+    if (max < 0) {
+        int split = emit(rx, OP_SPLIT, 0, 0);
+        compile_node(rx, child);
+        emit(rx, OP_JMP, split, 0);
+        if (n->greedy) { rx->prog[split].x = split + 1; rx->prog[split].y = rx->ninst; }
+        else { rx->prog[split].x = rx->ninst; rx->prog[split].y = split + 1; }
+        return;
+    }
+
+    // Up to max - min optional copies, nested so each needs the previous one
+    int optional = max - min;
+    int *splits = malloc((optional ? optional : 1) * sizeof(int));
+    for (int i = 0; i < optional; i++) {
+        splits[i] = emit(rx, OP_SPLIT, 0, 0);
+        compile_node(rx, child);
+    }
+    for (int i = 0; i < optional; i++) {
+        if (n->greedy) { rx->prog[splits[i]].x = splits[i] + 1; rx->prog[splits[i]].y = rx->ninst; }
+        else { rx->prog[splits[i]].x = rx->ninst; rx->prog[splits[i]].y = splits[i] + 1; }
+    }
+    free(splits);
+}
+
+// Compiles a run of alternatives nested to the right as one choice, without recursing into the run
+static void compile_alternation(Regex rx, Node n) {
+    int count = 0;
+    for (Node alt = n; alt->type == NODE_ALT; alt = alt->right) count++;
+    int *jumps = malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++, n = n->right) {
+        int split = emit(rx, OP_SPLIT, rx->ninst + 1, 0);
+        compile_node(rx, n->left);
+        jumps[i] = emit(rx, OP_JMP, 0, 0);
+        rx->prog[split].y = rx->ninst;
+    }
+    compile_node(rx, n);
+    for (int i = 0; i < count; i++) rx->prog[jumps[i]].x = rx->ninst;
+    free(jumps);
+}
+
+static void compile_node(Regex rx, Node n) {
+    // A long concatenation is walked along its right spine rather than recursed into
+    while (n->type == NODE_CAT && !rx->failed) {
+        compile_node(rx, n->left);
+        n = n->right;
+    }
+    if (rx->failed) return;
+    switch (n->type) {
+        case NODE_EMPTY:
+            break;
+        case NODE_BYTE:
+            emit(rx, OP_BYTE, n->value, 0);
+            break;
+        case NODE_CLASS: {
+            int parts = class_has_bytes(n) + n->nwide + (n->any_wide ? 1 : 0);
+            if (parts == 0) {
+                emit(rx, OP_SET, add_set(rx, n->set), 0); // Matches nothing
+            } else {
+                emit_choice(rx, n, parts, emit_class_part);
+            }
+            break;
+        }
+        case NODE_ALT:
+            compile_alternation(rx, n);
+            break;
+        case NODE_REPEAT:
+            compile_repeat(rx, n);
+            break;
+        case NODE_GROUP:
+            emit(rx, OP_SAVE, 2 * n->value, 0);
+            compile_node(rx, n->left);
+            emit(rx, OP_SAVE, 2 * n->value + 1, 0);
+            break;
+        case NODE_ASSERT:
+            rx->has_assertions = 1;
+            emit(rx, OP_ASSERT, n->value, 0);
+            break;
+    }
+}
+
+// Collects literal bytes every match must start with; *open is cleared when n ends the prefix
+static int collect_prefix(Node n, char *prefix, int len, int *open) {
+    if (!*open) return len;
+    switch (n->type) {
+        case NODE_EMPTY:
+        case NODE_ASSERT:
+            return len;
+        case NODE_BYTE:
+            if (len < MAX_PREFIX) prefix[len++] = n->value;
+            else *open = 0;
+            return len;
+        case NODE_CLASS:
+            // Case-insensitive literals stay in the prefix; the KMP skip folds them too
+            if (n->literal && len + 4 <= MAX_PREFIX) len += unicode_encode_utf8(n->literal, (unsigned char *)prefix + len);
+            else *open = 0;
+            return len;
+        case NODE_CAT:
+            for (; n->type == NODE_CAT && *open; n = n->right) len = collect_prefix(n->left, prefix, len, open);
+            return collect_prefix(n, prefix, len, open);
+        case NODE_GROUP:
+            return collect_prefix(n->left, prefix, len, open);
+        case NODE_REPEAT:
+            if (n->min > 0) len = collect_prefix(n->left, prefix, len, open);
+            if (n->min != 1 || n->max != 1) *open = 0;
+            return len;
+        default:
+            *open = 0;
+            return len;
+    }
+}
+
+// --- Pike VM ---
+
+// A line break is \n, \r\n or a lone \r; nothing is between the \r and \n of a CRLF
+static int assertion_holds(int kind, int prev, int cur) {
+    switch (kind) {
+        case ASSERT_LINE_START: return prev < 0 || prev == '\n' || (prev == '\r' && cur != '\n');
+        case ASSERT_LINE_END: return cur < 0 || cur == '\r' || (cur == '\n' && prev != '\r');
+        case ASSERT_WORD: return unicode_is_word_byte(prev) != unicode_is_word_byte(cur);
+        case ASSERT_NOT_WORD: return unicode_is_word_byte(prev) == unicode_is_word_byte(cur);
+        case ASSERT_NO_WORD_BEFORE: return !unicode_is_word_byte(prev);
+        case ASSERT_NO_WORD_AFTER: return !unicode_is_word_byte(cur);
+    }
+    return 0;
+}
+
+static int inst_accepts(Regex rx, const Inst *inst, int byte) {
+    if (byte < 0) return 0;
+    if (inst->op == OP_BYTE) return inst->x == byte;
+    return set_has(rx->sets[inst->x], byte);
+}
+
+/*
+ * Follows empty transitions from pc and appends every thread that waits for a
+ * byte (or has matched) to list, in priority order. caps is restored on return.
+ */
+static void add_thread(Regex rx, int list, int *count, int pc, int *caps, int pos, int prev, int cur) {
+    int *stack = rx->stack;
+    int top = 0;
+    stack[top++] = pc;
+    stack[top++] = -1;
+
+    while (top > 0) {
+        int slot = stack[--top];
+        pc = stack[--top];
+        if (slot >= 0) { caps[slot] = pc; continue; } // Undo a SAVE
+
+        while (rx->marks[pc] != rx->mark_generation) {
+            rx->marks[pc] = rx->mark_generation;
+            Inst *inst = &rx->prog[pc];
+            if (inst->op == OP_JMP) { pc = inst->x; continue; }
+            if (inst->op == OP_SPLIT) {
+                stack[top++] = inst->y;
+                stack[top++] = -1;
+                pc = inst->x;
+                continue;
+            }
+            if (inst->op == OP_SAVE) {
+                stack[top++] = caps[inst->x];
+                stack[top++] = inst->x;
+                caps[inst->x] = pos;
+                pc++;
+                continue;
+            }
+            if (inst->op == OP_ASSERT) {
+                if (!assertion_holds(inst->x, prev, cur)) break;
+                pc++;
+                continue;
+            }
+            rx->list_pcs[list][*count] = pc;
+            memcpy(rx->list_caps[list] + *count * rx->nslots, caps, rx->nslots * sizeof(int));
+            (*count)++;
+            break;
+        }
+    }
+}
+
+typedef struct {
+    Piecetable pt;
+    PiecetableCursor *cursor;
+    const unsigned char *text;
+    int start;     // Document offset of text[0]
+    int length;
+    int end;       // Bytes at or after this offset read as end of input
+} ByteReader;
+
+static void reader_init(ByteReader *reader, Piecetable pt, PiecetableCursor *cursor, int end) {
+    reader->pt = pt;
+    reader->cursor = cursor;
+    reader->text = NULL;
+    reader->start = 0;
+    reader->length = 0;
+    reader->end = end;
+}
+
+static int reader_byte(ByteReader *reader, int pos) {
+    if (pos < 0 || pos >= reader->end) return -1;
+    if (pos < reader->start || pos >= reader->start + reader->length) {
+        int available;
+        const char *text = piecetable_cursor_seek(reader->pt, reader->cursor, pos, &available);
+        if (!text) return -1;
+        reader->text = (const unsigned char *)text;
+        reader->start = pos;
+        reader->length = available;
+    }
+    return reader->text[pos - reader->start];
+}
+
+// Finds the leftmost-first match starting at or after from; *end_prev gets the byte before the match end
+static int pike_search(RegexScanner *sc, int from, int prev, RegexMatch *match, int *end_prev) {
+    Regex rx = sc->rx;
+    ByteReader reader;
+    reader_init(&reader, sc->pt, &sc->nfa_cursor, sc->end);
+
+    int *caps = rx->caps_scratch;
+    int count = 0, matched = 0, pending = 0;
+    int *pending_pcs = rx->list_pcs[1], *pending_caps = rx->list_caps[1];
+
+    for (int pos = from; ; pos++) {
+        if (!pending && !matched && rx->prefix_kmp && pos < sc->end) {
+            int next = kmp_find(rx->prefix_kmp, sc->pt, &sc->prefix_cursor, pos, sc->end);
+            if (next < 0) return 0;
+            if (next > pos) {
+                pos = next;
+                prev = reader_byte(&reader, pos - 1);
+            }
+        }
+        int cur = reader_byte(&reader, pos);
+
+        // Close the threads that consumed the previous byte, then start a new one
+        rx->mark_generation++;
+        count = 0;
+        for (int i = 0; i < pending; i++) {
+            memcpy(caps, pending_caps + i * rx->nslots, rx->nslots * sizeof(int));
+            add_thread(rx, 0, &count, pending_pcs[i], caps, pos, prev, cur);
+        }
+        if (!matched) {
+            for (int i = 0; i < rx->nslots; i++) caps[i] = -1;
+            add_thread(rx, 0, &count, 0, caps, pos, prev, cur);
+        }
+
+        // Step every thread over cur; a match cuts off lower-priority threads
+        pending = 0;
+        for (int i = 0; i < count; i++) {
+            int pc = rx->list_pcs[0][i];
+            int *thread_caps = rx->list_caps[0] + i * rx->nslots;
+            Inst *inst = &rx->prog[pc];
+            if (inst->op == OP_MATCH) {
+                matched = 1;
+                memcpy(match->groups, thread_caps, rx->nslots * sizeof(int));
+                *end_prev = prev;
+                break;
+            }
+            if (inst_accepts(rx, inst, cur)) {
+                pending_pcs[pending] = pc + 1;
+                memcpy(pending_caps + pending * rx->nslots, thread_caps, rx->nslots * sizeof(int));
+                pending++;
+            }
+        }
+
+        if (cur < 0 || (!pending && matched)) break;
+        prev = cur;
+    }
+    return matched;
+}
+
+// --- Lazy DFA ---
+
+static unsigned hash_pcs(const int *pcs, int npcs) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < npcs; i++) h = (h ^ (unsigned)pcs[i]) * 16777619u;
+    return h % DFA_BUCKETS;
+}
+
+static void dfa_flush(Regex rx) {
+    for (int i = 0; i < rx->nstates; i++) free(rx->states[i].pcs);
+    rx->nstates = 0;
+    for (int i = 0; i < DFA_BUCKETS; i++) rx->buckets[i] = -1;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Returns the state for a sorted set of waiting threads, creating it if needed
+static int dfa_state_for(Regex rx, int *pcs, int npcs) {
+    unsigned h = hash_pcs(pcs, npcs);
+    for (int i = rx->buckets[h]; i >= 0; i = rx->states[i].chain) {
+        if (rx->states[i].npcs == npcs && !memcmp(rx->states[i].pcs, pcs, npcs * sizeof(int)))
+            return i;
+    }
+    if (rx->nstates == DFA_MAX_STATES) return -1;
+
+    DfaState *state = &rx->states[rx->nstates];
+    state->pcs = malloc((npcs ? npcs : 1) * sizeof(int));
+    memcpy(state->pcs, pcs, npcs * sizeof(int));
+    state->npcs = npcs;
+    for (int i = 0; i < 256; i++) state->next[i] = -1;
+    state->chain = rx->buckets[h];
+    rx->buckets[h] = rx->nstates;
+
+    // Matching if closing the waiting threads plus a fresh start reaches MATCH
+    int count = 0;
+    rx->mark_generation++;
+    for (int i = 0; i <= npcs; i++) {
+        int pc = i < npcs ? pcs[i] : 0;
+        add_thread(rx, 0, &count, pc, rx->caps_scratch, 0, -1, -1);
+    }
+    state->matching = 0;
+    for (int i = 0; i < count; i++) {
+        if (rx->prog[rx->list_pcs[0][i]].op == OP_MATCH) state->matching = 1;
+    }
+    return rx->nstates++;
+}
+
+// Builds the transition of state s over byte; returns -1 if the cache is full
+static int dfa_transition(Regex rx, int s, int byte) {
+    int count = 0;
+    rx->mark_generation++;
+    DfaState *state = &rx->states[s];
+    for (int i = 0; i <= state->npcs; i++) {
+        int pc = i < state->npcs ? state->pcs[i] : 0;
+        add_thread(rx, 0, &count, pc, rx->caps_scratch, 0, -1, -1);
+    }
+
+    int npcs = 0;
+    for (int i = 0; i < count; i++) {
+        Inst *inst = &rx->prog[rx->list_pcs[0][i]];
+        if (inst->op != OP_MATCH && inst_accepts(rx, inst, byte))
+            rx->closure[npcs++] = rx->list_pcs[0][i] + 1;
+    }
+    qsort(rx->closure, npcs, sizeof(int), compare_ints);
+
+    int target = dfa_state_for(rx, rx->closure, npcs);
+    if (target >= 0) rx->states[s].next[byte] = target;
+    return target;
+}
+
+/*
+ * Scans forward from *from until a match ends. Returns 1 with *from and *prev set
+ * to the last position where no partial match was alive, 0 if there is no match,
+ * or -1 (with *from and *prev set the same way) if the DFA gave up.
+ */
+static int dfa_search(RegexScanner *sc, int *from, int *prev) {
+    Regex rx = sc->rx;
+    ByteReader reader;
+    reader_init(&reader, sc->pt, &sc->dfa_cursor, sc->end);
+
+    int pos = *from, last_byte = *prev;
+    int reset = pos, reset_prev = last_byte;
+    int bytes_since_flush = 0;
+    int empty[1];
+    int s = dfa_state_for(rx, empty, 0);
+    if (s < 0) { dfa_flush(rx); s = dfa_state_for(rx, empty, 0); }
+
+    for (;;) {
+        DfaState *state = &rx->states[s];
+        if (state->matching) {
+            *from = reset;
+            *prev = reset_prev;
+            return 1;
+        }
+        if (state->npcs == 0) {
+            if (rx->prefix_kmp && pos < sc->end) {
+                int next = kmp_find(rx->prefix_kmp, sc->pt, &sc->prefix_cursor, pos, sc->end);
+                if (next < 0) return 0;
+                if (next > pos) {
+                    pos = next;
+                    last_byte = reader_byte(&reader, pos - 1);
+                }
+            }
+            reset = pos;
+            reset_prev = last_byte;
+        }
+        if (pos >= sc->end) return 0;
+
+        int byte = reader_byte(&reader, pos);
+        int target = state->next[byte];
+        if (target < 0) {
+            target = dfa_transition(rx, s, byte);
+            if (target < 0) {
+                // Cache full: keep only the current state and carry on
+                int npcs = state->npcs;
+                int *pcs = malloc((npcs ? npcs : 1) * sizeof(int));
+                memcpy(pcs, state->pcs, npcs * sizeof(int));
+                dfa_flush(rx);
+                sc->dfa_flushes++;
+                s = dfa_state_for(rx, pcs, npcs);
+                free(pcs);
+                if (sc->dfa_flushes > DFA_MAX_FLUSHES &&
+                    bytes_since_flush < DFA_MAX_STATES * DFA_MIN_BYTES_PER_STATE) {
+                    *from = reset;
+                    *prev = reset_prev;
+                    return -1;
+                }
+                bytes_since_flush = 0;
+                continue;
+            }
+        }
+        s = target;
+        last_byte = byte;
+        pos++;
+        bytes_since_flush++;
+    }
+}
+
+// --- Public interface ---
+
+Regex regex_compile(const char *pattern, int flags, char *error, int error_size) {
+    Parser ps = {0};
+    ps.p = pattern;
+    ps.flags = flags;
+    ps.groups = 1; // Group 0 is the whole match
+    ps.error = error;
+    ps.error_size = error_size;
+
+    Node root = parse_alternation(&ps);
+    if (!ps.failed && *ps.p == ')') parse_fail(&ps, "Unmatched )");
+    if (ps.failed) {
+        node_free(root);
+        for (int i = 0; i < REGEX_MAX_GROUPS; i++) free(ps.names[i]);
+        return NULL;
+    }
+    if (flags & SEARCH_WHOLE_WORD) {
+        Node before = node_new(NODE_ASSERT), after = node_new(NODE_ASSERT);
+        before->value = ASSERT_NO_WORD_BEFORE;
+        after->value = ASSERT_NO_WORD_AFTER;
+        root = node_pair(NODE_CAT, node_pair(NODE_CAT, before, root), after);
+    }
+
+    Regex rx = calloc(1, sizeof(struct regex));
+    rx->ngroups = ps.groups;
+    memcpy(rx->names, ps.names, sizeof(rx->names));
+    emit(rx, OP_SAVE, 0, 0);
+    compile_node(rx, root);
+    emit(rx, OP_SAVE, 1, 0);
+    emit(rx, OP_MATCH, 0, 0);
+
+    int open = 1;
+    int prefix_length = collect_prefix(root, rx->prefix, 0, &open);
+    rx->prefix[prefix_length] = '\0';
+    node_free(root);
+
+    if (rx->failed) {
+        if (error) snprintf(error, error_size, "Pattern is too large");
+        regex_free(rx);
+        return NULL;
+    }
+    if (prefix_length > 0) rx->prefix_kmp = kmp_create(rx->prefix, prefix_length, flags & SEARCH_CASE_INSENSITIVE);
+
+    rx->nslots = 2 * rx->ngroups;
+    for (int i = 0; i < 2; i++) {
+        rx->list_pcs[i] = malloc(rx->ninst * sizeof(int));
+        rx->list_caps[i] = malloc(rx->ninst * rx->nslots * sizeof(int));
+    }
+    rx->marks = calloc(rx->ninst, sizeof(int));
+    rx->stack = malloc(4 * (rx->ninst + 1) * sizeof(int));
+    rx->caps_scratch = malloc(rx->nslots * sizeof(int));
+    rx->closure = malloc(rx->ninst * sizeof(int));
+    rx->states = malloc(DFA_MAX_STATES * sizeof(DfaState));
+    rx->buckets = malloc(DFA_BUCKETS * sizeof(int));
+    for (int i = 0; i < DFA_BUCKETS; i++) rx->buckets[i] = -1;
+
+    // A pattern that matches the empty string would make every DFA state matching
+    int empty[1];
+    int start = dfa_state_for(rx, empty, 0);
+    rx->nullable = rx->states[start].matching;
+    return rx;
+}
+
+void regex_free(Regex rx) {
+    if (!rx) return;
+    if (rx->states) dfa_flush(rx);
+    for (int i = 0; i < 2; i++) {
+        free(rx->list_pcs[i]);
+        free(rx->list_caps[i]);
+    }
+    for (int i = 0; i < REGEX_MAX_GROUPS; i++) free(rx->names[i]);
+    if (rx->prefix_kmp) kmp_free(rx->prefix_kmp);
+    free(rx->marks);
+    free(rx->stack);
+    free(rx->caps_scratch);
+    free(rx->closure);
+    free(rx->states);
+    free(rx->buckets);
+    free(rx->sets);
+    free(rx->prog);
+    free(rx);
+}
+
+int regex_group_count(Regex rx) {
+    return rx->ngroups;
+}
+
+// Returns the index of a named group, or -1
+int regex_group_index(Regex rx, const char *name) {
+    for (int i = 1; i < rx->ngroups; i++) {
+        if (rx->names[i] && !strcmp(rx->names[i], name)) return i;
+    }
+    return -1;
+}
+
+int regex_dfa_states(Regex rx) {
+    return rx->nstates;
+}
+
+const char *regex_literal_prefix(Regex rx) {
+    return rx->prefix;
+}
+
+void regex_scanner_init(RegexScanner *scanner, Regex rx, Piecetable pt, int from, int to) {
+    memset(scanner, 0, sizeof(RegexScanner));
+    scanner->rx = rx;
+    scanner->pt = pt;
+    scanner->position = from;
+    scanner->end = to < pt->length ? to : pt->length;
+    scanner->nfa_only = rx->has_assertions || rx->nullable;
+    piecetable_cursor_init(pt, &scanner->dfa_cursor);
+    piecetable_cursor_init(pt, &scanner->nfa_cursor);
+    piecetable_cursor_init(pt, &scanner->prefix_cursor);
+
+    ByteReader reader;
+    reader_init(&reader, pt, &scanner->nfa_cursor, scanner->end);
+    scanner->prev_byte = reader_byte(&reader, from - 1);
+}
+
+// Finds the next match; returns 0 once the range is exhausted
+int regex_scanner_next(RegexScanner *sc, RegexMatch *match) {
+    if (sc->position > sc->end) return 0;
+
+    int from = sc->position, prev = sc->prev_byte;
+    if (!sc->nfa_only) {
+        int found = dfa_search(sc, &from, &prev);
+        if (found == 0) { sc->position = sc->end + 1; return 0; }
+        if (found < 0) sc->nfa_only = 1;
+    }
+
+    int end_prev = prev;
+    for (int i = 0; i < 2 * REGEX_MAX_GROUPS; i++) match->groups[i] = -1;
+    if (!pike_search(sc, from, prev, match, &end_prev)) {
+        sc->position = sc->end + 1;
+        return 0;
+    }
+
+    int start = match->groups[0], end = match->groups[1];
+    if (end > start) {
+        sc->position = end;
+        sc->prev_byte = end_prev;
+    } else {
+        // Step over one character after an empty match
+        ByteReader reader;
+        reader_init(&reader, sc->pt, &sc->nfa_cursor, sc->end);
+        int byte = reader_byte(&reader, end);
+        int next = end + 1;
+        while (next < sc->end && (reader_byte(&reader, next) & 0xC0) == 0x80) next++;
+        sc->position = byte < 0 ? sc->end + 1 : next;
+        sc->prev_byte = reader_byte(&reader, next - 1);
+    }
+    return 1;
+}
+
+// Collects every match in the document, like kmp_search does for literal patterns
+SearchResults regex_search(Regex rx, Piecetable pt, int limit) {
+    SearchResults results;
+    search_results_init(&results, limit);
+    results.match_length = SEARCH_VARIABLE_LENGTH;
+
+    RegexScanner scanner;
+    RegexMatch match;
+    regex_scanner_init(&scanner, rx, pt, 0, pt->length);
+    while (regex_scanner_next(&scanner, &match))
+        search_results_add_match(&results, match.groups[0], match.groups[1] - match.groups[0]);
+    return results;
+}
@@ -0,0 +1,41 @@
+#ifndef REGEX_ENGINE_H
+#define REGEX_ENGINE_H
+
+#include "piecetable.h"
+#include "search.h"
+
+#define REGEX_MAX_GROUPS 32 // Capture groups, counting group 0 (the whole match)
+
+typedef struct regex *Regex;
+
+typedef struct {
+    int groups[2 * REGEX_MAX_GROUPS]; // Start and end offset of each group, -1 if it did not take part
+} RegexMatch;
+
+// Iteration state for finding successive matches in a piece table range
+typedef struct {
+    Regex rx;
+    Piecetable pt;
+    int position;              // Where the next search starts
+    int prev_byte;             // Byte before position, -1 at the start of the document
+    int end;                   // Matches must end at or before this offset
+    int nfa_only;              // Set once the DFA cache thrashes and the scan falls back to the NFA
+    int dfa_flushes;
+    PiecetableCursor dfa_cursor;
+    PiecetableCursor nfa_cursor;
+    PiecetableCursor prefix_cursor;
+} RegexScanner;
+
+Regex regex_compile(const char *pattern, int flags, char *error, int error_size);
+void regex_free(Regex rx);
+int regex_group_count(Regex rx);
+int regex_group_index(Regex rx, const char *name);
+int regex_dfa_states(Regex rx);
+const char *regex_literal_prefix(Regex rx);
+
+void regex_scanner_init(RegexScanner *scanner, Regex rx, Piecetable pt, int from, int to);
+int regex_scanner_next(RegexScanner *scanner, RegexMatch *match);
+
+SearchResults regex_search(Regex rx, Piecetable pt, int limit);
+
+#endif // REGEX_ENGINE_H
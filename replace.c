@@ -0,0 +1,341 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "replace.h"
+#include "list.h"
+
+static void append_piece(List pieces, int which, int start, int length) {
+    if (length <= 0) return;
+
+    // Neighbouring spans of one buffer merge back into a single piece
+    ListItem last = list_get_last(pieces);
+    if (last) {
+        Piece previous = (Piece)last->value;
+        if (previous->which == which && previous->start + previous->length == start) {
+            previous->length += length;
+            return;
+        }
+    }
+
+    Piece piece = malloc(sizeof(struct piece));
+    piece->which = which;
+    piece->start = start;
+    piece->length = length;
+    list_append(pieces, piece);
+}
+
+// Appends the old pieces' spans covering document offsets [from, to) to pieces
+static void copy_span(List pieces, PiecetableCursor *cursor, int from, int to) {
+    while (from < to) {
+        Piece piece = (Piece)cursor->item->value;
+        int piece_end = cursor->start + piece->length;
+        if (from >= piece_end) {
+            cursor->start = piece_end;
+            cursor->item = cursor->item->next;
+            continue;
+        }
+        int end = to < piece_end ? to : piece_end;
+        append_piece(pieces, piece->which, piece->start + (from - cursor->start), end - from);
+        from = end;
+    }
+}
+
+/*
+ * Replaces every match with replacement in a single pass: the new piece list
+ * references the untouched spans of the old pieces, and every replacement
+ * points at one copy of the replacement text in the add buffer. Overlapping
+ * matches are skipped. Returns the number of replacements made.
+ */
+int replace_all(Piecetable pt, const SearchResults *matches, const char *replacement) {
+    SearchCursor match;
+    if (!search_cursor_first(matches, &match)) return 0;
+
+    int replacement_length = strlen(replacement);
+    int replacement_start = piecetable_append_add(pt, replacement, replacement_length);
+
+    List pieces = list_create();
+    PiecetableCursor cursor;
+    piecetable_cursor_init(pt, &cursor);
+
+    int copied = 0, replaced = 0, length = 0;
+    for (int i = 0; i < matches->count; i++, search_cursor_next(matches, &match)) {
+        int offset = search_cursor_offset(&match);
+        if (offset < copied) continue;
+
+        copy_span(pieces, &cursor, copied, offset);
+        append_piece(pieces, ADD, replacement_start, replacement_length);
+        length += offset - copied + replacement_length;
+        copied = offset + search_cursor_length(matches, &match);
+        replaced++;
+    }
+    copy_span(pieces, &cursor, copied, pt->length);
+    length += pt->length - copied;
+
+    list_free(pt->pieces);
+    pt->pieces = pieces;
+    pt->length = length;
+    return replaced;
+}
+
+// --- Regex replacement ---
+
+#define REPLACE_BATCH 65536 // Replacement bytes gathered before each append to the add buffer
+
+typedef struct {
+    int group;   // Capture group to copy, or -1 for literal text
+    int start;   // Literal text in the expanded template
+    int length;
+} TemplatePart;
+
+typedef struct {
+    TemplatePart *parts;
+    int count;
+    char *text;  // Literal parts, with escapes already resolved
+} Template;
+
+static void add_part(Template *tpl, int group, int start, int length) {
+    if (group < 0 && tpl->count > 0 && tpl->parts[tpl->count - 1].group < 0) {
+        tpl->parts[tpl->count - 1].length += length;
+        return;
+    }
+    tpl->parts[tpl->count].group = group;
+    tpl->parts[tpl->count].start = start;
+    tpl->parts[tpl->count].length = length;
+    tpl->count++;
+}
+
+/*
+ * Splits a replacement into literal text and group references: \0 to \9, $n
+ * and ${n} by number, $name and ${name} by group name. \\ and $$ stand for
+ * the character itself and \n and \t for newline and tab.
+ */
+static int template_parse(Template *tpl, const char *replacement, Regex rx, char *error, int error_size) {
+    int n = strlen(replacement);
+    tpl->parts = malloc((n + 1) * sizeof(TemplatePart));
+    tpl->text = malloc(n + 1);
+    tpl->count = 0;
+
+    int length = 0;
+    for (int i = 0; i < n;) {
+        char c = replacement[i];
+        int group = -1;
+        if (c == '\\' && i + 1 < n) {
+            char next = replacement[i + 1];
+            i += 2;
+            if (next >= '0' && next <= '9') group = next - '0';
+            else c = next == 'n' ? '\n' : next == 't' ? '\t' : next;
+        } else if (c == '$' && i + 1 < n && replacement[i + 1] == '$') {
+            i += 2;
+        } else if (c == '$' && i + 1 < n) {
+            int braced = replacement[i + 1] == '{';
+            int start = i + 1 + braced, end = start;
+            while (end < n && (replacement[end] == '_' || isalnum((unsigned char)replacement[end]))) end++;
+            if (end == start || (braced && (end >= n || replacement[end] != '}'))) {
+                i++;
+            } else {
+                char name[64];
+                int name_length = end - start < 63 ? end - start : 63;
+                memcpy(name, replacement + start, name_length);
+                name[name_length] = '\0';
+                if (isdigit((unsigned char)name[0])) {
+                    group = atoi(name);
+                } else {
+                    group = regex_group_index(rx, name);
+                    if (group < 0) {
+                        snprintf(error, error_size, "No group named '%s'", name);
+                        return 0;
+                    }
+                }
+                i = end + braced;
+            }
+        } else {
+            i++;
+        }
+
+        if (group < 0) {
+            tpl->text[length] = c;
+            add_part(tpl, -1, length++, 1);
+        } else if (group >= regex_group_count(rx)) {
+            snprintf(error, error_size, "No group %d in the pattern", group);
+            return 0;
+        } else {
+            add_part(tpl, group, 0, 0);
+        }
+    }
+    return 1;
+}
+
+static void template_free(Template *tpl) {
+    free(tpl->parts);
+    free(tpl->text);
+}
+
+// Replacement text waiting to be appended to the add buffer in one go
+typedef struct {
+    Piecetable pt;
+    char *data;
+    int used;
+} Batch;
+
+// Returns the add-buffer offset the next batched byte will get
+static int batch_offset(Batch *batch) {
+    return batch->pt->add_length + batch->used;
+}
+
+static void batch_flush(Batch *batch) {
+    if (batch->used == 0) return;
+    piecetable_append_add(batch->pt, batch->data, batch->used);
+    batch->used = 0;
+}
+
+static void batch_write(Batch *batch, const char *text, int length) {
+    if (batch->used + length > REPLACE_BATCH) {
+        batch_flush(batch);
+        if (length > REPLACE_BATCH) {
+            piecetable_append_add(batch->pt, text, length);
+            return;
+        }
+    }
+    memcpy(batch->data + batch->used, text, length);
+    batch->used += length;
+}
+
+// Copies document offsets [from, to) of the current pieces into the batch
+static void batch_write_document(Batch *batch, PiecetableCursor *cursor, int from, int to) {
+    while (from < to) {
+        // Flush before seeking: the text may live in the add buffer a flush reallocates
+        if (batch->used == REPLACE_BATCH) batch_flush(batch);
+        int available;
+        const char *text = piecetable_cursor_seek(batch->pt, cursor, from, &available);
+        int length = to - from < available ? to - from : available;
+        if (length > REPLACE_BATCH - batch->used) length = REPLACE_BATCH - batch->used;
+        memcpy(batch->data + batch->used, text, length);
+        batch->used += length;
+        from += length;
+    }
+}
+
+// Writes the expansion of tpl for one match; returns its length
+static int expand_match(Batch *batch, PiecetableCursor *cursor, const Template *tpl, const RegexMatch *match) {
+    int length = 0;
+    for (int p = 0; p < tpl->count; p++) {
+        const TemplatePart *part = &tpl->parts[p];
+        if (part->group < 0) {
+            batch_write(batch, tpl->text + part->start, part->length);
+            length += part->length;
+            continue;
+        }
+        int start = match->groups[2 * part->group], end = match->groups[2 * part->group + 1];
+        if (start < 0 || end <= start) continue;
+        batch_write_document(batch, cursor, start, end);
+        length += end - start;
+    }
+    return length;
+}
+
+/*
+ * Replaces every match of rx, expanding group references in replacement, in a
+ * single pass over the document. Matches are streamed from the scanner and
+ * their expansions are written to the add buffer in batches, so besides the
+ * new piece list only the replacement text itself is stored. Returns the
+ * number of replacements, or -1 with error set if replacement refers to a
+ * group the pattern does not have.
+ */
+int replace_regex(Piecetable pt, Regex rx, const char *replacement, char *error, int error_size) {
+    Template tpl;
+    if (!template_parse(&tpl, replacement, rx, error, error_size)) {
+        template_free(&tpl);
+        return -1;
+    }
+
+    Batch batch = {pt, malloc(REPLACE_BATCH), 0};
+    List pieces = list_create();
+    PiecetableCursor copy_cursor, group_cursor;
+    piecetable_cursor_init(pt, &copy_cursor);
+    piecetable_cursor_init(pt, &group_cursor);
+
+    RegexScanner scanner;
+    RegexMatch match;
+    regex_scanner_init(&scanner, rx, pt, 0, pt->length);
+
+    int copied = 0, replaced = 0, length = 0;
+    while (regex_scanner_next(&scanner, &match)) {
+        int start = match.groups[0];
+        copy_span(pieces, &copy_cursor, copied, start);
+
+        int offset = batch_offset(&batch);
+        int expanded = expand_match(&batch, &group_cursor, &tpl, &match);
+        append_piece(pieces, ADD, offset, expanded);
+
+        length += start - copied + expanded;
+        copied = match.groups[1];
+        replaced++;
+    }
+    batch_flush(&batch);
+    copy_span(pieces, &copy_cursor, copied, pt->length);
+    length += pt->length - copied;
+
+    free(batch.data);
+    template_free(&tpl);
+    list_free(pt->pieces);
+    pt->pieces = pieces;
+    pt->length = length;
+    return replaced;
+}
+
+/**
+ * Expands replacement for the match of rx starting at offset. Returns NULL if
+ * none starts there, or with error set if replacement refers to a group the
+ * pattern does not have; error is empty otherwise.
+ */
+char *replace_regex_expand(Piecetable pt, Regex rx, const char *replacement, int offset, int *match_length,
+                           char *error, int error_size) {
+    Template tpl;
+    error[0] = '\0';
+    if (!template_parse(&tpl, replacement, rx, error, error_size)) {
+        template_free(&tpl);
+        return NULL;
+    }
+
+    RegexScanner scanner;
+    RegexMatch match;
+    regex_scanner_init(&scanner, rx, pt, offset, pt->length);
+    char *result = NULL;
+    if (regex_scanner_next(&scanner, &match) && match.groups[0] == offset) {
+        int length = 0;
+        for (int p = 0; p < tpl.count; p++) {
+            const TemplatePart *part = &tpl.parts[p];
+            if (part->group < 0) length += part->length;
+            else if (match.groups[2 * part->group] >= 0)
+                length += match.groups[2 * part->group + 1] - match.groups[2 * part->group];
+        }
+        result = malloc(length + 1);
+        PiecetableCursor cursor;
+        piecetable_cursor_init(pt, &cursor);
+        int written = 0;
+        for (int p = 0; p < tpl.count; p++) {
+            const TemplatePart *part = &tpl.parts[p];
+            int from = part->start, to = part->start + part->length;
+            if (part->group < 0) {
+                memcpy(result + written, tpl.text + from, to - from);
+                written += to - from;
+                continue;
+            }
+            from = match.groups[2 * part->group];
+            to = match.groups[2 * part->group + 1];
+            while (from >= 0 && from < to) {
+                int available;
+                const char *text = piecetable_cursor_seek(pt, &cursor, from, &available);
+                int take = to - from < available ? to - from : available;
+                memcpy(result + written, text, take);
+                written += take;
+                from += take;
+            }
+        }
+        result[written] = '\0';
+        *match_length = match.groups[1] - match.groups[0];
+    }
+    template_free(&tpl);
+    return result;
+}
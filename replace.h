@@ -0,0 +1,13 @@
+#ifndef REPLACE_H
+#define REPLACE_H
+
+#include "piecetable.h"
+#include "search.h"
+#include "regex_engine.h"
+
+int replace_all(Piecetable pt, const SearchResults *matches, const char *replacement);
+int replace_regex(Piecetable pt, Regex rx, const char *replacement, char *error, int error_size);
+char *replace_regex_expand(Piecetable pt, Regex rx, const char *replacement, int offset, int *match_length,
+                           char *error, int error_size);
+
+#endif // REPLACE_H
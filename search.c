@@ -2,11 +2,234 @@
 #include <stdlib.h>
 #include "search.h"
 #include "piecetable.h"
+#include "unicode.h"
 
-static void compute_lps(const char *pattern, int *lps) {
+// --- Result storage ---
+
+void search_results_init(SearchResults *results, int limit) {
+    results->first = NULL;
+    results->last = NULL;
+    results->count = 0;
+    results->total = 0;
+    results->limit = limit;
+    results->match_length = 0;
+}
+
+// Allocates an empty chunk and links it in after `prev` (or at the front)
+static SearchChunk chunk_insert_after(SearchResults *results, SearchChunk prev) {
+    SearchChunk chunk = malloc(sizeof(struct search_chunk));
+    chunk->count = 0;
+    chunk->shift = 0;
+    chunk->lengths = NULL;
+    chunk->prev = prev;
+    chunk->next = prev ? prev->next : results->first;
+    if (chunk->next) chunk->next->prev = chunk;
+    else results->last = chunk;
+    if (prev) prev->next = chunk;
+    else results->first = chunk;
+    return chunk;
+}
+
+static void chunk_unlink(SearchResults *results, SearchChunk chunk) {
+    if (chunk->prev) chunk->prev->next = chunk->next;
+    else results->first = chunk->next;
+    if (chunk->next) chunk->next->prev = chunk->prev;
+    else results->last = chunk->prev;
+    free(chunk->lengths);
+    free(chunk);
+}
+
+static int chunk_offset(SearchChunk chunk, int pos) {
+    return chunk->offsets[pos] + chunk->shift;
+}
+
+void search_results_add(SearchResults *results, int offset) {
+    results->total++;
+    if (results->limit != SEARCH_NO_LIMIT && results->count >= results->limit)
+        return; // Only counted, not stored
+
+    SearchChunk chunk = results->last;
+    if (!chunk || chunk->count == SEARCH_CHUNK_SIZE)
+        chunk = chunk_insert_after(results, results->last);
+    chunk->offsets[chunk->count++] = offset - chunk->shift;
+    results->count++;
+}
+
+// Stores a match whose length may differ from results->match_length
+void search_results_add_match(SearchResults *results, int offset, int length) {
+    int stored = results->count;
+    search_results_add(results, offset);
+    if (results->count == stored) return;
+
+    SearchChunk chunk = results->last;
+    if (!chunk->lengths && length == results->match_length) return;
+    if (!chunk->lengths) {
+        chunk->lengths = malloc(SEARCH_CHUNK_SIZE * sizeof(int));
+        for (int i = 0; i < chunk->count; i++)
+            chunk->lengths[i] = results->match_length;
+    }
+    chunk->lengths[chunk->count - 1] = length;
+}
+
+// Stores a match in sorted position, splitting a full chunk if needed
+static void search_results_insert_sorted(SearchResults *results, int offset, int length) {
+    SearchChunk chunk = results->first;
+    while (chunk && chunk->next && chunk_offset(chunk, chunk->count - 1) < offset)
+        chunk = chunk->next;
+    if (!chunk) chunk = chunk_insert_after(results, NULL);
+
+    int pos = 0;
+    while (pos < chunk->count && chunk_offset(chunk, pos) < offset)
+        pos++;
+
+    if (chunk->count == SEARCH_CHUNK_SIZE) {
+        // Move the upper half into a new chunk
+        SearchChunk upper = chunk_insert_after(results, chunk);
+        int half = SEARCH_CHUNK_SIZE / 2;
+        upper->shift = chunk->shift;
+        upper->count = SEARCH_CHUNK_SIZE - half;
+        memcpy(upper->offsets, chunk->offsets + half, upper->count * sizeof(int));
+        if (chunk->lengths) {
+            upper->lengths = malloc(SEARCH_CHUNK_SIZE * sizeof(int));
+            memcpy(upper->lengths, chunk->lengths + half, upper->count * sizeof(int));
+        }
+        chunk->count = half;
+        if (pos > half) {
+            chunk = upper;
+            pos -= half;
+        }
+    }
+    memmove(chunk->offsets + pos + 1, chunk->offsets + pos, (chunk->count - pos) * sizeof(int));
+    chunk->offsets[pos] = offset - chunk->shift;
+    if (!chunk->lengths && length != results->match_length) {
+        chunk->lengths = malloc(SEARCH_CHUNK_SIZE * sizeof(int));
+        for (int i = 0; i < chunk->count + 1; i++)
+            chunk->lengths[i] = results->match_length;
+    }
+    if (chunk->lengths) {
+        memmove(chunk->lengths + pos + 1, chunk->lengths + pos, (chunk->count - pos) * sizeof(int));
+        chunk->lengths[pos] = length;
+    }
+    chunk->count++;
+    results->count++;
+    results->total++;
+}
+
+// Drops stored offsets past the limit; they stay counted in total
+static void search_results_trim(SearchResults *results) {
+    if (results->limit == SEARCH_NO_LIMIT) return;
+    while (results->count > results->limit) {
+        SearchChunk chunk = results->last;
+        int excess = results->count - results->limit;
+        if (excess >= chunk->count) {
+            results->count -= chunk->count;
+            chunk_unlink(results, chunk);
+        } else {
+            chunk->count -= excess;
+            results->count -= excess;
+        }
+    }
+}
+
+void search_results_free(SearchResults *results) {
+    SearchChunk chunk = results->first;
+    while (chunk) {
+        SearchChunk next = chunk->next;
+        free(chunk->lengths);
+        free(chunk);
+        chunk = next;
+    }
+    results->first = NULL;
+    results->last = NULL;
+    results->count = 0;
+    results->total = 0;
+}
+
+// --- Lazy navigation ---
+
+int search_cursor_first(const SearchResults *results, SearchCursor *cursor) {
+    cursor->chunk = results->first;
+    cursor->pos = 0;
+    cursor->index = 0;
+    return cursor->chunk != NULL;
+}
+
+int search_cursor_last(const SearchResults *results, SearchCursor *cursor) {
+    cursor->chunk = results->last;
+    cursor->pos = cursor->chunk ? cursor->chunk->count - 1 : 0;
+    cursor->index = results->count - 1;
+    return cursor->chunk != NULL;
+}
+
+// Moves to the next match, wrapping around to the first one
+int search_cursor_next(const SearchResults *results, SearchCursor *cursor) {
+    if (!cursor->chunk) return search_cursor_first(results, cursor);
+    if (cursor->pos + 1 < cursor->chunk->count) {
+        cursor->pos++;
+        cursor->index++;
+    } else if (cursor->chunk->next) {
+        cursor->chunk = cursor->chunk->next;
+        cursor->pos = 0;
+        cursor->index++;
+    } else {
+        return search_cursor_first(results, cursor);
+    }
+    return 1;
+}
+
+// Moves to the previous match, wrapping around to the last one
+int search_cursor_prev(const SearchResults *results, SearchCursor *cursor) {
+    if (!cursor->chunk) return search_cursor_last(results, cursor);
+    if (cursor->pos > 0) {
+        cursor->pos--;
+        cursor->index--;
+    } else if (cursor->chunk->prev) {
+        cursor->chunk = cursor->chunk->prev;
+        cursor->pos = cursor->chunk->count - 1;
+        cursor->index--;
+    } else {
+        return search_cursor_last(results, cursor);
+    }
+    return 1;
+}
+
+int search_cursor_offset(const SearchCursor *cursor) {
+    return cursor->chunk ? chunk_offset(cursor->chunk, cursor->pos) : -1;
+}
+
+int search_cursor_length(const SearchResults *results, const SearchCursor *cursor) {
+    if (!cursor->chunk) return 0;
+    return cursor->chunk->lengths ? cursor->chunk->lengths[cursor->pos] : results->match_length;
+}
+
+// Places the cursor on the first match at or after offset, wrapping to the first match
+int search_cursor_seek(const SearchResults *results, SearchCursor *cursor, int offset) {
+    int index = 0;
+    SearchChunk chunk = results->first;
+    while (chunk && chunk_offset(chunk, chunk->count - 1) < offset) {
+        index += chunk->count;
+        chunk = chunk->next;
+    }
+    if (!chunk) return search_cursor_first(results, cursor);
+
+    int low = 0, high = chunk->count - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (chunk_offset(chunk, mid) < offset) low = mid + 1;
+        else high = mid;
+    }
+    cursor->chunk = chunk;
+    cursor->pos = low;
+    cursor->index = index + low;
+    return 1;
+}
+
+// --- KMP search ---
+
+static void compute_lps(const char *pattern, int length, int *lps) {
     int len = 0;
     lps[0] = 0;
-    for (int i = 1; pattern[i];) {
+    for (int i = 1; i < length;) {
         if (pattern[i] == pattern[len]) {
             lps[i++] = ++len;
         } else {
@@ -16,49 +239,336 @@ static void compute_lps(const char *pattern, int *lps) {
     }
 }
 
-SearchResults kmp_search(const char *pattern, Piecetable pt) {
-    SearchResults results = {0};
-    char *text = piecetable_value(pt);
-    if (!text) return results; // handle NULL
-    int M = strlen(pattern);
-    int N = strlen(text);
+static void compute_char_lps(const int *chars, int length, int *lps) {
+    int len = 0;
+    lps[0] = 0;
+    for (int i = 1; i < length;) {
+        if (chars[i] == chars[len]) {
+            lps[i++] = ++len;
+        } else {
+            if (len) len = lps[len - 1];
+            else lps[i++] = 0;
+        }
+    }
+}
 
-    if (M == 0 || N == 0 || M > N) {
-        free(text);
-        return results;
+static unsigned char fold_ascii(unsigned char c) {
+    return c | (((unsigned char)(c - 'A') < 26) << 5);
+}
+
+/*
+ * Case-insensitive patterns are folded once here. ASCII patterns keep the byte
+ * kernel with a one-instruction fold per byte; patterns with other characters
+ * (or with s and k, which U+017F and U+212A fold to) are matched as folded code
+ * points decoded on the fly, so no folded copy of the document is ever made.
+ */
+Kmp kmp_create(const char *pattern, int length, int flags) {
+    Kmp kmp = malloc(sizeof(struct kmp));
+    kmp->pattern = malloc(length + 1);
+    memcpy(kmp->pattern, pattern, length);
+    kmp->pattern[length] = '\0';
+    kmp->length = length;
+    kmp->flags = flags;
+    kmp->chars = NULL;
+    kmp->nchars = 0;
+    kmp->span = length;
+    kmp->lps = malloc((length ? length : 1) * sizeof(int));
+
+    int by_char = 0;
+    if (flags & SEARCH_CASE_INSENSITIVE) {
+        for (int i = 0; i < length; i++) {
+            unsigned char c = fold_ascii(kmp->pattern[i]);
+            if (c >= 0x80 || c == 's' || c == 'k') by_char = 1;
+            kmp->pattern[i] = c;
+        }
+    }
+
+    if (by_char) {
+        kmp->chars = malloc(length * sizeof(int));
+        kmp->span = 0;
+        for (int i = 0; i < length;) {
+            int cp, variants[UNICODE_MAX_VARIANTS];
+            i += unicode_decode_utf8((const unsigned char *)pattern + i, &cp);
+            kmp->chars[kmp->nchars++] = unicode_fold(cp);
+
+            // The longest spelling of this character in the text bounds the match length
+            int widest = 1, count = unicode_fold_variants(cp, variants);
+            for (int v = 0; v < count; v++) {
+                unsigned char bytes[4];
+                int width = unicode_encode_utf8(variants[v], bytes);
+                if (width > widest) widest = width;
+            }
+            kmp->span += widest;
+        }
+        compute_char_lps(kmp->chars, kmp->nchars, kmp->lps);
+    } else if (length) {
+        compute_lps(kmp->pattern, length, kmp->lps);
     }
+    return kmp;
+}
 
-    int *lps = malloc(M * sizeof(int));
-    compute_lps(pattern, lps);
+void kmp_free(Kmp kmp) {
+    free(kmp->pattern);
+    free(kmp->chars);
+    free(kmp->lps);
+    free(kmp);
+}
+
+// Recent bytes and character starts a scan needs to check a match after the fact
+typedef struct {
+    int whole_word;
+    unsigned char *bytes;    // Last bytes read, indexed by offset & mask
+    int mask;
+    int before_from;         // Byte preceding the scanned range, -1 at the document start
+    int from;
+    PiecetableCursor look;   // Reads the byte after a match
+    int *starts;             // Offsets of the last characters, char mode only
+    int char_mask;
+    int nchars_seen;
+} ScanHistory;
+
+static int ring_size(int needed) {
+    int size = 1;
+    while (size < needed) size <<= 1;
+    return size;
+}
+
+static int byte_at(Piecetable pt, PiecetableCursor *cursor, int offset) {
+    int available;
+    const char *text = piecetable_cursor_seek(pt, cursor, offset, &available);
+    return text ? (unsigned char)*text : -1;
+}
+
+static void history_init(ScanHistory *history, Kmp kmp, Piecetable pt, int from) {
+    history->whole_word = kmp->flags & SEARCH_WHOLE_WORD;
+    history->bytes = NULL;
+    history->starts = NULL;
+    history->from = from;
+    history->nchars_seen = 0;
+    piecetable_cursor_init(pt, &history->look);
+    if (history->whole_word) {
+        history->mask = ring_size(kmp->span + 1) - 1;
+        history->bytes = malloc(history->mask + 1);
+        history->before_from = byte_at(pt, &history->look, from - 1);
+        piecetable_cursor_init(pt, &history->look);
+    }
+    if (kmp->chars) {
+        history->char_mask = ring_size(kmp->nchars) - 1;
+        history->starts = malloc((history->char_mask + 1) * sizeof(int));
+    }
+}
+
+static void history_free(ScanHistory *history) {
+    free(history->bytes);
+    free(history->starts);
+}
+
+// Whole-word mode: the match must not touch a word character on either side
+static int history_accepts(ScanHistory *history, Piecetable pt, int start, int end) {
+    if (!history->whole_word) return 1;
+    int before = start == history->from ? history->before_from : history->bytes[(start - 1) & history->mask];
+    if (unicode_is_word_byte(before)) return 0;
+    return !unicode_is_word_byte(byte_at(pt, &history->look, end));
+}
+
+// Feeds one folded character to the code point matcher; returns the match start or -1
+static inline int kmp_char_step(Kmp kmp, ScanHistory *history, int *j, int cp, int char_start) {
+    int c = (cp >= 0 && cp < 0x80) ? fold_ascii(cp) : unicode_fold(cp);
+    history->starts[history->nchars_seen++ & history->char_mask] = char_start;
+    while (*j && kmp->chars[*j] != c)
+        *j = kmp->lps[*j - 1];
+    if (kmp->chars[*j] == c)
+        (*j)++;
+    if (*j < kmp->nchars) return -1;
+    *j = kmp->lps[*j - 1];
+    return history->starts[(history->nchars_seen - kmp->nchars) & history->char_mask];
+}
 
-    int *matches = malloc(N * sizeof(int)); //allocate for all possible matches
-    int count = 0;
+/*
+ * Runs the matcher over document offsets [from, to), reading the pieces in place.
+ * Every match is added to results; with results NULL the scan stops at the first
+ * match and returns its start. Returns -1 when there is no (further) match.
+ */
+static int kmp_run(Kmp kmp, Piecetable pt, PiecetableCursor *cursor, int from, int to,
+                   SearchResults *results) {
+    int M = kmp->length;
+    const char *pattern = kmp->pattern;
+    int fold = kmp->flags & SEARCH_CASE_INSENSITIVE;
+    ScanHistory history;
+    history_init(&history, kmp, pt, from);
 
-    int i = 0, j = 0;
-    while (i < N) {
-        if (pattern[j] == text[i]) {
-            j++;
-            i++;
+    int j = 0, available = 0, found = -1;
+    int pending = 0, cp = 0, char_start = 0; // Partial UTF-8 sequence, char mode only
+    const unsigned char *text = NULL;
+    for (int i = from; i < to && found < 0; i++) {
+        if (available == 0) {
+            text = (const unsigned char *)piecetable_cursor_seek(pt, cursor, i, &available);
+            if (!text) break;
         }
-        if (j == M) {
-            matches[count++] = i - j;
-            j = lps[j - 1];
-        } else if (i < N && pattern[j] != text[i]) {
-            if (j) j = lps[j - 1];
-            else i++;
+        unsigned char c = *text++;
+        available--;
+        if (history.bytes) history.bytes[i & history.mask] = c;
+
+        int start = -1, end = i + 1;
+        if (kmp->chars) {
+            if (pending && (c & 0xC0) == 0x80) {
+                cp = (cp << 6) | (c & 0x3F);
+                if (--pending == 0) start = kmp_char_step(kmp, &history, &j, cp, char_start);
+            } else {
+                if (pending) {
+                    // Truncated sequence: it can only match as an unknown character
+                    pending = 0;
+                    start = kmp_char_step(kmp, &history, &j, -1, char_start);
+                    if (start >= 0 && history_accepts(&history, pt, start, i)) {
+                        if (!results) { found = start; break; }
+                        search_results_add_match(results, start, i - start);
+                    }
+                    start = -1;
+                }
+                if (c >= 0xC2 && c <= 0xF4) {
+                    pending = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+                    cp = c & (0x3F >> pending);
+                    char_start = i;
+                } else {
+                    start = kmp_char_step(kmp, &history, &j, c < 0x80 ? c : -1, i);
+                }
+            }
+        } else {
+            if (fold) c = fold_ascii(c);
+            while (j && (unsigned char)pattern[j] != c)
+                j = kmp->lps[j - 1];
+            if ((unsigned char)pattern[j] == c)
+                j++;
+            if (j == M) {
+                j = kmp->lps[j - 1];
+                start = i + 1 - M;
+            }
+        }
+
+        if (start < 0 || !history_accepts(&history, pt, start, end)) continue;
+        if (!results) {
+            found = start;
+        } else if (kmp->chars) {
+            search_results_add_match(results, start, end - start);
+        } else {
+            search_results_add(results, start);
         }
     }
+    history_free(&history);
+    return found;
+}
 
-    free(lps);
-    free(text);
+// Adds every match lying inside [from, to) to results
+void kmp_scan(Kmp kmp, Piecetable pt, PiecetableCursor *cursor, int from, int to, SearchResults *results) {
+    if (kmp->length > 0) kmp_run(kmp, pt, cursor, from, to, results);
+}
 
-    results.indices = matches;
-    results.count = count;
+// Returns the first occurrence lying inside [from, to), or -1
+int kmp_find(Kmp kmp, Piecetable pt, PiecetableCursor *cursor, int from, int to) {
+    if (kmp->length == 0) return from <= to ? from : -1;
+    return kmp_run(kmp, pt, cursor, from, to, NULL);
+}
+
+SearchResults kmp_search(const char *pattern, int flags, Piecetable pt, int limit) {
+    SearchResults results;
+    search_results_init(&results, limit);
+    if (!pattern || !pt) return results;
+    int M = strlen(pattern);
+    int N = pt->length;
+
+    if (M == 0 || N == 0)
+        return results;
+
+    Kmp kmp = kmp_create(pattern, M, flags);
+    results.match_length = kmp->chars ? SEARCH_VARIABLE_LENGTH : M;
+    PiecetableCursor cursor;
+    piecetable_cursor_init(pt, &cursor);
+    kmp_run(kmp, pt, &cursor, 0, N, &results);
+    kmp_free(kmp);
     return results;
 }
 
-void search_results_free(SearchResults *results) {
-    free(results->indices);
-    results->indices = NULL;
-    results->count = 0;
+/*
+ * Updates results after `removed` characters at `at` were replaced by `inserted`
+ * characters. pt must already hold the edited text. Matches overlapping the edit
+ * (or, in whole-word mode, touching it) are dropped, later ones are shifted, and
+ * only the edit window widened by the longest possible match is searched again.
+ * Returns 0 if the results cannot be kept exact this way (the edit touches
+ * matches past the storage limit), in which case the caller should search again
+ * from scratch.
+ */
+int search_results_apply_edit(SearchResults *results, const char *pattern, int flags, Piecetable pt,
+                              int at, int removed, int inserted) {
+    int M = strlen(pattern);
+    if (M == 0) return 0;
+
+    Kmp kmp = kmp_create(pattern, M, flags);
+    int span = kmp->span;
+    int edge = (flags & SEARCH_WHOLE_WORD) ? 1 : 0;
+    int stale_from = at - span + 1 - edge;
+    int stale_to = at + removed + edge;
+    int delta = inserted - removed;
+
+    if (results->total > results->count) {
+        if (!results->last || stale_to + span - 1 > chunk_offset(results->last, results->last->count - 1)) {
+            kmp_free(kmp);
+            return 0;
+        }
+    }
+
+    // Drop matches overlapping the edit and shift the ones after it
+    SearchChunk chunk = results->first;
+    while (chunk) {
+        SearchChunk next = chunk->next;
+        if (chunk_offset(chunk, chunk->count - 1) < stale_from) {
+            chunk = next;
+            continue;
+        }
+        if (chunk_offset(chunk, 0) >= stale_to) {
+            chunk->shift += delta;
+            chunk = next;
+            continue;
+        }
+
+        int kept = 0;
+        for (int i = 0; i < chunk->count; i++) {
+            int offset = chunk_offset(chunk, i);
+            if (offset >= stale_from && offset < stale_to) continue;
+            if (chunk->lengths) chunk->lengths[kept] = chunk->lengths[i];
+            chunk->offsets[kept++] = chunk->offsets[i] + (offset >= stale_to ? delta : 0);
+        }
+        results->count -= chunk->count - kept;
+        results->total -= chunk->count - kept;
+        chunk->count = kept;
+        if (kept == 0) chunk_unlink(results, chunk);
+        chunk = next;
+    }
+
+    // Search the edited window again; matches starting past it were kept above
+    int window_from = stale_from > 0 ? stale_from : 0;
+    int window_to = at + inserted + span - 1 + edge;
+    int new_stale_to = stale_to + delta;
+    if (window_to > pt->length) window_to = pt->length;
+    if (window_to > window_from) {
+        SearchResults found;
+        SearchCursor cursor;
+        PiecetableCursor pt_cursor;
+        search_results_init(&found, SEARCH_NO_LIMIT);
+        found.match_length = results->match_length;
+        piecetable_cursor_init(pt, &pt_cursor);
+        kmp_run(kmp, pt, &pt_cursor, window_from, window_to, &found);
+        if (search_cursor_first(&found, &cursor)) {
+            for (int i = 0; i < found.count; i++) {
+                int offset = search_cursor_offset(&cursor);
+                if (offset < new_stale_to)
+                    search_results_insert_sorted(results, offset, search_cursor_length(&found, &cursor));
+                search_cursor_next(&found, &cursor);
+            }
+        }
+        search_results_free(&found);
+    }
+    kmp_free(kmp);
+
+    search_results_trim(results);
+    return 1;
 }
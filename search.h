@@ -3,12 +3,71 @@
 
 #include "piecetable.h"
 
-typedef struct {
-    int *indices;
+#define SEARCH_CHUNK_SIZE 1024       // Match offsets stored per results chunk
+#define SEARCH_DEFAULT_LIMIT 1000000 // Matches kept for navigation, the rest are only counted
+#define SEARCH_NO_LIMIT 0
+#define SEARCH_VARIABLE_LENGTH -1
+
+// Search option flags
+#define SEARCH_CASE_INSENSITIVE 1
+#define SEARCH_WHOLE_WORD 2
+
+typedef struct search_chunk {
+    int offsets[SEARCH_CHUNK_SIZE];
     int count;
+    int shift;   // Added to every offset, lets edits move whole chunks at once
+    int *lengths; // Per-match lengths, NULL while every match has results->match_length
+    struct search_chunk *prev;
+    struct search_chunk *next;
+} *SearchChunk;
+
+typedef struct {
+    SearchChunk first;
+    SearchChunk last;
+    int count;   // Number of offsets stored
+    int total;   // Exact number of matches, including those past the limit
+    int limit;   // Maximum number of offsets stored, SEARCH_NO_LIMIT for none
+    int match_length; // Length shared by all matches, SEARCH_VARIABLE_LENGTH if they differ
 } SearchResults;
 
-SearchResults kmp_search(const char *pattern, Piecetable pt);
+// Position inside a SearchResults, used to walk matches without indexing
+typedef struct {
+    SearchChunk chunk;
+    int pos;     // Index inside chunk
+    int index;   // Index among all stored offsets
+} SearchCursor;
+
+void search_results_init(SearchResults *results, int limit);
+void search_results_add(SearchResults *results, int offset);
+void search_results_add_match(SearchResults *results, int offset, int length);
 void search_results_free(SearchResults *results);
 
+int search_cursor_first(const SearchResults *results, SearchCursor *cursor);
+int search_cursor_last(const SearchResults *results, SearchCursor *cursor);
+int search_cursor_next(const SearchResults *results, SearchCursor *cursor);
+int search_cursor_prev(const SearchResults *results, SearchCursor *cursor);
+int search_cursor_offset(const SearchCursor *cursor);
+int search_cursor_length(const SearchResults *results, const SearchCursor *cursor);
+int search_cursor_seek(const SearchResults *results, SearchCursor *cursor, int offset);
+
+// Prepared KMP pattern for repeated "find next" queries
+typedef struct kmp {
+    char *pattern;  // ASCII-folded in case-insensitive mode
+    int length;
+    int *lps;
+    int flags;
+    int *chars;     // Folded code points, NULL while matching byte by byte
+    int nchars;
+    int span;       // Longest a match can be, in bytes
+} *Kmp;
+
+Kmp kmp_create(const char *pattern, int length, int flags);
+void kmp_free(Kmp kmp);
+int kmp_find(Kmp kmp, Piecetable pt, PiecetableCursor *cursor, int from, int to);
+void kmp_scan(Kmp kmp, Piecetable pt, PiecetableCursor *cursor, int from, int to, SearchResults *results);
+
+SearchResults kmp_search(const char *pattern, int flags, Piecetable pt, int limit);
+int search_results_apply_edit(SearchResults *results, const char *pattern, int flags, Piecetable pt,
+                              int at, int removed, int inserted);
+
 #endif // SEARCH_H
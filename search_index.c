@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <string.h>
+#include "search_index.h"
+
+/*
+ * The document is cut into blocks of about SEARCH_INDEX_BLOCK bytes and each
+ * block keeps a single-hash Bloom filter of the ASCII-folded trigrams starting
+ * in it. A pattern can only start in a block if every one of its trigrams is in
+ * the filters of that block or of the blocks its first bytes reach into, so a
+ * query reads just those candidate blocks. Edits resize the blocks they touch
+ * and mark them stale; stale blocks are always scanned until a build step,
+ * run in the background, refreshes them.
+ */
+
+#define INDEX_HASH_SHIFT 20      // 32 - log2(SEARCH_INDEX_BITS)
+#define INDEX_MAX_TRIGRAMS 32    // Pattern trigrams checked against the filters
+
+static unsigned char fold_byte(unsigned char c) {
+    return c | (((unsigned char)(c - 'A') < 26) << 5);
+}
+
+static unsigned trigram_bit(unsigned trigram) {
+    return ((trigram & 0xFFFFFF) * 2654435761u) >> INDEX_HASH_SHIFT;
+}
+
+static int block_has(const SearchIndexBlock *block, unsigned bit) {
+    return (block->bits[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static void mark_stale(SearchIndex index, int i) {
+    if (!index->blocks[i].built) return;
+    index->blocks[i].built = 0;
+    index->stale++;
+}
+
+static void reserve_blocks(SearchIndex index, int count) {
+    if (count <= index->capacity) return;
+    while (index->capacity < count) index->capacity = index->capacity ? index->capacity * 2 : 64;
+    index->blocks = realloc(index->blocks, index->capacity * sizeof(SearchIndexBlock));
+}
+
+// Replaces block i by enough stale blocks of SEARCH_INDEX_BLOCK bytes to hold its length
+static void split_block(SearchIndex index, int i) {
+    int length = index->blocks[i].length;
+    int parts = (length + SEARCH_INDEX_BLOCK - 1) / SEARCH_INDEX_BLOCK;
+    if (parts < 2) return;
+
+    if (index->blocks[i].built) index->stale++;
+    reserve_blocks(index, index->count + parts - 1);
+    memmove(index->blocks + i + parts, index->blocks + i + 1,
+            (index->count - i - 1) * sizeof(SearchIndexBlock));
+    for (int p = 0; p < parts; p++) {
+        SearchIndexBlock *block = &index->blocks[i + p];
+        block->length = p < parts - 1 ? SEARCH_INDEX_BLOCK : length - (parts - 1) * SEARCH_INDEX_BLOCK;
+        block->built = 0;
+    }
+    index->count += parts - 1;
+    index->stale += parts - 1;
+}
+
+SearchIndex search_index_create(int document_length) {
+    SearchIndex index = malloc(sizeof(struct search_index));
+    index->blocks = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->stale = 0;
+    index->next_stale = 0;
+    index->next_stale_start = 0;
+    index->last_scanned = 0;
+
+    reserve_blocks(index, 1);
+    index->blocks[0].length = document_length;
+    index->blocks[0].built = 0;
+    index->count = 1;
+    index->stale = 1;
+    split_block(index, 0);
+    return index;
+}
+
+void search_index_free(SearchIndex index) {
+    free(index->blocks);
+    free(index);
+}
+
+static void build_block(SearchIndexBlock *block, Piecetable pt, PiecetableCursor *cursor, int start) {
+    memset(block->bits, 0, sizeof(block->bits));
+
+    // Trigrams starting in the last two bytes read into the next block
+    int end = start + block->length + 2;
+    if (end > pt->length) end = pt->length;
+
+    unsigned window = 0;
+    int available = 0;
+    const unsigned char *text = NULL;
+    for (int i = start; i < end; i++) {
+        if (available == 0) {
+            text = (const unsigned char *)piecetable_cursor_seek(pt, cursor, i, &available);
+            if (!text) break;
+        }
+        window = (window << 8) | fold_byte(*text++);
+        available--;
+        if (i >= start + 2) {
+            unsigned bit = trigram_bit(window);
+            block->bits[bit >> 6] |= 1ULL << (bit & 63);
+        }
+    }
+    block->built = 1;
+}
+
+// Builds up to max_blocks stale filters; returns 1 while more work is left
+int search_index_build_step(SearchIndex index, Piecetable pt, int max_blocks) {
+    PiecetableCursor cursor;
+    piecetable_cursor_init(pt, &cursor);
+
+    int i = index->next_stale, start = index->next_stale_start;
+    while (i < index->count && index->stale > 0 && max_blocks > 0) {
+        SearchIndexBlock *block = &index->blocks[i];
+        if (!block->built) {
+            build_block(block, pt, &cursor, start);
+            index->stale--;
+            max_blocks--;
+        }
+        start += block->length;
+        i++;
+    }
+    index->next_stale = i;
+    index->next_stale_start = start;
+    if (i >= index->count) {
+        index->next_stale = 0;
+        index->next_stale_start = 0;
+    }
+    return index->stale > 0;
+}
+
+// Follows an edit of the document: removed bytes at `at` were replaced by inserted bytes
+void search_index_apply_edit(SearchIndex index, int at, int removed, int inserted) {
+    if (index->count == 0) {
+        reserve_blocks(index, 1);
+        index->blocks[0].length = 0;
+        index->blocks[0].built = 0;
+        index->count = 1;
+        index->stale++;
+    }
+
+    int b = 0, start = 0;
+    while (b < index->count - 1 && start + index->blocks[b].length <= at) {
+        start += index->blocks[b].length;
+        b++;
+    }
+
+    int offset = at - start, i = b;
+    while (removed > 0 && i < index->count) {
+        int available = index->blocks[i].length - offset;
+        int take = removed < available ? removed : available;
+        index->blocks[i].length -= take;
+        removed -= take;
+        mark_stale(index, i);
+        i++;
+        offset = 0;
+    }
+    index->blocks[b].length += inserted;
+    mark_stale(index, b);
+
+    // Trigrams at the end of the previous blocks read into the edited one
+    for (int p = b - 1; p >= 0 && p >= b - 2; p--) mark_stale(index, p);
+
+    // Drop blocks emptied by the removal
+    int kept = b + 1;
+    for (int j = b + 1; j < i; j++) {
+        if (index->blocks[j].length > 0) index->blocks[kept++] = index->blocks[j];
+        else if (!index->blocks[j].built) index->stale--;
+    }
+    if (kept < i) {
+        memmove(index->blocks + kept, index->blocks + i, (index->count - i) * sizeof(SearchIndexBlock));
+        index->count -= i - kept;
+    }
+    if (index->blocks[b].length > 2 * SEARCH_INDEX_BLOCK) split_block(index, b);
+
+    index->next_stale = 0;
+    index->next_stale_start = 0;
+}
+
+long search_index_memory(SearchIndex index) {
+    return sizeof(struct search_index) + (long)index->capacity * sizeof(SearchIndexBlock);
+}
+
+/*
+ * Finds pattern like kmp_search, reading only blocks the filters cannot rule out.
+ * Patterns shorter than a trigram, and case-insensitive patterns that need
+ * Unicode folding, fall back to a full scan.
+ */
+SearchResults search_index_find(SearchIndex index, const char *pattern, int flags, Piecetable pt, int limit) {
+    SearchResults results;
+    search_results_init(&results, limit);
+    int M = strlen(pattern);
+    if (M == 0 || pt->length == 0) return results;
+
+    Kmp kmp = kmp_create(pattern, M, flags);
+    results.match_length = kmp->chars ? SEARCH_VARIABLE_LENGTH : M;
+    PiecetableCursor cursor;
+    piecetable_cursor_init(pt, &cursor);
+
+    if (kmp->chars || M < 3) {
+        kmp_scan(kmp, pt, &cursor, 0, pt->length, &results);
+        index->last_scanned = pt->length;
+        kmp_free(kmp);
+        return results;
+    }
+
+    unsigned bits[INDEX_MAX_TRIGRAMS];
+    int ntrigrams = 0;
+    unsigned window = 0;
+    for (int k = 0; k < M && ntrigrams < INDEX_MAX_TRIGRAMS; k++) {
+        window = (window << 8) | fold_byte(pattern[k]);
+        if (k >= 2) bits[ntrigrams++] = trigram_bit(window);
+    }
+    int reach = ntrigrams + 1; // Bytes past a match start the checked trigrams cover, minus one
+
+    index->last_scanned = 0;
+    int range_start = -1, range_end = 0, start = 0;
+    for (int b = 0; b <= index->count; b++) {
+        int candidate = 0;
+        if (b < index->count) {
+            SearchIndexBlock *block = &index->blocks[b];
+            int end = start + block->length;
+            candidate = block->length > 0;
+
+            // Each trigram must be in this block or a following one it may start in
+            for (int t = 0; t < ntrigrams && candidate; t++) {
+                int found = 0, covered = start;
+                for (int c = b; c < index->count && covered < end + reach && !found; c++) {
+                    found = !index->blocks[c].built || block_has(&index->blocks[c], bits[t]);
+                    covered += index->blocks[c].length;
+                }
+                candidate = found;
+            }
+        }
+
+        if (candidate) {
+            if (range_start < 0) range_start = start;
+            range_end = start + index->blocks[b].length;
+        } else if (range_start >= 0) {
+            int scan_to = range_end + M - 1 < pt->length ? range_end + M - 1 : pt->length;
+            kmp_scan(kmp, pt, &cursor, range_start, scan_to, &results);
+            index->last_scanned += scan_to - range_start;
+            range_start = -1;
+        }
+        if (b < index->count) start += index->blocks[b].length;
+    }
+    kmp_free(kmp);
+    return results;
+}
@@ -0,0 +1,36 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include "piecetable.h"
+#include "search.h"
+
+#define SEARCH_INDEX_BLOCK 16384     // Document bytes summarised by one block filter
+#define SEARCH_INDEX_BITS 4096       // Trigram filter bits per block
+#define SEARCH_INDEX_MIN_LENGTH (4 * 1024 * 1024) // Smaller documents are simply scanned
+
+typedef struct {
+    int length;      // Document bytes covered by this block
+    int built;       // 0 while the filter is missing or stale after an edit
+    unsigned long long bits[SEARCH_INDEX_BITS / 64];
+} SearchIndexBlock;
+
+// Per-block trigram filters over the document, used to skip blocks a pattern cannot occur in
+typedef struct search_index {
+    SearchIndexBlock *blocks;
+    int count;
+    int capacity;
+    int stale;             // Blocks waiting to be (re)built
+    int next_stale;        // Block where the next build step starts looking
+    int next_stale_start;  // Document offset of that block
+    long last_scanned;     // Bytes the last query had to read
+} *SearchIndex;
+
+SearchIndex search_index_create(int document_length);
+void search_index_free(SearchIndex index);
+int search_index_build_step(SearchIndex index, Piecetable pt, int max_blocks);
+void search_index_apply_edit(SearchIndex index, int at, int removed, int inserted);
+long search_index_memory(SearchIndex index);
+
+SearchResults search_index_find(SearchIndex index, const char *pattern, int flags, Piecetable pt, int limit);
+
+#endif // SEARCH_INDEX_H
@@ -0,0 +1,374 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "session.h"
+
+/*
+ * The session file is laid out to be used where it lies once mapped: a
+ * header of fixed fields and offsets, then fixed-width arrays (the piece
+ * list, a large document's line lengths, the undo records) and the texts
+ * they point into. Reading it back checks bounds and builds what edits the
+ * document from the arrays, a list node per piece, the line index blocks and
+ * an action per undo entry that points at its texts in the mapping, but no
+ * text is parsed or copied except the add text, which the piece table
+ * appends to. An original text that is the mapped file itself is not stored,
+ * only the file's size and time, so a large file comes back by mapping it
+ * again. Undo texts an entry shares with the one before, as the snapshots of
+ * consecutive entries do, are stored once.
+ */
+
+#define SESSION_MAGIC "EDSESSN1"
+#define SESSION_MAGIC_LENGTH 8
+#define SESSION_BYTE_ORDER 0x01020304u  // Reads differently on a machine of the other byte order
+#define SESSION_ALIGN 8                 // Arrays start at multiples of this
+
+typedef struct {
+    char magic[SESSION_MAGIC_LENGTH];
+    guint32 byte_order;
+    guint32 header_size;       // Changes with the layout
+    gint64 file_size;          // The document's file when the session was written, -1 if none
+    gint64 file_mtime;
+    gint64 filename;           // Offsets of NUL-terminated strings, 0 for none
+    gint64 journal;
+    gint64 search_text;
+    gint64 original;           // Offset of the original text, in the document's file if original_in_file
+    gint64 add;
+    gint64 pieces;             // struct piece[piece_count]
+    gint64 lines;              // gint32[line_count], the length of each line
+    gint64 undo;               // SessionUndo[undo_count]
+    gint32 original_in_file;
+    gint32 original_length;
+    gint32 add_length;
+    gint32 piece_count;
+    gint32 length;
+    gint32 line_count;         // 0 unless the document is large
+    gint32 line_after_cr;
+    gint32 line_partial;
+    gint32 undo_count;
+    gint32 undo_current;
+    gint32 encoding;
+    gint32 line_ending;
+    gint32 codec;
+    gint32 level;
+    gint32 modified;
+    gint32 cursor;
+    gint32 selection_bound;
+    gint32 search_shown;
+    gint32 search_regex;
+    gint32 search_flags;
+} SessionHeader;
+
+// Offsets of the texts before and after an undo entry
+typedef struct {
+    gint64 prev_text;
+    gint64 next_text;
+} SessionUndo;
+
+static char *session_path(void) {
+    return g_build_filename(g_get_user_cache_dir(), "text-editor", "session", NULL);
+}
+
+// --- Writing ---
+
+static int write_all(int fd, const char *text, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, text, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        text += written;
+        length -= written;
+    }
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    gint64 offset;
+    int failed;
+} Output;
+
+// Writes length bytes at the end of the file, aligned if align is set; returns where they start
+static gint64 put(Output *out, const void *data, gsize length, int align) {
+    static const char zeros[SESSION_ALIGN];
+    int pad = align ? (SESSION_ALIGN - out->offset % SESSION_ALIGN) % SESSION_ALIGN : 0;
+    if (!out->failed && pad) out->failed = write_all(out->fd, zeros, pad) < 0;
+    out->offset += pad;
+    gint64 at = out->offset;
+    if (!out->failed && length) out->failed = write_all(out->fd, data, length) < 0;
+    out->offset += length;
+    return at;
+}
+
+static gint64 put_string(Output *out, const char *text) {
+    return text ? put(out, text, strlen(text) + 1, FALSE) : 0;
+}
+
+// Writes each undo entry's texts, one text for an entry starting where the one before ended
+static gint64 put_undo(Output *out, UndoRedoStack *undo, int *count) {
+    *count = list_length(undo->actions);
+    SessionUndo *records = g_new(SessionUndo, *count + 1);
+    const char *last = NULL;
+    gint64 last_offset = 0;
+    int i = 0;
+    for (ListItem item = list_get_first(undo->actions); item; item = item->next, i++) {
+        UndoRedoAction *action = item->value;
+        int shared = last && (last == action->prev_text || strcmp(last, action->prev_text) == 0);
+        records[i].prev_text = shared ? last_offset : put_string(out, action->prev_text);
+        records[i].next_text = put_string(out, action->next_text);
+        last = action->next_text;
+        last_offset = records[i].next_text;
+    }
+    gint64 at = put(out, records, *count * sizeof(SessionUndo), TRUE);
+    g_free(records);
+    return at;
+}
+
+static gint64 put_lines(Output *out, LineIndex lines) {
+    gint64 at = 0;
+    for (int b = 0; b < lines->block_count; b++) {
+        gint64 offset = put(out, lines->blocks[b].lengths, lines->blocks[b].count * sizeof(int), b == 0);
+        if (b == 0) at = offset;
+    }
+    return at;
+}
+
+/**
+ * Write session to the session file, replacing the last one once it is
+ * complete; returns -1 with error set if it cannot be written
+ */
+int session_write(Session session, GError **error) {
+    char *path = session_path();
+    char *dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    char *temp = g_strdup_printf("%s.XXXXXX", path);
+    int fd = g_mkstemp(temp);
+    if (fd < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "%s: %s", path, g_strerror(errno));
+        g_free(temp);
+        g_free(path);
+        return -1;
+    }
+
+    SessionHeader h;
+    memset(&h, 0, sizeof(h));
+    Output out = {fd, 0, 0};
+    put(&out, &h, sizeof(h), FALSE);
+    memcpy(h.magic, SESSION_MAGIC, SESSION_MAGIC_LENGTH);
+    h.byte_order = SESSION_BYTE_ORDER;
+    h.header_size = sizeof(h);
+    h.file_size = -1;
+    struct stat st;
+    if (session->filename && stat(session->filename, &st) == 0) {
+        h.file_size = st.st_size;
+        h.file_mtime = st.st_mtime;
+    }
+    h.filename = put_string(&out, session->filename);
+    h.journal = put_string(&out, session->journal);
+    h.search_text = put_string(&out, session->search_text);
+
+    // Only the text the pieces use is kept
+    PiecetableSnapshot snapshot = piecetable_snapshot(session->pt);
+    for (int i = 0; i < snapshot->count; i++) {
+        const struct piece *piece = &snapshot->pieces[i];
+        int *extent = piece->which == ORIGINAL ? &h.original_length : &h.add_length;
+        if (piece->start + piece->length > *extent) *extent = piece->start + piece->length;
+    }
+    h.pieces = put(&out, snapshot->pieces, snapshot->count * sizeof(struct piece), TRUE);
+    h.piece_count = snapshot->count;
+    h.length = snapshot->length;
+
+    // An original text read from the file as it still is on disk is read from there again
+    const char *original = snapshot->original->text;
+    GMappedFile *file = session->original_mapping;
+    const char *contents = file ? g_mapped_file_get_contents(file) : NULL;
+    gint64 file_length = file ? (gint64)g_mapped_file_get_length(file) : 0;
+    if (file && h.file_size == file_length && original >= contents &&
+        original + h.original_length <= contents + file_length) {
+        h.original_in_file = 1;
+        h.original = original - contents;
+    } else {
+        h.original = put(&out, original, h.original_length, FALSE);
+    }
+    h.add = put(&out, h.add_length ? snapshot->add->text : NULL, h.add_length, FALSE);
+    piecetable_snapshot_unref(snapshot);
+
+    if (session->lines) {
+        h.lines = put_lines(&out, session->lines);
+        h.line_count = session->lines->lines;
+        h.line_after_cr = session->lines->after_cr;
+        h.line_partial = session->lines->partial;
+    }
+    h.undo = put_undo(&out, session->undo, &h.undo_count);
+    h.undo_current = session->undo->current_index;
+    // Every string in the file ends before its end
+    put(&out, "", 1, FALSE);
+
+    h.encoding = session->encoding;
+    h.line_ending = session->line_ending;
+    h.codec = session->compression.codec;
+    h.level = session->compression.level;
+    h.modified = session->modified;
+    h.cursor = session->cursor;
+    h.selection_bound = session->selection_bound;
+    h.search_shown = session->search_shown;
+    h.search_regex = session->search_regex;
+    h.search_flags = session->search_flags;
+
+    int failed = out.failed || pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || fsync(fd) < 0;
+    if (close(fd) < 0 || (!failed && g_rename(temp, path) < 0)) failed = 1;
+    if (failed) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "%s: %s", path, g_strerror(errno));
+        g_unlink(temp);
+    }
+    g_free(temp);
+    g_free(path);
+    return failed ? -1 : 0;
+}
+
+// --- Reading ---
+
+static int in_bounds(gsize size, gint64 offset, gint64 length) {
+    return offset >= 0 && length >= 0 && offset <= (gint64)size && length <= (gint64)size - offset;
+}
+
+static char *read_string(const char *data, gsize size, gint64 offset) {
+    return offset > 0 && offset < (gint64)size ? g_strdup(data + offset) : NULL;
+}
+
+static Session invalid(Session session, GError **error, const char *why) {
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "The session file %s", why);
+    session_free(session);
+    return NULL;
+}
+
+// Checks that the pieces lie inside their texts and add up to the document
+static int valid_pieces(const struct piece *pieces, const SessionHeader *h) {
+    gint64 total = 0;
+    for (int i = 0; i < h->piece_count; i++) {
+        const struct piece *piece = &pieces[i];
+        int extent = piece->which == ORIGINAL ? h->original_length : h->add_length;
+        if ((piece->which != ORIGINAL && piece->which != ADD) || piece->start < 0 || piece->length < 0 ||
+            piece->start > extent - piece->length)
+            return FALSE;
+        total += piece->length;
+    }
+    return total == h->length;
+}
+
+/**
+ * Map the session file the editor last wrote and rebuild what it holds;
+ * returns NULL with error set if there is none or it cannot be used
+ */
+Session session_read(GError **error) {
+    char *path = session_path();
+    GMappedFile *mapping = g_mapped_file_new(path, FALSE, error);
+    g_free(path);
+    if (!mapping) return NULL;
+    Session session = g_new0(struct session, 1);
+    session->mapping = mapping;
+    const char *data = g_mapped_file_get_contents(mapping);
+    gsize size = g_mapped_file_get_length(mapping);
+
+    SessionHeader h;
+    if (size <= sizeof(h) || data[size - 1] != '\0') return invalid(session, error, "is cut short");
+    memcpy(&h, data, sizeof(h));
+    if (memcmp(h.magic, SESSION_MAGIC, SESSION_MAGIC_LENGTH) != 0 || h.byte_order != SESSION_BYTE_ORDER ||
+        h.header_size != sizeof(h))
+        return invalid(session, error, "was written by another version of the editor");
+    if (h.piece_count < 0 || h.line_count < 0 || h.undo_count < 0 ||
+        !in_bounds(size, h.pieces, (gint64)h.piece_count * sizeof(struct piece)) ||
+        !in_bounds(size, h.lines, (gint64)h.line_count * sizeof(gint32)) ||
+        !in_bounds(size, h.undo, (gint64)h.undo_count * sizeof(SessionUndo)) ||
+        !in_bounds(size, h.add, h.add_length) ||
+        (!h.original_in_file && !in_bounds(size, h.original, h.original_length)) ||
+        h.undo_current < -1 || h.undo_current >= h.undo_count)
+        return invalid(session, error, "is damaged");
+
+    session->filename = read_string(data, size, h.filename);
+    session->journal = read_string(data, size, h.journal);
+    session->search_text = read_string(data, size, h.search_text);
+    struct stat st;
+    if (session->filename && h.file_size >= 0)
+        session->file_changed = stat(session->filename, &st) != 0 || st.st_size != h.file_size ||
+                                st.st_mtime != h.file_mtime;
+
+    const char *original;
+    session->original_in_file = h.original_in_file;
+    if (h.original_in_file) {
+        if (!session->filename || session->file_changed)
+            return invalid(session, error, "is for a file that has changed since");
+        session->original_mapping = g_mapped_file_new(session->filename, FALSE, error);
+        if (!session->original_mapping) {
+            session_free(session);
+            return NULL;
+        }
+        if (!in_bounds(g_mapped_file_get_length(session->original_mapping), h.original, h.original_length))
+            return invalid(session, error, "is for a file that has changed since");
+        original = g_mapped_file_get_contents(session->original_mapping) + h.original;
+    } else {
+        session->original_mapping = g_mapped_file_ref(mapping);
+        original = data + h.original;
+    }
+
+    const struct piece *pieces = (const struct piece *)(data + h.pieces);
+    if (!valid_pieces(pieces, &h)) return invalid(session, error, "is damaged");
+    session->pt = piecetable_restore(original, data + h.add, h.add_length, pieces, h.piece_count);
+
+    if (h.line_count > 0) {
+        const gint32 *lengths = (const gint32 *)(data + h.lines);
+        gint64 total = 0;
+        for (int i = 0; i < h.line_count; i++) total += lengths[i] >= 0 ? lengths[i] : G_MAXINT;
+        if (total != h.length) return invalid(session, error, "is damaged");
+        session->lines = line_index_restore(lengths, h.line_count, h.line_after_cr, h.line_partial);
+    }
+
+    // The undo texts are read where they are, for as long as the stack lives
+    session->undo = undo_redo_stack_create();
+    const SessionUndo *records = (const SessionUndo *)(data + h.undo);
+    for (int i = 0; i < h.undo_count; i++) {
+        if (records[i].prev_text <= 0 || records[i].prev_text >= (gint64)size || records[i].next_text <= 0 ||
+            records[i].next_text >= (gint64)size)
+            return invalid(session, error, "is damaged");
+        undo_redo_restore(session->undo, data + records[i].prev_text, data + records[i].next_text);
+    }
+    session->undo->current_index = h.undo_current;
+    if (h.undo_count) undo_redo_hold(session->undo, g_mapped_file_ref(mapping), (void (*)(void *))g_mapped_file_unref);
+
+    session->encoding = h.encoding;
+    session->line_ending = h.line_ending;
+    session->compression = (Compression){h.codec, h.level};
+    session->modified = h.modified;
+    session->cursor = CLAMP(h.cursor, 0, h.length);
+    session->selection_bound = CLAMP(h.selection_bound, 0, h.length);
+    session->search_shown = h.search_shown;
+    session->search_regex = h.search_regex;
+    session->search_flags = h.search_flags;
+    return session;
+}
+
+// Removes the session file, so it is not restored again
+void session_discard(void) {
+    char *path = session_path();
+    g_unlink(path);
+    g_free(path);
+}
+
+// Frees a session read back, with whatever the caller did not take from it
+void session_free(Session session) {
+    if (!session) return;
+    if (session->pt) piecetable_free(session->pt);
+    if (session->lines) line_index_free(session->lines);
+    if (session->undo) undo_redo_stack_free(session->undo);
+    if (session->original_mapping) g_mapped_file_unref(session->original_mapping);
+    if (session->mapping) g_mapped_file_unref(session->mapping);
+    g_free(session->filename);
+    g_free(session->journal);
+    g_free(session->search_text);
+    g_free(session);
+}
@@ -0,0 +1,44 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <glib.h>
+#include "compression.h"
+#include "encoding.h"
+#include "line_index.h"
+#include "piecetable.h"
+#include "undo_redo.h"
+
+/*
+ * The editor's state when it last exited: the document as its piece list
+ * and texts, its undo history, and where the user was in it. Written from
+ * borrowed fields; read back into fields the caller takes, setting each one
+ * it takes to NULL so session_free() leaves it alone.
+ */
+typedef struct session {
+    char *filename;             // The document's file, NULL if untitled
+    char *journal;              // Its autosave journal, if it had one
+    Encoding encoding;
+    LineEnding line_ending;
+    Compression compression;
+    int modified;               // The document had changes its file does not have
+    int file_changed;           // On read: the file is no longer as it was when the session was written
+    Piecetable pt;
+    GMappedFile *original_mapping;  // Mapping the original text lies in: the file, or on read possibly the session
+    int original_in_file;       // The original text is read from the file rather than the session
+    LineIndex lines;            // A large document's line index, NULL for one shown whole
+    UndoRedoStack *undo;
+    int cursor;                 // Document offsets of the insertion point and the selection's other end
+    int selection_bound;
+    char *search_text;          // The search bar's pattern, NULL if empty
+    int search_shown;
+    int search_regex;
+    int search_flags;           // SEARCH_CASE_INSENSITIVE and SEARCH_WHOLE_WORD
+    GMappedFile *mapping;       // On read: the session file, which the texts point into
+} *Session;
+
+int session_write(Session session, GError **error);
+Session session_read(GError **error);
+void session_discard(void);
+void session_free(Session session);
+
+#endif // SESSION_H
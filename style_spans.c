@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include "style_spans.h"
+
+/*
+ * Styles are runs of equal style covering the whole document, as nodes of a
+ * treap keyed implicitly by position: each node knows the characters in its
+ * subtree, so splitting at an offset cuts at most one run in two. An edit
+ * splits the treap around the edit and joins the pieces back, which costs
+ * O(log n) in the number of runs, and neighbouring runs that end up with the
+ * same style are joined into one so the treap stays as small as the styling.
+ * Style ids are opaque here; what a style means is up to the caller.
+ */
+
+static unsigned next_priority(StyleSpans spans) {
+    spans->seed = spans->seed * 1103515245u + 12345u;
+    return spans->seed;
+}
+
+static StyleSpan new_span(StyleSpans spans, int length, int style) {
+    StyleSpan span = calloc(1, sizeof(struct style_span));
+    span->priority = next_priority(spans);
+    span->length = length;
+    span->style = style;
+    span->total = length;
+    spans->runs++;
+    return span;
+}
+
+static void update(StyleSpan node) {
+    node->total = node->length;
+    if (node->left) node->total += node->left->total;
+    if (node->right) node->total += node->right->total;
+}
+
+static StyleSpan merge(StyleSpan a, StyleSpan b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->priority > b->priority) {
+        a->right = merge(a->right, b);
+        update(a);
+        return a;
+    }
+    b->left = merge(a, b->left);
+    update(b);
+    return b;
+}
+
+// Splits into the first offset characters and the rest, cutting the run that straddles offset
+static void split(StyleSpans spans, StyleSpan node, int offset, StyleSpan *before, StyleSpan *after) {
+    if (!node) {
+        *before = *after = NULL;
+        return;
+    }
+    int left = node->left ? node->left->total : 0;
+    if (offset <= left) {
+        split(spans, node->left, offset, before, &node->left);
+        *after = node;
+    } else if (offset >= left + node->length) {
+        split(spans, node->right, offset - left - node->length, &node->right, after);
+        *before = node;
+    } else {
+        StyleSpan tail = new_span(spans, left + node->length - offset, node->style);
+        *after = merge(tail, node->right);
+        node->right = NULL;
+        node->length = offset - left;
+        *before = node;
+    }
+    update(node);
+}
+
+// Merges a before b, folding b's first run into a's last when their styles are equal
+static StyleSpan join(StyleSpans spans, StyleSpan a, StyleSpan b) {
+    if (!a) return b;
+    if (!b) return a;
+    StyleSpan last = a, first = b, parent = NULL;
+    while (last->right) last = last->right;
+    while (first->left) {
+        parent = first;
+        first = first->left;
+    }
+    if (last->style == first->style) {
+        int extra = first->length;
+        for (StyleSpan node = b; node != first; node = node->left) node->total -= extra;
+        if (parent) parent->left = first->right;
+        else b = first->right;
+        free(first);
+        spans->runs--;
+        for (StyleSpan node = a; node; node = node->right) node->total += extra;
+        last->length += extra;
+    }
+    return merge(a, b);
+}
+
+static int count_nodes(StyleSpan node) {
+    return node ? 1 + count_nodes(node->left) + count_nodes(node->right) : 0;
+}
+
+static void free_nodes(StyleSpan node) {
+    if (!node) return;
+    free_nodes(node->left);
+    free_nodes(node->right);
+    free(node);
+}
+
+static void update_all(StyleSpan node) {
+    if (!node) return;
+    update_all(node->left);
+    update_all(node->right);
+    update(node);
+}
+
+/*
+ * Builds a treap of runs in linear time along its right spine, joining equal
+ * neighbours and skipping empty runs
+ */
+static StyleSpan build(StyleSpans spans, const int *lengths, const int *styles, int count) {
+    StyleSpan *spine = NULL;
+    int depth = 0, capacity = 0;
+    StyleSpan root = NULL, previous = NULL;
+
+    for (int i = 0; i < count; i++) {
+        if (lengths[i] <= 0) continue;
+        if (previous && previous->style == styles[i]) {
+            previous->length += lengths[i];
+            continue;
+        }
+        StyleSpan node = new_span(spans, lengths[i], styles[i]);
+
+        StyleSpan last = NULL;
+        while (depth > 0 && spine[depth - 1]->priority < node->priority) last = spine[--depth];
+        node->left = last;
+        if (depth > 0) spine[depth - 1]->right = node;
+        else root = node;
+        if (depth == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            spine = realloc(spine, capacity * sizeof(StyleSpan));
+        }
+        spine[depth++] = node;
+        previous = node;
+    }
+    free(spine);
+    update_all(root);
+    return root;
+}
+
+// In order, appends each run's length and style to the arrays
+static int flatten(StyleSpan node, int *lengths, int *styles, int n) {
+    if (!node) return n;
+    n = flatten(node->left, lengths, styles, n);
+    lengths[n] = node->length;
+    styles[n++] = node->style;
+    return flatten(node->right, lengths, styles, n);
+}
+
+// Creates spans for a document of length unstyled characters
+StyleSpans style_spans_create(int length) {
+    StyleSpans spans = malloc(sizeof(struct style_spans));
+    spans->root = NULL;
+    spans->runs = 0;
+    spans->seed = 2463534242u;
+    if (length > 0) spans->root = new_span(spans, length, 0);
+    return spans;
+}
+
+void style_spans_free(StyleSpans spans) {
+    free_nodes(spans->root);
+    free(spans);
+}
+
+// Follows the insertion of count characters at offset at; inserted text is unstyled, as in GTK
+void style_spans_insert(StyleSpans spans, int at, int count) {
+    if (count <= 0) return;
+    StyleSpan before, after;
+    split(spans, spans->root, at, &before, &after);
+    StyleSpan inserted = new_span(spans, count, 0);
+    spans->root = join(spans, join(spans, before, inserted), after);
+}
+
+// Follows the deletion of count characters at offset at
+void style_spans_delete(StyleSpans spans, int at, int count) {
+    if (count <= 0) return;
+    StyleSpan before, removed, after;
+    split(spans, spans->root, at, &before, &after);
+    split(spans, after, count, &removed, &after);
+    spans->runs -= count_nodes(removed);
+    free_nodes(removed);
+    spans->root = join(spans, before, after);
+}
+
+// Replaces the style of every run in [from, to) with map(style, data)
+void style_spans_map(StyleSpans spans, int from, int to, StyleMapFunc map, void *data) {
+    if (to <= from) return;
+    StyleSpan before, range, after;
+    split(spans, spans->root, from, &before, &after);
+    split(spans, after, to - from, &range, &after);
+
+    int count = count_nodes(range);
+    int *lengths = malloc(count * sizeof(int));
+    int *styles = malloc(count * sizeof(int));
+    flatten(range, lengths, styles, 0);
+    for (int i = 0; i < count; i++) styles[i] = map(styles[i], data);
+    spans->runs -= count;
+    free_nodes(range);
+    range = build(spans, lengths, styles, count);
+    free(lengths);
+    free(styles);
+
+    spans->root = join(spans, join(spans, before, range), after);
+}
+
+static void visit(StyleSpan node, int base, int from, int to, StyleRunFunc func, void *data) {
+    if (!node) return;
+    int start = base + (node->left ? node->left->total : 0);
+    int end = start + node->length;
+    if (from < start) visit(node->left, base, from, to, func, data);
+    if (start < to && end > from) func(start > from ? start : from, end < to ? end : to, node->style, data);
+    if (end < to) visit(node->right, end, from, to, func, data);
+}
+
+// Calls func with each run overlapping [from, to), in order
+void style_spans_foreach(StyleSpans spans, int from, int to, StyleRunFunc func, void *data) {
+    if (to > from) visit(spans->root, 0, from, to, func, data);
+}
+
+// Returns the style of the character at offset, or 0 past the end
+int style_spans_style_at(StyleSpans spans, int offset) {
+    StyleSpan node = spans->root;
+    while (node) {
+        int left = node->left ? node->left->total : 0;
+        if (offset < left) {
+            node = node->left;
+        } else if (offset < left + node->length) {
+            return node->style;
+        } else {
+            offset -= left + node->length;
+            node = node->right;
+        }
+    }
+    return 0;
+}
+
+// Copies the runs out, in O(runs) time and memory
+StyleRuns *style_spans_snapshot(StyleSpans spans) {
+    StyleRuns *runs = malloc(sizeof(StyleRuns));
+    runs->count = spans->runs;
+    runs->lengths = malloc((runs->count ? runs->count : 1) * sizeof(int));
+    runs->styles = malloc((runs->count ? runs->count : 1) * sizeof(int));
+    flatten(spans->root, runs->lengths, runs->styles, 0);
+    return runs;
+}
+
+// Replaces every span with the runs of a snapshot
+void style_spans_restore(StyleSpans spans, const StyleRuns *runs) {
+    free_nodes(spans->root);
+    spans->runs = 0;
+    spans->root = build(spans, runs->lengths, runs->styles, runs->count);
+}
+
+void style_runs_free(StyleRuns *runs) {
+    if (!runs) return;
+    free(runs->lengths);
+    free(runs->styles);
+    free(runs);
+}
@@ -0,0 +1,43 @@
+#ifndef STYLE_SPANS_H
+#define STYLE_SPANS_H
+
+// One run of characters sharing a style, kept in a treap ordered by position
+typedef struct style_span {
+    struct style_span *left;
+    struct style_span *right;
+    unsigned priority;
+    int length;   // Characters in this run
+    int style;    // Style id; 0 is unstyled
+    int total;    // Characters in the whole subtree
+} *StyleSpan;
+
+// Character styles of the document as run-length spans that shift with each edit
+typedef struct style_spans {
+    StyleSpan root;
+    int runs;
+    unsigned seed;
+} *StyleSpans;
+
+// A flat copy of the spans, kept by undo entries
+typedef struct style_runs {
+    int count;
+    int *lengths;
+    int *styles;
+} StyleRuns;
+
+// Called with each run in a range, clipped to it
+typedef void (*StyleRunFunc)(int start, int end, int style, void *data);
+typedef int (*StyleMapFunc)(int style, void *data);
+
+StyleSpans style_spans_create(int length);
+void style_spans_free(StyleSpans spans);
+void style_spans_insert(StyleSpans spans, int at, int count);
+void style_spans_delete(StyleSpans spans, int at, int count);
+void style_spans_map(StyleSpans spans, int from, int to, StyleMapFunc map, void *data);
+void style_spans_foreach(StyleSpans spans, int from, int to, StyleRunFunc func, void *data);
+int style_spans_style_at(StyleSpans spans, int offset);
+StyleRuns *style_spans_snapshot(StyleSpans spans);
+void style_spans_restore(StyleSpans spans, const StyleRuns *runs);
+void style_runs_free(StyleRuns *runs);
+
+#endif // STYLE_SPANS_H
@@ -5,6 +5,337 @@
 
 GtkWidget *global_text_view = NULL;
 
+// --- Interned style tags ---
+
+/*
+ * Formatting tags are named "style:<property>=<value>" and looked up in the
+ * buffer's tag table before one is created, so formatting the same way again
+ * reuses a tag instead of growing the table (GTK's per-character tag toggles
+ * get slower with every tag it holds).
+ */
+
+#define STYLE_TAG_PREFIX "style:"
+
+static int style_tags_created = 0;
+static int style_tags_reused = 0;
+
+static GtkTextTag *intern_style_tag(GtkTextBuffer *buffer, const char *property, const char *key, GValue *value) {
+    GtkTextTagTable *table = gtk_text_buffer_get_tag_table(buffer);
+    gchar *name = g_strdup_printf(STYLE_TAG_PREFIX "%s=%s", property, key);
+    GtkTextTag *tag = gtk_text_tag_table_lookup(table, name);
+    if (!tag) {
+        tag = gtk_text_buffer_create_tag(buffer, name, NULL);
+        g_object_set_property(G_OBJECT(tag), property, value);
+        style_tags_created++;
+    } else {
+        style_tags_reused++;
+    }
+    g_free(name);
+    return tag;
+}
+
+// Sets how many style tags were created, and how many times formatting reused one instead
+void text_style_tag_counts(int *created, int *reused) {
+    *created = style_tags_created;
+    *reused = style_tags_reused;
+}
+
+// Returns the buffer's tag setting a string property, creating it on first use
+GtkTextTag *text_style_tag(GtkTextBuffer *buffer, const char *property, const char *value) {
+    // Spellings of one color share a tag
+    GdkRGBA color;
+    gchar *key = NULL;
+    if ((!strcmp(property, "foreground") || !strcmp(property, "background")) && gdk_rgba_parse(&color, value)) {
+        key = gdk_rgba_to_string(&color);
+    }
+
+    GValue gvalue = G_VALUE_INIT;
+    g_value_init(&gvalue, G_TYPE_STRING);
+    g_value_set_string(&gvalue, key ? key : value);
+    GtkTextTag *tag = intern_style_tag(buffer, property, key ? key : value, &gvalue);
+    g_value_unset(&gvalue);
+    g_free(key);
+    return tag;
+}
+
+// Returns the buffer's tag setting an int or enum property, creating it on first use
+GtkTextTag *text_style_tag_int(GtkTextBuffer *buffer, const char *property, int value) {
+    gpointer tag_class = g_type_class_ref(GTK_TYPE_TEXT_TAG);
+    GParamSpec *spec = g_object_class_find_property(G_OBJECT_CLASS(tag_class), property);
+    g_type_class_unref(tag_class);
+    char key[16];
+    g_snprintf(key, sizeof(key), "%d", value);
+
+    GValue gvalue = G_VALUE_INIT;
+    g_value_init(&gvalue, spec ? G_PARAM_SPEC_VALUE_TYPE(spec) : G_TYPE_INT);
+    if (G_VALUE_HOLDS_ENUM(&gvalue)) g_value_set_enum(&gvalue, value);
+    else g_value_set_int(&gvalue, value);
+    GtkTextTag *tag = intern_style_tag(buffer, property, key, &gvalue);
+    g_value_unset(&gvalue);
+    return tag;
+}
+
+// --- Style sets ---
+
+/*
+ * A style id names a set of interned tags with at most one per property, and
+ * id 0 is the empty set. The spans store ids, so a run costs the same however
+ * many properties it sets, and two runs look the same exactly when their ids
+ * are equal. Ids are never freed; there are as many as distinct combinations
+ * of formatting ever used.
+ */
+
+static GPtrArray *style_sets = NULL;      // Style id -> NULL-terminated sorted tag names
+static GHashTable *style_set_ids = NULL;  // Tag names joined by newlines -> style id
+
+static int compare_names(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const gchar *const *)a, *(const gchar *const *)b);
+}
+
+static void init_style_sets(void) {
+    if (style_sets) return;
+    style_sets = g_ptr_array_new();
+    g_ptr_array_add(style_sets, g_new0(gchar *, 1));
+    style_set_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_insert(style_set_ids, g_strdup(""), GINT_TO_POINTER(0));
+}
+
+// Returns the id of a set of tag names, which are sorted in place
+static int intern_style_set(GPtrArray *names) {
+    init_style_sets();
+    g_ptr_array_sort(names, compare_names);
+    g_ptr_array_add(names, NULL);
+    gchar *key = g_strjoinv("\n", (gchar **)names->pdata);
+    gpointer id;
+    if (g_hash_table_lookup_extended(style_set_ids, key, NULL, &id)) {
+        g_free(key);
+        return GPOINTER_TO_INT(id);
+    }
+    int style = style_sets->len;
+    g_ptr_array_add(style_sets, g_strdupv((gchar **)names->pdata));
+    g_hash_table_insert(style_set_ids, key, GINT_TO_POINTER(style));
+    return style;
+}
+
+static gchar **style_set_names(int style) {
+    init_style_sets();
+    return g_ptr_array_index(style_sets, style);
+}
+
+typedef struct {
+    const gchar *name;  // Interned tag name, "style:<property>=<value>"
+    int add;
+} StyleChange;
+
+// Maps a style to one with the change's tag added, or with its property unset
+static int change_style(int style, void *data) {
+    StyleChange *change = data;
+    size_t prefix = strchr(change->name, '=') - change->name + 1;
+    GPtrArray *names = g_ptr_array_new();
+    for (gchar **name = style_set_names(style); *name; name++) {
+        if (strncmp(*name, change->name, prefix) != 0) g_ptr_array_add(names, *name);
+    }
+    if (change->add) g_ptr_array_add(names, (gpointer)change->name);
+    int changed = intern_style_set(names);
+    g_ptr_array_free(names, TRUE);
+    return changed;
+}
+
+static int clear_style(int style, void *data) {
+    return 0;
+}
+
+// --- Style spans in the view ---
+
+/*
+ * The document's formatting lives in the style spans, which follow every edit
+ * in O(log n). Tags are only put on the text around the viewport: offsets
+ * [shown_from, shown_to) carry tags that match the spans, and anything outside
+ * may be stale until it is scrolled into view and re-tagged. Inserted text is
+ * unstyled in both the spans and the buffer, so an edit only moves the shown
+ * range, and then tags what it brought into view.
+ */
+
+#define STYLE_MARGIN_LINES 50  // Lines tagged above and below the visible ones
+
+static GtkTextView *styled_view = NULL;
+static StyleSpans styled_spans = NULL;
+static int shown_from = 0;
+static int shown_to = 0;
+static guint show_source = 0;
+
+static void apply_run(int start, int end, int style, void *data) {
+    GtkTextBuffer *buffer = data;
+    gchar **names = style_set_names(style);
+    if (!*names) return;
+    GtkTextTagTable *table = gtk_text_buffer_get_tag_table(buffer);
+    GtkTextIter from, to;
+    gtk_text_buffer_get_iter_at_offset(buffer, &from, start);
+    gtk_text_buffer_get_iter_at_offset(buffer, &to, end);
+    for (; *names; names++) {
+        GtkTextTag *tag = gtk_text_tag_table_lookup(table, *names);
+        if (tag) gtk_text_buffer_apply_tag(buffer, tag, &from, &to);
+    }
+}
+
+typedef struct {
+    GtkTextBuffer *buffer;
+    GtkTextIter *start;
+    GtkTextIter *end;
+} StyleRemoval;
+
+static void remove_style_tag(GtkTextTag *tag, gpointer data) {
+    StyleRemoval *removal = data;
+    gchar *name = NULL;
+    g_object_get(tag, "name", &name, NULL);
+    if (name && g_str_has_prefix(name, STYLE_TAG_PREFIX)) {
+        gtk_text_buffer_remove_tag(removal->buffer, tag, removal->start, removal->end);
+    }
+    g_free(name);
+}
+
+// Re-tags [from, to) from the spans
+static void show_styles(int from, int to) {
+    if (to <= from) return;
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(styled_view);
+    GtkTextIter start, end;
+    gtk_text_buffer_get_iter_at_offset(buffer, &start, from);
+    gtk_text_buffer_get_iter_at_offset(buffer, &end, to);
+    StyleRemoval removal = {buffer, &start, &end};
+    gtk_text_tag_table_foreach(gtk_text_buffer_get_tag_table(buffer), remove_style_tag, &removal);
+    style_spans_foreach(styled_spans, from, to, apply_run, buffer);
+}
+
+// Tags the lines around the viewport that are not shown yet
+static void show_viewport(void) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(styled_view);
+    GdkRectangle visible;
+    GtkTextIter top, bottom;
+    gtk_text_view_get_visible_rect(styled_view, &visible);
+    gtk_text_view_get_line_at_y(styled_view, &top, visible.y, NULL);
+    gtk_text_view_get_line_at_y(styled_view, &bottom, visible.y + visible.height, NULL);
+
+    int lines = gtk_text_buffer_get_line_count(buffer);
+    int first = MAX(0, gtk_text_iter_get_line(&top) - STYLE_MARGIN_LINES);
+    int last = gtk_text_iter_get_line(&bottom) + STYLE_MARGIN_LINES;
+    gtk_text_buffer_get_iter_at_line(buffer, &top, first);
+    if (last < lines - 1) gtk_text_buffer_get_iter_at_line(buffer, &bottom, last + 1);
+    else gtk_text_buffer_get_end_iter(buffer, &bottom);
+    int from = gtk_text_iter_get_offset(&top), to = gtk_text_iter_get_offset(&bottom);
+    if (shown_from <= from && to <= shown_to) return;
+
+    if (to < shown_from || from > shown_to || shown_from == shown_to) {
+        show_styles(from, to);
+        shown_from = from;
+        shown_to = to;
+    } else {
+        show_styles(from, shown_from);
+        show_styles(shown_to, to);
+        shown_from = MIN(from, shown_from);
+        shown_to = MAX(to, shown_to);
+    }
+}
+
+static gboolean show_viewport_idle(gpointer data) {
+    show_source = 0;
+    show_viewport();
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_show_viewport(void) {
+    if (!show_source) show_source = g_idle_add_full(G_PRIORITY_HIGH_IDLE, show_viewport_idle, NULL, NULL);
+}
+
+static void on_styles_scrolled(GtkAdjustment *adjustment, gpointer data) {
+    queue_show_viewport();
+}
+
+static void on_styles_resized(GtkWidget *widget, GdkRectangle *allocation, gpointer data) {
+    queue_show_viewport();
+}
+
+// Connected after the default handler, so location points past the new text
+static void on_styles_insert_text(GtkTextBuffer *buffer, GtkTextIter *location, gchar *text, gint len, gpointer data) {
+    int inserted = g_utf8_strlen(text, len);
+    int at = gtk_text_iter_get_offset(location) - inserted;
+    style_spans_insert(styled_spans, at, inserted);
+    if (at < shown_from) shown_from += inserted;
+    if (at <= shown_to) shown_to += inserted;
+    queue_show_viewport();
+}
+
+// Connected before the default handler, while start and end still span the text
+static void on_styles_delete_range(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, gpointer data) {
+    int from = gtk_text_iter_get_offset(start), to = gtk_text_iter_get_offset(end);
+    style_spans_delete(styled_spans, from, to - from);
+    shown_from = shown_from >= to ? shown_from - (to - from) : MIN(shown_from, from);
+    shown_to = shown_to >= to ? shown_to - (to - from) : MIN(shown_to, from);
+    queue_show_viewport(); // Lines below may move up into view
+}
+
+/**
+ * Show spans as the formatting of a text view, keeping them in step with its edits
+ */
+void init_text_styles(GtkTextView *text_view, StyleSpans spans) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(text_view);
+    styled_view = text_view;
+    styled_spans = spans;
+    g_signal_connect_after(buffer, "insert-text", G_CALLBACK(on_styles_insert_text), NULL);
+    g_signal_connect(buffer, "delete-range", G_CALLBACK(on_styles_delete_range), NULL);
+
+    GtkAdjustment *vadjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(text_view));
+    if (vadjustment) g_signal_connect(vadjustment, "value-changed", G_CALLBACK(on_styles_scrolled), NULL);
+    g_signal_connect(text_view, "size-allocate", G_CALLBACK(on_styles_resized), NULL);
+}
+
+static void styles_changed(void) {
+    shown_from = shown_to = 0;
+    show_viewport();
+}
+
+/**
+ * Set (add) or unset the property of an interned style tag on [from, to)
+ */
+void text_styles_format(int from, int to, GtkTextTag *tag, int add) {
+    gchar *name = NULL;
+    g_object_get(tag, "name", &name, NULL);
+    if (!name || !g_str_has_prefix(name, STYLE_TAG_PREFIX) || !strchr(name, '=')) {
+        g_free(name);
+        return;
+    }
+    StyleChange change = {name, add};
+    style_spans_map(styled_spans, from, to, change_style, &change);
+    g_free(name);
+    styles_changed();
+}
+
+// Removes every style from [from, to)
+void text_styles_clear(int from, int to) {
+    style_spans_map(styled_spans, from, to, clear_style, NULL);
+    styles_changed();
+}
+
+// Returns whether the character at offset has the interned tag's property set to its value
+int text_styles_has(int offset, GtkTextTag *tag) {
+    gchar *name = NULL;
+    g_object_get(tag, "name", &name, NULL);
+    int found = 0;
+    for (gchar **names = style_set_names(style_spans_style_at(styled_spans, offset)); name && *names; names++) {
+        if (!strcmp(*names, name)) found = 1;
+    }
+    g_free(name);
+    return found;
+}
+
+/**
+ * Replace the spans with a snapshot taken for the text now in the buffer, as
+ * after an undo restored it
+ */
+void text_styles_restore(const StyleRuns *runs) {
+    style_spans_restore(styled_spans, runs);
+    styles_changed();
+}
+
 void prompt_and_apply_color(GtkTextView *text_view)
 {
     global_text_view = GTK_WIDGET(text_view);
@@ -28,13 +359,9 @@ void on_color_response(GtkDialog *dialog, gint response_id, gpointer user_data)
         GtkTextIter start, end;
         if (gtk_text_buffer_get_selection_bounds(buffer, &start, &end))
         {
-            GtkTextTagTable *tag_table = gtk_text_buffer_get_tag_table(buffer);
-            GtkTextTag *tag = gtk_text_tag_new(NULL);
-
             gchar *rgba_str = gdk_rgba_to_string(&color);
-            g_object_set(tag, "foreground-rgba", &color, NULL);
-            gtk_text_tag_table_add(tag_table, tag);
-            gtk_text_buffer_apply_tag(buffer, tag, &start, &end);
+            GtkTextTag *tag = text_style_tag(buffer, "foreground", rgba_str);
+            text_styles_format(gtk_text_iter_get_offset(&start), gtk_text_iter_get_offset(&end), tag, 1);
             g_free(rgba_str);
         }
     }
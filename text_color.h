@@ -2,10 +2,21 @@
 #define TEXT_COLOR_H
 
 #include <gtk/gtk.h>
+#include "style_spans.h"
 
 extern GtkWidget *global_text_view;
 
 void prompt_and_apply_color(GtkTextView *text_view);
 void on_color_response(GtkDialog *dialog, gint response_id, gpointer user_data);
 
+GtkTextTag *text_style_tag(GtkTextBuffer *buffer, const char *property, const char *value);
+GtkTextTag *text_style_tag_int(GtkTextBuffer *buffer, const char *property, int value);
+void text_style_tag_counts(int *created, int *reused);
+
+void init_text_styles(GtkTextView *text_view, StyleSpans spans);
+void text_styles_format(int from, int to, GtkTextTag *tag, int add);
+void text_styles_clear(int from, int to);
+int text_styles_has(int offset, GtkTextTag *tag);
+void text_styles_restore(const StyleRuns *runs);
+
 #endif
\ No newline at end of file
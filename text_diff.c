@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+#include "text_diff.h"
+
+/*
+ * Compares a document with a new version of its text, line by line. The
+ * lines both start and end with are found first by comparing bytes, so a
+ * change in one place, or text added at the end, costs one pass and no line
+ * splitting. The lines left between are hashed and diffed with Myers' O(ND)
+ * algorithm, which finds the fewest lines to delete and insert. A rewrite
+ * needing more than TEXT_DIFF_MAX_EDITS of them, or too much work, is taken
+ * as one hunk instead; a finer diff of it would not be worth the time.
+ */
+
+#define COMPARE_BLOCK 4096
+#define DIFF_WORK_LIMIT (64 * 1024 * 1024)  // Line comparisons the diff may make
+
+typedef struct {
+    const char *text;
+    int length;   // With its line break
+    unsigned hash;
+} Line;
+
+static int min_int(int a, int b) {
+    return a < b ? a : b;
+}
+
+// Returns how many of the first n bytes of a and b are equal
+static int matching_bytes(const char *a, const char *b, int n) {
+    int same = 0;
+    while (same + COMPARE_BLOCK <= n && memcmp(a + same, b + same, COMPARE_BLOCK) == 0) same += COMPARE_BLOCK;
+    while (same < n && a[same] == b[same]) same++;
+    return same;
+}
+
+// Returns how many of the n bytes before a_end and b_end are equal, counting back
+static int matching_bytes_back(const char *a_end, const char *b_end, int n) {
+    int same = 0;
+    while (same + COMPARE_BLOCK <= n &&
+           memcmp(a_end - same - COMPARE_BLOCK, b_end - same - COMPARE_BLOCK, COMPARE_BLOCK) == 0)
+        same += COMPARE_BLOCK;
+    while (same < n && a_end[-same - 1] == b_end[-same - 1]) same++;
+    return same;
+}
+
+static int common_prefix(PiecetableSnapshot old, const char *text, int length) {
+    int same = 0;
+    for (int i = 0; i < old->count; i++) {
+        int n = min_int(old->pieces[i].length, length - same);
+        int equal = matching_bytes(piecetable_snapshot_piece_text(old, i), text + same, n);
+        same += equal;
+        if (equal < old->pieces[i].length) break;
+    }
+    return same;
+}
+
+// Like common_prefix from the other end, stopping after limit bytes
+static int common_suffix(PiecetableSnapshot old, const char *text, int length, int limit) {
+    int same = 0;
+    for (int i = old->count - 1; i >= 0 && same < limit; i--) {
+        int n = min_int(old->pieces[i].length, limit - same);
+        const char *piece_end = piecetable_snapshot_piece_text(old, i) + old->pieces[i].length;
+        int equal = matching_bytes_back(piece_end, text + length - same, n);
+        same += equal;
+        if (equal < old->pieces[i].length) break;
+    }
+    return same;
+}
+
+static char snapshot_byte(PiecetableSnapshot snapshot, int offset) {
+    for (int i = 0; i < snapshot->count; i++) {
+        if (offset < snapshot->pieces[i].length) return piecetable_snapshot_piece_text(snapshot, i)[offset];
+        offset -= snapshot->pieces[i].length;
+    }
+    return 0;
+}
+
+static void copy_range(PiecetableSnapshot snapshot, int from, int to, char *out) {
+    int offset = 0;
+    for (int i = 0; i < snapshot->count && offset < to; i++) {
+        int length = snapshot->pieces[i].length;
+        int start = from > offset ? from : offset, end = min_int(to, offset + length);
+        if (start < end) {
+            memcpy(out, piecetable_snapshot_piece_text(snapshot, i) + (start - offset), end - start);
+            out += end - start;
+        }
+        offset += length;
+    }
+}
+
+// Splits text at \n; a \r\n ends a line with it and the rare lone \r stays inside one
+static int split_lines(const char *text, int length, Line **out) {
+    int capacity = 64, count = 0;
+    Line *lines = malloc(capacity * sizeof(Line));
+    const char *end = text + length;
+    while (text < end) {
+        const char *newline = memchr(text, '\n', end - text);
+        int n = newline ? newline - text + 1 : end - text;
+        unsigned hash = 2166136261u;
+        for (int i = 0; i < n; i++) hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+        if (count == capacity) {
+            capacity *= 2;
+            lines = realloc(lines, capacity * sizeof(Line));
+        }
+        lines[count++] = (Line){text, n, hash};
+        text += n;
+    }
+    *out = lines;
+    return count;
+}
+
+static int same_line(const Line *a, const Line *b) {
+    return a->hash == b->hash && a->length == b->length && memcmp(a->text, b->text, a->length) == 0;
+}
+
+/*
+ * Returns the furthest x reached on diagonal k (x - y = k) with edit d, from
+ * the furthest points of edit d - 1 in prev (diagonal j at prev[j + d - 1]),
+ * or -1 if no move stays inside the n by m grid. from_k is set to the
+ * diagonal the move came from: k - 1 for deleting a line, k + 1 for inserting.
+ */
+static int enter_diagonal(const int *prev, int d, int k, int n, int m, int *from_k) {
+    int deleted = k > -d && prev[k - 1 + d - 1] >= 0 ? prev[k - 1 + d - 1] + 1 : -1;
+    int inserted = k < d && prev[k + 1 + d - 1] >= 0 ? prev[k + 1 + d - 1] : -1;
+    if (deleted > n) deleted = -1;
+    if (inserted >= 0 && inserted - k > m) inserted = -1;
+    *from_k = inserted >= deleted ? k + 1 : k - 1;
+    return inserted >= deleted ? inserted : deleted;
+}
+
+/*
+ * Marks the lines of a to delete and those of b to insert for the fewest such
+ * edits turning a into b; returns 0 if that takes too many
+ */
+static int diff_lines(const Line *a, int n, const Line *b, int m, char *deleted, char *inserted) {
+    int limit = min_int(n + m, TEXT_DIFF_MAX_EDITS);
+    int **trace = calloc(limit + 1, sizeof(int *));  // trace[d][k + d]: furthest x on diagonal k with d edits
+    long work = 0;
+    int found = -1;
+    for (int d = 0; d <= limit && found < 0 && work <= DIFF_WORK_LIMIT; d++) {
+        int *v = trace[d] = malloc((2 * d + 1) * sizeof(int));
+        for (int k = -d; k <= d; k += 2) {
+            int from_k;
+            int x = d == 0 ? 0 : enter_diagonal(trace[d - 1], d, k, n, m, &from_k);
+            if (x < 0) {
+                v[k + d] = -1;
+                continue;
+            }
+            int y = x - k, start = x;
+            while (x < n && y < m && same_line(&a[x], &b[y])) x++, y++;
+            work += x - start + 1;
+            v[k + d] = x;
+            if (x == n && y == m) {
+                found = d;
+                break;
+            }
+        }
+    }
+
+    // Walk back from the end, marking the line each edit deleted or inserted
+    if (found >= 0) {
+        int x = n, y = m;
+        for (int d = found; d > 0; d--) {
+            int k = x - y, from_k;
+            enter_diagonal(trace[d - 1], d, k, n, m, &from_k);
+            int px = trace[d - 1][from_k + d - 1], py = px - from_k;
+            if (from_k == k - 1) deleted[px] = 1;
+            else inserted[py] = 1;
+            x = px;
+            y = py;
+        }
+    }
+    for (int d = 0; d <= limit; d++) free(trace[d]);
+    free(trace);
+    return found >= 0;
+}
+
+static void add_hunk(TextDiff *diff, int *capacity, int old_start, int old_length, int new_start, int new_length) {
+    if (diff->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        diff->hunks = realloc(diff->hunks, *capacity * sizeof(TextHunk));
+    }
+    diff->hunks[diff->count++] = (TextHunk){old_start, old_length, new_start, new_length};
+}
+
+/**
+ * Return the hunks that turn the text of old into new_text; none if they are
+ * the same. The hunks start and end at line starts, so never inside a
+ * character.
+ */
+TextDiff text_diff(PiecetableSnapshot old, const char *new_text, int new_length) {
+    TextDiff diff = {NULL, 0};
+    int capacity = 0;
+    int prefix = common_prefix(old, new_text, new_length);
+    if (prefix == old->length && prefix == new_length) return diff;
+    while (prefix > 0 && new_text[prefix - 1] != '\n') prefix--;
+
+    // The common end has to start a line in both texts; inside it they have the same bytes
+    int suffix = common_suffix(old, new_text, new_length, min_int(old->length, new_length) - prefix);
+    int new_line_start = suffix == new_length || new_text[new_length - suffix - 1] == '\n';
+    int old_line_start = suffix == old->length || snapshot_byte(old, old->length - suffix - 1) == '\n';
+    if (suffix > 0 && !(new_line_start && old_line_start)) suffix--;
+    while (suffix > 0 && suffix < new_length && new_text[new_length - suffix - 1] != '\n') suffix--;
+
+    int old_middle = old->length - prefix - suffix, new_middle = new_length - prefix - suffix;
+    if (old_middle == 0 || new_middle == 0) {
+        add_hunk(&diff, &capacity, prefix, old_middle, prefix, new_middle);
+        return diff;
+    }
+
+    char *old_text = malloc(old_middle);
+    copy_range(old, prefix, prefix + old_middle, old_text);
+    Line *a, *b;
+    int n = split_lines(old_text, old_middle, &a);
+    int m = split_lines(new_text + prefix, new_middle, &b);
+    char *deleted = calloc(n + 1, 1), *inserted = calloc(m + 1, 1);
+
+    if (!diff_lines(a, n, b, m, deleted, inserted)) {
+        add_hunk(&diff, &capacity, prefix, old_middle, prefix, new_middle);
+    } else {
+        // Unmarked lines pair up in order; each run of marked lines between them is a hunk
+        int i = 0, j = 0;
+        while (i < n || j < m) {
+            if (i < n && j < m && !deleted[i] && !inserted[j]) {
+                i++, j++;
+                continue;
+            }
+            int i0 = i, j0 = j;
+            while (i < n && deleted[i]) i++;
+            while (j < m && inserted[j]) j++;
+            if (i == i0 && j == j0) i = n, j = m;
+            int old_start = prefix + (i0 < n ? a[i0].text - old_text : old_middle);
+            int old_end = prefix + (i < n ? a[i].text - old_text : old_middle);
+            int new_start = prefix + (j0 < m ? b[j0].text - (new_text + prefix) : new_middle);
+            int new_end = prefix + (j < m ? b[j].text - (new_text + prefix) : new_middle);
+            add_hunk(&diff, &capacity, old_start, old_end - old_start, new_start, new_end - new_start);
+        }
+    }
+    free(deleted);
+    free(inserted);
+    free(a);
+    free(b);
+    free(old_text);
+    return diff;
+}
+
+void text_diff_free(TextDiff *diff) {
+    free(diff->hunks);
+    diff->hunks = NULL;
+    diff->count = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef TEXT_DIFF_H
+#define TEXT_DIFF_H
+
+#include "piecetable.h"
+
+#define TEXT_DIFF_MAX_EDITS 1000  // Line edits past which the changed lines are replaced as one hunk
+
+// Bytes [old_start, old_start + old_length) of the old text become [new_start, new_start + new_length) of the new
+typedef struct {
+    int old_start;
+    int old_length;
+    int new_start;
+    int new_length;
+} TextHunk;
+
+// The hunks turning one text into another, in order and not overlapping; each covers whole lines
+typedef struct {
+    TextHunk *hunks;
+    int count;
+} TextDiff;
+
+TextDiff text_diff(PiecetableSnapshot old, const char *new_text, int new_length);
+void text_diff_free(TextDiff *diff);
+
+#endif // TEXT_DIFF_H
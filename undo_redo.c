@@ -2,33 +2,43 @@
 #include <string.h>
 #include "undo_redo.h"
 
+static void free_action(UndoRedoAction *action) {
+    if (!action->borrowed) {
+        free(action->prev_text);
+        free(action->next_text);
+    }
+    style_runs_free(action->prev_styles);
+    style_runs_free(action->next_styles);
+    free(action);
+}
+
 UndoRedoStack* undo_redo_stack_create(void) {
     UndoRedoStack *stack = malloc(sizeof(UndoRedoStack));
     stack->actions = list_create();
     stack->current_index = -1;
+    stack->held = NULL;
+    stack->release = NULL;
     return stack;
 }
 
 void undo_redo_stack_free(UndoRedoStack *stack) {
     ListItem item = list_get_first(stack->actions);
     while (item) {
-        UndoRedoAction *action = (UndoRedoAction*)item->value;
-        free(action->prev_text);
-        free(action->next_text);
-        free(action);
+        free_action((UndoRedoAction*)item->value);
+        // list_free() would free the action again
+        item->value = NULL;
         item = item->next;
     }
     list_free(stack->actions);
+    if (stack->release) stack->release(stack->held);
     free(stack);
 }
 
-void undo_redo_push(UndoRedoStack *stack, const char *prev, const char *next) {
+// Takes ownership of the style snapshots
+void undo_redo_push(UndoRedoStack *stack, const char *prev, const char *next, StyleRuns *prev_styles, StyleRuns *next_styles) {
     while (list_length(stack->actions) > stack->current_index + 1) {
         ListItem last = list_get_last(stack->actions);
-        UndoRedoAction *action = (UndoRedoAction*)last->value;
-        free(action->prev_text);
-        free(action->next_text);
-        free(action);
+        free_action((UndoRedoAction*)last->value);
         ListItem item = stack->actions->first;
         if (item == last) {
             stack->actions->first = NULL;
@@ -44,10 +54,35 @@ void undo_redo_push(UndoRedoStack *stack, const char *prev, const char *next) {
     UndoRedoAction *action = malloc(sizeof(UndoRedoAction));
     action->prev_text = strdup(prev);
     action->next_text = strdup(next);
+    action->prev_styles = prev_styles;
+    action->next_styles = next_styles;
+    action->borrowed = 0;
     list_append(stack->actions, action);
     stack->current_index++;
 }
 
+/*
+ * Adds an action read back from a saved session after the others, reading
+ * its texts where they are, in memory handed to undo_redo_hold(). It has no
+ * formatting. The caller sets current_index once all are added.
+ */
+void undo_redo_restore(UndoRedoStack *stack, const char *prev, const char *next) {
+    UndoRedoAction *action = malloc(sizeof(UndoRedoAction));
+    action->prev_text = (char *)prev;
+    action->next_text = (char *)next;
+    action->prev_styles = NULL;
+    action->next_styles = NULL;
+    action->borrowed = 1;
+    list_append(stack->actions, action);
+}
+
+// Keeps held, which restored actions read, until the stack is freed and calls release on it
+void undo_redo_hold(UndoRedoStack *stack, void *held, void (*release)(void *held)) {
+    if (stack->release) stack->release(stack->held);
+    stack->held = held;
+    stack->release = release;
+}
+
 int undo_redo_can_undo(UndoRedoStack *stack) {
     return stack->current_index >= 0;
 }
@@ -56,18 +91,22 @@ int undo_redo_can_redo(UndoRedoStack *stack) {
     return stack->current_index < list_length(stack->actions) - 1;
 }
 
-const char* undo_redo_undo(UndoRedoStack *stack) {
+// Returns the text before the current action; styles is set to its formatting, if recorded
+const char* undo_redo_undo(UndoRedoStack *stack, const StyleRuns **styles) {
     if (!undo_redo_can_undo(stack)) return NULL;
     ListItem item = list_get_item(stack->actions, stack->current_index);
     stack->current_index--;
     UndoRedoAction *action = (UndoRedoAction*)item->value;
+    if (styles) *styles = action->prev_styles;
     return action->prev_text;
 }
 
-const char* undo_redo_redo(UndoRedoStack *stack) {
+// Returns the text after the next action; styles is set to its formatting, if recorded
+const char* undo_redo_redo(UndoRedoStack *stack, const StyleRuns **styles) {
     if (!undo_redo_can_redo(stack)) return NULL;
     stack->current_index++;
     ListItem item = list_get_item(stack->actions, stack->current_index);
     UndoRedoAction *action = (UndoRedoAction*)item->value;
+    if (styles) *styles = action->next_styles;
     return action->next_text;
 }
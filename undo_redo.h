@@ -2,23 +2,31 @@
 #define UNDO_REDO_H
 
 #include "list.h"
+#include "style_spans.h"
 
 typedef struct undo_redo_action {
     char *prev_text;
     char *next_text;
+    StyleRuns *prev_styles; // Formatting of each text, or NULL
+    StyleRuns *next_styles;
+    int borrowed;           // The texts point into memory the stack holds and are not freed
 } UndoRedoAction;
 
 typedef struct undo_redo_stack {
     List actions;
     int current_index;
+    void *held;                   // Memory borrowed actions read, such as a mapped session file
+    void (*release)(void *held);  // Lets go of it when the stack is freed
 } UndoRedoStack;
 
 UndoRedoStack* undo_redo_stack_create(void);
 void undo_redo_stack_free(UndoRedoStack *stack);
-void undo_redo_push(UndoRedoStack *stack, const char *prev, const char *next);
+void undo_redo_push(UndoRedoStack *stack, const char *prev, const char *next, StyleRuns *prev_styles, StyleRuns *next_styles);
+void undo_redo_restore(UndoRedoStack *stack, const char *prev, const char *next);
+void undo_redo_hold(UndoRedoStack *stack, void *held, void (*release)(void *held));
 int undo_redo_can_undo(UndoRedoStack *stack);
 int undo_redo_can_redo(UndoRedoStack *stack);
-const char* undo_redo_undo(UndoRedoStack *stack);
-const char* undo_redo_redo(UndoRedoStack *stack);
+const char* undo_redo_undo(UndoRedoStack *stack, const StyleRuns **styles);
+const char* undo_redo_redo(UndoRedoStack *stack, const StyleRuns **styles);
 
 #endif // UNDO_REDO_H
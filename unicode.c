@@ -0,0 +1,108 @@
+#include "unicode.h"
+
+// Decodes one UTF-8 sequence; an invalid byte decodes as itself with length 1
+int unicode_decode_utf8(const unsigned char *s, int *cp) {
+    int len = 1;
+    if (s[0] >= 0xF0 && s[0] <= 0xF4) len = 4;
+    else if (s[0] >= 0xE0 && s[0] <= 0xEF) len = 3;
+    else if (s[0] >= 0xC2 && s[0] <= 0xDF) len = 2;
+    for (int i = 1; i < len; i++) {
+        if ((s[i] & 0xC0) != 0x80) len = 1;
+    }
+    if (len == 1) { *cp = s[0]; return 1; }
+    int value = s[0] & (0x7F >> len);
+    for (int i = 1; i < len; i++) value = (value << 6) | (s[i] & 0x3F);
+    *cp = value;
+    return len;
+}
+
+int unicode_encode_utf8(int cp, unsigned char *out) {
+    if (cp < 0x80) { out[0] = cp; return 1; }
+    if (cp < 0x800) { out[0] = 0xC0 | (cp >> 6); out[1] = 0x80 | (cp & 0x3F); return 2; }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12); out[1] = 0x80 | ((cp >> 6) & 0x3F); out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (cp >> 18); out[1] = 0x80 | ((cp >> 12) & 0x3F);
+    out[2] = 0x80 | ((cp >> 6) & 0x3F); out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+// --- Case folding ---
+
+typedef struct {
+    int first, last;
+    int delta;        // Added to fold a code point of the range
+    int alternating;  // Only every other code point (first, first + 2, ...) folds
+} FoldRange;
+
+static const FoldRange fold_ranges[] = {
+    {0x0041, 0x005A, 32, 0},
+    {0x00B5, 0x00B5, 0x03BC - 0x00B5, 0},   // Micro sign
+    {0x00C0, 0x00D6, 32, 0},
+    {0x00D8, 0x00DE, 32, 0},
+    {0x0100, 0x012F, 1, 1},
+    {0x0132, 0x0137, 1, 1},
+    {0x0139, 0x0148, 1, 1},
+    {0x014A, 0x0177, 1, 1},
+    {0x0178, 0x0178, 0x00FF - 0x0178, 0},
+    {0x0179, 0x017E, 1, 1},
+    {0x017F, 0x017F, 's' - 0x017F, 0},      // Long s
+    {0x0386, 0x0386, 38, 0},
+    {0x0388, 0x038A, 37, 0},
+    {0x038C, 0x038C, 64, 0},
+    {0x038E, 0x038F, 63, 0},
+    {0x0391, 0x03A1, 32, 0},
+    {0x03A3, 0x03AB, 32, 0},
+    {0x03C2, 0x03C2, 1, 0},                 // Final sigma
+    {0x0400, 0x040F, 80, 0},
+    {0x0410, 0x042F, 32, 0},
+    {0x0460, 0x0481, 1, 1},
+    {0x048A, 0x04BF, 1, 1},
+    {0x04C1, 0x04CE, 1, 1},
+    {0x04D0, 0x052F, 1, 1},
+    {0x0531, 0x0556, 48, 0},
+    {0x1E00, 0x1E95, 1, 1},
+    {0x1E9E, 0x1E9E, 0x00DF - 0x1E9E, 0},   // Capital sharp s
+    {0x1EA0, 0x1EFF, 1, 1},
+    {0x212A, 0x212A, 'k' - 0x212A, 0},      // Kelvin sign
+    {0x212B, 0x212B, 0x00E5 - 0x212B, 0},   // Angstrom sign
+    {0xFF21, 0xFF3A, 32, 0},
+};
+
+#define FOLD_RANGE_COUNT (int)(sizeof(fold_ranges) / sizeof(fold_ranges[0]))
+
+int unicode_fold(int cp) {
+    if (cp < 0x41) return cp;
+    if (cp < 0x80) return cp <= 'Z' ? cp + 32 : cp;
+
+    int low = 0, high = FOLD_RANGE_COUNT - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        const FoldRange *range = &fold_ranges[mid];
+        if (cp < range->first) high = mid - 1;
+        else if (cp > range->last) low = mid + 1;
+        else if (range->alternating && (cp - range->first) % 2) return cp;
+        else return cp + range->delta;
+    }
+    return cp;
+}
+
+// Stores every code point folding the same way as cp (cp included); returns how many
+int unicode_fold_variants(int cp, int *variants) {
+    int folded = unicode_fold(cp);
+    int count = 0;
+    if (unicode_fold(folded) == folded) variants[count++] = folded;
+    for (int i = 0; i < FOLD_RANGE_COUNT && count < UNICODE_MAX_VARIANTS; i++) {
+        int source = folded - fold_ranges[i].delta;
+        if (source < fold_ranges[i].first || source > fold_ranges[i].last) continue;
+        if (source != folded && unicode_fold(source) == folded) variants[count++] = source;
+    }
+    return count;
+}
+
+// Letters, digits, underscore and any byte of a non-ASCII character
+int unicode_is_word_byte(int byte) {
+    return byte >= 0 && (byte == '_' || (byte >= '0' && byte <= '9') || (byte >= 'a' && byte <= 'z') ||
+                         (byte >= 'A' && byte <= 'Z') || byte >= 0x80);
+}
@@ -0,0 +1,15 @@
+#ifndef UNICODE_H
+#define UNICODE_H
+
+#define UNICODE_MAX_VARIANTS 4   // Most code points sharing one case folding
+
+int unicode_decode_utf8(const unsigned char *s, int *cp);
+int unicode_encode_utf8(int cp, unsigned char *out);
+
+// Simple case folding for Latin, Greek, Cyrillic, Armenian and fullwidth letters
+int unicode_fold(int cp);
+int unicode_fold_variants(int cp, int *variants);
+
+int unicode_is_word_byte(int byte);
+
+#endif // UNICODE_H
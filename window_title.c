@@ -6,19 +6,27 @@ void update_window_title(GtkWindow* window, const char* filepath) {
      * Updates window title with current filename.
      * If filepath is NULL, shows "Untitled - Text Editor".
      */
+    update_window_title_state(window, filepath, FALSE, FALSE);
+}
+
+void update_window_title_state(GtkWindow* window, const char* filepath, gboolean dirty, gboolean saving) {
+    /**
+     * Same, with a leading "*" while there are unsaved changes and
+     * "(saving...)" after the name while a save is being written.
+     */
     if (!window) return;
 
-    char* title;
+    char* name;
     if (filepath && g_file_test(filepath, G_FILE_TEST_EXISTS)) {
-        char* basename = g_path_get_basename(filepath);
-        title = g_strdup_printf("%s - Text Editor", basename);
-        g_free(basename);
+        name = g_path_get_basename(filepath);
     } else {
-        title = g_strdup("Untitled - Text Editor");
+        name = g_strdup("Untitled");
     }
 
+    char* title = g_strdup_printf("%s%s%s - Text Editor", dirty ? "*" : "", name, saving ? " (saving...)" : "");
     gtk_window_set_title(window, title);
     g_free(title);
+    g_free(name);
 }
 
 static char *current_filename = NULL; // Tracks the current opened/saved file
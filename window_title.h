@@ -3,5 +3,6 @@
 #include <gtk/gtk.h>
 
 void update_window_title(GtkWindow* window, const char* filepath);
+void update_window_title_state(GtkWindow* window, const char* filepath, gboolean dirty, gboolean saving);
 
 #endif